@@ -0,0 +1,157 @@
+#ifndef BLOB_H
+#define BLOB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "dispatcher.h"
+
+// Attachment store: ciphertext blobs too large for one frame, uploaded in
+// BLOB_PUT chunks and served in BLOB_DATA chunks. Each blob is one file,
+// named by its id: "<id>.part" while uploading, renamed to "<id>" once
+// complete and durable. An upload holds only the chunk being written, and
+// what is on disk is the resume point: a client that reconnects asks how
+// much the server has and sends the rest.
+//
+// Downloads are BlobStreams. A frame's header and prefix are sent from
+// memory, its body straight from the page cache with sendfile. Every
+// recipient of an attachment streams the same file, so a group of fifty
+// costs one copy on disk and none per recipient in the server's memory.
+//
+// Writes start writeback every BLOB_WRITEBACK_BYTES, so a completed upload's
+// fdatasync has little left to do. What is left runs on the store's publisher
+// thread, with the rename and the directory fsync, never on a reactor
+// thread: the uploader holds its final reply until the BlobPublish is done.
+//
+// The publisher thread also deletes part files nobody has written for
+// partExpirySeconds, at open and every BLOB_SWEEP_INTERVAL_S, and the store
+// as a whole is held to quotaBytes: an upload reserves its full size when it
+// begins, so uploads racing each other cannot overshoot.
+//
+// Linux only (sendfile, sync_file_range); the store is opened by the reactor.
+
+#define BLOB_DEFAULT_DIRECTORY "blobs"
+#define BLOB_DEFAULT_MAX_BYTES (1024ULL * 1024 * 1024)
+#define BLOB_CHUNK_BYTES (256 * 1024)       // body of each BLOB_DATA frame
+#define BLOB_WRITEBACK_BYTES (4 * 1024 * 1024)
+#define BLOB_DEFAULT_QUOTA_BYTES (64ULL * 1024 * 1024 * 1024)
+#define BLOB_DEFAULT_PART_EXPIRY_S (24 * 60 * 60)
+#define BLOB_SWEEP_INTERVAL_S (10 * 60)    // shortened to partExpirySeconds if that is less
+#define BLOB_DATA_PREFIX (PROTO_ID_SIZE + 2 * PROTO_SEQ_SIZE)   // blobId, uint64 size, uint64 offset
+
+struct BlobConfig {
+    const char* directory;
+    uint64_t maxBytes;          // largest blob accepted
+    uint64_t quotaBytes;        // all blobs and parts together; 0 for no limit
+    unsigned partExpirySeconds; // unwritten for this long, a part file is deleted; 0 never
+};
+
+struct BlobStore;
+
+// Called by the publisher thread after every batch it published or gave up on.
+typedef void (*blob_published_fn)(void* context);
+
+// A complete upload handed to the publisher thread, which owns its file
+// (and its lock) from then on. The uploader keeps it until done reads true,
+// then releases it; either side may let go first.
+struct BlobPublish {
+    struct BlobPublish* next;   // publisher queue
+    int fd;
+    uint8_t id[PROTO_ID_SIZE];
+    uint64_t size;
+    bool ok;                    // durable and visible; valid once done
+    atomic_bool done;
+    atomic_int refs;
+};
+
+// The upload a connection is writing; fd -1 when none.
+struct BlobUpload {
+    int fd;
+    uint8_t id[PROTO_ID_SIZE];
+    uint64_t size;
+    uint64_t stored;            // bytes on disk (in the page cache at least)
+    uint64_t writebackFrom;     // first byte not yet handed to writeback
+    uint64_t reserved;          // quota taken for bytes not written yet
+    struct BlobPublish* publish;    // set by the call that completed the blob; the caller takes it
+};
+
+// A download in progress; fd -1 when none.
+struct BlobStream {
+    int fd;
+    uint8_t id[PROTO_ID_SIZE];
+    uint64_t size;
+    uint64_t offset;            // next file byte to frame
+    uint8_t header[PROTO_HEADER_SIZE + BLOB_DATA_PREFIX];   // of the frame being sent
+    size_t headerSent;
+    size_t bodyLeft;            // file bytes of that frame not sent yet
+    bool inFrame;               // part of a frame is out: nothing else may be sent
+};
+
+enum BlobSendResult {
+    BLOB_SEND_FRAME,            // a whole frame went out; more follow
+    BLOB_SEND_DONE,             // the last frame went out; the stream is closed
+    BLOB_SEND_BLOCKED,          // the socket is full
+    BLOB_SEND_ERROR
+};
+
+static inline void blob_default_config(struct BlobConfig* config)
+{
+    config->directory = BLOB_DEFAULT_DIRECTORY;
+    config->maxBytes = BLOB_DEFAULT_MAX_BYTES;
+    config->quotaBytes = BLOB_DEFAULT_QUOTA_BYTES;
+    config->partExpirySeconds = BLOB_DEFAULT_PART_EXPIRY_S;
+}
+
+// Creates the directory if needed, expires stale parts and starts the
+// publisher thread.
+struct BlobStore* blob_open(const struct BlobConfig* config, blob_published_fn onPublished, void* context);
+// Publishes whatever is queued first.
+void blob_close(struct BlobStore* store);
+
+// Starts or resumes uploading blob id of size bytes. Returns 0 with
+// upload->stored set, or -1 if the size is over the limit or disagrees with
+// what is stored, the quota has no room for the rest, another connection is
+// uploading or publishing it, or the file could not be opened. If the blob
+// is already complete no file stays open, and upload->publish is set if it
+// still has to be published.
+int blob_upload_begin(struct BlobStore* store, struct BlobUpload* upload, const uint8_t* id, uint64_t size);
+
+// Writes length bytes at offset, which must be upload->stored. The write
+// that completes the blob hands it to the publisher in upload->publish.
+// Returns 0, or -1 after which the upload is closed.
+int blob_upload_write(struct BlobStore* store, struct BlobUpload* upload, uint64_t offset, const uint8_t* data,
+    size_t length);
+
+// Closes the file, keeping what was written for a later resume, and gives
+// back the quota reserved for the rest.
+void blob_upload_end(struct BlobStore* store, struct BlobUpload* upload);
+
+// Drops the uploader's hold on publish.
+void blob_publish_release(struct BlobPublish* publish);
+
+static inline void blob_upload_init(struct BlobUpload* upload)
+{
+    upload->fd = -1;
+    upload->reserved = 0;
+    upload->publish = NULL;
+}
+
+// Opens complete blob id for streaming from offset. Returns 0, or -1 if it
+// is unknown, still uploading, or offset is past its end.
+int blob_stream_open(struct BlobStore* store, struct BlobStream* stream, const uint8_t* id, uint64_t offset);
+
+// Sends the rest of the frame in progress, or else the next one, on a
+// non-blocking socket.
+enum BlobSendResult blob_stream_send(struct BlobStream* stream, int socketFd);
+
+void blob_stream_close(struct BlobStream* stream);
+
+static inline void blob_stream_init(struct BlobStream* stream)
+{
+    stream->fd = -1;
+    stream->inFrame = false;
+}
+
+#endif // BLOB_H
@@ -0,0 +1,153 @@
+#ifndef CHATCLIENT_H
+#define CHATCLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "dispatcher.h"
+
+// Asynchronous client library: one connection to the server, driven by a
+// thread of its own, for the CLI client and for bots and integrations.
+//
+// Sending only queues. Frames from any thread are appended to an outbound
+// queue and the I/O thread writes them out in batches, as fast as the socket
+// and the server's CREDIT take them, so a sender never waits on a round trip
+// and thousands of messages a second fit one connection. A full queue is
+// reported, not waited on; chatclient_drain waits.
+//
+// The server also limits each device to --device-rate frames a second
+// (REACTOR_DEFAULT_DEVICE_RATE, with a burst of REACTOR_DEFAULT_DEVICE_BURST).
+// A client over it is not disconnected: the server stops reading its socket
+// until the bucket refills, so frames wait in this queue and it fills up
+// sooner. Bots that send faster need a server started with a higher rate,
+// or 0 for no limit.
+//
+// Inbound frames go to the handlers, on the I/O thread. PING, CREDIT and
+// FEATURES are handled here; conversation and device messages are parsed
+// into a ChatMessage, everything else is passed on as a ProtoFrame.
+//
+// The connection is kept up: when it drops the client reconnects after a
+// jittered exponential backoff, then says HELLO again, re-acknowledges the
+// last device seq it acked, rejoins its conversations and pages back through
+// each one's history, resumeHistory messages a page, newest page first,
+// until it reaches the last seq seen there. The server replays device
+// messages from the first one not acknowledged; what was delivered already,
+// and history at or below the last seq seen in a conversation, is skipped,
+// so handlers see each stored message once. Frames not yet written when the
+// connection dropped go out on the next one; frames written but in flight
+// may be lost with it.
+//
+// Compression (PROTO_FEATURE_LZ) is asked for on every connection when
+// configured, and each connection starts new streams.
+
+#define CHATCLIENT_DEFAULT_PORT 2000
+#define CHATCLIENT_DEFAULT_RECONNECT_BASE_MS 250
+#define CHATCLIENT_DEFAULT_RECONNECT_MAX_MS 30000
+#define CHATCLIENT_DEFAULT_CONNECT_TIMEOUT_MS 5000
+#define CHATCLIENT_DEFAULT_SILENCE_MS 90000     // the server's idle timeout: it pings well before
+#define CHATCLIENT_DEFAULT_MAX_QUEUED_BYTES (8 * 1024 * 1024)
+#define CHATCLIENT_DEFAULT_RESUME_HISTORY 100
+#define CHATCLIENT_COMPRESS_MIN 64              // smallest payload sent compressed
+
+enum ChatClientStatus {
+    CHATCLIENT_OK = 0,
+    CHATCLIENT_FULL = -1,           // the queue holds maxQueuedBytes; drain and retry
+    CHATCLIENT_TOO_LARGE = -2,      // over PROTO_DEFAULT_MAX_PAYLOAD
+    CHATCLIENT_NO_MEMORY = -3
+};
+
+enum ChatClientState {
+    CHATCLIENT_CONNECTING,
+    CHATCLIENT_CONNECTED,           // handshake queued; frames flow
+    CHATCLIENT_DISCONNECTED         // retrying after retryMs
+};
+
+struct ChatClientConfig {
+    const char* host;               // IPv4 address
+    int port;
+    bool compress;                  // ask for PROTO_FEATURE_LZ
+    bool autoAck;                   // acknowledge device messages once handled
+    uint32_t reconnectBaseMs;       // first backoff; doubles per failed attempt
+    uint32_t reconnectMaxMs;
+    uint32_t connectTimeoutMs;
+    uint32_t silenceMs;             // reconnect after this long without a byte; 0 never
+    size_t maxQueuedBytes;
+    uint16_t resumeHistory;         // messages per HISTORY page when resuming after a reconnect; 0 none
+};
+
+// A stored (or live) message, valid for the duration of the handler.
+struct ChatMessage {
+    const uint8_t* conversationId;  // NULL for a device message
+    const uint8_t* sender;          // deviceId
+    uint64_t seq;                   // 0 when the server did not store it
+    uint8_t type;                   // ProtoConversationType of a conversation message
+    bool replayed;                  // from history, filling the gap of a reconnect
+    const uint8_t* body;
+    size_t length;
+};
+
+struct ChatClientHandlers {
+    void* context;
+    void (*message)(void* context, const struct ChatMessage* message);
+    // Every other frame, refused device messages included; non-zero drops
+    // the connection (and reconnects).
+    proto_handler_fn frame;
+    // retryMs is the backoff ahead when disconnected.
+    void (*state)(void* context, enum ChatClientState state, uint32_t retryMs);
+};
+
+struct ChatClientStats {
+    uint64_t framesSent;            // queued frames written to a socket
+    uint64_t rawBytes;              // their size uncompressed
+    uint64_t wireBytes;             // everything written, handshakes included
+    uint64_t wireBytesReceived;
+    uint64_t reconnects;
+    size_t queuedBytes;             // waiting to be written
+};
+
+struct ChatClient;
+
+static inline void chatclient_default_config(struct ChatClientConfig* config)
+{
+    config->host = "127.0.0.1";
+    config->port = CHATCLIENT_DEFAULT_PORT;
+    config->compress = true;
+    config->autoAck = true;
+    config->reconnectBaseMs = CHATCLIENT_DEFAULT_RECONNECT_BASE_MS;
+    config->reconnectMaxMs = CHATCLIENT_DEFAULT_RECONNECT_MAX_MS;
+    config->connectTimeoutMs = CHATCLIENT_DEFAULT_CONNECT_TIMEOUT_MS;
+    config->silenceMs = CHATCLIENT_DEFAULT_SILENCE_MS;
+    config->maxQueuedBytes = CHATCLIENT_DEFAULT_MAX_QUEUED_BYTES;
+    config->resumeHistory = CHATCLIENT_DEFAULT_RESUME_HISTORY;
+}
+
+// Starts the I/O thread, which connects at once. Returns NULL on failure.
+struct ChatClient* chatclient_create(const struct ChatClientConfig* config, const struct ChatClientHandlers* handlers);
+// Stops the thread and closes the connection; queued frames are dropped.
+void chatclient_destroy(struct ChatClient* client);
+
+// The functions below are safe from any thread, handlers included, and
+// return a ChatClientStatus.
+
+// Queues a frame whose payload is head followed by body.
+int chatclient_send(struct ChatClient* client, uint8_t opcode, const void* head, size_t headLength, const void* body,
+    size_t bodyLength);
+// HELLO, remembered for reconnects.
+int chatclient_hello(struct ChatClient* client, const uint8_t* userId, const uint8_t* deviceId);
+// JOIN and LEAVE; joined conversations are rejoined and resumed on reconnect.
+int chatclient_join(struct ChatClient* client, const uint8_t* conversationId, enum ProtoConversationType type);
+int chatclient_leave(struct ChatClient* client, const uint8_t* conversationId);
+int chatclient_send_conversation(struct ChatClient* client, const uint8_t* conversationId, const void* body,
+    size_t length);
+int chatclient_send_device(struct ChatClient* client, const uint8_t* deviceId, const void* body, size_t length);
+// Acknowledges device messages up to seq (without autoAck).
+int chatclient_ack(struct ChatClient* client, uint64_t seq);
+
+// Waits until every queued frame is written, for at most timeoutMs. Returns
+// false on timeout.
+bool chatclient_drain(struct ChatClient* client, uint32_t timeoutMs);
+
+void chatclient_stats(struct ChatClient* client, struct ChatClientStats* stats);
+
+#endif // CHATCLIENT_H
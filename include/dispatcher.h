@@ -0,0 +1,182 @@
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Wire framing shared by server and clients. Every message is
+//
+//   uint32 length   payload bytes, big-endian
+//   uint8  opcode   selects the handler
+//   uint8  flags    per-opcode bits
+//   uint8  encoding 0, or PROTO_ENCODING_LZ once FEATURES enabled it
+//   uint8  reserved zero
+//   payload[length]
+//
+// Frames are parsed in place from a connection's receive buffer: handlers get
+// a pointer into that buffer, valid only for the duration of the call. An
+// encoded frame is decoded first (struct ProtoDispatcher's decode), and its
+// handler sees the decoded payload.
+
+#define PROTO_HEADER_SIZE 8
+#define PROTO_DEFAULT_MAX_PAYLOAD (1024 * 1024)
+#define PROTO_RECV_CHUNK 4096
+#define PROTO_ID_SIZE 16    // users, devices and conversations are UUIDs, raw bytes on the wire
+#define PROTO_ENCODING_OFFSET 6     // header byte holding the encoding
+
+// Payloads below list fields in order; ids are PROTO_ID_SIZE bytes.
+enum ProtoOpcode {
+    PROTO_OP_CHAT = 1,      // text message; broadcast by the server, delivered to clients
+    PROTO_OP_HELLO = 2,     // client -> server: userId, deviceId
+    PROTO_OP_JOIN = 3,      // client -> server: conversationId, uint8 ProtoConversationType
+    PROTO_OP_LEAVE = 4,     // client -> server: conversationId
+    PROTO_OP_CONV_MSG = 5,  // client -> server: conversationId, body
+                            // server -> client: conversationId, sender deviceId, uint64 seq
+                            // (0 when not stored), body; flags carry the conversation type
+    PROTO_OP_DEVICE_MSG = 6,    // client -> server: recipient deviceId, body; stored until acked
+                                // server -> client: sender deviceId, uint64 seq, body; with
+                                // PROTO_DEVICE_REFUSED, recipient deviceId alone: one message to it
+                                // was not stored
+    PROTO_OP_ACK = 7,           // client -> server: uint64 seq; acknowledges every seq up to it
+    PROTO_OP_PING = 8,          // server -> client heartbeat, empty; answered with PONG
+    PROTO_OP_PONG = 9,          // client -> server, empty
+    PROTO_OP_HISTORY = 10,      // client -> server: conversationId, uint64 beforeSeq (0: newest), uint16 limit
+                                // server -> client: conversationId, then per message in ascending
+                                // order uint64 seq, uint64 createdAtMs, sender deviceId, uint32 length, body
+    PROTO_OP_PREKEY_UPLOAD = 11,    // client -> server: per key keyId, uint16 length, public key; after HELLO
+                                    // server -> client: uint32 stored, uint32 available
+    PROTO_OP_PREKEY_CLAIM = 12,     // client -> server: deviceId
+                                    // server -> client: deviceId, keyId, public key; deviceId alone if none left
+    PROTO_OP_PREKEY_LOW = 13,       // server -> client: uint32 available; the device's pool is running out
+    PROTO_OP_PRESENCE = 14,         // server -> client: conversationId, then per device deviceId,
+                                    // uint8 status (0 offline, 1 online), uint64 lastSeenAtMs (wall clock)
+    PROTO_OP_RECEIPT = 15,          // client -> server: conversationId, uint8 kind (1 delivered, 2 read),
+                                    // uint64 fromSeq, uint64 toSeq; acknowledges the whole range
+                                    // server -> client: conversationId, sender deviceId, then per ack
+                                    // reader deviceId, uint8 kind, uint64 fromSeq, uint64 toSeq; only
+                                    // acks covering some of the sender's messages, batched
+    PROTO_OP_CREDIT = 16,           // server -> client: uint32 total frames the client may have sent
+                                    // since connecting (wrapping); withheld while reading is paused
+    PROTO_OP_BLOB_PUT = 17,         // client -> server: blobId, uint64 size, uint64 offset, bytes; offset must
+                                    // be what the server holds, an empty chunk asks for that; after HELLO
+                                    // server -> client: blobId, uint64 stored; answers a query, a chunk at the
+                                    // wrong offset, a refusal (PROTO_BLOB_REFUSED) and the last chunk
+    PROTO_OP_BLOB_GET = 18,         // client -> server: blobId, uint64 offset; after HELLO
+    PROTO_OP_BLOB_DATA = 19,        // server -> client: blobId, uint64 size, uint64 offset, bytes; sent until
+                                    // offset + bytes reaches size. PROTO_BLOB_REFUSED: unknown, incomplete,
+                                    // or another download is in progress on the connection
+    PROTO_OP_FEATURES = 20          // client -> server: uint32 ProtoFeature bits it supports; sent first.
+                                    // server -> client: uint32 bits enabled, in both directions
+};
+
+// PROTO_FEATURE_LZ: payloads may be compressed (lz.h, one stream per
+// direction) and marked PROTO_ENCODING_LZ. A client decodes from the moment
+// it asks and encodes once the server's answer enables it.
+enum ProtoFeature {
+    PROTO_FEATURE_LZ = 1
+};
+
+#define PROTO_ENCODING_LZ 1
+
+#define PROTO_BLOB_REFUSED 1    // BLOB_PUT / BLOB_DATA flag
+#define PROTO_DEVICE_REFUSED 1  // DEVICE_MSG flag
+
+#define PROTO_SEQ_SIZE 8    // big-endian on the wire
+
+// Mirrors ConversationType in src/db/database_schema.c.
+enum ProtoConversationType {
+    PROTO_CONV_DIRECT = 0,
+    PROTO_CONV_GROUP = 1,
+    PROTO_CONV_BROADCAST = 2    // reaches every connection; servers refuse to create one unless allowed
+};
+
+enum ProtoStatus {
+    PROTO_OK = 0,
+    PROTO_PAUSED = 1,           // admit held a frame back; it stays buffered for the next dispatch
+    PROTO_ERR_TOO_LARGE = -1,   // declared payload exceeds the buffer's limit
+    PROTO_ERR_NO_MEMORY = -2,
+    PROTO_ERR_HANDLER = -3,     // a handler asked for the connection to be closed
+    PROTO_ERR_DECODE = -4       // an encoded frame that could not be decoded
+};
+
+struct ProtoFrame {
+    uint8_t opcode;
+    uint8_t flags;
+    uint8_t encoding;
+    uint32_t length;
+    const uint8_t* payload;
+};
+
+// Returns 0 to continue, non-zero to stop dispatching and close the connection.
+typedef int (*proto_handler_fn)(void* context, const struct ProtoFrame* frame);
+// Returns false to stop dispatching before frame, leaving it buffered.
+typedef bool (*proto_admit_fn)(void* context, const struct ProtoFrame* frame);
+// Replaces an encoded frame's payload and length with the decoded ones (valid
+// until the next decode) and clears its encoding. Returns false if it cannot.
+typedef bool (*proto_decode_fn)(void* context, struct ProtoFrame* frame);
+
+struct ProtoDispatcher {
+    proto_handler_fn handlers[256];
+    proto_handler_fn fallback;      // unknown opcodes; NULL ignores them
+    proto_admit_fn admit;           // asked before every frame, still encoded; NULL admits all
+    proto_decode_fn decode;         // frames with an encoding; NULL rejects them
+};
+
+// Per-connection receive buffer. Storage is allocated on first use, grows
+// with the bytes received (not with a frame's declared length) and is
+// released once every received byte has been dispatched.
+struct ProtoRecvBuffer {
+    uint8_t* data;
+    size_t capacity;
+    size_t start;   // first unparsed byte
+    size_t end;     // one past the last received byte
+    uint32_t maxPayload;
+    uint64_t frames;    // frames dispatched since init
+    size_t claimed;     // charged against the receive-memory limit
+    bool limited;       // the last reserve was refused by the receive-memory limit
+};
+
+void proto_dispatcher_init(struct ProtoDispatcher* dispatcher);
+void proto_register(struct ProtoDispatcher* dispatcher, uint8_t opcode, proto_handler_fn handler);
+
+// Where receive buffer storage comes from: malloc and free unless a
+// program installs its own (the server's block pools) before any buffer is
+// used.
+typedef void* (*proto_alloc_fn)(size_t size);
+typedef void (*proto_free_fn)(void* block);
+void proto_set_allocator(proto_alloc_fn alloc, proto_free_fn release);
+
+void proto_recv_init(struct ProtoRecvBuffer* buffer, uint32_t maxPayload);
+void proto_recv_destroy(struct ProtoRecvBuffer* buffer);
+
+// Caps the storage of all receive buffers together; 0 (the default) none.
+// A buffer is charged for the frame it holds as soon as the header says how
+// long it is, and only growth past its first PROTO_RECV_CHUNK is refused.
+// Set it well above the largest frame.
+void proto_set_recv_limit(size_t bytes);
+
+// Returns space for at least PROTO_RECV_CHUNK bytes to recv() into, or NULL
+// when out of memory or, with buffer->limited set, when growing would pass
+// the receive-memory limit: stop reading and try again later.
+uint8_t* proto_recv_reserve(struct ProtoRecvBuffer* buffer, size_t* available);
+// For bytes already taken from the socket (a completed io_uring recv): grows
+// past the limit, but still sets buffer->limited so reading stops after them.
+uint8_t* proto_recv_reserve_received(struct ProtoRecvBuffer* buffer, size_t* available);
+void proto_recv_commit(struct ProtoRecvBuffer* buffer, size_t received);
+
+// Dispatches every complete frame in the buffer and keeps any trailing
+// partial frame for the next recv. Returns PROTO_PAUSED if admit stopped it.
+int proto_recv_dispatch(struct ProtoRecvBuffer* buffer, const struct ProtoDispatcher* dispatcher, void* context);
+
+// Frees the storage if nothing is pending; call when the socket would block.
+void proto_recv_release_idle(struct ProtoRecvBuffer* buffer);
+
+void proto_encode_header(uint8_t* out, uint8_t opcode, uint8_t flags, uint32_t length);
+
+// Parses a UUID in its canonical 8-4-4-4-12 hex form (dashes optional).
+bool proto_parse_id(const char* text, uint8_t* id);
+// Writes the canonical form; out must hold 37 bytes.
+void proto_format_id(const uint8_t* id, char* out);
+
+#endif // DISPATCHER_H
@@ -0,0 +1,31 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear (HDR-style) histogram of uint64 values: every power of two is
+// split into 2^HISTOGRAM_SUB_BITS equal buckets, so any value is reported
+// within 0.1% of what was recorded, from nanoseconds to hours, in a fixed
+// array. Recording is an index computation and an increment; histograms of
+// several threads are merged once at the end.
+
+#define HISTOGRAM_SUB_BITS 10
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+struct Histogram {
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t counts[HISTOGRAM_BUCKETS];
+};
+
+void histogram_init(struct Histogram* histogram);
+void histogram_record(struct Histogram* histogram, uint64_t value);
+void histogram_merge(struct Histogram* into, const struct Histogram* from);
+
+// The value at or below which percentile (0..100) of the recorded values
+// fall, rounded up to its bucket's highest value; 0 if nothing was recorded.
+uint64_t histogram_percentile(const struct Histogram* histogram, double percentile);
+
+#endif // HISTOGRAM_H
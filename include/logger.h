@@ -0,0 +1,92 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Asynchronous server log. A call copies its format pointer and raw
+// arguments (strings by value, bounded) into a record of the calling
+// thread's own ring: no lock, no formatting, no I/O. A flusher thread
+// drains every ring every flushIntervalMs, orders the batch by time,
+// formats it and writes it with one call per stream. A full ring drops the
+// record and counts it instead of blocking.
+//
+// Per-message traffic goes through log_sampled: LOG_LEVEL_DEBUG, every
+// sampleEvery-th call on a thread, at most sampledPerSecond per thread.
+// The default level, info, leaves it off.
+
+enum LogLevel {
+    LOG_LEVEL_ERROR,        // stderr
+    LOG_LEVEL_WARN,         // stderr
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
+#define LOGGER_DEFAULT_LEVEL LOG_LEVEL_INFO
+#define LOGGER_DEFAULT_SAMPLE_EVERY 1
+#define LOGGER_DEFAULT_SAMPLED_PER_SECOND 100
+#define LOGGER_DEFAULT_FLUSH_INTERVAL_MS 20
+
+struct LoggerConfig {
+    enum LogLevel level;
+    unsigned sampleEvery;           // log_sampled keeps one call in this many per thread
+    unsigned sampledPerSecond;      // and at most this many per thread and second; 0 unlimited
+    unsigned flushIntervalMs;
+};
+
+static inline void logger_default_config(struct LoggerConfig* config)
+{
+    config->level = LOGGER_DEFAULT_LEVEL;
+    config->sampleEvery = LOGGER_DEFAULT_SAMPLE_EVERY;
+    config->sampledPerSecond = LOGGER_DEFAULT_SAMPLED_PER_SECOND;
+    config->flushIntervalMs = LOGGER_DEFAULT_FLUSH_INTERVAL_MS;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LOG_PRINTF_FORMAT(formatIndex, firstArg) __attribute__((format(printf, formatIndex, firstArg)))
+#else
+#define LOG_PRINTF_FORMAT(formatIndex, firstArg)
+#endif
+
+// Set by logger_start; read unsynchronized on every call.
+extern enum LogLevel g_logLevel;
+
+bool logger_parse_level(const char* name, enum LogLevel* level);
+
+// Starts the flusher. Until then, and after logger_stop, calls write
+// synchronously.
+int logger_start(const struct LoggerConfig* config);
+// Writes out everything logged so far and stops the flusher.
+void logger_stop(void);
+
+// format must be a string literal (only the pointer is kept). Formatting
+// happens later, so arguments must be values: %s strings are copied, up to
+// what fits in one record.
+void log_write(enum LogLevel level, const char* format, ...) LOG_PRINTF_FORMAT(2, 3);
+
+// "label failed with error: N (text)" for the current socket/system error.
+void log_os_error(const char* label);
+
+// True for the calls log_sampled should keep on this thread.
+bool log_sample(void);
+
+#define log_at(level, ...) \
+    do { \
+        if ((level) <= g_logLevel) { \
+            log_write((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define log_error(...) log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#define log_sampled(...) \
+    do { \
+        if (LOG_LEVEL_DEBUG <= g_logLevel && log_sample()) { \
+            log_write(LOG_LEVEL_DEBUG, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#endif // LOGGER_H
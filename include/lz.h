@@ -0,0 +1,48 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Small LZ77 codec for frame payloads, with a streaming dictionary: a block
+// may copy from the last LZ_WINDOW bytes of the blocks before it on the same
+// stream, so what repeats from frame to frame on a connection (ids, sender
+// prefixes, JSON keys of message metadata) costs a few bytes after its first
+// appearance. One stream per connection and direction; encoder and decoder
+// must see the same blocks in the same order. A block the encoder gives up
+// on (it would not fit) is not part of the stream and is sent raw.
+//
+// Block: uint16 decoded length, big-endian, then sequences. A sequence is
+// a token (high nibble literal count, low nibble match length - 4; 15 means
+// bytes follow that add to it, until one is below 255), the literals, then,
+// unless it is the last sequence, a uint16 little-endian match distance
+// (1..LZ_WINDOW) and the match length's extra bytes. The format is LZ4's
+// block format with a length in front; greedy matching with LZ4's skip
+// heuristic makes incompressible input (ciphertext) cheap to give up on.
+
+#define LZ_WINDOW (16 * 1024)
+#define LZ_MAX_INPUT (16 * 1024)    // largest block, decoded
+#define LZ_BLOCK_HEADER 2
+
+struct LzEncoder;
+struct LzDecoder;
+
+struct LzEncoder* lz_encoder_create(void);
+void lz_encoder_destroy(struct LzEncoder* encoder);
+
+// Compresses prefix followed by data, at most LZ_MAX_INPUT bytes together,
+// into out. Returns the block's size, or 0 if it would not fit in capacity,
+// in which case the stream is as if the call never happened: pass less than
+// the input's size to keep only blocks that shrink.
+size_t lz_compress(struct LzEncoder* encoder, const uint8_t* prefix, size_t prefixLength, const uint8_t* data,
+    size_t length, uint8_t* out, size_t capacity);
+
+struct LzDecoder* lz_decoder_create(void);
+void lz_decoder_destroy(struct LzDecoder* decoder);
+
+// Decodes a block. Returns the decoded bytes, valid until the next call,
+// and sets *length; NULL if the block is corrupt.
+const uint8_t* lz_decompress(struct LzDecoder* decoder, const uint8_t* block, size_t blockLength, size_t* length);
+
+#endif // LZ_H
@@ -0,0 +1,100 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+
+// Server counters. Every thread adds to a shard of its own, aligned to a
+// cache line, with a relaxed atomic add: no line is shared between two
+// reactor threads, so counting a frame costs a few nanoseconds. Readers sum
+// the shards on demand. Threads beyond METRICS_MAX_SHARDS (thread-per-client
+// mode) share shards round-robin, which the atomic add keeps correct.
+//
+// Gauges are counters of signed deltas (added modulo 2^64): a frame queued
+// on one thread and written on another still sums to the right depth.
+
+#define METRICS_MAX_SHARDS 64
+#define METRICS_CACHE_LINE 64
+#define METRICS_FANOUT_BUCKETS 18   // recipients <= 1, 2, 4, ... 65536, then more
+#define METRICS_DEFAULT_ADMIN_ADDRESS "127.0.0.1"
+
+enum MetricId {
+    METRIC_FRAMES_IN,
+    METRIC_BYTES_IN,
+    METRIC_FRAMES_OUT,
+    METRIC_BYTES_OUT,
+    METRIC_SEND_ERRORS,
+    METRIC_QUEUE_DROPS,             // frames an outbound queue discarded
+    METRIC_QUEUED_FRAMES,           // gauge: frames in outbound queues
+    METRIC_QUEUED_BYTES,            // gauge: bytes in outbound queues
+    METRIC_CONNECTIONS_OPENED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_FANOUT_RECIPIENTS,       // sum over fan-outs; their count is in the buckets
+    METRIC_REGISTRY_LOCKS,          // connection registry writer mutex
+    METRIC_REGISTRY_LOCK_CONTENDED,
+    METRIC_REGISTRY_LOCK_WAIT_NS,
+    METRIC_REGISTRY_LOCK_HOLD_NS,
+    METRIC_IO_SYSCALLS,             // reactor accept/recv/send/wait/wakeup system calls
+    METRIC_ZEROCOPY_SENDS,          // sends made with MSG_ZEROCOPY
+    METRIC_ZEROCOPY_COPIED,         // ...that the kernel completed by copying anyway
+    METRIC_RATE_LIMITED,            // reads paused for want of tokens
+    METRIC_BACKPRESSURE_PAUSES,     // reads paused while the client's own queue was full
+    METRIC_RECV_MEMORY_PAUSES,      // reads paused while receive buffers were at their memory limit
+    METRIC_RATE_TABLE_FULL,         // frames let through for want of a bucket slot
+    METRIC_BLOB_BYTES_IN,           // attachment bytes written to the blob store
+    METRIC_BLOB_BYTES_OUT,          // attachment bytes sent with sendfile
+    METRIC_BLOB_QUOTA_REFUSALS,     // uploads refused because the store was at its quota
+    METRIC_BLOB_PARTS_EXPIRED,      // abandoned part files deleted
+    METRIC_COMPRESSED_FRAMES,       // frames sent compressed
+    METRIC_COMPRESS_SAVED_BYTES,    // payload bytes compression kept off the wire
+    METRIC_COMPRESS_SKIPPED,        // frames tried but sent raw: they would not shrink
+    METRIC_COMPRESS_NS,             // time spent compressing and decompressing
+    METRIC_POOL_ALLOCS,             // pool_alloc and slab_alloc calls
+    METRIC_POOL_DEPOT_TRANSFERS,    // batches moved between a thread cache and the depot
+    METRIC_POOL_MALLOCS,            // chunks carved plus oversized blocks
+    METRIC_POOL_RESERVED_BYTES,     // gauge: memory the pools hold from malloc
+    METRIC_COUNT
+};
+
+struct MetricsShard {
+    alignas(METRICS_CACHE_LINE) atomic_uint_fast64_t values[METRIC_COUNT];
+    atomic_uint_fast64_t fanout[METRICS_FANOUT_BUCKETS];
+};
+
+// Appends extra exposition lines (subsystem gauges) at out; returns their
+// length, at most capacity.
+typedef size_t (*metrics_extra_fn)(char* out, size_t capacity);
+
+struct MetricsShard* metrics_attach(void);
+
+extern _Thread_local struct MetricsShard* t_metricsShard;
+
+static inline void metrics_add(enum MetricId id, uint64_t value)
+{
+    struct MetricsShard* shard = t_metricsShard ? t_metricsShard : metrics_attach();
+    atomic_fetch_add_explicit(&shard->values[id], value, memory_order_relaxed);
+}
+
+// Adds a signed change to a gauge.
+static inline void metrics_adjust(enum MetricId id, int64_t delta)
+{
+    metrics_add(id, (uint64_t)delta);
+}
+
+// One frame handed to recipients connections.
+void metrics_record_fanout(size_t recipients);
+
+uint64_t metrics_now_ns(void);
+
+// Writes every metric in the Prometheus text exposition format, followed
+// by what extra appends. Returns the length written (truncated to capacity - 1).
+size_t metrics_render(char* out, size_t capacity, metrics_extra_fn extra);
+
+// Serves metrics_render on address:port from a background thread: an HTTP
+// GET (any path) gets a text/plain response, anything else (e.g. "stats"
+// typed into nc) just the text. Returns non-zero if the port can't be bound.
+int metrics_start_admin(const char* address, int port, metrics_extra_fn extra);
+
+#endif // METRICS_H
@@ -0,0 +1,46 @@
+#ifndef MSGBUF_H
+#define MSGBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "dispatcher.h"
+
+// Immutable, reference-counted outbound frame. A broadcast composes one and
+// every recipient queue holds a reference, so fan-out copies nothing per
+// recipient. The frame is kept as two segments for writev: the head (frame
+// header + optional sender prefix) and the body (payload bytes). Frames come
+// from the block pools (pool.h), so composing one does not call malloc.
+
+#define MSGBUF_MAX_PREFIX 48
+
+struct MsgBuf {
+    atomic_uint refs;
+    uint32_t headLength;
+    uint32_t bodyLength;
+    uint8_t head[PROTO_HEADER_SIZE + MSGBUF_MAX_PREFIX];
+    uint8_t body[];
+};
+
+// Builds a frame whose payload is prefix followed by body. Returns NULL on
+// allocation failure or a prefix longer than MSGBUF_MAX_PREFIX. The caller
+// owns the single initial reference. A NULL body leaves bodyLength bytes
+// for the caller to fill in before sharing the frame.
+struct MsgBuf* msgbuf_create(uint8_t opcode, uint8_t flags, const char* prefix, size_t prefixLength,
+    const void* body, size_t bodyLength);
+
+static inline size_t msgbuf_size(const struct MsgBuf* buf)
+{
+    return (size_t)buf->headLength + buf->bodyLength;
+}
+
+static inline void msgbuf_retain(struct MsgBuf* buf)
+{
+    atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+}
+
+// Frees the frame when the last reference is dropped.
+void msgbuf_release(struct MsgBuf* buf);
+
+#endif // MSGBUF_H
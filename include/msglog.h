@@ -0,0 +1,103 @@
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "dispatcher.h"
+
+// Message history (the Message entity): every conversation has its own
+// directory of append-only, memory-mapped segment files holding its
+// ciphertexts in sequence order. A sparse in-memory index (one entry every
+// indexInterval records, rebuilt on load) maps sequence numbers and
+// creation times to file offsets, so a page of history is one binary search
+// plus a short forward scan over mapped memory.
+//
+// Writers only lock the conversations they append to; a batch takes each
+// conversation's lock once. As in the offline store, a flusher thread
+// msyncs dirty segments once per commit interval instead of per message;
+// before that it fills in each new record's CiphertextHashSha256 with one
+// sha256_batch per segment, keeping hashing off the network threads.
+//
+// Linux only (mmap, msync); the log is opened by the reactor.
+
+#define MSGLOG_DEFAULT_DIRECTORY "history"
+#define MSGLOG_DEFAULT_SEGMENT_BYTES (16 * 1024 * 1024)
+#define MSGLOG_DEFAULT_COMMIT_INTERVAL_MS 10
+#define MSGLOG_DEFAULT_INDEX_INTERVAL 64
+
+struct MsgLogConfig {
+    const char* directory;
+    size_t segmentBytes;
+    unsigned commitIntervalMs;
+    unsigned indexInterval;     // records between sparse index entries
+};
+
+struct MsgLog;
+
+// One message to append. messageId may be NULL: a UUIDv7 is derived from
+// the creation time and sequence number. createdAtMs 0 means now (wall
+// clock); times are kept non-decreasing within a conversation.
+struct MsgLogEntry {
+    const uint8_t* conversationId;
+    const uint8_t* messageId;
+    const uint8_t* senderDeviceId;
+    const void* protocolHeader;
+    size_t protocolHeaderLength;
+    const void* ciphertext;
+    size_t ciphertextLength;
+    uint64_t createdAtMs;
+    uint64_t seq;           // out: assigned by msglog_append, from 1 per conversation
+};
+
+// A stored message; pointers reference the mapping and are only valid
+// during the callback that receives it.
+struct MsgLogRecord {
+    uint64_t seq;
+    uint64_t createdAtMs;
+    const uint8_t* messageId;
+    const uint8_t* senderDeviceId;
+    const uint8_t* ciphertextHash;  // SHA-256 of the ciphertext; NULL until the flusher has hashed it
+    const uint8_t* protocolHeader;
+    size_t protocolHeaderLength;
+    const uint8_t* ciphertext;
+    size_t ciphertextLength;
+};
+
+// Return false to stop the scan after this record.
+typedef bool (*msglog_record_fn)(void* context, const struct MsgLogRecord* record);
+
+static inline void msglog_default_config(struct MsgLogConfig* config)
+{
+    config->directory = MSGLOG_DEFAULT_DIRECTORY;
+    config->segmentBytes = MSGLOG_DEFAULT_SEGMENT_BYTES;
+    config->commitIntervalMs = MSGLOG_DEFAULT_COMMIT_INTERVAL_MS;
+    config->indexInterval = MSGLOG_DEFAULT_INDEX_INTERVAL;
+}
+
+// Creates the directory if needed; conversations are loaded lazily on first use.
+struct MsgLog* msglog_open(const struct MsgLogConfig* config);
+void msglog_close(struct MsgLog* log);
+
+// Appends entries in order, filling in each seq. Returns how many were
+// stored; on a failure the rest of the batch is skipped.
+size_t msglog_append(struct MsgLog* log, struct MsgLogEntry* entries, size_t count);
+
+// Passes up to limit records with seq >= fromSeq to fn in ascending order.
+// Returns how many were passed.
+size_t msglog_scan(struct MsgLog* log, const uint8_t* conversationId, uint64_t fromSeq, size_t limit,
+    msglog_record_fn fn, void* context);
+
+// The limit records just before beforeSeq (0: the newest), in ascending
+// order, i.e. one page further back in the history.
+size_t msglog_page_back(struct MsgLog* log, const uint8_t* conversationId, uint64_t beforeSeq, size_t limit,
+    msglog_record_fn fn, void* context);
+
+// First seq created at or after timeMs, or one past the newest if none was.
+uint64_t msglog_seq_at(struct MsgLog* log, const uint8_t* conversationId, uint64_t timeMs);
+
+// Newest seq of the conversation, 0 if it has no messages.
+uint64_t msglog_last_seq(struct MsgLog* log, const uint8_t* conversationId);
+
+#endif // MSGLOG_H
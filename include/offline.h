@@ -0,0 +1,88 @@
+#ifndef OFFLINE_H
+#define OFFLINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "dispatcher.h"
+
+// Store-and-forward queue of device deliveries (MessageDelivery rows in
+// Queued state). Every recipient device has its own directory of
+// append-only segment files; records get a per-device sequence number and
+// stay until the device acknowledges them, after which whole segments are
+// deleted. Appends never touch a file: they copy into the tail segment's
+// mapping, or, when there is none with room, into memory. A flusher thread
+// creates segments, writes what was staged and syncs every dirty segment
+// once per commit interval (group commit), so the durability window is that
+// interval, not one fsync per message.
+//
+// Only devices with a consumer attached keep their segments mapped, up to
+// maxMappedSegments across the store; the others are read and written
+// through the files. Staged records are capped at maxStagedBytes, past
+// which appends fail until the flusher catches up.
+//
+// Linux only (mmap, fdatasync); the store is opened by the reactor.
+
+#define OFFLINE_DEFAULT_DIRECTORY "spool"
+#define OFFLINE_DEFAULT_SEGMENT_BYTES (4 * 1024 * 1024)
+#define OFFLINE_DEFAULT_COMMIT_INTERVAL_MS 10
+#define OFFLINE_DEFAULT_MAX_STAGED_BYTES (64 * 1024 * 1024)
+#define OFFLINE_DEFAULT_MAX_MAPPED_SEGMENTS 8192
+
+struct OfflineConfig {
+    const char* directory;
+    size_t segmentBytes;
+    unsigned commitIntervalMs;
+    size_t maxStagedBytes;
+    size_t maxMappedSegments;
+};
+
+struct OfflineStore;
+
+// Called with the device's lock held whenever a record is appended for a
+// device that has a consumer attached. Must only schedule work.
+typedef void (*offline_notify_fn)(void* consumer);
+
+// Return false to stop reading after this record.
+typedef bool (*offline_record_fn)(void* context, uint64_t seq, const uint8_t* sender, const uint8_t* body,
+    size_t length);
+
+static inline void offline_default_config(struct OfflineConfig* config)
+{
+    config->directory = OFFLINE_DEFAULT_DIRECTORY;
+    config->segmentBytes = OFFLINE_DEFAULT_SEGMENT_BYTES;
+    config->commitIntervalMs = OFFLINE_DEFAULT_COMMIT_INTERVAL_MS;
+    config->maxStagedBytes = OFFLINE_DEFAULT_MAX_STAGED_BYTES;
+    config->maxMappedSegments = OFFLINE_DEFAULT_MAX_MAPPED_SEGMENTS;
+}
+
+// Creates the directory if needed; devices are loaded lazily on first use.
+struct OfflineStore* offline_open(const struct OfflineConfig* config);
+void offline_close(struct OfflineStore* store);
+
+// Appends a record for device. Returns 0 and its sequence number, or -1 if
+// it could not be stored, e.g. while the disk is failing.
+int offline_append(struct OfflineStore* store, const uint8_t* device, const uint8_t* sender, const void* body,
+    size_t length, uint64_t* seq);
+
+// Makes consumer the device's single consumer (replacing any other) and
+// returns the first sequence number it has not acknowledged.
+uint64_t offline_attach(struct OfflineStore* store, const uint8_t* device, void* consumer, offline_notify_fn notify);
+// No-op unless consumer is still the attached one. After it returns notify
+// is never called for consumer again.
+void offline_detach(struct OfflineStore* store, const uint8_t* device, void* consumer);
+
+// Passes records with seq >= fromSeq to fn in order, until fn returns false
+// or none are left. Returns the sequence number to read from next.
+uint64_t offline_read(struct OfflineStore* store, const uint8_t* device, uint64_t fromSeq, offline_record_fn fn,
+    void* context);
+
+// First sequence number the device has not acknowledged.
+uint64_t offline_first_unacked(struct OfflineStore* store, const uint8_t* device);
+
+// Acknowledges every record up to and including seq; segments holding only
+// acknowledged records are deleted after the acknowledgement is durable.
+void offline_ack(struct OfflineStore* store, const uint8_t* device, uint64_t seq);
+
+#endif // OFFLINE_H
@@ -0,0 +1,141 @@
+#ifndef OUTQUEUE_H
+#define OUTQUEUE_H
+
+#include "socketutil.h"
+#include "msgbuf.h"
+
+// Bounded per-connection queue of outbound frames. Producers (broadcasters on
+// any thread) only enqueue; the connection's owning reactor thread drains it
+// when the socket is writable, so a slow receiver never stalls a sender.
+// Frames are shared MsgBufs: a queue holds a reference, never a copy. The
+// --threaded fallback has no owning thread to drain it and sends directly.
+//
+// A flush hands the kernel every queued frame in one vectored send, so a
+// burst for one connection costs a single system call. Frames of at least
+// zeroCopyMinBytes can go out with MSG_ZEROCOPY: the kernel then reads them
+// in place, and the queue holds them until the socket's error queue reports
+// the send complete.
+//
+// An encoder (per-connection compression) may rewrite each frame once, on
+// the owning thread, just before its first byte is gathered for sending, so
+// frames are encoded in exactly the order they go out. It runs without the
+// mutex, so producers never wait behind compression; a frame is claimed
+// (marked encoded) first, and an encoded frame is never dropped: the peer's
+// decoder expects it.
+
+#define OUTQ_DEFAULT_MAX_FRAMES 1024
+#define OUTQ_DEFAULT_HIGH_WATER_BYTES (4 * 1024 * 1024)
+#define OUTQ_DEFAULT_ZEROCOPY_MIN_BYTES 0
+
+enum OutQueuePolicy {
+    OUTQ_DROP_OLDEST,
+    OUTQ_DROP_NEWEST,
+    OUTQ_DISCONNECT
+};
+
+enum OutQueueResult {
+    OUTQ_QUEUED,        // accepted; queue was not empty before
+    OUTQ_QUEUED_FIRST,  // accepted into an empty queue; owner must be woken to drain
+    OUTQ_DROPPED,       // the new frame was discarded (drop-newest, or it can never fit)
+    OUTQ_OVERFLOW       // disconnect policy tripped; the connection must be closed
+};
+
+enum OutQueueFlushResult {
+    OUTQ_FLUSH_DRAINED,     // everything was written
+    OUTQ_FLUSH_BLOCKED,     // socket buffer is full; wait for writability
+    OUTQ_FLUSH_ERROR        // send failed or the queue overflowed; close the connection
+};
+
+struct OutQueueConfig {
+    size_t maxFrames;
+    size_t highWaterBytes;
+    enum OutQueuePolicy policy;
+    size_t zeroCopyMinBytes;    // payloads this large use MSG_ZEROCOPY where enabled; 0 never
+};
+
+struct OutFrame {
+    struct MsgBuf* buf;
+    size_t offset;  // bytes of this frame already written
+    bool encoded;   // has been through the encoder
+};
+
+// Returns a replacement for buf holding its own reference, or NULL to send
+// buf as it is.
+typedef struct MsgBuf* (*outqueue_encode_fn)(void* context, struct MsgBuf* buf);
+
+struct OutQueue {
+    pthread_mutex_t mutex;
+    struct OutFrame* frames;    // ring, grown on demand up to maxFrames
+    size_t capacity;
+    size_t head;
+    size_t count;
+    size_t queuedBytes;
+    size_t pinned;      // head frames an asynchronous send still reads
+    bool overflowed;
+    uint64_t droppedFrames;
+    const struct OutQueueConfig* config;
+
+    // Frames MSG_ZEROCOPY sends still lend to the kernel, oldest first; the
+    // first is the send with notification id zeroCopyFirstId, and an entry
+    // is NULL once completed. Owning thread only.
+    bool zeroCopy;
+    struct MsgBuf** zeroCopyBufs;
+    size_t zeroCopyCapacity;
+    size_t zeroCopyHead;
+    size_t zeroCopyCount;
+    uint32_t zeroCopyFirstId;
+
+    // Owning thread only; NULL sends frames as queued. encodeNext counts the
+    // frames from the head the encoder has claimed or passed over; only
+    // those are gathered.
+    outqueue_encode_fn encode;
+    void* encodeContext;
+    size_t encodeNext;
+};
+
+void outqueue_default_config(struct OutQueueConfig* config);
+bool outqueue_parse_policy(const char* name, enum OutQueuePolicy* policy);
+
+void outqueue_init(struct OutQueue* queue, const struct OutQueueConfig* config);
+void outqueue_destroy(struct OutQueue* queue);
+
+// Takes a reference to buf if it is queued, applying the configured policy
+// when the queue is at its frame or byte high-water mark.
+enum OutQueueResult outqueue_push(struct OutQueue* queue, struct MsgBuf* buf);
+
+// True while the queue is below half of both limits. Lets a producer that
+// can regenerate its frames (offline replay) fill it without tripping the
+// drop policy, leaving room for live traffic.
+bool outqueue_has_headroom(struct OutQueue* queue);
+
+// Frames still queued, including one partly written.
+size_t outqueue_length(struct OutQueue* queue);
+
+// Writes queued frames to sockfd without blocking, as many per call as fit
+// one vectored send. Called by the owning thread only.
+enum OutQueueFlushResult outqueue_flush(struct OutQueue* queue, socket_t sockfd);
+
+// Runs every frame not yet sent through encode from now on. Owning thread only.
+void outqueue_set_encoder(struct OutQueue* queue, outqueue_encode_fn encode, void* context);
+
+#ifdef __linux__
+// Lets outqueue_flush send large frames with MSG_ZEROCOPY; the caller has
+// set SO_ZEROCOPY on the socket. Owning thread only.
+void outqueue_enable_zerocopy(struct OutQueue* queue);
+// Reads the zero-copy completions waiting on sockfd's error queue and
+// releases the frames they cover. Returns false if the socket failed.
+bool outqueue_reap_zerocopy(struct OutQueue* queue, socket_t sockfd);
+#endif
+
+#ifndef _WIN32
+// For asynchronous senders (the io_uring backend), instead of outqueue_flush:
+// describes the queued bytes, from the first unwritten one, in at most
+// maxIov segments and pins the frames they cover, so drop-oldest leaves
+// them alone until outqueue_complete. Returns the segment count (0 when
+// empty), or -1 once the queue overflowed. Owning thread only.
+int outqueue_gather(struct OutQueue* queue, struct iovec* iov, int maxIov);
+// Accounts for written bytes of the gathered frames and unpins them.
+void outqueue_complete(struct OutQueue* queue, size_t written);
+#endif
+
+#endif // OUTQUEUE_H
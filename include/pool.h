@@ -0,0 +1,41 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+// Size-classed block pools for frames and receive buffers. Blocks come in
+// powers of two from 64 bytes to 64 KB. Every thread keeps a free list per
+// class, so pool_alloc and pool_free are a pointer pop and push. Only every
+// POOL_BATCH-th operation touches the shared depot, which is a mutex-guarded
+// list per class. Blocks freed on another thread than the one that
+// allocated them (every fanned-out frame) migrate through the depot. The
+// depot grows by carving POOL_CHUNK_SIZE chunks and never returns them, so
+// once traffic reaches its working set the pools stop calling malloc;
+// chat_pool_mallocs_total in the metrics shows that.
+//
+// Requests above the largest class go to malloc and are counted as well.
+
+#define POOL_MIN_SHIFT 6
+#define POOL_CLASS_COUNT 11         // 64 B .. 64 KB blocks, header included
+#define POOL_BATCH 32               // blocks moved between a thread and the depot at once
+#define POOL_CHUNK_SIZE (256 * 1024)
+
+void* pool_alloc(size_t size);
+void pool_free(void* block);
+
+// Fixed-size objects (connections) carved from chunks, zeroed on
+// allocation. Connects are rare next to messages, so one mutex guards the
+// free list; freed objects are reused before any new chunk is carved.
+struct Slab {
+    pthread_mutex_t mutex;
+    size_t objectSize;
+    void* freeList;
+};
+
+void slab_init(struct Slab* slab, size_t objectSize);
+void* slab_alloc(struct Slab* slab);
+void slab_free(struct Slab* slab, void* object);
+
+#endif // POOL_H
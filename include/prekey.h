@@ -0,0 +1,99 @@
+#ifndef PREKEY_H
+#define PREKEY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "dispatcher.h"
+
+// One-time prekey pools (DeviceOneTimePrekey). Every device has a ring of
+// uploaded public keys; claiming one is a compare-and-swap on the ring's
+// head, so hundreds of sessions claiming from one device never queue on a
+// lock and no two of them can get the same key. Uploads append at the tail
+// under a per-device mutex that claims never take.
+//
+// Durability: uploads and consumptions (tombstones, ConsumedAt) go to an
+// append-only journal, written by one thread in batches with one fdatasync
+// each. A claim is only final once its tombstone is durable: callers hold
+// the key back until prekey_durable_generation reaches the claim's
+// generation, so a crash can never hand the same key out twice. A batch
+// that fails to write is retried; if the journal stays unwritable, the
+// claims waiting on it are failed rather than released. The journal is
+// compacted to the live keys on open.
+//
+// A device whose pool drops below lowWatermark is notified once through its
+// attached consumer; refilling above it re-arms the notification.
+//
+// Linux only (fdatasync); the pools are opened by the reactor.
+
+#define PREKEY_DEFAULT_DIRECTORY "prekeys"
+#define PREKEY_DEFAULT_CAPACITY 1024
+#define PREKEY_DEFAULT_LOW_WATERMARK 20
+#define PREKEY_DEFAULT_COMMIT_INTERVAL_MS 10
+#define PREKEY_MAX_KEY_SIZE 256
+
+struct PrekeyConfig {
+    const char* directory;
+    size_t capacity;            // keys a device may have waiting; rounded up to a power of two
+    size_t lowWatermark;
+    unsigned commitIntervalMs;
+};
+
+struct PrekeyStore;
+
+// Called when the device's pool falls below the low watermark, with the
+// device's mutex held. Must only schedule work.
+typedef void (*prekey_notify_fn)(void* consumer);
+
+// Called by the journal thread after every batch it made durable or gave up on.
+typedef void (*prekey_durable_fn)(void* context);
+
+struct PrekeyUpload {
+    const uint8_t* keyId;
+    const uint8_t* publicKey;
+    size_t length;              // at most PREKEY_MAX_KEY_SIZE
+};
+
+struct PrekeyClaim {
+    uint8_t keyId[PROTO_ID_SIZE];
+    uint8_t publicKey[PREKEY_MAX_KEY_SIZE];
+    size_t length;
+    uint64_t generation;        // durable once prekey_durable_generation() reaches this
+};
+
+static inline void prekey_default_config(struct PrekeyConfig* config)
+{
+    config->directory = PREKEY_DEFAULT_DIRECTORY;
+    config->capacity = PREKEY_DEFAULT_CAPACITY;
+    config->lowWatermark = PREKEY_DEFAULT_LOW_WATERMARK;
+    config->commitIntervalMs = PREKEY_DEFAULT_COMMIT_INTERVAL_MS;
+}
+
+// Loads and compacts the journal. onDurable may be NULL.
+struct PrekeyStore* prekey_open(const struct PrekeyConfig* config, prekey_durable_fn onDurable, void* context);
+void prekey_close(struct PrekeyStore* store);
+
+// Adds keys to the device's pool in order. Returns how many were taken: the
+// rest did not fit, or were malformed.
+size_t prekey_upload(struct PrekeyStore* store, const uint8_t* deviceId, const struct PrekeyUpload* keys,
+    size_t count);
+
+// Takes the oldest key of the device. Lock-free. Returns false if the pool is empty.
+bool prekey_claim(struct PrekeyStore* store, const uint8_t* deviceId, struct PrekeyClaim* claim);
+
+// Every claim with generation <= the result is durable.
+uint64_t prekey_durable_generation(struct PrekeyStore* store);
+
+// Every claim with generation <= the result that is not durable yet failed:
+// its tombstone could not be written, so the key must not be sent.
+uint64_t prekey_failed_generation(struct PrekeyStore* store);
+
+size_t prekey_available(struct PrekeyStore* store, const uint8_t* deviceId);
+
+// The device's low-watermark notifications go to consumer until detached.
+// Returns true if the pool is already low; that counts as the notification.
+bool prekey_attach(struct PrekeyStore* store, const uint8_t* deviceId, void* consumer, prekey_notify_fn notify);
+void prekey_detach(struct PrekeyStore* store, const uint8_t* deviceId, void* consumer);
+
+#endif // PREKEY_H
@@ -0,0 +1,69 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "dispatcher.h"
+
+// Device presence (UserDevice.LastSeenAt, IpLast and the online status that
+// User.Status is derived from). The current state of every device lives in
+// memory; connecting, disconnecting and activity only update it and mark the
+// device dirty. A flusher thread appends each dirty device's state once per
+// persistInterval with one write and one fdatasync, however often it changed
+// in between, so a device flapping online and offline costs at most one
+// record per interval. The journal is compacted to one record per device on
+// open and whenever it grows to several times that.
+//
+// Linux only (fdatasync); the store is opened by the reactor.
+
+#define PRESENCE_DEFAULT_DIRECTORY "presence"
+#define PRESENCE_DEFAULT_PERSIST_INTERVAL_MS 5000
+
+enum PresenceStatus {
+    PRESENCE_OFFLINE = 0,
+    PRESENCE_ONLINE = 1
+};
+
+struct PresenceConfig {
+    const char* directory;
+    unsigned persistIntervalMs;     // how stale the journal may get; also the most often a device is written
+};
+
+struct PresenceStore;
+
+struct PresenceState {
+    uint8_t userId[PROTO_ID_SIZE];
+    uint8_t status;             // enum PresenceStatus
+    uint64_t lastSeenAtMs;      // wall clock
+    uint32_t address;           // IpLast: IPv4 address and port, network byte order
+    uint16_t port;
+};
+
+static inline void presence_default_config(struct PresenceConfig* config)
+{
+    config->directory = PRESENCE_DEFAULT_DIRECTORY;
+    config->persistIntervalMs = PRESENCE_DEFAULT_PERSIST_INTERVAL_MS;
+}
+
+// Loads and compacts the journal; every device starts offline.
+struct PresenceStore* presence_open(const struct PresenceConfig* config);
+void presence_close(struct PresenceStore* store);
+
+// A connection identified itself as deviceId. Returns true if the device was
+// offline until now.
+bool presence_connect(struct PresenceStore* store, const uint8_t* deviceId, const uint8_t* userId,
+    uint32_t address, uint16_t port);
+
+// One of the device's connections went away. Returns true if it was the last.
+bool presence_disconnect(struct PresenceStore* store, const uint8_t* deviceId);
+
+// The device was active: moves LastSeenAt to now. Cheap, but callers still
+// only need to call it about once per persist interval.
+void presence_touch(struct PresenceStore* store, const uint8_t* deviceId);
+
+// Returns false if the device has never been seen.
+bool presence_get(struct PresenceStore* store, const uint8_t* deviceId, struct PresenceState* state);
+
+#endif // PRESENCE_H
@@ -0,0 +1,71 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+
+// Token buckets keyed by 64-bit ids (client IP, device), shared by every
+// reactor thread. The table is split into RATE_SHARDS fixed arrays of slots,
+// each on its own cache lines. A slot holds a key and a bucket packed into
+// one 64-bit word: milli-tokens and the millisecond it was last refilled.
+// Taking a token is a compare-and-swap on that word; claiming an empty slot
+// is one on the key. Nothing locks and nothing is allocated after init, so
+// the table's memory is fixed however many clients flood it.
+//
+// A bucket that has refilled to its burst is indistinguishable from a new
+// one, so such a slot is reused by the next key probing past it. A key that
+// finds no slot within RATE_MAX_PROBE is let through and counted.
+
+#define RATE_SHARDS 16
+#define RATE_MAX_PROBE 16
+#define RATE_DEFAULT_SLOTS 65536    // over all shards; rounded up to a power of two per shard
+
+struct RateLimitConfig {
+    unsigned ratePerSecond;     // tokens added per second; 0 disables the limit
+    unsigned burst;             // bucket size, at most 268435; 0 means twice the rate
+    size_t slots;
+};
+
+struct RateSlot {
+    _Atomic uint64_t key;       // 0: empty
+    _Atomic uint64_t bucket;    // milli-tokens << 36 | refill time (ms, low 36 bits); 0: full
+};
+
+struct RateShard {
+    alignas(64) struct RateSlot* slots;
+    size_t mask;
+    atomic_size_t used;
+};
+
+struct RateTable {
+    struct RateShard shards[RATE_SHARDS];
+    uint64_t ratePerMs;         // milli-tokens per millisecond, which is tokens per second
+    uint64_t burstMilli;
+};
+
+static inline void ratelimit_default_config(struct RateLimitConfig* config, unsigned ratePerSecond, unsigned burst)
+{
+    config->ratePerSecond = ratePerSecond;
+    config->burst = burst;
+    config->slots = RATE_DEFAULT_SLOTS;
+}
+
+int ratelimit_init(struct RateTable* table, const struct RateLimitConfig* config);
+void ratelimit_destroy(struct RateTable* table);
+
+// Key of a client address, or of a 16-byte id (never 0, and never equal
+// to an address key).
+uint64_t ratelimit_key_ipv4(uint32_t address);
+uint64_t ratelimit_key_id(const uint8_t* id);
+
+// Takes one token from key's bucket. Returns 0 if it had one, otherwise how
+// many milliseconds until it will.
+uint32_t ratelimit_take(struct RateTable* table, uint64_t key, uint64_t nowMs);
+
+// Slots holding a key, over all shards.
+size_t ratelimit_used(const struct RateTable* table);
+
+#endif // RATELIMIT_H
@@ -0,0 +1,153 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "socketutil.h"
+#include "outqueue.h"
+#include "offline.h"
+#include "msglog.h"
+#include "prekey.h"
+#include "presence.h"
+#include "receipts.h"
+#include "ratelimit.h"
+#include "blob.h"
+
+// Event-driven server mode (Linux only): a fixed pool of threads, each running
+// an edge-triggered epoll loop that owns accept, recv and send for the
+// connections it accepted. Replaces one thread per client.
+//
+// Sharded mode gives every thread its own SO_REUSEPORT listener and
+// connection table; broadcasts reach other shards through a per-shard inbox.
+//
+// The io_uring backend replaces epoll and the per-connection recv/send calls
+// with one ring per thread: multishot accept, multishot recv into provided
+// buffers, and one SENDMSG per connection carrying its queued frames. A
+// loop iteration submits everything it queued and waits for completions in
+// a single io_uring_enter. A thread whose ring can't be set up (kernel
+// before 6.0, io_uring disabled) falls back to epoll.
+//
+// Frames queued for a connection during a loop iteration are written
+// together after it, in one vectored send; corkMs holds them a little
+// longer so a burst shares that send. Client sockets get TCP_NODELAY,
+// since this coalescing replaces Nagle's.
+//
+// Flow control: each connection is granted CREDIT for flowWindow frames at
+// a time, and stops being read (its frames wait in the kernel, not dropped)
+// while its own outbound queue is over half full or its device or address
+// is out of rate-limit tokens. Memory per connection stays bounded however
+// hard a client floods.
+//
+// Clients may enable compression with FEATURES: each direction of the
+// connection is then one lz.h stream (about 72 KiB of state per
+// connection), and payloads of at least compressMinBytes go out compressed
+// when that makes them smaller.
+
+#define REACTOR_DEFAULT_THREADS 4
+#define REACTOR_DEFAULT_BACKLOG SOMAXCONN
+#define REACTOR_DEFAULT_IDLE_TIMEOUT_MS 90000
+#define REACTOR_DEFAULT_HEARTBEAT_MS 30000
+#define REACTOR_DEFAULT_RETRY_BASE_MS 2000
+#define REACTOR_DEFAULT_RETRY_MAX_MS 60000
+#define REACTOR_DEFAULT_PRESENCE_NOTIFY_MS 500
+#define REACTOR_DEFAULT_RECEIPT_NOTIFY_MS 500
+#define REACTOR_DEFAULT_FLOW_WINDOW 64
+#define REACTOR_DEFAULT_DEVICE_RATE 5000     // a chatclient bot at full speed fits under it
+#define REACTOR_DEFAULT_DEVICE_BURST 10000
+#define REACTOR_DEFAULT_COMPRESS_MIN_BYTES 64
+#define REACTOR_DEFAULT_RECV_MEMORY_BYTES (256 * 1024 * 1024)
+
+enum ReactorBackend {
+    REACTOR_BACKEND_EPOLL,
+    REACTOR_BACKEND_URING
+};
+
+struct ReactorConfig {
+    enum ReactorBackend backend;
+    int threadCount;        // 0: REACTOR_DEFAULT_THREADS, or one per online CPU when sharded
+    int backlog;            // listen() backlog of every listener
+    bool sharded;
+    bool pinCpus;           // pin thread i to CPU i (mod CPU count)
+    bool noDelay;           // TCP_NODELAY on client sockets
+    unsigned corkMs;        // hold queued frames this long for more to share a send; 0 none
+    unsigned flowWindow;    // frames granted per CREDIT; 0 sends no CREDIT
+    bool allowBroadcast;    // JOIN may create Broadcast conversations, which reach every connection
+    struct RateLimitConfig deviceLimit;     // frames per second per device (per connection before HELLO)
+    struct RateLimitConfig addressLimit;    // frames per second per client IP; off by default
+    size_t compressMinBytes;    // smallest payload compressed for clients that enable it; 0 offers no compression
+    size_t recvMemoryBytes;     // receive buffers of all connections together; reads pause past it, 0 no limit
+    struct OutQueueConfig outQueue;
+    struct OfflineConfig offline;   // DEVICE_MSG spool; a NULL directory disables it
+    struct MsgLogConfig history;    // CONV_MSG history; a NULL directory disables it
+    struct PrekeyConfig prekeys;    // one-time prekey pools; a NULL directory disables them
+    struct PresenceConfig presence; // LastSeenAt, IpLast and status; a NULL directory disables it
+    struct ReceiptsConfig receipts; // Delivered/Read state; a NULL directory (or no history) disables it
+    struct BlobConfig blobs;        // attachments; a NULL directory disables them
+    unsigned idleTimeoutMs;     // close a connection that sent nothing this long; 0 never
+    unsigned heartbeatMs;       // PING a connection that sent nothing this long; 0 never
+    unsigned retryBaseMs;       // resend unacked device messages after this, doubling...
+    unsigned retryMaxMs;        // ...up to this while acks stall; 0 base disables retries
+    unsigned presenceNotifyMs;  // presence changes are announced in batches this far apart
+    unsigned receiptNotifyMs;   // receipts are passed on to senders in batches this far apart
+};
+
+// Timer wheel health, summed over workers: fired timers and how late they ran.
+struct ReactorTimerStats {
+    uint64_t fired;
+    uint64_t lagTotalMs;
+    uint64_t lagMaxMs;
+};
+
+static inline void reactor_default_config(struct ReactorConfig* config)
+{
+    config->backend = REACTOR_BACKEND_EPOLL;
+    config->threadCount = 0;
+    config->backlog = REACTOR_DEFAULT_BACKLOG;
+    config->sharded = false;
+    config->pinCpus = false;
+    config->noDelay = true;
+    config->corkMs = 0;
+    config->flowWindow = REACTOR_DEFAULT_FLOW_WINDOW;
+    config->allowBroadcast = false;
+    ratelimit_default_config(&config->deviceLimit, REACTOR_DEFAULT_DEVICE_RATE, REACTOR_DEFAULT_DEVICE_BURST);
+    ratelimit_default_config(&config->addressLimit, 0, 0);
+    config->compressMinBytes = REACTOR_DEFAULT_COMPRESS_MIN_BYTES;
+    config->recvMemoryBytes = REACTOR_DEFAULT_RECV_MEMORY_BYTES;
+    outqueue_default_config(&config->outQueue);
+    offline_default_config(&config->offline);
+    msglog_default_config(&config->history);
+    prekey_default_config(&config->prekeys);
+    presence_default_config(&config->presence);
+    receipts_default_config(&config->receipts);
+    blob_default_config(&config->blobs);
+    config->idleTimeoutMs = REACTOR_DEFAULT_IDLE_TIMEOUT_MS;
+    config->heartbeatMs = REACTOR_DEFAULT_HEARTBEAT_MS;
+    config->retryBaseMs = REACTOR_DEFAULT_RETRY_BASE_MS;
+    config->retryMaxMs = REACTOR_DEFAULT_RETRY_MAX_MS;
+    config->presenceNotifyMs = REACTOR_DEFAULT_PRESENCE_NOTIFY_MS;
+    config->receiptNotifyMs = REACTOR_DEFAULT_RECEIPT_NOTIFY_MS;
+}
+
+static inline bool reactor_parse_backend(const char* name, enum ReactorBackend* backend)
+{
+    if (strcmp(name, "epoll") == 0) {
+        *backend = REACTOR_BACKEND_EPOLL;
+    } else if (strcmp(name, "uring") == 0) {
+        *backend = REACTOR_BACKEND_URING;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+#ifdef __linux__
+// Sets SO_REUSEPORT when config asks for sharding; call before bind().
+int reactor_prepare_listener(socket_t listenFd, const struct ReactorConfig* config);
+
+// Runs the reactor on an already bound and listening socket. Blocks for the
+// lifetime of the server; returns non-zero if the threads could not start.
+int reactor_run(socket_t listenFd, const struct ReactorConfig* config);
+
+// Safe from any thread while the reactor runs.
+void reactor_timer_stats(struct ReactorTimerStats* stats);
+#endif
+
+#endif // REACTOR_H
@@ -0,0 +1,66 @@
+#ifndef RECEIPTS_H
+#define RECEIPTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "dispatcher.h"
+
+// Delivered and Read state of conversation messages (MessageDelivery),
+// kept per (conversation, device) rather than per (message, device): a
+// watermark below which every seq is acknowledged, plus a bitmap of the
+// RECEIPTS_WINDOW seqs above it for acks that arrive out of order. Acking a
+// range moves the watermark in one step, so a device reading a thousand
+// messages is one update, and a thousand devices acking one message are a
+// thousand small in-place updates instead of a thousand rows.
+//
+// As in the presence store, updates only mark the entry dirty; a flusher
+// thread appends each dirty entry once per persistInterval with one write
+// and one fdatasync, and the journal is compacted on open and whenever it
+// grows to several times one record per entry.
+//
+// Linux only (fdatasync); the store is opened by the reactor.
+
+#define RECEIPTS_DEFAULT_DIRECTORY "receipts"
+#define RECEIPTS_DEFAULT_PERSIST_INTERVAL_MS 1000
+#define RECEIPTS_WINDOW 64      // seqs past a gap an ack may mark; acks further out are dropped
+
+enum ReceiptKind {
+    RECEIPT_DELIVERED = 1,
+    RECEIPT_READ = 2            // implies delivered
+};
+
+struct ReceiptsConfig {
+    const char* directory;
+    unsigned persistIntervalMs;     // how stale the journal may get; also the most often an entry is written
+};
+
+struct ReceiptStore;
+
+struct ReceiptMark {
+    uint64_t watermark;     // every seq up to it is acknowledged
+    uint64_t window;        // bit i: seq watermark + 1 + i is acknowledged; bit 0 is always clear
+};
+
+struct ReceiptState {
+    struct ReceiptMark delivered;
+    struct ReceiptMark read;
+};
+
+static inline void receipts_default_config(struct ReceiptsConfig* config)
+{
+    config->directory = RECEIPTS_DEFAULT_DIRECTORY;
+    config->persistIntervalMs = RECEIPTS_DEFAULT_PERSIST_INTERVAL_MS;
+}
+
+// Loads and compacts the journal.
+struct ReceiptStore* receipts_open(const struct ReceiptsConfig* config);
+void receipts_close(struct ReceiptStore* store);
+
+// The device acknowledges seqs fromSeq..toSeq (inclusive, from 1) of the
+// conversation as kind. Returns true if that acknowledged anything new.
+bool receipt_ack(struct ReceiptStore* store, const uint8_t* conversationId, const uint8_t* deviceId,
+    enum ReceiptKind kind, uint64_t fromSeq, uint64_t toSeq);
+
+#endif // RECEIPTS_H
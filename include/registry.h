@@ -0,0 +1,101 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Connection registry indexed by slot id. Fan-out readers walk the slot
+// array without taking any lock; connects and disconnects take a writer
+// mutex only among themselves and are O(1). Removed items are retired and
+// freed by epoch-based reclamation once every reader that might still see
+// them has left its read section.
+
+#define REGISTRY_NO_SLOT UINT32_MAX
+
+typedef void (*registry_free_fn)(void* item);
+
+struct RegistrySlots {
+    size_t capacity;
+    atomic_size_t used;         // slots [0, used) have ever been handed out
+    _Atomic(void*) items[];
+};
+
+struct RegistryRetired {
+    void* item;
+    registry_free_fn freeItem;
+    uint64_t epoch;
+    struct RegistryRetired* next;
+};
+
+struct RegistryReader {
+    atomic_uint_fast64_t epoch;     // 0 while outside a read section
+    struct RegistryRetired* retired;    // items this reader removed; it frees them
+    size_t retiredCount;
+    bool inUse;
+    struct RegistryReader* next;
+};
+
+struct Registry {
+    pthread_mutex_t mutex;      // writers, reader registration and orphan reclaim
+    _Atomic(struct RegistrySlots*) slots;
+    atomic_uint_fast64_t epoch;
+    uint32_t* freeSlots;
+    size_t freeCount;
+    size_t freeCapacity;
+    size_t count;
+    struct RegistryReader* readers;
+    struct RegistryRetired* orphans;    // retired by readers that have unregistered
+    registry_free_fn freeItem;
+    uint64_t lockedAtNs;        // under mutex: when it was taken, for the hold time metric
+};
+
+void registry_init(struct Registry* registry, registry_free_fn freeItem);
+
+// Readers are per thread and reused after unregistering. Returns NULL when out of memory.
+struct RegistryReader* registry_reader_register(struct Registry* registry);
+void registry_reader_unregister(struct Registry* registry, struct RegistryReader* reader);
+
+// Returns the item's slot id, or REGISTRY_NO_SLOT when out of memory.
+uint32_t registry_insert(struct Registry* registry, void* item);
+
+// Unlinks the item in slot and retires it on reader's list; freeItem runs
+// from a later registry_reclaim by the same reader.
+void registry_remove(struct Registry* registry, struct RegistryReader* reader, uint32_t slot);
+
+// Retires any other memory readers reach through this registry's read
+// sections (e.g. index nodes); freeItem runs once no reader can see it.
+void registry_retire(struct Registry* registry, struct RegistryReader* reader, void* item, registry_free_fn freeItem);
+
+// Frees reader's retired items (and unowned ones) no reader can still see.
+// Must not be called from inside a read section. reader may be NULL.
+void registry_reclaim(struct Registry* registry, struct RegistryReader* reader);
+
+size_t registry_count(struct Registry* registry);
+
+static inline struct RegistrySlots* registry_read_begin(struct Registry* registry, struct RegistryReader* reader)
+{
+    atomic_store(&reader->epoch, atomic_load(&registry->epoch));
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(&registry->slots, memory_order_acquire);
+}
+
+static inline void registry_read_end(struct RegistryReader* reader)
+{
+    atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+}
+
+// Loop bound for a read section: items past it were never handed out.
+static inline size_t registry_slots_used(struct RegistrySlots* slots)
+{
+    return slots ? atomic_load_explicit(&slots->used, memory_order_acquire) : 0;
+}
+
+static inline void* registry_slot_item(struct RegistrySlots* slots, size_t slot)
+{
+    return atomic_load_explicit(&slots->items[slot], memory_order_acquire);
+}
+
+#endif // REGISTRY_H
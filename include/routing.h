@@ -0,0 +1,102 @@
+#ifndef ROUTING_H
+#define ROUTING_H
+
+#include "dispatcher.h"
+#include "registry.h"
+
+// In-memory routing index: conversation id -> live endpoints of its
+// participants. Endpoints are opaque (the server's connection objects).
+// Lookups run inside a read section of the registry the table was created
+// with and take no lock. Joins and leaves lock only their bucket's stripe,
+// and change the member array in place the way the registry changes its
+// slots: a join appends to the spare capacity, a leave clears one endpoint.
+// The array is rebuilt, and the old one retired through the registry's
+// epoch reclamation, only when it is full or mostly cleared, so building a
+// group of n costs O(n) and membership churn never blocks delivery.
+
+#define ROUTING_DEFAULT_BUCKETS 4096
+#define ROUTING_LOCK_STRIPES 64
+#define ROUTING_MIN_CAPACITY 8
+// Users in a Direct conversation, each with any number of devices.
+#define ROUTING_DIRECT_USERS 2
+
+enum RoutingStatus {
+    ROUTING_OK = 0,
+    ROUTING_ERR_NO_MEMORY = -1,
+    ROUTING_ERR_FULL = -2,          // a Direct conversation already has two other users
+    ROUTING_ERR_TYPE = -3,          // the conversation exists with another type
+    ROUTING_ERR_DENIED = -4         // Broadcast conversations are closed to joins
+};
+
+struct RoutingMember {
+    _Atomic(void*) endpoint;    // NULL once the member left
+    uint32_t shard;     // owner of endpoint, for callers that partition delivery
+    uint8_t userId[PROTO_ID_SIZE];      // as of the join; zero if the endpoint had none
+    uint8_t deviceId[PROTO_ID_SIZE];
+};
+
+// Slots below count are fully written and only their endpoint changes, to
+// NULL. Both indexes map a hash to slot + 1 (0: empty), by open addressing
+// at most half full; entries of cleared slots stay until the next rebuild.
+struct RoutingMembers {
+    atomic_size_t count;        // slots in use, cleared ones included
+    size_t capacity;
+    size_t live;                // slots with an endpoint; writers only
+    size_t indexMask;
+    _Atomic(uint32_t)* byEndpoint;
+    uint32_t* byDevice;         // writers only
+    struct RoutingMember members[];
+};
+
+struct RoutingConversation {
+    uint8_t id[PROTO_ID_SIZE];
+    uint8_t type;   // enum ProtoConversationType
+    _Atomic(struct RoutingMembers*) members;
+    _Atomic(struct RoutingConversation*) next;
+};
+
+struct RoutingTable {
+    pthread_mutex_t locks[ROUTING_LOCK_STRIPES];    // writers only, by bucket
+    struct Registry* epochs;
+    bool allowBroadcast;
+    size_t bucketMask;
+    _Atomic(struct RoutingConversation*)* conversations;
+};
+
+// bucketCount is rounded up to a power of two; 0 picks ROUTING_DEFAULT_BUCKETS.
+// Broadcast conversations reach every connection, so joins may create them
+// only with allowBroadcast.
+int routing_init(struct RoutingTable* table, struct Registry* epochs, size_t bucketCount, bool allowBroadcast);
+
+// Writers. reader is the calling thread's reader on table->epochs; replaced
+// nodes are retired on it. userId and deviceId may be NULL (not identified).
+// A device is one participant: joining from a new endpoint replaces the
+// entry of its previous one, which may not have closed yet.
+int routing_join(struct RoutingTable* table, struct RegistryReader* reader, const uint8_t* conversationId,
+    uint8_t type, void* endpoint, uint32_t shard, const uint8_t* userId, const uint8_t* deviceId);
+bool routing_leave(struct RoutingTable* table, struct RegistryReader* reader, const uint8_t* conversationId,
+    void* endpoint);
+
+// Readers; only valid inside a read section on table->epochs.
+struct RoutingConversation* routing_find(struct RoutingTable* table, const uint8_t* conversationId);
+
+static inline const struct RoutingMembers* routing_members(struct RoutingConversation* conversation)
+{
+    return conversation ? atomic_load_explicit(&conversation->members, memory_order_acquire) : NULL;
+}
+
+// Slots to walk; skip those whose endpoint is NULL.
+static inline size_t routing_member_slots(const struct RoutingMembers* members)
+{
+    return members ? atomic_load_explicit(&members->count, memory_order_acquire) : 0;
+}
+
+static inline void* routing_member_endpoint(const struct RoutingMember* member)
+{
+    return atomic_load_explicit(&member->endpoint, memory_order_acquire);
+}
+
+// O(1) through the endpoint index.
+bool routing_is_member(const struct RoutingMembers* members, const void* endpoint);
+
+#endif // ROUTING_H
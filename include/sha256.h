@@ -0,0 +1,50 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// SHA-256 (FIPS 180-4) for Message.CiphertextHashSha256. Three
+// implementations, picked once at runtime from CPUID:
+//
+//   SHA256_IMPL_SHANI   x86 SHA extensions, one buffer at a time
+//   SHA256_IMPL_AVX2    eight buffers in lockstep, one per 32-bit lane
+//   SHA256_IMPL_SCALAR  portable C, the reference the others must match
+//
+// sha256_batch is the entry point for bulk work. With AVX2 it keeps all
+// eight lanes busy, refilling a lane as soon as its buffer is done, so
+// buffers of different lengths batch well; on SHA-NI CPUs it still does so
+// for batches of short buffers, where the lanes are faster.
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_HEX_SIZE (2 * SHA256_DIGEST_SIZE + 1)
+
+enum Sha256Impl {
+    SHA256_IMPL_SCALAR = 0,
+    SHA256_IMPL_AVX2 = 1,
+    SHA256_IMPL_SHANI = 2
+};
+
+struct Sha256Job {
+    const void* data;
+    size_t length;
+    uint8_t digest[SHA256_DIGEST_SIZE];     // out
+};
+
+void sha256(const void* data, size_t length, uint8_t* digest);
+void sha256_batch(struct Sha256Job* jobs, size_t count);
+
+// Lowercase hex, as stored in the schema; out must hold SHA256_HEX_SIZE bytes.
+void sha256_hex(const uint8_t* digest, char* out);
+
+// The implementation in use, and whether this CPU can run another one.
+enum Sha256Impl sha256_impl(void);
+bool sha256_impl_supported(enum Sha256Impl impl);
+const char* sha256_impl_name(enum Sha256Impl impl);
+
+// Switches every later call to impl; returns false if the CPU lacks it.
+// For benchmarks and tests: not safe while other threads are hashing.
+bool sha256_use_impl(enum Sha256Impl impl);
+
+#endif // SHA256_H
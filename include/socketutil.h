@@ -1,25 +1,64 @@
 #ifndef SOCKETUTIL_H
 #define SOCKETUTIL_H
 
+#ifdef _WIN32
 #define _WIN32_WINNT 0x0600
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <windows.h>
+#else
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include <pthread.h> 
+#include <pthread.h>
 #ifdef _MSC_VER
 #pragma comment(lib, "ws2_32.lib")
 #endif
 
 
+#ifdef _WIN32
 typedef SOCKET socket_t;
+#define MSG_NOSIGNAL 0
+#define SOCKET_WOULD_BLOCK(err) ((err) == WSAEWOULDBLOCK)
+#define SOCKET_TIMED_OUT(err) ((err) == WSAETIMEDOUT)     // SO_RCVTIMEO expired
+#else
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#define SD_BOTH SHUT_RDWR
+#define closesocket close
+#define WSAGetLastError() errno
+#define SOCKET_WOULD_BLOCK(err) ((err) == EAGAIN || (err) == EWOULDBLOCK)
+#define SOCKET_TIMED_OUT(err) SOCKET_WOULD_BLOCK(err)    // SO_RCVTIMEO expired
+#endif
 
 #define BUFFER_SIZE 4096
+int socket_startup(void);
+void socket_cleanup(void);
 socket_t create_socket(void);
+int set_socket_nonblocking(socket_t sockfd);
+// Makes blocking recv() fail with a would-block error after timeoutMs of silence; 0 waits forever.
+int set_socket_recv_timeout(socket_t sockfd, unsigned timeoutMs);
+int send_all(socket_t sockfd, const void* data, size_t length);
+// One nonblocking gather send of two segments. Returns bytes sent or SOCKET_ERROR.
+int send_two(socket_t sockfd, const void* first, size_t firstLength, const void* second, size_t secondLength);
 int createIPv4Adress_getaddrinfo(const char *hostname, const char *port, struct addrinfo **result);
 struct sockaddr_in* createIPv4Address(const char* ip, int port);
 void print_last_error(const char *label);
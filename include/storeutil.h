@@ -0,0 +1,112 @@
+#ifndef STOREUTIL_H
+#define STOREUTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+// Pieces shared by the on-disk stores (offline, msglog, prekey, presence,
+// receipts): file and path helpers, the flusher thread that turns many
+// updates into one sync, and the fixed-size record journal that presence
+// and receipts keep their latest state in.
+//
+// Linux only (fdatasync), like the stores.
+
+#define STORE_FNV_BASIS 2166136261u
+
+static inline size_t store_align_up(size_t value, size_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+uint64_t store_wall_clock_ms(void);
+
+// FNV-1a: detects torn writes, not tampering. Start from STORE_FNV_BASIS.
+uint32_t store_fnv1a(uint32_t hash, const void* data, size_t length);
+
+// Spreads a random 16-byte id over 64 bits; mask it to the table size.
+uint64_t store_hash_id(const uint8_t* id);
+
+// "directory/name" in a new allocation, or NULL.
+char* store_join_path(const char* directory, const char* name);
+
+bool store_write_all(int fd, const void* data, size_t length);
+
+// Makes renames and creations in the directory durable.
+bool store_sync_directory(const char* path);
+
+// Flusher thread. In commit-group mode it sleeps until woken, lets more
+// work gather for one interval, then flushes it in one pass; in periodic
+// mode it flushes once per interval whether woken or not. Either way it
+// makes one last pass when stopped.
+typedef void (*store_flush_fn)(void* context);
+
+enum StoreFlushMode {
+    STORE_FLUSH_COMMIT_GROUP,
+    STORE_FLUSH_PERIODIC
+};
+
+struct StoreFlusher {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool pending;
+    bool stopping;
+    enum StoreFlushMode mode;
+    unsigned intervalMs;
+    store_flush_fn flush;
+    void* context;
+    pthread_t thread;
+};
+
+bool store_flusher_start(struct StoreFlusher* flusher, enum StoreFlushMode mode, unsigned intervalMs,
+    store_flush_fn flush, void* context);
+// Call when there is work for a flusher that had none.
+void store_flusher_wake(struct StoreFlusher* flusher);
+// Returns after the last pass.
+void store_flusher_stop(struct StoreFlusher* flusher);
+
+// Append-only journal of fixed-size records, host byte order, each starting
+// with a 32-bit checksum over the rest of it; a bad one marks a torn tail.
+// Records are staged in the journal's scratch array and written from there
+// with one write and one fdatasync. Only the flusher thread touches it once
+// the store is open.
+struct StoreJournal {
+    const char* label;      // for messages, e.g. "presence journal"
+    char* directory;
+    char* path;
+    char* compactPath;
+    size_t recordSize;
+    int fd;
+    size_t bytes;           // written since the last compaction
+
+    uint8_t* scratch;
+    size_t scratchCapacity; // records
+};
+
+// Return false to stop loading.
+typedef bool (*store_record_fn)(void* context, const void* record);
+
+bool store_journal_init(struct StoreJournal* journal, const char* directory, size_t recordSize, const char* label);
+void store_journal_free(struct StoreJournal* journal);
+
+// Passes every intact record to fn, oldest first. False if the journal
+// could not be read or fn stopped early.
+bool store_journal_load(struct StoreJournal* journal, store_record_fn fn, void* context);
+
+// Slot index of the scratch array, grown as needed; NULL if out of memory.
+void* store_journal_slot(struct StoreJournal* journal, size_t index);
+
+// Checksums the first count scratch records and appends them durably. On
+// failure the journal is cut back to what it held before, and the caller
+// still owns the records.
+bool store_journal_append(struct StoreJournal* journal, size_t count);
+
+// Replaces the whole journal with the first count scratch records: written
+// aside, synced and renamed over it. Also creates the journal.
+bool store_journal_replace(struct StoreJournal* journal, size_t count);
+
+// Whether the journal has grown to factor records per live one, and past minBytes.
+bool store_journal_oversized(const struct StoreJournal* journal, size_t live, size_t factor, size_t minBytes);
+
+#endif // STOREUTIL_H
@@ -0,0 +1,74 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Hierarchical timing wheel: TIMERWHEEL_LEVELS wheels of TIMERWHEEL_SLOTS
+// slots, each level TIMERWHEEL_SLOTS times coarser than the one below.
+// Timers are intrusive nodes, so schedule and cancel are O(1) list splices
+// with no allocation; a timer far out sits in a coarse slot and cascades
+// down as its time approaches. Not thread-safe: one wheel per event loop,
+// driven by its owner.
+
+#define TIMERWHEEL_BITS 6
+#define TIMERWHEEL_SLOTS (1 << TIMERWHEEL_BITS)
+#define TIMERWHEEL_LEVELS 4
+#define TIMERWHEEL_DEFAULT_TICK_MS 10
+
+struct TimerNode;
+typedef void (*timer_fn)(struct TimerNode* timer);
+
+struct TimerNode {
+    struct TimerNode* prev;     // NULL while not scheduled
+    struct TimerNode* next;
+    uint64_t expiresTick;
+    uint64_t expiresMs;         // as requested; lag is measured against it
+    timer_fn callback;
+    void* context;
+};
+
+// Readable from any thread; how late timers fire tells whether the loop keeps up.
+struct TimerWheelStats {
+    atomic_uint_fast64_t fired;
+    atomic_uint_fast64_t lagTotalMs;
+    atomic_uint_fast64_t lagMaxMs;
+};
+
+struct TimerWheel {
+    uint64_t tickMs;
+    uint64_t nowTick;       // every slot before this has been run
+    size_t count;
+    struct TimerNode slots[TIMERWHEEL_LEVELS][TIMERWHEEL_SLOTS];   // list heads
+    struct TimerWheelStats stats;
+};
+
+void timerwheel_init(struct TimerWheel* wheel, uint64_t tickMs, uint64_t nowMs);
+
+static inline void timer_init(struct TimerNode* timer, timer_fn callback, void* context)
+{
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->callback = callback;
+    timer->context = context;
+}
+
+static inline bool timer_pending(const struct TimerNode* timer)
+{
+    return timer->prev != NULL;
+}
+
+// (Re)arms timer to fire at expiresMs, rounded up to the next tick.
+void timerwheel_schedule(struct TimerWheel* wheel, struct TimerNode* timer, uint64_t expiresMs);
+void timerwheel_cancel(struct TimerWheel* wheel, struct TimerNode* timer);
+
+// Runs every timer due by nowMs. Callbacks may schedule or cancel any timer,
+// including themselves.
+void timerwheel_advance(struct TimerWheel* wheel, uint64_t nowMs);
+
+// Milliseconds until the wheel next needs advancing, or -1 if it is empty.
+int timerwheel_next_timeout(const struct TimerWheel* wheel, uint64_t nowMs);
+
+#endif // TIMERWHEEL_H
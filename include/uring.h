@@ -0,0 +1,97 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+
+// Minimal io_uring driver over the raw system calls, for the reactor's
+// io_uring backend: one ring per worker thread, used only by that thread.
+// Submissions collect in the SQ and go to the kernel together with the
+// wait for completions, so a loop iteration costs one io_uring_enter however
+// many sends and re-arms it queued.
+//
+// A provided buffer ring (buffer group 0) feeds multishot recv: the kernel
+// picks a buffer per completion, the reactor copies the bytes out and hands
+// the buffer straight back.
+
+#define URING_DEFAULT_ENTRIES 4096
+#define URING_DEFAULT_BUFFERS 512       // provided recv buffers; a power of two
+#define URING_BUFFER_GROUP 0
+
+struct Uring {
+    int fd;
+
+    // Submission queue; sqTail is ours until uring_enter publishes it.
+    _Atomic unsigned* sqHead;
+    _Atomic unsigned* sqTailShared;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned sqTail;
+    struct io_uring_sqe* sqes;
+
+    // Completion queue.
+    _Atomic unsigned* cqHead;
+    _Atomic unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+
+    void* ringMemory;
+    size_t ringSize;
+    size_t sqesSize;
+
+    // Provided recv buffers.
+    struct io_uring_buf_ring* bufRing;
+    uint8_t* buffers;
+    unsigned bufferCount;
+    unsigned bufferSize;
+    uint16_t bufTail;       // published by uring_buffers_commit
+};
+
+// Sets up a ring with entries submission slots (twice that for completions)
+// and bufferCount recv buffers of bufferSize bytes. Returns non-zero, with
+// errno set, where io_uring or the features used are unavailable: the
+// opcodes are probed, and multishot recv (6.0+) is tried on a socket pair.
+int uring_init(struct Uring* ring, unsigned entries, unsigned bufferCount, unsigned bufferSize);
+void uring_destroy(struct Uring* ring);
+
+// A zeroed submission slot. When the SQ is full its contents are submitted
+// first; NULL only if that fails.
+struct io_uring_sqe* uring_get_sqe(struct Uring* ring);
+
+// Submits everything queued and, unless waitFor is 0, waits until that many
+// completions are ready or timeoutMs passes (negative: no limit). Returns
+// 0 or a negative errno; a timeout or signal is not an error.
+int uring_enter(struct Uring* ring, unsigned waitFor, int timeoutMs);
+
+static inline struct io_uring_cqe* uring_peek_cqe(struct Uring* ring)
+{
+    unsigned head = atomic_load_explicit(ring->cqHead, memory_order_relaxed);
+    if (head == atomic_load_explicit(ring->cqTail, memory_order_acquire)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cqMask];
+}
+
+static inline void uring_cqe_seen(struct Uring* ring)
+{
+    atomic_fetch_add_explicit(ring->cqHead, 1, memory_order_release);
+}
+
+static inline uint8_t* uring_buffer(struct Uring* ring, uint16_t bufferId)
+{
+    return ring->buffers + (size_t)bufferId * ring->bufferSize;
+}
+
+// Queues a used recv buffer for reuse; uring_buffers_commit hands the
+// queued ones back to the kernel.
+void uring_recycle_buffer(struct Uring* ring, uint16_t bufferId);
+void uring_buffers_commit(struct Uring* ring);
+
+#endif // __linux__
+
+#endif // URING_H
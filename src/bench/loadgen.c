@@ -0,0 +1,930 @@
+// Load generator: opens many connections to a local server, puts them in
+// group conversations and has every connection send CONV_MSG frames at a
+// fixed total rate. Each body starts with the time the message was due, so
+// every recipient measures end-to-end fan-out latency. Stamping the due
+// time rather than the actual send time keeps a stalled sender from hiding
+// its own delay (coordinated omission).
+//
+//   loadgen [--host IP] [--port N] [--connections N] [--group N] [--rate MSGS/S]
+//           [--size BYTES] [--payload zero|json|random] [--compress] [--duration S]
+//           [--threads N] [--flood N] [--spawn COMMAND]
+//
+// Connections send only within the CREDIT the server grants. --flood N
+// makes the last N connections ignore it and send as fast as their
+// sockets take frames, to watch the server hold them back; their messages
+// are counted apart from the latency figures.
+//
+// --compress asks for PROTO_FEATURE_LZ on every connection. --payload sets
+// what follows the stamp: zeros, JSON message metadata that varies a little
+// per message, or random bytes standing in for ciphertext. The report gives
+// bytes on the wire against what they carried, and the CPU time loadgen
+// (and, with --spawn, the server) spent per message.
+//
+// --spawn starts the server first (through /bin/sh, so it may redirect its
+// output) and stops it afterwards, for runs tracked per commit:
+//   loadgen --spawn "./server > /dev/null" --connections 5000
+//
+// Prints a report and, last, one "result" line of key=value pairs for
+// scripts. Linux only (epoll). Build it optimised for meaningful numbers:
+//   make -f MAKEFILE CFLAGS="-std=c11 -O2 -Wall -Wextra -Iinclude" bench
+
+#include "socketutil.h"
+#include "dispatcher.h"
+#include "histogram.h"
+#include "lz.h"
+
+#ifdef __linux__
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#define LOAD_DEFAULT_PORT 2000
+#define LOAD_DEFAULT_CONNECTIONS 1000
+#define LOAD_DEFAULT_GROUP 10
+#define LOAD_DEFAULT_RATE 10000
+#define LOAD_DEFAULT_SIZE 128
+#define LOAD_DEFAULT_DURATION 10
+#define LOAD_DEFAULT_THREADS 4
+#define LOAD_MAX_EVENTS 256
+// After the last send, wait this long for deliveries still in flight.
+#define LOAD_DRAIN_MS 2000
+// Time for the server to process every JOIN before the clock starts.
+#define LOAD_SETTLE_MS 500
+#define LOAD_SPAWN_WAIT_MS 10000
+// A connection with this much unsent data skips its turns until it drains.
+#define LOAD_MAX_PENDING (4 * 1024 * 1024)
+// Most messages one loop iteration sends, so receiving never starves.
+#define LOAD_MAX_BURST 1024
+// Body prefix: the due time, big-endian nanoseconds.
+#define LOAD_STAMP_SIZE 8
+// Server -> client CONV_MSG prefix: conversationId, sender deviceId, seq.
+#define LOAD_CONV_PREFIX (2 * PROTO_ID_SIZE + PROTO_SEQ_SIZE)
+// Smallest payload sent compressed, as the server's default.
+#define LOAD_COMPRESS_MIN 64
+
+enum LoadPayload {
+    LOAD_PAYLOAD_ZERO,
+    LOAD_PAYLOAD_JSON,
+    LOAD_PAYLOAD_RANDOM
+};
+
+struct LoadConfig {
+    const char* host;
+    int port;
+    size_t connections;
+    size_t group;
+    double rate;            // messages per second, over all connections
+    size_t size;            // body bytes, stamp included
+    enum LoadPayload payload;
+    bool compress;          // ask for PROTO_FEATURE_LZ
+    double duration;        // seconds of sending
+    int threads;
+    size_t flood;           // the last this many connections flood
+    const char* spawn;
+};
+
+struct LoadWorker;
+
+struct LoadConnection {
+    socket_t fd;
+    struct LoadWorker* owner;
+    struct ProtoRecvBuffer recvBuffer;
+    uint8_t conversationId[PROTO_ID_SIZE];
+    size_t recipients;      // other members of its conversation
+    uint8_t* pending;       // frames send() did not take yet
+    size_t pendingStart;
+    size_t pendingEnd;
+    size_t pendingCapacity;
+    uint32_t framesSent;    // wrapping, like the server's CREDIT totals
+    uint32_t creditLimit;
+    bool creditSeen;        // no CREDIT yet: the server does no flow control
+    bool flooder;
+    struct LzEncoder* encoder;  // with --compress; used once FEATURES enables it
+    struct LzDecoder* decoder;
+    bool compressing;
+};
+
+struct LoadWorker {
+    int index;
+    pthread_t thread;
+    int epollFd;
+    struct LoadConnection* connections;
+    size_t count;
+    size_t nextSender;
+    size_t flooders;
+    double rate;
+    uint8_t* frame;         // scratch: one outgoing CONV_MSG
+    uint8_t* packed;        // scratch: the same, compressed
+    uint64_t random;        // xorshift state for --payload random
+
+    struct Histogram* latency;          // due time to receipt, ns
+    struct Histogram* connectLatency;   // connect() to established, ns
+    uint64_t connectFailures;
+    uint64_t sent;
+    uint64_t skipped;       // turns of backlogged connections
+    uint64_t throttled;     // turns of connections out of credit
+    uint64_t floodSent;
+    uint64_t floodReceived;
+    uint64_t expected;      // deliveries the sent messages should cause
+    uint64_t received;
+    uint64_t receivedBytes;
+    uint64_t sentBytes;         // CONV_MSG frames as they went on the wire
+    uint64_t sentRawBytes;      // the same frames uncompressed
+    uint64_t wireReceivedBytes; // everything recv() returned
+    bool failed;
+};
+
+static struct LoadConfig g_config;
+static struct ProtoDispatcher g_dispatcher;
+static pthread_barrier_t g_barrier;
+static uint64_t g_startNs;      // published by the barrier
+static uint64_t g_random;
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t next_random(void)
+{
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 7;
+    g_random ^= g_random << 17;
+    return g_random;
+}
+
+static void random_id(uint8_t* id)
+{
+    uint64_t low = next_random();
+    uint64_t high = next_random();
+    memcpy(id, &low, sizeof(low));
+    memcpy(id + sizeof(low), &high, sizeof(high));
+}
+
+static void encode_be(uint8_t* out, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        out[i] = (uint8_t)(value >> (8 * (size - 1 - i)));
+    }
+}
+
+static uint64_t decode_be(const uint8_t* in, size_t size)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Returns false if the connection is broken.
+static bool flush_pending(struct LoadConnection* conn)
+{
+    while (conn->pendingStart < conn->pendingEnd) {
+        ssize_t sent = send(conn->fd, conn->pending + conn->pendingStart, conn->pendingEnd - conn->pendingStart,
+            MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        conn->pendingStart += (size_t)sent;
+    }
+    conn->pendingStart = 0;
+    conn->pendingEnd = 0;
+    return true;
+}
+
+// Sends the frame, keeping whatever the socket does not take for later.
+static bool queue_frame(struct LoadConnection* conn, const uint8_t* frame, size_t length)
+{
+    if (conn->pendingStart == conn->pendingEnd) {
+        ssize_t sent = send(conn->fd, frame, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return false;
+        }
+        if (sent > 0) {
+            frame += sent;
+            length -= (size_t)sent;
+        }
+        if (length == 0) {
+            return true;
+        }
+    }
+
+    if (conn->pendingEnd + length > conn->pendingCapacity) {
+        size_t capacity = conn->pendingCapacity ? conn->pendingCapacity : 4096;
+        while (capacity < conn->pendingEnd + length) {
+            capacity *= 2;
+        }
+        uint8_t* pending = (uint8_t*)realloc(conn->pending, capacity);
+        if (!pending) {
+            return false;
+        }
+        conn->pending = pending;
+        conn->pendingCapacity = capacity;
+    }
+    memcpy(conn->pending + conn->pendingEnd, frame, length);
+    conn->pendingEnd += length;
+    return true;
+}
+
+static int record_delivery(void* context, const struct ProtoFrame* frame)
+{
+    struct LoadConnection* conn = (struct LoadConnection*)context;
+    if (frame->length < LOAD_CONV_PREFIX + LOAD_STAMP_SIZE) {
+        return 0;
+    }
+    uint64_t dueNs = decode_be(frame->payload + LOAD_CONV_PREFIX, LOAD_STAMP_SIZE);
+    if (dueNs == 0) {
+        ++conn->owner->floodReceived;
+        return 0;
+    }
+    uint64_t nowNs = now_ns();
+    histogram_record(conn->owner->latency, nowNs > dueNs ? nowNs - dueNs : 0);
+    ++conn->owner->received;
+    conn->owner->receivedBytes += PROTO_HEADER_SIZE + frame->length;
+    return 0;
+}
+
+static int answer_ping(void* context, const struct ProtoFrame* frame)
+{
+    (void)frame;
+    uint8_t pong[PROTO_HEADER_SIZE];
+    proto_encode_header(pong, PROTO_OP_PONG, 0, 0);
+    struct LoadConnection* conn = (struct LoadConnection*)context;
+    ++conn->framesSent;
+    return queue_frame(conn, pong, sizeof(pong)) ? 0 : -1;
+}
+
+static int record_features(void* context, const struct ProtoFrame* frame)
+{
+    struct LoadConnection* conn = (struct LoadConnection*)context;
+    if (frame->length < 4) {
+        return -1;
+    }
+    conn->compressing = conn->encoder && (decode_be(frame->payload, 4) & PROTO_FEATURE_LZ) != 0;
+    return 0;
+}
+
+static bool decode_frame(void* context, struct ProtoFrame* frame)
+{
+    struct LoadConnection* conn = (struct LoadConnection*)context;
+    size_t length;
+    const uint8_t* payload = frame->encoding == PROTO_ENCODING_LZ && conn->decoder
+        ? lz_decompress(conn->decoder, frame->payload, frame->length, &length) : NULL;
+    if (!payload) {
+        return false;
+    }
+    frame->payload = payload;
+    frame->length = (uint32_t)length;
+    frame->encoding = 0;
+    return true;
+}
+
+static int record_credit(void* context, const struct ProtoFrame* frame)
+{
+    struct LoadConnection* conn = (struct LoadConnection*)context;
+    if (frame->length < 4) {
+        return -1;
+    }
+    conn->creditLimit = (uint32_t)decode_be(frame->payload, 4);
+    conn->creditSeen = true;
+    return 0;
+}
+
+static bool read_connection(struct LoadConnection* conn)
+{
+    while (true) {
+        size_t available;
+        uint8_t* space = proto_recv_reserve(&conn->recvBuffer, &available);
+        if (!space) {
+            return false;
+        }
+        ssize_t got = recv(conn->fd, space, available, 0);
+        if (got > 0) {
+            conn->owner->wireReceivedBytes += (uint64_t)got;
+            proto_recv_commit(&conn->recvBuffer, (size_t)got);
+            if (proto_recv_dispatch(&conn->recvBuffer, &g_dispatcher, conn) != PROTO_OK) {
+                return false;
+            }
+        } else if (got == 0) {
+            return false;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+    }
+}
+
+static void close_connection(struct LoadConnection* conn)
+{
+    if (conn->fd != INVALID_SOCKET) {
+        epoll_ctl(conn->owner->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+        closesocket(conn->fd);
+        conn->fd = INVALID_SOCKET;
+    }
+    lz_encoder_destroy(conn->encoder);
+    lz_decoder_destroy(conn->decoder);
+    conn->encoder = NULL;
+    conn->decoder = NULL;
+    conn->compressing = false;
+}
+
+// Connects, identifies and joins; blocking, before the clock starts.
+static bool open_connection(struct LoadWorker* worker, struct LoadConnection* conn, const struct sockaddr_in* address)
+{
+    uint64_t startNs = now_ns();
+    conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (conn->fd == INVALID_SOCKET) {
+        return false;
+    }
+    if (connect(conn->fd, (const struct sockaddr*)address, sizeof(*address)) != 0) {
+        closesocket(conn->fd);
+        conn->fd = INVALID_SOCKET;
+        return false;
+    }
+    histogram_record(worker->connectLatency, now_ns() - startNs);
+
+    // FEATURES (with --compress), HELLO, JOIN. Compressed frames may follow
+    // FEATURES at once, so the decoder exists before it is sent.
+    uint8_t frames[3 * PROTO_HEADER_SIZE + 4 + 3 * PROTO_ID_SIZE + 1];
+    uint8_t* features = frames;
+    size_t skip = PROTO_HEADER_SIZE + 4;
+    conn->framesSent = 2;
+    if (g_config.compress) {
+        conn->encoder = lz_encoder_create();
+        conn->decoder = lz_decoder_create();
+        if (!conn->encoder || !conn->decoder) {
+            closesocket(conn->fd);
+            conn->fd = INVALID_SOCKET;
+            return false;
+        }
+        proto_encode_header(features, PROTO_OP_FEATURES, 0, 4);
+        encode_be(features + PROTO_HEADER_SIZE, PROTO_FEATURE_LZ, 4);
+        skip = 0;
+        ++conn->framesSent;
+    }
+    uint8_t* hello = features + PROTO_HEADER_SIZE + 4;
+    proto_encode_header(hello, PROTO_OP_HELLO, 0, 2 * PROTO_ID_SIZE);
+    random_id(hello + PROTO_HEADER_SIZE);
+    random_id(hello + PROTO_HEADER_SIZE + PROTO_ID_SIZE);
+    uint8_t* join = hello + PROTO_HEADER_SIZE + 2 * PROTO_ID_SIZE;
+    proto_encode_header(join, PROTO_OP_JOIN, 0, PROTO_ID_SIZE + 1);
+    memcpy(join + PROTO_HEADER_SIZE, conn->conversationId, PROTO_ID_SIZE);
+    join[PROTO_HEADER_SIZE + PROTO_ID_SIZE] = PROTO_CONV_GROUP;
+    if (send_all(conn->fd, frames + skip, sizeof(frames) - skip) != 0 || set_socket_nonblocking(conn->fd) != 0) {
+        closesocket(conn->fd);
+        conn->fd = INVALID_SOCKET;
+        return false;
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, conn->fd, &event) != 0) {
+        closesocket(conn->fd);
+        conn->fd = INVALID_SOCKET;
+        return false;
+    }
+    return true;
+}
+
+// Fills the body after the stamp as --payload asks.
+static void fill_body(struct LoadWorker* worker, struct LoadConnection* conn, uint64_t dueNs)
+{
+    uint8_t* body = worker->frame + PROTO_HEADER_SIZE + PROTO_ID_SIZE + LOAD_STAMP_SIZE;
+    size_t length = g_config.size - LOAD_STAMP_SIZE;
+    if (g_config.payload == LOAD_PAYLOAD_RANDOM) {
+        for (size_t i = 0; i < length; i += sizeof(uint64_t)) {
+            worker->random ^= worker->random << 13;
+            worker->random ^= worker->random >> 7;
+            worker->random ^= worker->random << 17;
+            uint64_t value = worker->random;
+            memcpy(body + i, &value, length - i < sizeof(value) ? length - i : sizeof(value));
+        }
+    } else if (g_config.payload == LOAD_PAYLOAD_JSON) {
+        char conversation[37];
+        proto_format_id(conn->conversationId, conversation);
+        char text[512];
+        int textLength = snprintf(text, sizeof(text), "{\"version\":1,\"type\":\"conversation.message\","
+            "\"conversationId\":\"%s\",\"messageSeq\":%llu,\"sentAt\":%llu,"
+            "\"contentType\":\"text/plain; charset=utf-8\",\"attachments\":[],\"expiresInSeconds\":604800}",
+            conversation, (unsigned long long)worker->sent, (unsigned long long)(dueNs / 1000000));
+        for (size_t i = 0; i < length; i += (size_t)textLength) {
+            memcpy(body + i, text, length - i < (size_t)textLength ? length - i : (size_t)textLength);
+        }
+    }
+}
+
+// Sends one message from the next connection in turn, stamped with its due time.
+static void send_message(struct LoadWorker* worker, uint64_t dueNs)
+{
+    for (size_t tries = 0; tries < worker->count; ++tries) {
+        struct LoadConnection* conn = &worker->connections[worker->nextSender];
+        worker->nextSender = (worker->nextSender + 1) % worker->count;
+        if (conn->fd == INVALID_SOCKET || conn->flooder) {
+            continue;
+        }
+        if (conn->pendingEnd - conn->pendingStart > LOAD_MAX_PENDING) {
+            ++worker->skipped;
+            continue;
+        }
+        if (conn->creditSeen && (int32_t)(conn->creditLimit - conn->framesSent) <= 0) {
+            ++worker->throttled;
+            continue;
+        }
+
+        size_t length = PROTO_HEADER_SIZE + PROTO_ID_SIZE + g_config.size;
+        memcpy(worker->frame + PROTO_HEADER_SIZE, conn->conversationId, PROTO_ID_SIZE);
+        encode_be(worker->frame + PROTO_HEADER_SIZE + PROTO_ID_SIZE, dueNs, LOAD_STAMP_SIZE);
+        fill_body(worker, conn, dueNs);
+        const uint8_t* frame = worker->frame;
+        size_t wireLength = length;
+        size_t payloadLength = length - PROTO_HEADER_SIZE;
+        if (conn->compressing && payloadLength >= LOAD_COMPRESS_MIN && payloadLength <= LZ_MAX_INPUT) {
+            size_t packedLength = lz_compress(conn->encoder, NULL, 0, worker->frame + PROTO_HEADER_SIZE,
+                payloadLength, worker->packed + PROTO_HEADER_SIZE, payloadLength - 1);
+            if (packedLength > 0) {
+                proto_encode_header(worker->packed, PROTO_OP_CONV_MSG, 0, (uint32_t)packedLength);
+                worker->packed[PROTO_ENCODING_OFFSET] = PROTO_ENCODING_LZ;
+                frame = worker->packed;
+                wireLength = PROTO_HEADER_SIZE + packedLength;
+            }
+        }
+        if (!queue_frame(conn, frame, wireLength)) {
+            close_connection(conn);
+            continue;
+        }
+        ++conn->framesSent;
+        ++worker->sent;
+        worker->sentBytes += wireLength;
+        worker->sentRawBytes += length;
+        worker->expected += conn->recipients;
+        return;
+    }
+}
+
+// Has every flooding connection send, stamped 0, until its socket and
+// LOAD_MAX_PENDING are full.
+static void flood(struct LoadWorker* worker)
+{
+    size_t length = PROTO_HEADER_SIZE + PROTO_ID_SIZE + g_config.size;
+    for (size_t i = 0; i < worker->count; ++i) {
+        struct LoadConnection* conn = &worker->connections[i];
+        if (!conn->flooder) {
+            continue;
+        }
+        memcpy(worker->frame + PROTO_HEADER_SIZE, conn->conversationId, PROTO_ID_SIZE);
+        encode_be(worker->frame + PROTO_HEADER_SIZE + PROTO_ID_SIZE, 0, LOAD_STAMP_SIZE);
+        for (int burst = 0; burst < LOAD_MAX_BURST && conn->fd != INVALID_SOCKET
+            && conn->pendingEnd - conn->pendingStart <= LOAD_MAX_PENDING; ++burst) {
+            if (!queue_frame(conn, worker->frame, length)) {
+                close_connection(conn);
+                break;
+            }
+            ++conn->framesSent;
+            ++worker->floodSent;
+        }
+    }
+}
+
+static void* load_thread(void* arg)
+{
+    struct LoadWorker* worker = (struct LoadWorker*)arg;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)g_config.port);
+    inet_pton(AF_INET, g_config.host, &address.sin_addr);
+
+    for (size_t i = 0; i < worker->count; ++i) {
+        if (!open_connection(worker, &worker->connections[i], &address)) {
+            ++worker->connectFailures;
+        }
+    }
+    pthread_barrier_wait(&g_barrier);   // everyone connected
+    pthread_barrier_wait(&g_barrier);   // g_startNs set
+
+    uint64_t intervalNs = worker->rate > 0 ? (uint64_t)(1e9 / worker->rate) : UINT64_MAX;
+    uint64_t sendEndNs = g_startNs + (uint64_t)(g_config.duration * 1e9);
+    uint64_t endNs = sendEndNs + (uint64_t)LOAD_DRAIN_MS * 1000000ULL;
+    uint64_t nextDueNs = g_startNs + (uint64_t)worker->index * intervalNs / (uint64_t)g_config.threads;
+    struct epoll_event events[LOAD_MAX_EVENTS];
+
+    while (true) {
+        uint64_t nowNs = now_ns();
+        if (nowNs >= endNs) {
+            break;
+        }
+        for (int burst = 0; nextDueNs <= nowNs && nextDueNs < sendEndNs && burst < LOAD_MAX_BURST; ++burst) {
+            send_message(worker, nextDueNs);
+            nextDueNs += intervalNs;
+        }
+        if (worker->flooders > 0 && nowNs < sendEndNs) {
+            flood(worker);
+        }
+
+        int timeout = 10;
+        if (worker->flooders > 0 && nowNs < sendEndNs) {
+            timeout = 0;
+        } else if (nextDueNs < sendEndNs) {
+            uint64_t waitNs = nextDueNs > nowNs ? nextDueNs - nowNs : 0;
+            timeout = waitNs < 10000000ULL ? (int)(waitNs / 1000000ULL) : 10;
+        }
+        int count = epoll_wait(worker->epollFd, events, LOAD_MAX_EVENTS, timeout);
+        for (int i = 0; i < count; ++i) {
+            struct LoadConnection* conn = (struct LoadConnection*)events[i].data.ptr;
+            bool alive = (events[i].events & (EPOLLERR | EPOLLHUP)) == 0;
+            if (alive && (events[i].events & (EPOLLIN | EPOLLRDHUP))) {
+                alive = read_connection(conn);
+            }
+            if (alive && (events[i].events & EPOLLOUT)) {
+                alive = flush_pending(conn);
+            }
+            if (!alive) {
+                close_connection(conn);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < worker->count; ++i) {
+        close_connection(&worker->connections[i]);
+    }
+    return NULL;
+}
+
+static pid_t spawn_server(const char* command)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, 0);
+        execl("/bin/sh", "sh", "-c", command, (char*)NULL);
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    // Ready once it accepts a connection.
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)g_config.port);
+    inet_pton(AF_INET, g_config.host, &address.sin_addr);
+    for (int waited = 0; waited < LOAD_SPAWN_WAIT_MS; waited += 50) {
+        socket_t fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+        bool up = fd != INVALID_SOCKET && connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0;
+        if (fd != INVALID_SOCKET) {
+            closesocket(fd);
+        }
+        if (up) {
+            return pid;
+        }
+        usleep(50000);
+    }
+    fprintf(stderr, "server did not start listening on %s:%d\n", g_config.host, g_config.port);
+    kill(-pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static void stop_server(pid_t pid)
+{
+    kill(-pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+static double ms(uint64_t ns)
+{
+    return (double)ns / 1e6;
+}
+
+// CPU time this process (or its waited-for children) has used, in µs.
+static uint64_t cpu_us(int who)
+{
+    struct rusage usage;
+    if (getrusage(who, &usage) != 0) {
+        return 0;
+    }
+    return (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000
+        + (uint64_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+static void report(struct LoadWorker* workers, double connectSeconds, uint64_t cpuUs, uint64_t serverCpuUs)
+{
+    struct Histogram* latency = (struct Histogram*)malloc(sizeof(*latency));
+    struct Histogram* connectLatency = (struct Histogram*)malloc(sizeof(*connectLatency));
+    if (!latency || !connectLatency) {
+        fprintf(stderr, "malloc failed while reporting\n");
+        free(latency);
+        free(connectLatency);
+        return;
+    }
+    histogram_init(latency);
+    histogram_init(connectLatency);
+    uint64_t failures = 0, sent = 0, skipped = 0, expected = 0, received = 0, receivedBytes = 0;
+    uint64_t throttled = 0, floodSent = 0, floodReceived = 0, sentBytes = 0, sentRawBytes = 0, wireReceivedBytes = 0;
+    for (int i = 0; i < g_config.threads; ++i) {
+        histogram_merge(latency, workers[i].latency);
+        histogram_merge(connectLatency, workers[i].connectLatency);
+        failures += workers[i].connectFailures;
+        sent += workers[i].sent;
+        skipped += workers[i].skipped;
+        throttled += workers[i].throttled;
+        floodSent += workers[i].floodSent;
+        floodReceived += workers[i].floodReceived;
+        expected += workers[i].expected;
+        received += workers[i].received;
+        receivedBytes += workers[i].receivedBytes;
+        sentBytes += workers[i].sentBytes;
+        sentRawBytes += workers[i].sentRawBytes;
+        wireReceivedBytes += workers[i].wireReceivedBytes;
+    }
+
+    uint64_t connected = g_config.connections - failures;
+    double connectRate = connectSeconds > 0 ? (double)connected / connectSeconds : 0;
+    uint64_t lost = expected > received ? expected - received : 0;
+    double cpuPerMessage = sent + received > 0 ? (double)cpuUs / (double)(sent + received) : 0;
+    double serverCpuPerDelivery = received > 0 ? (double)serverCpuUs / (double)received : 0;
+    printf("connections  %llu of %zu in %.2f s (%.0f/s), connect p50 %.3f ms p99 %.3f ms max %.3f ms\n",
+        (unsigned long long)connected, g_config.connections, connectSeconds, connectRate,
+        ms(histogram_percentile(connectLatency, 50)), ms(histogram_percentile(connectLatency, 99)),
+        ms(connectLatency->max > 0 ? connectLatency->max : 0));
+    printf("sent         %llu messages of %zu bytes (%.0f/s), %llu turns skipped while backlogged, "
+        "%llu without credit\n", (unsigned long long)sent, g_config.size, (double)sent / g_config.duration,
+        (unsigned long long)skipped, (unsigned long long)throttled);
+    printf("delivered    %llu of %llu (%llu lost), %.0f/s, %.1f MB/s\n", (unsigned long long)received,
+        (unsigned long long)expected, (unsigned long long)lost, (double)received / g_config.duration,
+        (double)receivedBytes / g_config.duration / 1e6);
+    if (g_config.flood > 0) {
+        printf("flood        %zu connections sent %llu messages (%.0f/s), %llu deliveries\n", g_config.flood,
+            (unsigned long long)floodSent, (double)floodSent / g_config.duration, (unsigned long long)floodReceived);
+    }
+    printf("wire         sent %.1f MB for %.1f MB of messages, received %.1f MB for %.1f MB of deliveries\n",
+        (double)sentBytes / 1e6, (double)sentRawBytes / 1e6, (double)wireReceivedBytes / 1e6,
+        (double)receivedBytes / 1e6);
+    if (g_config.spawn) {
+        printf("cpu          %.2f us per message sent or delivered, server %.2f us per delivery\n",
+            cpuPerMessage, serverCpuPerDelivery);
+    } else {
+        printf("cpu          %.2f us per message sent or delivered\n", cpuPerMessage);
+    }
+    printf("fan-out ms   p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+        ms(histogram_percentile(latency, 50)), ms(histogram_percentile(latency, 90)),
+        ms(histogram_percentile(latency, 99)), ms(histogram_percentile(latency, 99.9)), ms(latency->max));
+    printf("result connections=%llu connect_per_s=%.0f sent=%llu expected=%llu delivered=%llu lost=%llu "
+        "msgs_per_s=%.0f deliveries_per_s=%.0f p50_us=%llu p90_us=%llu p99_us=%llu p999_us=%llu max_us=%llu "
+        "throttled=%llu flood_sent=%llu flood_delivered=%llu wire_sent_bytes=%llu raw_sent_bytes=%llu "
+        "wire_recv_bytes=%llu delivered_bytes=%llu cpu_us_per_msg=%.2f server_cpu_us_per_delivery=%.2f\n",
+        (unsigned long long)connected, connectRate, (unsigned long long)sent, (unsigned long long)expected,
+        (unsigned long long)received, (unsigned long long)lost, (double)sent / g_config.duration,
+        (double)received / g_config.duration,
+        (unsigned long long)(histogram_percentile(latency, 50) / 1000),
+        (unsigned long long)(histogram_percentile(latency, 90) / 1000),
+        (unsigned long long)(histogram_percentile(latency, 99) / 1000),
+        (unsigned long long)(histogram_percentile(latency, 99.9) / 1000),
+        (unsigned long long)(latency->max / 1000), (unsigned long long)throttled, (unsigned long long)floodSent,
+        (unsigned long long)floodReceived, (unsigned long long)sentBytes, (unsigned long long)sentRawBytes,
+        (unsigned long long)wireReceivedBytes, (unsigned long long)receivedBytes, cpuPerMessage,
+        serverCpuPerDelivery);
+    free(latency);
+    free(connectLatency);
+}
+
+static void print_usage(const char* program)
+{
+    fprintf(stderr, "Usage: %s [--host IP] [--port N] [--connections N] [--group N] [--rate MSGS/S]\n"
+        "          [--size BYTES] [--payload zero|json|random] [--compress] [--duration S]\n"
+        "          [--threads N] [--flood N] [--spawn COMMAND]\n", program);
+    fprintf(stderr, "  --connections N  connections to open (default %d)\n", LOAD_DEFAULT_CONNECTIONS);
+    fprintf(stderr, "  --group N        members per group conversation (default %d)\n", LOAD_DEFAULT_GROUP);
+    fprintf(stderr, "  --rate N         messages per second over all connections (default %d)\n", LOAD_DEFAULT_RATE);
+    fprintf(stderr, "  --size N         message body bytes, at least %d (default %d)\n", LOAD_STAMP_SIZE, LOAD_DEFAULT_SIZE);
+    fprintf(stderr, "  --payload KIND   body after the stamp: zero, json or random (default zero)\n");
+    fprintf(stderr, "  --compress       ask the server to compress (PROTO_FEATURE_LZ) and compress messages\n");
+    fprintf(stderr, "  --duration S     seconds of sending (default %d)\n", LOAD_DEFAULT_DURATION);
+    fprintf(stderr, "  --threads N      client threads (default %d)\n", LOAD_DEFAULT_THREADS);
+    fprintf(stderr, "  --flood N        the last N connections ignore CREDIT and send flat out (default 0)\n");
+    fprintf(stderr, "  --spawn COMMAND  start the server with this shell command, stop it afterwards\n");
+}
+
+static bool parse_args(int argc, char** argv)
+{
+    g_config.host = "127.0.0.1";
+    g_config.port = LOAD_DEFAULT_PORT;
+    g_config.connections = LOAD_DEFAULT_CONNECTIONS;
+    g_config.group = LOAD_DEFAULT_GROUP;
+    g_config.rate = LOAD_DEFAULT_RATE;
+    g_config.size = LOAD_DEFAULT_SIZE;
+    g_config.duration = LOAD_DEFAULT_DURATION;
+    g_config.threads = LOAD_DEFAULT_THREADS;
+    g_config.flood = 0;
+    g_config.spawn = NULL;
+    g_config.payload = LOAD_PAYLOAD_ZERO;
+    g_config.compress = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--compress") == 0) {
+            g_config.compress = true;
+            continue;
+        }
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            return false;
+        }
+        if (strcmp(argv[i], "--host") == 0) {
+            g_config.host = value;
+        } else if (strcmp(argv[i], "--port") == 0) {
+            g_config.port = atoi(value);
+        } else if (strcmp(argv[i], "--connections") == 0) {
+            g_config.connections = (size_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--group") == 0) {
+            g_config.group = (size_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--rate") == 0) {
+            g_config.rate = atof(value);
+        } else if (strcmp(argv[i], "--size") == 0) {
+            g_config.size = (size_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--payload") == 0) {
+            if (strcmp(value, "zero") == 0) {
+                g_config.payload = LOAD_PAYLOAD_ZERO;
+            } else if (strcmp(value, "json") == 0) {
+                g_config.payload = LOAD_PAYLOAD_JSON;
+            } else if (strcmp(value, "random") == 0) {
+                g_config.payload = LOAD_PAYLOAD_RANDOM;
+            } else {
+                return false;
+            }
+        } else if (strcmp(argv[i], "--duration") == 0) {
+            g_config.duration = atof(value);
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            g_config.threads = atoi(value);
+        } else if (strcmp(argv[i], "--flood") == 0) {
+            g_config.flood = (size_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--spawn") == 0) {
+            g_config.spawn = value;
+        } else {
+            return false;
+        }
+        ++i;
+    }
+
+    struct in_addr ignored;
+    return inet_pton(AF_INET, g_config.host, &ignored) == 1 && g_config.port > 0 && g_config.connections > 0
+        && g_config.group > 0 && g_config.rate >= 0 && g_config.size >= LOAD_STAMP_SIZE
+        && g_config.size <= PROTO_DEFAULT_MAX_PAYLOAD - LOAD_CONV_PREFIX && g_config.duration > 0
+        && g_config.threads > 0 && g_config.flood <= g_config.connections;
+}
+
+int main(int argc, char** argv)
+{
+    if (!parse_args(argc, argv)) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if ((size_t)g_config.threads > g_config.connections) {
+        g_config.threads = (int)g_config.connections;
+    }
+    raise_fd_limit();
+    signal(SIGPIPE, SIG_IGN);
+    g_random = now_ns() ^ ((uint64_t)getpid() << 32) ^ 0x9e3779b97f4a7c15ULL;
+
+    proto_dispatcher_init(&g_dispatcher);
+    proto_register(&g_dispatcher, PROTO_OP_CONV_MSG, record_delivery);
+    proto_register(&g_dispatcher, PROTO_OP_PING, answer_ping);
+    proto_register(&g_dispatcher, PROTO_OP_CREDIT, record_credit);
+    proto_register(&g_dispatcher, PROTO_OP_FEATURES, record_features);
+    g_dispatcher.decode = decode_frame;
+
+    pid_t server = -1;
+    if (g_config.spawn) {
+        server = spawn_server(g_config.spawn);
+        if (server < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Connection i joins conversation i / group; every member but the
+    // sender receives each message.
+    struct LoadConnection* connections = (struct LoadConnection*)calloc(g_config.connections, sizeof(*connections));
+    struct LoadWorker* workers = (struct LoadWorker*)calloc((size_t)g_config.threads, sizeof(*workers));
+    if (!connections || !workers) {
+        fprintf(stderr, "malloc failed while starting\n");
+        return EXIT_FAILURE;
+    }
+    uint8_t conversationId[PROTO_ID_SIZE];
+    for (size_t i = 0; i < g_config.connections; ++i) {
+        if (i % g_config.group == 0) {
+            random_id(conversationId);
+        }
+        size_t first = i - i % g_config.group;
+        size_t members = g_config.connections - first < g_config.group ? g_config.connections - first : g_config.group;
+        memcpy(connections[i].conversationId, conversationId, PROTO_ID_SIZE);
+        connections[i].recipients = members - 1;
+        connections[i].fd = INVALID_SOCKET;
+        connections[i].flooder = i >= g_config.connections - g_config.flood;
+        proto_recv_init(&connections[i].recvBuffer, 0);
+    }
+
+    pthread_barrier_init(&g_barrier, NULL, (unsigned)g_config.threads + 1);
+    size_t assigned = 0;
+    int started = 0;
+    for (int i = 0; i < g_config.threads; ++i) {
+        struct LoadWorker* worker = &workers[i];
+        worker->index = i;
+        worker->connections = connections + assigned;
+        worker->count = g_config.connections / (size_t)g_config.threads
+            + ((size_t)i < g_config.connections % (size_t)g_config.threads ? 1 : 0);
+        assigned += worker->count;
+        worker->rate = g_config.rate / g_config.threads;
+        worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        worker->frame = (uint8_t*)calloc(1, PROTO_HEADER_SIZE + PROTO_ID_SIZE + g_config.size);
+        worker->packed = (uint8_t*)malloc(PROTO_HEADER_SIZE + LZ_MAX_INPUT);
+        worker->random = g_random ^ ((uint64_t)(i + 1) << 40);
+        worker->latency = (struct Histogram*)malloc(sizeof(*worker->latency));
+        worker->connectLatency = (struct Histogram*)malloc(sizeof(*worker->connectLatency));
+        if (worker->epollFd < 0 || !worker->frame || !worker->packed || !worker->latency || !worker->connectLatency) {
+            fprintf(stderr, "could not set up load thread %d\n", i);
+            return EXIT_FAILURE;
+        }
+        histogram_init(worker->latency);
+        histogram_init(worker->connectLatency);
+        proto_encode_header(worker->frame, PROTO_OP_CONV_MSG, 0, (uint32_t)(PROTO_ID_SIZE + g_config.size));
+        for (size_t j = 0; j < worker->count; ++j) {
+            worker->connections[j].owner = worker;
+            worker->flooders += worker->connections[j].flooder ? 1 : 0;
+        }
+    }
+
+    uint64_t connectStartNs = now_ns();
+    for (int i = 0; i < g_config.threads; ++i) {
+        int err = pthread_create(&workers[i].thread, NULL, load_thread, &workers[i]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create failed: %d\n", err);
+            return EXIT_FAILURE;
+        }
+        ++started;
+    }
+    pthread_barrier_wait(&g_barrier);
+    double connectSeconds = (double)(now_ns() - connectStartNs) / 1e9;
+
+    usleep(LOAD_SETTLE_MS * 1000);
+    g_startNs = now_ns();
+    uint64_t cpuStartUs = cpu_us(RUSAGE_SELF);
+    pthread_barrier_wait(&g_barrier);
+    for (int i = 0; i < started; ++i) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    uint64_t cpuUs = cpu_us(RUSAGE_SELF) - cpuStartUs;
+    // The server's CPU covers its whole life, connecting included.
+    uint64_t serverCpuUs = 0;
+    if (server > 0) {
+        stop_server(server);
+        serverCpuUs = cpu_us(RUSAGE_CHILDREN);
+    }
+
+    report(workers, connectSeconds, cpuUs, serverCpuUs);
+
+    for (int i = 0; i < g_config.threads; ++i) {
+        close(workers[i].epollFd);
+        free(workers[i].frame);
+        free(workers[i].packed);
+        free(workers[i].latency);
+        free(workers[i].connectLatency);
+    }
+    for (size_t i = 0; i < g_config.connections; ++i) {
+        proto_recv_destroy(&connections[i].recvBuffer);
+        free(connections[i].pending);
+    }
+    free(connections);
+    free(workers);
+    pthread_barrier_destroy(&g_barrier);
+    return EXIT_SUCCESS;
+}
+
+#else
+
+int main(void)
+{
+    fprintf(stderr, "loadgen needs epoll (Linux)\n");
+    return EXIT_FAILURE;
+}
+
+#endif // __linux__
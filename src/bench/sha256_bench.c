@@ -0,0 +1,204 @@
+// Compares the SHA-256 implementations: checks each against the FIPS 180-4
+// test vectors and against the scalar reference on random buffers, then
+// measures single-buffer and batched throughput for typical ciphertext sizes.
+//
+//   sha256_bench [seconds per case]
+//
+// Build it optimised for meaningful numbers:
+//   make -f MAKEFILE CFLAGS="-std=c11 -O2 -Wall -Wextra -Iinclude" bench
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "sha256.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_BATCH 64
+#define BENCH_CHECK_BUFFERS 4096
+#define BENCH_CHECK_MAX_LENGTH 3000
+
+struct TestVector {
+    const char* input;
+    size_t repeat;
+    const char* digest;
+};
+
+static const struct TestVector VECTORS[] = {
+    { "", 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+    { "abc", 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+    { "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+        1, "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1" },
+    { "a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+};
+
+static double now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static uint64_t g_random = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void)
+{
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 7;
+    g_random ^= g_random << 17;
+    return g_random;
+}
+
+static bool check_vectors(void)
+{
+    bool ok = true;
+    size_t count = sizeof(VECTORS) / sizeof(VECTORS[0]);
+    struct Sha256Job jobs[sizeof(VECTORS) / sizeof(VECTORS[0])];
+    char* inputs[sizeof(VECTORS) / sizeof(VECTORS[0])];
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t length = strlen(VECTORS[i].input);
+        inputs[i] = (char*)malloc(length * VECTORS[i].repeat + 1);
+        if (!inputs[i]) {
+            return false;
+        }
+        for (size_t r = 0; r < VECTORS[i].repeat; ++r) {
+            memcpy(inputs[i] + r * length, VECTORS[i].input, length);
+        }
+        jobs[i].data = inputs[i];
+        jobs[i].length = length * VECTORS[i].repeat;
+    }
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_HEX_SIZE];
+    for (size_t i = 0; i < count; ++i) {
+        sha256(jobs[i].data, jobs[i].length, digest);
+        sha256_hex(digest, hex);
+        if (strcmp(hex, VECTORS[i].digest) != 0) {
+            fprintf(stderr, "%s: vector %zu gives %s\n", sha256_impl_name(sha256_impl()), i, hex);
+            ok = false;
+        }
+    }
+    sha256_batch(jobs, count);
+    for (size_t i = 0; i < count; ++i) {
+        sha256_hex(jobs[i].digest, hex);
+        if (strcmp(hex, VECTORS[i].digest) != 0) {
+            fprintf(stderr, "%s batch: vector %zu gives %s\n", sha256_impl_name(sha256_impl()), i, hex);
+            ok = false;
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        free(inputs[i]);
+    }
+    return ok;
+}
+
+// Random lengths around every padding boundary, batched, against scalar digests.
+static bool check_against_scalar(const uint8_t* pool, const uint8_t (*expected)[SHA256_DIGEST_SIZE],
+    struct Sha256Job* jobs)
+{
+    g_random = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < BENCH_CHECK_BUFFERS; ++i) {
+        jobs[i].data = pool + next_random() % BENCH_CHECK_MAX_LENGTH;
+        jobs[i].length = (size_t)(next_random() % BENCH_CHECK_MAX_LENGTH);
+    }
+    sha256_batch(jobs, BENCH_CHECK_BUFFERS);
+
+    bool ok = true;
+    for (size_t i = 0; i < BENCH_CHECK_BUFFERS; ++i) {
+        uint8_t single[SHA256_DIGEST_SIZE];
+        sha256(jobs[i].data, jobs[i].length, single);
+        if (expected && (memcmp(jobs[i].digest, expected[i], SHA256_DIGEST_SIZE) != 0
+                || memcmp(single, expected[i], SHA256_DIGEST_SIZE) != 0)) {
+            fprintf(stderr, "%s: buffer %zu (%zu bytes) differs from scalar\n", sha256_impl_name(sha256_impl()), i,
+                jobs[i].length);
+            ok = false;
+            break;
+        }
+    }
+    return ok;
+}
+
+static double measure(const uint8_t* pool, size_t size, bool batched, double seconds)
+{
+    struct Sha256Job jobs[BENCH_BATCH];
+    for (size_t i = 0; i < BENCH_BATCH; ++i) {
+        jobs[i].data = pool + i * size;
+        jobs[i].length = size;
+    }
+
+    size_t bytes = 0;
+    double start = now_seconds();
+    double elapsed;
+    do {
+        for (int round = 0; round < 16; ++round) {
+            if (batched) {
+                sha256_batch(jobs, BENCH_BATCH);
+            } else {
+                for (size_t i = 0; i < BENCH_BATCH; ++i) {
+                    sha256(jobs[i].data, jobs[i].length, jobs[i].digest);
+                }
+            }
+            bytes += BENCH_BATCH * size;
+        }
+        elapsed = now_seconds() - start;
+    } while (elapsed < seconds);
+    return (double)bytes / elapsed / 1e6;
+}
+
+int main(int argc, char** argv)
+{
+    static const size_t SIZES[] = { 64, 128, 256, 1024, 4096, 16384 };
+    double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+    size_t poolSize = BENCH_BATCH * SIZES[sizeof(SIZES) / sizeof(SIZES[0]) - 1] + 2 * BENCH_CHECK_MAX_LENGTH;
+
+    uint8_t* pool = (uint8_t*)malloc(poolSize);
+    struct Sha256Job* jobs = (struct Sha256Job*)malloc(BENCH_CHECK_BUFFERS * sizeof(*jobs));
+    uint8_t (*expected)[SHA256_DIGEST_SIZE] = malloc(BENCH_CHECK_BUFFERS * sizeof(*expected));
+    if (!pool || !jobs || !expected) {
+        fprintf(stderr, "malloc failed\n");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < poolSize; ++i) {
+        pool[i] = (uint8_t)next_random();
+    }
+
+    enum Sha256Impl detected = sha256_impl();
+    printf("detected: %s\n", sha256_impl_name(detected));
+
+    sha256_use_impl(SHA256_IMPL_SCALAR);
+    check_against_scalar(pool, NULL, jobs);
+    for (size_t i = 0; i < BENCH_CHECK_BUFFERS; ++i) {
+        memcpy(expected[i], jobs[i].digest, SHA256_DIGEST_SIZE);
+    }
+
+    bool ok = true;
+    printf("%-8s %8s %14s %14s\n", "impl", "bytes", "single MB/s", "batch MB/s");
+    for (int impl = SHA256_IMPL_SCALAR; impl <= SHA256_IMPL_SHANI; ++impl) {
+        if (!sha256_use_impl((enum Sha256Impl)impl)) {
+            printf("%-8s unsupported on this CPU\n", sha256_impl_name((enum Sha256Impl)impl));
+            continue;
+        }
+        if (!check_vectors() || !check_against_scalar(pool, (const uint8_t (*)[SHA256_DIGEST_SIZE])expected, jobs)) {
+            ok = false;
+            continue;
+        }
+        for (size_t s = 0; s < sizeof(SIZES) / sizeof(SIZES[0]); ++s) {
+            printf("%-8s %8zu %14.0f %14.0f\n", sha256_impl_name((enum Sha256Impl)impl), SIZES[s],
+                measure(pool, SIZES[s], false, seconds), measure(pool, SIZES[s], true, seconds));
+        }
+    }
+
+    free(pool);
+    free(jobs);
+    free(expected);
+    printf(ok ? "all implementations match the reference\n" : "MISMATCH\n");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,1015 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "chatclient.h"
+#include "socketutil.h"
+#include "lz.h"
+
+#include <time.h>
+#ifdef _WIN32
+#define poll WSAPoll
+#define SOCKET_CONNECT_PENDING(err) ((err) == WSAEWOULDBLOCK)
+#else
+#include <poll.h>
+#define SOCKET_CONNECT_PENDING(err) ((err) == EINPROGRESS)
+#endif
+
+// Wire bytes staged ahead of the socket; more frames wait in the queue.
+#define CHATCLIENT_BATCH_BYTES (64 * 1024)
+// recv() calls per wakeup, so a flood in can't starve what goes out.
+#define CHATCLIENT_RECV_ROUNDS 16
+// Longest poll(), so a missed timer costs no more than this.
+#define CHATCLIENT_MAX_WAIT_MS 1000
+#define CHATCLIENT_HISTORY_RECORD (2 * PROTO_SEQ_SIZE + PROTO_ID_SIZE + 4)
+
+struct ChatConversation {
+    uint8_t id[PROTO_ID_SIZE];
+    uint8_t type;
+    uint64_t lastSeq;       // highest seq handed to the handler
+    bool resuming;          // paging back through HISTORY after a reconnect
+    uint64_t resumeFloor;   // lastSeq when the first page was asked
+    uint64_t firstLive;     // lowest seq delivered live since; 0 none
+};
+
+// A queued frame in the wire buffer: where it ends there, and its size in the queue.
+struct ChatStaged {
+    size_t wireEnd;
+    size_t rawLength;
+};
+
+struct ChatClient {
+    struct ChatClientConfig config;
+    struct ChatClientHandlers handlers;
+    struct sockaddr_in address;
+    pthread_t thread;
+    socket_t wakeFd;        // UDP socket connected to itself
+
+    // Shared with senders, under mutex.
+    pthread_mutex_t mutex;
+    pthread_cond_t drained;
+    bool stopping;
+    bool woken;             // a wake datagram is on its way
+    uint8_t* pending;       // raw frames, [pendingStart, pendingEnd)
+    size_t pendingCapacity;
+    size_t pendingStart;
+    size_t pendingEnd;
+    size_t taken;           // bytes from pendingStart staged on this connection
+    bool identified;
+    uint8_t userId[PROTO_ID_SIZE];
+    uint8_t deviceId[PROTO_ID_SIZE];
+    struct ChatConversation* conversations;
+    size_t conversationCount;
+    size_t conversationCapacity;
+    uint64_t ackedSeq;      // highest device seq acknowledged
+    struct ChatClientStats stats;
+
+    // I/O thread only.
+    socket_t fd;
+    bool connecting;
+    bool connectedBefore;
+    bool failed;            // drop the connection at the end of this round
+    uint64_t deadlineMs;    // of the connect in progress
+    uint64_t retryAtMs;
+    uint64_t lastReceiveMs;
+    uint32_t attempt;       // failed attempts since data last came in
+    uint64_t random;
+    uint8_t* wire;          // what goes out next, [wireSent, wireLength)
+    size_t wireCapacity;
+    size_t wireLength;
+    size_t wireSent;
+    struct ChatStaged* staged;
+    size_t stagedHead;
+    size_t stagedCount;
+    size_t stagedCapacity;
+    struct ProtoRecvBuffer recvBuffer;
+    struct ProtoDispatcher dispatcher;
+    struct LzEncoder* encoder;
+    struct LzDecoder* decoder;
+    bool compressing;       // the server enabled PROTO_FEATURE_LZ
+    uint32_t framesSent;    // wrapping, like the server's CREDIT totals
+    uint32_t creditLimit;
+    bool creditSeen;        // no CREDIT yet: the server does no flow control
+    uint64_t deliveredSeq;  // highest device seq handed to the handler
+    uint64_t ackSentSeq;    // highest automatic ACK staged
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static void encode_be(uint8_t* out, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        out[i] = (uint8_t)(value >> (8 * (size - 1 - i)));
+    }
+}
+
+static uint64_t decode_be(const uint8_t* in, size_t size)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+static uint64_t next_random(struct ChatClient* client)
+{
+    client->random ^= client->random << 13;
+    client->random ^= client->random >> 7;
+    client->random ^= client->random << 17;
+    return client->random;
+}
+
+static struct ChatConversation* find_conversation(struct ChatClient* client, const uint8_t* id)
+{
+    for (size_t i = 0; i < client->conversationCount; ++i) {
+        if (memcmp(client->conversations[i].id, id, PROTO_ID_SIZE) == 0) {
+            return &client->conversations[i];
+        }
+    }
+    return NULL;
+}
+
+// A loopback datagram socket talking to itself: poll() wakes on what it sends.
+static socket_t open_wake_socket(void)
+{
+    socket_t fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd == INVALID_SOCKET) {
+        return INVALID_SOCKET;
+    }
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0
+        || getsockname(fd, (struct sockaddr*)&address, &addressLength) != 0
+        || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || set_socket_nonblocking(fd) != 0) {
+        closesocket(fd);
+        return INVALID_SOCKET;
+    }
+    return fd;
+}
+
+static void wake(struct ChatClient* client)
+{
+    char byte = 0;
+    send(client->wakeFd, &byte, 1, 0);
+}
+
+// --- Outgoing -------------------------------------------------------------
+
+static bool reserve_wire(struct ChatClient* client, size_t more)
+{
+    if (client->wireCapacity - client->wireLength >= more) {
+        return true;
+    }
+    size_t capacity = client->wireCapacity ? client->wireCapacity : CHATCLIENT_BATCH_BYTES;
+    while (capacity - client->wireLength < more) {
+        capacity *= 2;
+    }
+    uint8_t* wire = (uint8_t*)realloc(client->wire, capacity);
+    if (!wire) {
+        return false;
+    }
+    client->wire = wire;
+    client->wireCapacity = capacity;
+    return true;
+}
+
+// Appends a frame to the wire buffer, compressed when that is enabled and
+// makes it smaller. Every frame counts against the server's credit.
+static bool stage_frame(struct ChatClient* client, uint8_t opcode, uint8_t flags, const uint8_t* head,
+    size_t headLength, const uint8_t* body, size_t bodyLength)
+{
+    size_t length = headLength + bodyLength;
+    if (!reserve_wire(client, PROTO_HEADER_SIZE + length)) {
+        return false;
+    }
+    uint8_t* out = client->wire + client->wireLength;
+    if (client->compressing && length >= CHATCLIENT_COMPRESS_MIN && length <= LZ_MAX_INPUT) {
+        size_t packedLength = lz_compress(client->encoder, head, headLength, body, bodyLength,
+            out + PROTO_HEADER_SIZE, length - 1);
+        if (packedLength > 0) {
+            proto_encode_header(out, opcode, flags, (uint32_t)packedLength);
+            out[PROTO_ENCODING_OFFSET] = PROTO_ENCODING_LZ;
+            client->wireLength += PROTO_HEADER_SIZE + packedLength;
+            ++client->framesSent;
+            return true;
+        }
+    }
+    proto_encode_header(out, opcode, flags, (uint32_t)length);
+    if (headLength > 0) {
+        memcpy(out + PROTO_HEADER_SIZE, head, headLength);
+    }
+    if (bodyLength > 0) {
+        memcpy(out + PROTO_HEADER_SIZE + headLength, body, bodyLength);
+    }
+    client->wireLength += PROTO_HEADER_SIZE + length;
+    ++client->framesSent;
+    return true;
+}
+
+static bool stage_seq(struct ChatClient* client, uint8_t opcode, uint64_t seq)
+{
+    uint8_t payload[PROTO_SEQ_SIZE];
+    encode_be(payload, seq, sizeof(payload));
+    return stage_frame(client, opcode, 0, payload, sizeof(payload), NULL, 0);
+}
+
+static bool out_of_credit(const struct ChatClient* client)
+{
+    return client->creditSeen && (int32_t)(client->creditLimit - client->framesSent) <= 0;
+}
+
+// Moves queued frames into the wire buffer while there is room and credit.
+// Returns how many it moved, or -1 out of memory.
+static int stage_pending(struct ChatClient* client)
+{
+    int moved = 0;
+    pthread_mutex_lock(&client->mutex);
+    while (client->pendingStart + client->taken < client->pendingEnd
+        && client->wireLength - client->wireSent < CHATCLIENT_BATCH_BYTES && !out_of_credit(client)) {
+        if (client->stagedHead > 0) {
+            memmove(client->staged, client->staged + client->stagedHead, client->stagedCount * sizeof(*client->staged));
+            client->stagedHead = 0;
+        }
+        if (client->stagedCount == client->stagedCapacity) {
+            size_t capacity = client->stagedCapacity ? client->stagedCapacity * 2 : 256;
+            struct ChatStaged* staged = (struct ChatStaged*)realloc(client->staged, capacity * sizeof(*staged));
+            if (!staged) {
+                moved = -1;
+                break;
+            }
+            client->staged = staged;
+            client->stagedCapacity = capacity;
+        }
+        const uint8_t* frame = client->pending + client->pendingStart + client->taken;
+        size_t length = (size_t)decode_be(frame, 4);
+        if (!stage_frame(client, frame[4], frame[5], frame + PROTO_HEADER_SIZE, length, NULL, 0)) {
+            moved = -1;
+            break;
+        }
+        struct ChatStaged* entry = &client->staged[client->stagedHead + client->stagedCount++];
+        entry->wireEnd = client->wireLength;
+        entry->rawLength = PROTO_HEADER_SIZE + length;
+        client->taken += entry->rawLength;
+        ++moved;
+    }
+    pthread_mutex_unlock(&client->mutex);
+    return moved;
+}
+
+// Writes the wire buffer until the socket blocks, then retires the queued
+// frames that went out whole.
+static void flush_wire(struct ChatClient* client)
+{
+    size_t before = client->wireSent;
+    while (client->wireSent < client->wireLength) {
+        int sent = send(client->fd, (const char*)client->wire + client->wireSent,
+            (int)(client->wireLength - client->wireSent), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (!SOCKET_WOULD_BLOCK(WSAGetLastError())) {
+                client->failed = true;
+            }
+            break;
+        }
+        client->wireSent += (size_t)sent;
+    }
+    if (client->wireSent == before) {
+        return;
+    }
+
+    pthread_mutex_lock(&client->mutex);
+    client->stats.wireBytes += client->wireSent - before;
+    while (client->stagedCount > 0 && client->staged[client->stagedHead].wireEnd <= client->wireSent) {
+        size_t rawLength = client->staged[client->stagedHead].rawLength;
+        client->pendingStart += rawLength;
+        client->taken -= rawLength;
+        client->stats.rawBytes += rawLength;
+        ++client->stats.framesSent;
+        ++client->stagedHead;
+        --client->stagedCount;
+    }
+    if (client->stagedCount == 0) {
+        client->stagedHead = 0;
+    }
+    if (client->pendingStart == client->pendingEnd) {
+        client->pendingStart = 0;
+        client->pendingEnd = 0;
+        pthread_cond_broadcast(&client->drained);
+    }
+    pthread_mutex_unlock(&client->mutex);
+    if (client->wireSent == client->wireLength) {
+        client->wireSent = 0;
+        client->wireLength = 0;
+    }
+}
+
+// Alternates staging and writing until the socket blocks or nothing is left.
+static void pump(struct ChatClient* client)
+{
+    while (!client->failed) {
+        int moved = stage_pending(client);
+        if (moved < 0) {
+            client->failed = true;
+            break;
+        }
+        flush_wire(client);
+        if (moved == 0 || client->wireLength > 0) {
+            break;
+        }
+    }
+}
+
+// --- Incoming -------------------------------------------------------------
+
+static void deliver(struct ChatClient* client, const struct ChatMessage* message)
+{
+    if (client->handlers.message) {
+        client->handlers.message(client->handlers.context, message);
+    }
+}
+
+static int forward_frame(void* context, const struct ProtoFrame* frame)
+{
+    struct ChatClient* client = (struct ChatClient*)context;
+    return client->handlers.frame ? client->handlers.frame(client->handlers.context, frame) : 0;
+}
+
+static bool decode_frame(void* context, struct ProtoFrame* frame)
+{
+    struct ChatClient* client = (struct ChatClient*)context;
+    size_t length;
+    const uint8_t* payload = frame->encoding == PROTO_ENCODING_LZ && client->decoder
+        ? lz_decompress(client->decoder, frame->payload, frame->length, &length) : NULL;
+    if (!payload) {
+        return false;
+    }
+    frame->payload = payload;
+    frame->length = (uint32_t)length;
+    frame->encoding = 0;
+    return true;
+}
+
+static int answer_ping(void* context, const struct ProtoFrame* frame)
+{
+    (void)frame;
+    struct ChatClient* client = (struct ChatClient*)context;
+    return stage_frame(client, PROTO_OP_PONG, 0, NULL, 0, NULL, 0) ? 0 : -1;
+}
+
+static int record_credit(void* context, const struct ProtoFrame* frame)
+{
+    struct ChatClient* client = (struct ChatClient*)context;
+    if (frame->length != 4) {
+        return -1;
+    }
+    client->creditLimit = (uint32_t)decode_be(frame->payload, 4);
+    client->creditSeen = true;
+    return 0;
+}
+
+static int record_features(void* context, const struct ProtoFrame* frame)
+{
+    struct ChatClient* client = (struct ChatClient*)context;
+    if (frame->length < 4) {
+        return -1;
+    }
+    client->compressing = client->encoder && (decode_be(frame->payload, 4) & PROTO_FEATURE_LZ) != 0;
+    return 0;
+}
+
+static int handle_conversation(void* context, const struct ProtoFrame* frame)
+{
+    struct ChatClient* client = (struct ChatClient*)context;
+    const size_t prefix = 2 * PROTO_ID_SIZE + PROTO_SEQ_SIZE;
+    if (frame->length < prefix) {
+        return -1;
+    }
+    struct ChatMessage message;
+    message.conversationId = frame->payload;
+    message.sender = frame->payload + PROTO_ID_SIZE;
+    message.seq = decode_be(frame->payload + 2 * PROTO_ID_SIZE, PROTO_SEQ_SIZE);
+    message.type = frame->flags;
+    message.replayed = false;
+    message.body = frame->payload + prefix;
+    message.length = frame->length - prefix;
+
+    // Live messages are never repeats, but may come slightly out of order.
+    pthread_mutex_lock(&client->mutex);
+    struct ChatConversation* conversation = find_conversation(client, message.conversationId);
+    if (conversation && message.seq > 0) {
+        if (message.seq > conversation->lastSeq) {
+            conversation->lastSeq = message.seq;
+        }
+        if (conversation->resuming && (conversation->firstLive == 0 || message.seq < conversation->firstLive)) {
+            conversation->firstLive = message.seq;
+        }
+    }
+    pthread_mutex_unlock(&client->mutex);
+    deliver(client, &message);
+    return 0;
+}
+
+static int handle_device_message(void* context, const struct ProtoFrame* frame)
+{
+    struct ChatClient* client = (struct ChatClient*)context;
+    const size_t prefix = PROTO_ID_SIZE + PROTO_SEQ_SIZE;
+    if (frame->flags & PROTO_DEVICE_REFUSED) {
+        return forward_frame(context, frame);
+    }
+    if (frame->length < prefix) {
+        return -1;
+    }
+    struct ChatMessage message;
+    message.conversationId = NULL;
+    message.sender = frame->payload;
+    message.seq = decode_be(frame->payload + PROTO_ID_SIZE, PROTO_SEQ_SIZE);
+    message.type = 0;
+    message.replayed = false;
+    message.body = frame->payload + prefix;
+    message.length = frame->length - prefix;
+    // The server replays in order from the first unacknowledged seq.
+    if (message.seq <= client->deliveredSeq) {
+        return 0;
+    }
+    client->deliveredSeq = message.seq;
+    deliver(client, &message);
+    return 0;
+}
+
+// Fills a reconnect's gap from the HISTORY pages the handshake started:
+// what is newer than the last seq seen before, and older than anything
+// since delivered live. A page is the newest records before the seq asked
+// for, as many as the limit and, on the server, one frame allow; while its
+// lowest seq is still above the floor, the page before it is asked for.
+// Other HISTORY answers go to the frame handler.
+static int handle_history(void* context, const struct ProtoFrame* frame)
+{
+    struct ChatClient* client = (struct ChatClient*)context;
+    if (frame->length < PROTO_ID_SIZE) {
+        return -1;
+    }
+    pthread_mutex_lock(&client->mutex);
+    struct ChatConversation* conversation = find_conversation(client, frame->payload);
+    bool resume = conversation && conversation->resuming;
+    uint64_t floor = 0;
+    uint64_t firstLive = 0;
+    uint8_t type = 0;
+    if (resume) {
+        floor = conversation->resumeFloor;
+        firstLive = conversation->firstLive;
+        type = conversation->type;
+    }
+    pthread_mutex_unlock(&client->mutex);
+    if (!resume) {
+        return forward_frame(context, frame);
+    }
+
+    uint64_t highest = 0;
+    uint64_t lowest = 0;
+    size_t offset = PROTO_ID_SIZE;
+    while (frame->length - offset >= CHATCLIENT_HISTORY_RECORD) {
+        const uint8_t* record = frame->payload + offset;
+        size_t length = (size_t)decode_be(record + 2 * PROTO_SEQ_SIZE + PROTO_ID_SIZE, 4);
+        if (length > frame->length - offset - CHATCLIENT_HISTORY_RECORD) {
+            return -1;
+        }
+        struct ChatMessage message;
+        message.conversationId = frame->payload;
+        message.sender = record + 2 * PROTO_SEQ_SIZE;
+        message.seq = decode_be(record, PROTO_SEQ_SIZE);
+        message.type = type;
+        message.replayed = true;
+        message.body = record + CHATCLIENT_HISTORY_RECORD;
+        message.length = length;
+        if (lowest == 0 || message.seq < lowest) {
+            lowest = message.seq;
+        }
+        if (message.seq > floor && (firstLive == 0 || message.seq < firstLive)) {
+            deliver(client, &message);
+            highest = message.seq > highest ? message.seq : highest;
+        }
+        offset += CHATCLIENT_HISTORY_RECORD + length;
+    }
+
+    // An empty page means nothing is older.
+    bool more = lowest > floor + 1;
+    pthread_mutex_lock(&client->mutex);
+    conversation = find_conversation(client, frame->payload);
+    if (conversation && highest > conversation->lastSeq) {
+        conversation->lastSeq = highest;
+    }
+    if (conversation) {
+        conversation->resuming = more;
+    } else {
+        more = false;   // left meanwhile
+    }
+    pthread_mutex_unlock(&client->mutex);
+    if (more) {
+        uint8_t request[PROTO_SEQ_SIZE + 2];
+        encode_be(request, lowest, PROTO_SEQ_SIZE);
+        encode_be(request + PROTO_SEQ_SIZE, client->config.resumeHistory, 2);
+        client->failed = !stage_frame(client, PROTO_OP_HISTORY, 0, frame->payload, PROTO_ID_SIZE, request,
+            sizeof(request));
+    }
+    return 0;
+}
+
+// Reads what has arrived and dispatches it; acknowledges what the handler
+// was given, once per round, with autoAck.
+static void read_socket(struct ChatClient* client)
+{
+    for (int round = 0; round < CHATCLIENT_RECV_ROUNDS && !client->failed; ++round) {
+        size_t available;
+        uint8_t* space = proto_recv_reserve(&client->recvBuffer, &available);
+        if (!space) {
+            client->failed = true;
+            break;
+        }
+        int received = recv(client->fd, (char*)space, (int)available, 0);
+        if (received <= 0) {
+            if (received == 0 || !SOCKET_WOULD_BLOCK(WSAGetLastError())) {
+                client->failed = true;
+            } else {
+                proto_recv_release_idle(&client->recvBuffer);
+            }
+            break;
+        }
+        client->lastReceiveMs = now_ms();
+        client->attempt = 0;
+        pthread_mutex_lock(&client->mutex);
+        client->stats.wireBytesReceived += (uint64_t)received;
+        pthread_mutex_unlock(&client->mutex);
+        proto_recv_commit(&client->recvBuffer, (size_t)received);
+        if (proto_recv_dispatch(&client->recvBuffer, &client->dispatcher, client) != PROTO_OK) {
+            client->failed = true;
+        }
+    }
+
+    if (client->config.autoAck && client->deliveredSeq > client->ackSentSeq && !client->failed) {
+        client->ackSentSeq = client->deliveredSeq;
+        pthread_mutex_lock(&client->mutex);
+        if (client->ackSentSeq > client->ackedSeq) {
+            client->ackedSeq = client->ackSentSeq;
+        }
+        pthread_mutex_unlock(&client->mutex);
+        client->failed = !stage_seq(client, PROTO_OP_ACK, client->ackSentSeq);
+    }
+}
+
+// --- Connection -----------------------------------------------------------
+
+static void set_state(struct ChatClient* client, enum ChatClientState state, uint32_t retryMs)
+{
+    if (client->handlers.state) {
+        client->handlers.state(client->handlers.context, state, retryMs);
+    }
+}
+
+// Closes the connection and schedules the next attempt: a random delay
+// between half and all of base * 2^attempts, capped, so clients dropped
+// together don't come back together. Unwritten frames stay queued.
+static void disconnect(struct ChatClient* client)
+{
+    if (client->fd != INVALID_SOCKET) {
+        closesocket(client->fd);
+        client->fd = INVALID_SOCKET;
+    }
+    client->connecting = false;
+    client->failed = false;
+    client->wireLength = 0;
+    client->wireSent = 0;
+    pthread_mutex_lock(&client->mutex);
+    client->taken = 0;
+    client->stagedHead = 0;
+    client->stagedCount = 0;
+    pthread_mutex_unlock(&client->mutex);
+    proto_recv_destroy(&client->recvBuffer);
+    lz_encoder_destroy(client->encoder);
+    lz_decoder_destroy(client->decoder);
+    client->encoder = NULL;
+    client->decoder = NULL;
+    client->compressing = false;
+
+    uint32_t shift = client->attempt < 16 ? client->attempt : 16;
+    uint64_t ceiling = (uint64_t)client->config.reconnectBaseMs << shift;
+    if (ceiling > client->config.reconnectMaxMs) {
+        ceiling = client->config.reconnectMaxMs;
+    }
+    uint32_t delay = (uint32_t)(ceiling / 2 + next_random(client) % (ceiling / 2 + 1));
+    ++client->attempt;
+    client->retryAtMs = now_ms() + delay;
+    set_state(client, CHATCLIENT_DISCONNECTED, delay);
+}
+
+// Stages the handshake ahead of anything queued: FEATURES, HELLO, the last
+// ACK, and per conversation JOIN and the HISTORY that resumes it.
+static bool stage_handshake(struct ChatClient* client)
+{
+    bool ok = true;
+    if (client->config.compress) {
+        client->encoder = lz_encoder_create();
+        client->decoder = lz_decoder_create();
+        uint8_t features[4];
+        encode_be(features, PROTO_FEATURE_LZ, sizeof(features));
+        ok = client->encoder && client->decoder
+            && stage_frame(client, PROTO_OP_FEATURES, 0, features, sizeof(features), NULL, 0);
+    }
+
+    pthread_mutex_lock(&client->mutex);
+    if (ok && client->identified) {
+        ok = stage_frame(client, PROTO_OP_HELLO, 0, client->userId, PROTO_ID_SIZE, client->deviceId, PROTO_ID_SIZE)
+            && (client->ackedSeq == 0 || stage_seq(client, PROTO_OP_ACK, client->ackedSeq));
+    }
+    for (size_t i = 0; ok && i < client->conversationCount; ++i) {
+        struct ChatConversation* conversation = &client->conversations[i];
+        ok = stage_frame(client, PROTO_OP_JOIN, 0, conversation->id, PROTO_ID_SIZE, &conversation->type, 1);
+        conversation->resuming = false;
+        if (ok && client->config.resumeHistory > 0 && conversation->lastSeq > 0) {
+            uint8_t request[PROTO_SEQ_SIZE + 2];
+            encode_be(request, 0, PROTO_SEQ_SIZE);
+            encode_be(request + PROTO_SEQ_SIZE, client->config.resumeHistory, 2);
+            ok = stage_frame(client, PROTO_OP_HISTORY, 0, conversation->id, PROTO_ID_SIZE, request, sizeof(request));
+            conversation->resuming = true;
+            conversation->resumeFloor = conversation->lastSeq;
+            conversation->firstLive = 0;
+        }
+    }
+    if (client->connectedBefore) {
+        ++client->stats.reconnects;
+    }
+    pthread_mutex_unlock(&client->mutex);
+    return ok;
+}
+
+static void connected(struct ChatClient* client)
+{
+    client->connecting = false;
+    client->lastReceiveMs = now_ms();
+    client->framesSent = 0;
+    client->creditLimit = 0;
+    client->creditSeen = false;
+    client->ackSentSeq = client->deliveredSeq;
+    proto_recv_init(&client->recvBuffer, PROTO_DEFAULT_MAX_PAYLOAD);
+    if (!stage_handshake(client)) {
+        client->failed = true;
+        return;
+    }
+    client->connectedBefore = true;
+    set_state(client, CHATCLIENT_CONNECTED, 0);
+}
+
+static void start_connect(struct ChatClient* client)
+{
+    set_state(client, CHATCLIENT_CONNECTING, 0);
+    client->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (client->fd == INVALID_SOCKET || set_socket_nonblocking(client->fd) != 0) {
+        client->failed = true;
+        return;
+    }
+    int one = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+    if (connect(client->fd, (struct sockaddr*)&client->address, sizeof(client->address)) == 0) {
+        connected(client);
+        return;
+    }
+    if (!SOCKET_CONNECT_PENDING(WSAGetLastError())) {
+        client->failed = true;
+        return;
+    }
+    client->connecting = true;
+    client->deadlineMs = now_ms() + client->config.connectTimeoutMs;
+}
+
+static void finish_connect(struct ChatClient* client)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(client->fd, SOL_SOCKET, SO_ERROR, (char*)&error, &length) != 0 || error != 0) {
+        client->failed = true;
+        return;
+    }
+    connected(client);
+}
+
+static int wait_ms(const struct ChatClient* client, uint64_t nowMs)
+{
+    uint64_t until = nowMs + CHATCLIENT_MAX_WAIT_MS;
+    if (client->fd == INVALID_SOCKET) {
+        until = client->retryAtMs;
+    } else if (client->connecting) {
+        until = client->deadlineMs;
+    } else if (client->config.silenceMs > 0) {
+        until = client->lastReceiveMs + client->config.silenceMs;
+    }
+    if (until <= nowMs) {
+        return 0;
+    }
+    return until - nowMs < CHATCLIENT_MAX_WAIT_MS ? (int)(until - nowMs) : CHATCLIENT_MAX_WAIT_MS;
+}
+
+static void* io_thread(void* arg)
+{
+    struct ChatClient* client = (struct ChatClient*)arg;
+    while (true) {
+        pthread_mutex_lock(&client->mutex);
+        bool stopping = client->stopping;
+        pthread_mutex_unlock(&client->mutex);
+        if (stopping) {
+            break;
+        }
+
+        uint64_t nowMs = now_ms();
+        if (client->fd == INVALID_SOCKET && nowMs >= client->retryAtMs) {
+            start_connect(client);
+            if (client->failed) {
+                disconnect(client);
+                continue;
+            }
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = client->wakeFd;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        unsigned count = 1;
+        if (client->fd != INVALID_SOCKET) {
+            fds[1].fd = client->fd;
+            fds[1].events = client->connecting ? POLLOUT
+                : (short)(POLLIN | (client->wireSent < client->wireLength ? POLLOUT : 0));
+            fds[1].revents = 0;
+            count = 2;
+        }
+        if (poll(fds, count, wait_ms(client, nowMs)) < 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            char drain[64];
+            while (recv(client->wakeFd, drain, sizeof(drain), 0) > 0) {
+            }
+            pthread_mutex_lock(&client->mutex);
+            client->woken = false;
+            pthread_mutex_unlock(&client->mutex);
+        }
+        if (client->fd == INVALID_SOCKET) {
+            continue;
+        }
+
+        nowMs = now_ms();
+        if (client->connecting) {
+            if (fds[1].revents & (POLLOUT | POLLERR | POLLHUP)) {
+                finish_connect(client);
+            } else if (nowMs >= client->deadlineMs) {
+                client->failed = true;
+            }
+        } else {
+            if (fds[1].revents & (POLLIN | POLLERR | POLLHUP)) {
+                read_socket(client);
+            }
+            if (client->config.silenceMs > 0 && nowMs >= client->lastReceiveMs + client->config.silenceMs) {
+                client->failed = true;
+            }
+        }
+        if (!client->connecting && !client->failed) {
+            pump(client);
+        }
+        if (client->failed) {
+            disconnect(client);
+        }
+    }
+
+    if (client->fd != INVALID_SOCKET) {
+        closesocket(client->fd);
+        client->fd = INVALID_SOCKET;
+    }
+    proto_recv_destroy(&client->recvBuffer);
+    lz_encoder_destroy(client->encoder);
+    lz_decoder_destroy(client->decoder);
+    return NULL;
+}
+
+// --- API ------------------------------------------------------------------
+
+struct ChatClient* chatclient_create(const struct ChatClientConfig* config, const struct ChatClientHandlers* handlers)
+{
+    struct ChatClient* client = (struct ChatClient*)calloc(1, sizeof(*client));
+    if (!client) {
+        return NULL;
+    }
+    client->config = *config;
+    client->handlers = *handlers;
+    client->fd = INVALID_SOCKET;
+    client->address.sin_family = AF_INET;
+    client->address.sin_port = htons((uint16_t)config->port);
+    client->random = ((uint64_t)now_ms() << 20) ^ (uint64_t)(uintptr_t)client ^ 0x9e3779b97f4a7c15ULL;
+    proto_recv_init(&client->recvBuffer, PROTO_DEFAULT_MAX_PAYLOAD);
+    proto_dispatcher_init(&client->dispatcher);
+    proto_register(&client->dispatcher, PROTO_OP_PING, answer_ping);
+    proto_register(&client->dispatcher, PROTO_OP_CREDIT, record_credit);
+    proto_register(&client->dispatcher, PROTO_OP_FEATURES, record_features);
+    proto_register(&client->dispatcher, PROTO_OP_CONV_MSG, handle_conversation);
+    proto_register(&client->dispatcher, PROTO_OP_DEVICE_MSG, handle_device_message);
+    proto_register(&client->dispatcher, PROTO_OP_HISTORY, handle_history);
+    client->dispatcher.fallback = forward_frame;
+    client->dispatcher.decode = decode_frame;
+
+    if (inet_pton(AF_INET, config->host, &client->address.sin_addr) != 1) {
+        free(client);
+        return NULL;
+    }
+    client->wakeFd = open_wake_socket();
+    if (client->wakeFd == INVALID_SOCKET) {
+        free(client);
+        return NULL;
+    }
+    pthread_mutex_init(&client->mutex, NULL);
+    pthread_cond_init(&client->drained, NULL);
+    if (pthread_create(&client->thread, NULL, io_thread, client) != 0) {
+        pthread_cond_destroy(&client->drained);
+        pthread_mutex_destroy(&client->mutex);
+        closesocket(client->wakeFd);
+        free(client);
+        return NULL;
+    }
+    return client;
+}
+
+void chatclient_destroy(struct ChatClient* client)
+{
+    if (!client) {
+        return;
+    }
+    pthread_mutex_lock(&client->mutex);
+    client->stopping = true;
+    pthread_cond_broadcast(&client->drained);
+    pthread_mutex_unlock(&client->mutex);
+    wake(client);
+    pthread_join(client->thread, NULL);
+
+    closesocket(client->wakeFd);
+    pthread_cond_destroy(&client->drained);
+    pthread_mutex_destroy(&client->mutex);
+    free(client->pending);
+    free(client->conversations);
+    free(client->wire);
+    free(client->staged);
+    free(client);
+}
+
+int chatclient_send(struct ChatClient* client, uint8_t opcode, const void* head, size_t headLength, const void* body,
+    size_t bodyLength)
+{
+    size_t length = headLength + bodyLength;
+    if (length > PROTO_DEFAULT_MAX_PAYLOAD) {
+        return CHATCLIENT_TOO_LARGE;
+    }
+    size_t frameLength = PROTO_HEADER_SIZE + length;
+
+    pthread_mutex_lock(&client->mutex);
+    size_t queued = client->pendingEnd - client->pendingStart;
+    // An empty queue takes any frame, so none is too big to ever send.
+    if (queued > 0 && queued + frameLength > client->config.maxQueuedBytes) {
+        pthread_mutex_unlock(&client->mutex);
+        return CHATCLIENT_FULL;
+    }
+    if (client->pendingCapacity - client->pendingEnd < frameLength && client->pendingStart > 0) {
+        memmove(client->pending, client->pending + client->pendingStart, queued);
+        client->pendingStart = 0;
+        client->pendingEnd = queued;
+    }
+    if (client->pendingCapacity - client->pendingEnd < frameLength) {
+        size_t capacity = client->pendingCapacity ? client->pendingCapacity : CHATCLIENT_BATCH_BYTES;
+        while (capacity - client->pendingEnd < frameLength) {
+            capacity *= 2;
+        }
+        uint8_t* pending = (uint8_t*)realloc(client->pending, capacity);
+        if (!pending) {
+            pthread_mutex_unlock(&client->mutex);
+            return CHATCLIENT_NO_MEMORY;
+        }
+        client->pending = pending;
+        client->pendingCapacity = capacity;
+    }
+    uint8_t* out = client->pending + client->pendingEnd;
+    proto_encode_header(out, opcode, 0, (uint32_t)length);
+    if (headLength > 0) {
+        memcpy(out + PROTO_HEADER_SIZE, head, headLength);
+    }
+    if (bodyLength > 0) {
+        memcpy(out + PROTO_HEADER_SIZE + headLength, body, bodyLength);
+    }
+    client->pendingEnd += frameLength;
+    // One datagram per round of the I/O thread, however many frames.
+    bool woken = client->woken;
+    client->woken = true;
+    pthread_mutex_unlock(&client->mutex);
+    if (!woken) {
+        wake(client);
+    }
+    return CHATCLIENT_OK;
+}
+
+int chatclient_hello(struct ChatClient* client, const uint8_t* userId, const uint8_t* deviceId)
+{
+    pthread_mutex_lock(&client->mutex);
+    client->identified = true;
+    memcpy(client->userId, userId, PROTO_ID_SIZE);
+    memcpy(client->deviceId, deviceId, PROTO_ID_SIZE);
+    pthread_mutex_unlock(&client->mutex);
+    return chatclient_send(client, PROTO_OP_HELLO, userId, PROTO_ID_SIZE, deviceId, PROTO_ID_SIZE);
+}
+
+int chatclient_join(struct ChatClient* client, const uint8_t* conversationId, enum ProtoConversationType type)
+{
+    pthread_mutex_lock(&client->mutex);
+    struct ChatConversation* conversation = find_conversation(client, conversationId);
+    if (!conversation) {
+        if (client->conversationCount == client->conversationCapacity) {
+            size_t capacity = client->conversationCapacity ? client->conversationCapacity * 2 : 8;
+            struct ChatConversation* conversations = (struct ChatConversation*)realloc(client->conversations,
+                capacity * sizeof(*conversations));
+            if (!conversations) {
+                pthread_mutex_unlock(&client->mutex);
+                return CHATCLIENT_NO_MEMORY;
+            }
+            client->conversations = conversations;
+            client->conversationCapacity = capacity;
+        }
+        conversation = &client->conversations[client->conversationCount++];
+        memset(conversation, 0, sizeof(*conversation));
+        memcpy(conversation->id, conversationId, PROTO_ID_SIZE);
+    }
+    conversation->type = (uint8_t)type;
+    pthread_mutex_unlock(&client->mutex);
+    uint8_t kind = (uint8_t)type;
+    return chatclient_send(client, PROTO_OP_JOIN, conversationId, PROTO_ID_SIZE, &kind, 1);
+}
+
+int chatclient_leave(struct ChatClient* client, const uint8_t* conversationId)
+{
+    pthread_mutex_lock(&client->mutex);
+    struct ChatConversation* conversation = find_conversation(client, conversationId);
+    if (conversation) {
+        *conversation = client->conversations[--client->conversationCount];
+    }
+    pthread_mutex_unlock(&client->mutex);
+    return chatclient_send(client, PROTO_OP_LEAVE, conversationId, PROTO_ID_SIZE, NULL, 0);
+}
+
+int chatclient_send_conversation(struct ChatClient* client, const uint8_t* conversationId, const void* body,
+    size_t length)
+{
+    return chatclient_send(client, PROTO_OP_CONV_MSG, conversationId, PROTO_ID_SIZE, body, length);
+}
+
+int chatclient_send_device(struct ChatClient* client, const uint8_t* deviceId, const void* body, size_t length)
+{
+    return chatclient_send(client, PROTO_OP_DEVICE_MSG, deviceId, PROTO_ID_SIZE, body, length);
+}
+
+int chatclient_ack(struct ChatClient* client, uint64_t seq)
+{
+    pthread_mutex_lock(&client->mutex);
+    if (seq > client->ackedSeq) {
+        client->ackedSeq = seq;
+    }
+    pthread_mutex_unlock(&client->mutex);
+    uint8_t payload[PROTO_SEQ_SIZE];
+    encode_be(payload, seq, sizeof(payload));
+    return chatclient_send(client, PROTO_OP_ACK, payload, sizeof(payload), NULL, 0);
+}
+
+bool chatclient_drain(struct ChatClient* client, uint32_t timeoutMs)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&client->mutex);
+    while (client->pendingStart < client->pendingEnd && !client->stopping
+        && pthread_cond_timedwait(&client->drained, &client->mutex, &deadline) == 0) {
+    }
+    bool drained = client->pendingStart == client->pendingEnd;
+    pthread_mutex_unlock(&client->mutex);
+    return drained;
+}
+
+void chatclient_stats(struct ChatClient* client, struct ChatClientStats* stats)
+{
+    pthread_mutex_lock(&client->mutex);
+    *stats = client->stats;
+    stats->queuedBytes = client->pendingEnd - client->pendingStart;
+    pthread_mutex_unlock(&client->mutex);
+}
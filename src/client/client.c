@@ -1,96 +1,689 @@
 #include <socketutil.h>
+#include <dispatcher.h>
+#include <chatclient.h>
+#include <time.h>
 
-static void* receive_messages(void* arg)
+// /prekeys uploads keys of this size, at most this many per command.
+#define CLIENT_PREKEY_SIZE 32
+#define CLIENT_MAX_PREKEY_UPLOAD 1000
+// /upload sends files in chunks of this size; larger messages must go that way.
+#define CLIENT_BLOB_CHUNK (256 * 1024)
+#define CLIENT_BLOB_HEADER (PROTO_ID_SIZE + 2 * PROTO_SEQ_SIZE)
+#define CLIENT_MAX_MESSAGE (PROTO_DEFAULT_MAX_PAYLOAD / 2)
+#define CLIENT_BLOB_REPLY_TIMEOUT_S 5
+// How long a command waits for room in a full outbound queue.
+#define CLIENT_DRAIN_TIMEOUT_MS 30000
+
+static int print_chat(void* context, const struct ProtoFrame* frame)
+{
+    (void)context;
+    printf("\nMessage from server: %.*s\n", (int)frame->length, (const char*)frame->payload);
+    printf("Enter message to send(type \"exit\" to exit):\n");
+    return 0;
+}
+
+static unsigned long long read_be(const uint8_t* in, size_t size)
+{
+    unsigned long long value = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+static void write_be(uint8_t* out, unsigned long long value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        out[i] = (uint8_t)(value >> (8 * (size - 1 - i)));
+    }
+}
+
+static void print_message(void* context, const struct ChatMessage* message)
+{
+    (void)context;
+    char device[37];
+    proto_format_id(message->sender, device);
+    if (message->conversationId)
+    {
+        char conversation[37];
+        proto_format_id(message->conversationId, conversation);
+        printf("\n[%s] #%llu %s%s: %.*s\n", conversation, (unsigned long long)message->seq, device,
+            message->replayed ? " (missed)" : "", (int)message->length, (const char*)message->body);
+    }
+    else
+    {
+        printf("\n#%llu %s: %.*s\n", (unsigned long long)message->seq, device, (int)message->length,
+            (const char*)message->body);
+    }
+    printf("Enter message to send(type \"exit\" to exit):\n");
+}
+
+static int print_history(void* context, const struct ProtoFrame* frame)
 {
-    socket_t sockfd = *(socket_t*)arg;
-    char buffer[BUFFER_SIZE];
+    (void)context;
+    const size_t recordHeader = 2 * PROTO_SEQ_SIZE + PROTO_ID_SIZE + 4;
+    if (frame->length < PROTO_ID_SIZE)
+    {
+        return -1;
+    }
+    char conversation[37];
+    proto_format_id(frame->payload, conversation);
+    printf("\nHistory of %s:\n", conversation);
 
-    while (true)
+    size_t offset = PROTO_ID_SIZE;
+    while (frame->length - offset >= recordHeader)
     {
-        int received = recv(sockfd, buffer, sizeof(buffer) - 1, 0);
-        if (received > 0)
+        const uint8_t* record = frame->payload + offset;
+        size_t length = (size_t)read_be(record + 2 * PROTO_SEQ_SIZE + PROTO_ID_SIZE, 4);
+        if (length > frame->length - offset - recordHeader)
         {
-            buffer[received] = '\0';
-            printf("\nMessage from server: %s\n", buffer);
-            printf("Enter message to send(type \"exit\" to exit):\n");
+            return -1;
         }
-        else if (received == 0)
+        char device[37];
+        proto_format_id(record + 2 * PROTO_SEQ_SIZE, device);
+        printf("  #%llu %s: %.*s\n", read_be(record, PROTO_SEQ_SIZE), device, (int)length,
+            (const char*)record + recordHeader);
+        offset += recordHeader + length;
+    }
+    printf("Enter message to send(type \"exit\" to exit):\n");
+    return 0;
+}
+
+static int print_prekey_upload(void* context, const struct ProtoFrame* frame)
+{
+    (void)context;
+    if (frame->length != 8)
+    {
+        return -1;
+    }
+    printf("\nStored %llu prekey(s), %llu available\n", read_be(frame->payload, 4), read_be(frame->payload + 4, 4));
+    printf("Enter message to send(type \"exit\" to exit):\n");
+    return 0;
+}
+
+static int print_prekey_claim(void* context, const struct ProtoFrame* frame)
+{
+    (void)context;
+    if (frame->length < PROTO_ID_SIZE || (frame->length > PROTO_ID_SIZE && frame->length <= 2 * PROTO_ID_SIZE))
+    {
+        return -1;
+    }
+    char device[37];
+    proto_format_id(frame->payload, device);
+    if (frame->length == PROTO_ID_SIZE)
+    {
+        printf("\nNo prekeys left for %s\n", device);
+    }
+    else
+    {
+        char key[37];
+        proto_format_id(frame->payload + PROTO_ID_SIZE, key);
+        printf("\nClaimed prekey %s of %s (%u bytes)\n", key, device, (unsigned)(frame->length - 2 * PROTO_ID_SIZE));
+    }
+    printf("Enter message to send(type \"exit\" to exit):\n");
+    return 0;
+}
+
+static int print_prekey_low(void* context, const struct ProtoFrame* frame)
+{
+    (void)context;
+    if (frame->length != 4)
+    {
+        return -1;
+    }
+    printf("\nOnly %llu prekey(s) left; upload more with /prekeys\n", read_be(frame->payload, 4));
+    printf("Enter message to send(type \"exit\" to exit):\n");
+    return 0;
+}
+
+// The connection, its I/O thread and the outbound queue.
+static struct ChatClient* g_client;
+
+// The receiver hands BLOB_PUT replies to an /upload waiting for one, and
+// writes BLOB_DATA to the file of the /download in progress.
+static pthread_mutex_t g_blobMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_blobCond = PTHREAD_COND_INITIALIZER;
+static uint8_t g_putId[PROTO_ID_SIZE];
+static bool g_putReplied;
+static bool g_putRefused;
+static unsigned long long g_putStored;
+static FILE* g_download;
+static uint8_t g_downloadId[PROTO_ID_SIZE];
+
+static int print_blob_put(void* context, const struct ProtoFrame* frame)
+{
+    (void)context;
+    if (frame->length != PROTO_ID_SIZE + PROTO_SEQ_SIZE)
+    {
+        return -1;
+    }
+    char blob[37];
+    proto_format_id(frame->payload, blob);
+    unsigned long long stored = read_be(frame->payload + PROTO_ID_SIZE, PROTO_SEQ_SIZE);
+    bool refused = (frame->flags & PROTO_BLOB_REFUSED) != 0;
+
+    pthread_mutex_lock(&g_blobMutex);
+    g_putReplied = memcmp(g_putId, frame->payload, PROTO_ID_SIZE) == 0;
+    g_putRefused = refused;
+    g_putStored = stored;
+    pthread_cond_signal(&g_blobCond);
+    pthread_mutex_unlock(&g_blobMutex);
+
+    if (refused)
+    {
+        printf("\nServer refused blob %s (it holds %llu bytes)\n", blob, stored);
+    }
+    else
+    {
+        printf("\nServer holds %llu bytes of blob %s\n", stored, blob);
+    }
+    printf("Enter message to send(type \"exit\" to exit):\n");
+    return 0;
+}
+
+static int save_blob_data(void* context, const struct ProtoFrame* frame)
+{
+    (void)context;
+    if (frame->length < CLIENT_BLOB_HEADER)
+    {
+        return -1;
+    }
+    char blob[37];
+    proto_format_id(frame->payload, blob);
+    unsigned long long size = read_be(frame->payload + PROTO_ID_SIZE, PROTO_SEQ_SIZE);
+    unsigned long long offset = read_be(frame->payload + PROTO_ID_SIZE + PROTO_SEQ_SIZE, PROTO_SEQ_SIZE);
+    size_t length = frame->length - CLIENT_BLOB_HEADER;
+
+    pthread_mutex_lock(&g_blobMutex);
+    bool ours = g_download && memcmp(g_downloadId, frame->payload, PROTO_ID_SIZE) == 0;
+    bool failed = ours && !(frame->flags & PROTO_BLOB_REFUSED)
+        && fwrite(frame->payload + CLIENT_BLOB_HEADER, 1, length, g_download) != length;
+    bool finished = ours && (failed || (frame->flags & PROTO_BLOB_REFUSED) || offset + length == size);
+    if (finished)
+    {
+        fclose(g_download);
+        g_download = NULL;
+    }
+    pthread_mutex_unlock(&g_blobMutex);
+
+    if (!finished)
+    {
+        return 0;
+    }
+    if (frame->flags & PROTO_BLOB_REFUSED)
+    {
+        printf("\nBlob %s is not available (unknown, still uploading, or a download is in progress)\n", blob);
+    }
+    else if (failed)
+    {
+        printf("\nCould not write blob %s; run /download again to resume\n", blob);
+    }
+    else
+    {
+        printf("\nDownloaded blob %s (%llu bytes)\n", blob, size);
+    }
+    printf("Enter message to send(type \"exit\" to exit):\n");
+    return 0;
+}
+
+// Queues a frame, waiting for room if the queue is full. Returns a
+// ChatClientStatus, having said what went wrong.
+static int send_frame(uint8_t opcode, const uint8_t* head, size_t headLength, const char* body, size_t bodyLength)
+{
+    if (headLength + bodyLength > CLIENT_MAX_MESSAGE)
+    {
+        printf("Message too long (%zu bytes); send large content with /upload\n", headLength + bodyLength);
+        return CHATCLIENT_TOO_LARGE;
+    }
+    int status = chatclient_send(g_client, opcode, head, headLength, body, bodyLength);
+    while (status == CHATCLIENT_FULL && chatclient_drain(g_client, CLIENT_DRAIN_TIMEOUT_MS))
+    {
+        status = chatclient_send(g_client, opcode, head, headLength, body, bodyLength);
+    }
+    if (status != CHATCLIENT_OK)
+    {
+        printf("Could not queue the message (%s)\n", status == CHATCLIENT_FULL ? "the server is not reading" : "out of memory");
+    }
+    return status;
+}
+
+static int print_presence(void* context, const struct ProtoFrame* frame)
+{
+    (void)context;
+    const size_t entrySize = PROTO_ID_SIZE + 1 + PROTO_SEQ_SIZE;
+    if (frame->length < PROTO_ID_SIZE || (frame->length - PROTO_ID_SIZE) % entrySize != 0)
+    {
+        return -1;
+    }
+    char conversation[37];
+    proto_format_id(frame->payload, conversation);
+    printf("\nPresence in %s:\n", conversation);
+    for (size_t offset = PROTO_ID_SIZE; offset < frame->length; offset += entrySize)
+    {
+        const uint8_t* entry = frame->payload + offset;
+        char device[37];
+        proto_format_id(entry, device);
+        time_t lastSeen = (time_t)(read_be(entry + PROTO_ID_SIZE + 1, PROTO_SEQ_SIZE) / 1000);
+        char when[32] = "";
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&lastSeen));
+        printf("  %s %s (last seen %s)\n", device, entry[PROTO_ID_SIZE] ? "online" : "offline", when);
+    }
+    printf("Enter message to send(type \"exit\" to exit):\n");
+    return 0;
+}
+
+static int print_receipts(void* context, const struct ProtoFrame* frame)
+{
+    (void)context;
+    const size_t entrySize = PROTO_ID_SIZE + 1 + 2 * PROTO_SEQ_SIZE;
+    if (frame->length < 2 * PROTO_ID_SIZE || (frame->length - 2 * PROTO_ID_SIZE) % entrySize != 0)
+    {
+        return -1;
+    }
+    char conversation[37];
+    proto_format_id(frame->payload, conversation);
+    printf("\nReceipts in %s:\n", conversation);
+    for (size_t offset = 2 * PROTO_ID_SIZE; offset < frame->length; offset += entrySize)
+    {
+        const uint8_t* entry = frame->payload + offset;
+        char device[37];
+        proto_format_id(entry, device);
+        printf("  %s %s #%llu..#%llu\n", device, entry[PROTO_ID_SIZE] == 2 ? "read" : "delivered",
+            read_be(entry + PROTO_ID_SIZE + 1, PROTO_SEQ_SIZE),
+            read_be(entry + PROTO_ID_SIZE + 1 + PROTO_SEQ_SIZE, PROTO_SEQ_SIZE));
+    }
+    printf("Enter message to send(type \"exit\" to exit):\n");
+    return 0;
+}
+
+// Uploads count random keys; enough for exercising the pool, not for real sessions.
+static int send_prekeys(size_t count)
+{
+    const size_t entrySize = PROTO_ID_SIZE + 2 + CLIENT_PREKEY_SIZE;
+    uint8_t* payload = (uint8_t*)malloc(count * entrySize);
+    if (!payload)
+    {
+        fprintf(stderr, "malloc failed while generating prekeys\n");
+        return 1;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint8_t* entry = payload + i * entrySize;
+        for (size_t j = 0; j < entrySize; ++j)
         {
-            printf("\nServer closed the connection.\n");
-            break;
+            entry[j] = (uint8_t)rand();
         }
-        else
+        entry[PROTO_ID_SIZE] = 0;
+        entry[PROTO_ID_SIZE + 1] = CLIENT_PREKEY_SIZE;
+    }
+    send_frame(PROTO_OP_PREKEY_UPLOAD, payload, count * entrySize, NULL, 0);
+    free(payload);
+    return 1;
+}
+
+// Sends an empty BLOB_PUT and waits for the server to say how much of the
+// blob it holds. Returns false on refusal or no answer (no HELLO yet, or
+// a server without a blob store).
+static bool query_blob(uint8_t* head, unsigned long long* stored)
+{
+    pthread_mutex_lock(&g_blobMutex);
+    memcpy(g_putId, head, PROTO_ID_SIZE);
+    g_putReplied = false;
+    pthread_mutex_unlock(&g_blobMutex);
+    write_be(head + PROTO_ID_SIZE + PROTO_SEQ_SIZE, 0, PROTO_SEQ_SIZE);
+    if (send_frame(PROTO_OP_BLOB_PUT, head, CLIENT_BLOB_HEADER, NULL, 0) != CHATCLIENT_OK)
+    {
+        return false;
+    }
+
+    struct timespec deadline;
+    deadline.tv_sec = time(NULL) + CLIENT_BLOB_REPLY_TIMEOUT_S;
+    deadline.tv_nsec = 0;
+    pthread_mutex_lock(&g_blobMutex);
+    while (!g_putReplied && pthread_cond_timedwait(&g_blobCond, &g_blobMutex, &deadline) == 0)
+    {
+    }
+    bool replied = g_putReplied && !g_putRefused;
+    *stored = g_putStored;
+    pthread_mutex_unlock(&g_blobMutex);
+    return replied;
+}
+
+// Uploads path as a blob (resuming blobText if given) from wherever the
+// server's copy ends, then announces it in the conversation.
+static int upload_file(const uint8_t* conversationId, const char* path, const char* blobText)
+{
+    uint8_t head[CLIENT_BLOB_HEADER];
+    if (blobText && !proto_parse_id(blobText, head))
+    {
+        printf("Usage: /upload <conversation-id> <file> [blob-id to resume]\n");
+        return 1;
+    }
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        printf("Cannot open %s\n", path);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    unsigned long long size = (unsigned long long)ftell(file);
+    if (!blobText)
+    {
+        for (size_t i = 0; i < PROTO_ID_SIZE; ++i)
         {
-            print_last_error("recv");
+            head[i] = (uint8_t)rand();
+        }
+    }
+    write_be(head + PROTO_ID_SIZE, size, PROTO_SEQ_SIZE);
+    char blob[37];
+    proto_format_id(head, blob);
+
+    unsigned long long offset = 0;
+    char* chunk = (char*)malloc(CLIENT_BLOB_CHUNK);
+    if (!chunk || !query_blob(head, &offset) || fseek(file, (long)offset, SEEK_SET) != 0)
+    {
+        printf("Could not upload %s as blob %s\n", path, blob);
+        free(chunk);
+        fclose(file);
+        return 1;
+    }
+    printf("Uploading %s (%llu bytes) as blob %s from byte %llu\n", path, size, blob, offset);
+
+    int result = CHATCLIENT_OK;
+    while (offset < size && result == CHATCLIENT_OK)
+    {
+        size_t wanted = size - offset < CLIENT_BLOB_CHUNK ? (size_t)(size - offset) : CLIENT_BLOB_CHUNK;
+        size_t length = fread(chunk, 1, wanted, file);
+        if (length == 0)
+        {
+            printf("Could not read %s\n", path);
             break;
         }
+        write_be(head + PROTO_ID_SIZE + PROTO_SEQ_SIZE, offset, PROTO_SEQ_SIZE);
+        result = send_frame(PROTO_OP_BLOB_PUT, head, CLIENT_BLOB_HEADER, chunk, length);
+        offset += length;
     }
+    free(chunk);
+    fclose(file);
 
-    return NULL;
+    if (result == CHATCLIENT_OK && offset == size)
+    {
+        // Frames are handled in order: the blob is complete before anyone sees this.
+        char note[256];
+        int noteLength = snprintf(note, sizeof(note), "[attachment %s, %llu bytes: /download %s <file>]", path,
+            size, blob);
+        if (noteLength > 0 && (size_t)noteLength < sizeof(note))
+        {
+            send_frame(PROTO_OP_CONV_MSG, conversationId, PROTO_ID_SIZE, note, (size_t)noteLength);
+        }
+    }
+    return 1;
 }
 
-int main()
+// Asks for blob id from the end of path, so an interrupted download resumes.
+static int start_download(const uint8_t* id, const char* path)
 {
+    pthread_mutex_lock(&g_blobMutex);
+    if (g_download)
+    {
+        pthread_mutex_unlock(&g_blobMutex);
+        printf("A download is already in progress\n");
+        return 1;
+    }
+    g_download = fopen(path, "ab");
+    if (!g_download)
+    {
+        pthread_mutex_unlock(&g_blobMutex);
+        printf("Cannot open %s\n", path);
+        return 1;
+    }
+    fseek(g_download, 0, SEEK_END);
+    uint8_t head[PROTO_ID_SIZE + PROTO_SEQ_SIZE];
+    memcpy(head, id, PROTO_ID_SIZE);
+    write_be(head + PROTO_ID_SIZE, (unsigned long long)ftell(g_download), PROTO_SEQ_SIZE);
+    memcpy(g_downloadId, id, PROTO_ID_SIZE);
+    pthread_mutex_unlock(&g_blobMutex);
+    send_frame(PROTO_OP_BLOB_GET, head, sizeof(head), NULL, 0);
+    return 1;
+}
 
-    WSADATA wsaData;
-    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (iResult != 0) {
-        printf("WSAStartup failed: %d\n", iResult);
+// Says why a command could not be queued. Returns 1, as for any command.
+static int queued(int status)
+{
+    if (status != CHATCLIENT_OK)
+    {
+        printf("Could not queue the command (%s)\n", status == CHATCLIENT_FULL ? "queue full" : "out of memory");
+    }
+    return 1;
+}
+
+// Handles the /hello, /join, /leave, /to, /history, /receipt, /send, /ack, /prekeys, /claim, /upload and
+// /download commands. Returns
+// 1 if line was a command, 0 if it is plain chat.
+static int send_command(char* line)
+{
+    if (line[0] != '/')
+    {
+        return 0;
+    }
+
+    char* command = strtok(line, " ");
+    char* first = strtok(NULL, " ");
+    char* rest = strtok(NULL, "");
+    uint8_t ids[2 * PROTO_ID_SIZE + 1];     // also fits /history's and /receipt's fields
+
+    if (strcmp(command, "/hello") == 0 && first && rest
+        && proto_parse_id(first, ids) && proto_parse_id(rest, ids + PROTO_ID_SIZE))
+    {
+        return queued(chatclient_hello(g_client, ids, ids + PROTO_ID_SIZE));
+    }
+    if (strcmp(command, "/join") == 0 && first && rest && proto_parse_id(first, ids))
+    {
+        enum ProtoConversationType type;
+        if (strcmp(rest, "direct") == 0)
+        {
+            type = PROTO_CONV_DIRECT;
+        }
+        else if (strcmp(rest, "group") == 0)
+        {
+            type = PROTO_CONV_GROUP;
+        }
+        else if (strcmp(rest, "broadcast") == 0)
+        {
+            type = PROTO_CONV_BROADCAST;
+        }
+        else
+        {
+            printf("Usage: /join <conversation-id> direct|group|broadcast\n");
+            return 1;
+        }
+        return queued(chatclient_join(g_client, ids, type));
+    }
+    if (strcmp(command, "/leave") == 0 && first && !rest && proto_parse_id(first, ids))
+    {
+        return queued(chatclient_leave(g_client, ids));
+    }
+    if (strcmp(command, "/to") == 0 && first && rest && proto_parse_id(first, ids))
+    {
+        send_frame(PROTO_OP_CONV_MSG, ids, PROTO_ID_SIZE, rest, strlen(rest));
         return 1;
     }
-    
-    const char *ip = "127.0.0.1";
-    int port = 2000;
+    if (strcmp(command, "/history") == 0 && first && proto_parse_id(first, ids))
+    {
+        // Fifty messages before the given seq, or the newest fifty.
+        unsigned long long before = rest ? strtoull(rest, NULL, 10) : 0;
+        for (size_t i = 0; i < PROTO_SEQ_SIZE; ++i)
+        {
+            ids[PROTO_ID_SIZE + i] = (uint8_t)(before >> (8 * (PROTO_SEQ_SIZE - 1 - i)));
+        }
+        ids[PROTO_ID_SIZE + PROTO_SEQ_SIZE] = 0;
+        ids[PROTO_ID_SIZE + PROTO_SEQ_SIZE + 1] = 50;
+        send_frame(PROTO_OP_HISTORY, ids, PROTO_ID_SIZE + PROTO_SEQ_SIZE + 2, NULL, 0);
+        return 1;
+    }
+    if (strcmp(command, "/receipt") == 0 && first && rest && proto_parse_id(first, ids))
+    {
+        // One frame acknowledges the whole range.
+        char kind[16];
+        unsigned long long from = 0;
+        unsigned long long to = 0;
+        int fields = sscanf(rest, "%15s %llu %llu", kind, &from, &to);
+        if (fields >= 2 && (strcmp(kind, "delivered") == 0 || strcmp(kind, "read") == 0))
+        {
+            ids[PROTO_ID_SIZE] = strcmp(kind, "read") == 0 ? 2 : 1;
+            write_be(ids + PROTO_ID_SIZE + 1, from, PROTO_SEQ_SIZE);
+            write_be(ids + PROTO_ID_SIZE + 1 + PROTO_SEQ_SIZE, fields == 3 ? to : from, PROTO_SEQ_SIZE);
+            send_frame(PROTO_OP_RECEIPT, ids, PROTO_ID_SIZE + 1 + 2 * PROTO_SEQ_SIZE, NULL, 0);
+            return 1;
+        }
+    }
 
-    struct sockaddr_in* addrinfo_result = createIPv4Address(ip, port);
-    if (!addrinfo_result) {
-        fprintf(stderr, "Failed to create IPv4 address\n");
-        WSACleanup();
-        return EXIT_FAILURE;
+    if (strcmp(command, "/send") == 0 && first && rest && proto_parse_id(first, ids))
+    {
+        send_frame(PROTO_OP_DEVICE_MSG, ids, PROTO_ID_SIZE, rest, strlen(rest));
+        return 1;
+    }
+    if (strcmp(command, "/ack") == 0 && first && !rest)
+    {
+        return queued(chatclient_ack(g_client, strtoull(first, NULL, 10)));
+    }
+    if (strcmp(command, "/prekeys") == 0 && first && !rest)
+    {
+        unsigned long count = strtoul(first, NULL, 10);
+        if (count > 0 && count <= CLIENT_MAX_PREKEY_UPLOAD)
+        {
+            return send_prekeys(count);
+        }
+    }
+    if (strcmp(command, "/claim") == 0 && first && !rest && proto_parse_id(first, ids))
+    {
+        send_frame(PROTO_OP_PREKEY_CLAIM, ids, PROTO_ID_SIZE, NULL, 0);
+        return 1;
+    }
+    if (strcmp(command, "/upload") == 0 && first && rest && proto_parse_id(first, ids))
+    {
+        char* path = strtok(rest, " ");
+        return upload_file(ids, path, strtok(NULL, " "));
+    }
+    if (strcmp(command, "/download") == 0 && first && rest && proto_parse_id(first, ids))
+    {
+        return start_download(ids, rest);
     }
 
-    socket_t socketFD = create_socket();
-    if (socketFD == INVALID_SOCKET) {
-        free(addrinfo_result);
-        WSACleanup();
-        return EXIT_FAILURE;
+    printf("Commands: /hello <user-id> <device-id>, /join <conversation-id> direct|group|broadcast,\n"
+        "          /leave <conversation-id>, /to <conversation-id> <message>,\n"
+        "          /history <conversation-id> [before-seq],\n"
+        "          /receipt <conversation-id> delivered|read <from-seq> [to-seq],\n"
+        "          /send <device-id> <message>, /ack <seq>,\n"
+        "          /prekeys <count>, /claim <device-id>,\n"
+        "          /upload <conversation-id> <file> [blob-id to resume], /download <blob-id> <file>\n");
+    return 1;
+}
+
+// Everything but conversation and device messages, which print_message gets.
+static struct ProtoDispatcher g_frames;
+
+static int print_frame(void* context, const struct ProtoFrame* frame)
+{
+    proto_handler_fn handler = g_frames.handlers[frame->opcode];
+    return handler ? handler(context, frame) : 0;
+}
+
+static void print_state(void* context, enum ChatClientState state, uint32_t retryMs)
+{
+    (void)context;
+    if (state == CHATCLIENT_CONNECTED)
+    {
+        printf("Connected\n");
+    }
+    else if (state == CHATCLIENT_DISCONNECTED)
+    {
+        printf("\nDisconnected; reconnecting in %u ms\n", (unsigned)retryMs);
     }
+}
 
-    int result = connect(socketFD, (struct sockaddr*)addrinfo_result, sizeof(struct sockaddr_in));
-    if (result == SOCKET_ERROR) {
-        print_last_error("connect");
-        free(addrinfo_result);
-        closesocket(socketFD);
-        WSACleanup();
-        return EXIT_FAILURE;
+// Reads one line of any length from stdin into *line, growing it as needed
+// and dropping the newline. Returns its length, or -1 at end of input.
+static long read_line(char** line, size_t* capacity)
+{
+    size_t length = 0;
+    while (1)
+    {
+        if (*capacity - length < 2)
+        {
+            size_t grown = *capacity ? *capacity * 2 : BUFFER_SIZE;
+            char* bigger = (char*)realloc(*line, grown);
+            if (!bigger)
+            {
+                return -1;
+            }
+            *line = bigger;
+            *capacity = grown;
+        }
+        if (!fgets(*line + length, (int)(*capacity - length), stdin))
+        {
+            return length > 0 ? (long)length : -1;
+        }
+        length += strlen(*line + length);
+        if (length > 0 && (*line)[length - 1] == '\n')
+        {
+            (*line)[--length] = '\0';
+            return (long)length;
+        }
+    }
+}
+
+int main()
+{
+
+    int iResult = socket_startup();
+    if (iResult != 0) {
+        return 1;
     }
-    printf("Connected to %s:%d\n", ip, port);
     
-    pthread_t receiverThread;
-    int threadErr = pthread_create(&receiverThread, NULL, receive_messages, &socketFD);
-    if (threadErr != 0)
-    {
-        fprintf(stderr, "Failed to create receiver thread: %d\n", threadErr);
-        free(addrinfo_result);
-        closesocket(socketFD);
-        WSACleanup();
+    srand((unsigned)time(NULL));
+    proto_dispatcher_init(&g_frames);
+    proto_register(&g_frames, PROTO_OP_CHAT, print_chat);
+    proto_register(&g_frames, PROTO_OP_HISTORY, print_history);
+    proto_register(&g_frames, PROTO_OP_PREKEY_UPLOAD, print_prekey_upload);
+    proto_register(&g_frames, PROTO_OP_PREKEY_CLAIM, print_prekey_claim);
+    proto_register(&g_frames, PROTO_OP_PREKEY_LOW, print_prekey_low);
+    proto_register(&g_frames, PROTO_OP_PRESENCE, print_presence);
+    proto_register(&g_frames, PROTO_OP_RECEIPT, print_receipts);
+    proto_register(&g_frames, PROTO_OP_BLOB_PUT, print_blob_put);
+    proto_register(&g_frames, PROTO_OP_BLOB_DATA, save_blob_data);
+
+    // Device messages wait for /ack; compression is asked for on every connection.
+    struct ChatClientConfig config;
+    chatclient_default_config(&config);
+    config.autoAck = false;
+    struct ChatClientHandlers handlers;
+    handlers.context = NULL;
+    handlers.message = print_message;
+    handlers.frame = print_frame;
+    handlers.state = print_state;
+    printf("Connecting to %s:%d\n", config.host, config.port);
+    g_client = chatclient_create(&config, &handlers);
+    if (!g_client)
+    {
+        fprintf(stderr, "Failed to start the client\n");
+        socket_cleanup();
         return EXIT_FAILURE;
     }
 
-    char line[BUFFER_SIZE];
+    char* line = NULL;
+    size_t lineCapacity = 0;
     printf("Enter message to send(type \"exit\" to exit):\n");
     while(1)
     {
-        if (!fgets(line, sizeof(line), stdin))
+        long lineLength = read_line(&line, &lineCapacity);
+        if (lineLength < 0)
         {
             break;
         }
-        size_t charCount = strlen(line);
-        if (charCount > 0 && line[charCount - 1] == '\n')
-        {
-            line[charCount - 1] = '\0';
-            --charCount;
-        }
+        size_t charCount = (size_t)lineLength;
         if (charCount == 0)
         {
             continue;
@@ -99,39 +692,24 @@ int main()
         {
             break;
         }
-        // #can you send data and the info of the client socket
-        printf("Sending data to %s:%d\n", ip, port);
-        printf("Client socket info:\n");
-        print_socket_info(socketFD);
-
-        size_t total_sent = 0;
-        while (total_sent < charCount)
+        if (send_command(line) == 0)
         {
-            int amountWasSent = send(socketFD, line + total_sent, (int)(charCount - total_sent), 0);
-            if (amountWasSent == SOCKET_ERROR)
-            {
-                print_last_error("send");
-                free(addrinfo_result);
-                shutdown(socketFD, SD_BOTH);
-                pthread_join(receiverThread, NULL);
-                closesocket(socketFD);
-                WSACleanup();
-                return EXIT_FAILURE;
-            }
-            total_sent += (size_t)amountWasSent;
+            send_frame(PROTO_OP_CHAT, NULL, 0, line, charCount);
         }
-
     }
     
 
     printf("Exiting...\n");
+    free(line);
 
-    shutdown(socketFD, SD_BOTH);
-    pthread_join(receiverThread, NULL);
+    // Whatever is still queued gets a moment to go out.
+    if (!chatclient_drain(g_client, 2000))
+    {
+        printf("Some messages were not sent\n");
+    }
+    chatclient_destroy(g_client);
 
     printf("\n");
-    free(addrinfo_result);
-    closesocket(socketFD);
-    WSACleanup();
+    socket_cleanup();
     return EXIT_SUCCESS;
 }
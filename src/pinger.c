@@ -1,36 +1,635 @@
-// client.c
-#define WIN32_LEAN_AND_MEAN
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <stdio.h>
+// Endpoint prober: health-checks many TCP endpoints (SCPI instruments by
+// default) at once. Every round connects to all targets concurrently with
+// nonblocking sockets, sends the query and waits for a reply line, each
+// target bounded by its own connect and reply timeouts, so a sweep of
+// 1000 endpoints takes about one timeout, not 1000.
+//
+//   pinger [--port N] [--query TEXT] [--connect-timeout MS] [--timeout MS]
+//          [--interval MS] [--count N] [--parallel N] [--file PATH] [HOST[:PORT] ...]
+//
+// Targets come from the command line and from --file, one HOST[:PORT] per
+// line ('#' starts a comment); names are resolved once, at startup. An
+// empty --query only checks that the port accepts connections.
+//
+// Rounds start every --interval; --count 0 probes until interrupted, and
+// an interrupt lets the round in progress finish. Each round prints one
+// line; at the end every target gets its probes, failures and reply
+// latency (connect to reply line): min, average, percentiles over the last
+// PINGER_WINDOW replies, and max. Exits non-zero if any target failed its
+// last probe.
 
-int main(void) {
-    WSADATA wsa;
-    SOCKET sock;
-    struct sockaddr_in addr;
-    char buf[256];
-    int len;
+#include "socketutil.h"
 
-    WSAStartup(MAKEWORD(2,2), &wsa);
+#include <signal.h>
+#include <time.h>
+#ifdef _WIN32
+#define poll WSAPoll
+#define SOCKET_CONNECT_PENDING(err) ((err) == WSAEWOULDBLOCK)
+#define SOCKET_REFUSED(err) ((err) == WSAECONNREFUSED)
+#else
+#include <poll.h>
+#include <sys/resource.h>
+#define SOCKET_CONNECT_PENDING(err) ((err) == EINPROGRESS)
+#define SOCKET_REFUSED(err) ((err) == ECONNREFUSED)
+#endif
 
-    sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(5025);
-    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+#define PINGER_DEFAULT_PORT 5025
+#define PINGER_DEFAULT_QUERY "*IDN?\n"
+#define PINGER_DEFAULT_CONNECT_TIMEOUT_MS 1000
+#define PINGER_DEFAULT_TIMEOUT_MS 2000
+#define PINGER_DEFAULT_INTERVAL_MS 10000
+#define PINGER_DEFAULT_PARALLEL 1000
+// Reply latencies kept per target for the percentiles.
+#define PINGER_WINDOW 1024
+// Longest reply kept; a reply filling it counts as complete.
+#define PINGER_REPLY_SIZE 256
 
-    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
-        printf("connect error\n");
-        return 1;
+enum ProbeState {
+    PROBE_IDLE,
+    PROBE_CONNECTING,
+    PROBE_WAITING           // connected; query (partly) sent, reply line awaited
+};
+
+struct ProbeTarget {
+    char* name;             // as given, for the report
+    struct sockaddr_in address;
+
+    socket_t fd;
+    enum ProbeState state;
+    uint64_t startUs;
+    uint64_t deadlineUs;
+    size_t querySent;
+    char reply[PINGER_REPLY_SIZE];
+    size_t replyLength;
+
+    uint64_t probes;
+    uint64_t failures;
+    bool up;                // last probe answered
+    const char* lastError;
+    char lastReply[PINGER_REPLY_SIZE];
+    uint64_t connectTotalUs;
+    uint64_t totalUs;       // over answered probes
+    uint64_t minUs;
+    uint64_t maxUs;
+    uint32_t window[PINGER_WINDOW];
+    size_t windowCount;
+    size_t windowNext;
+};
+
+struct PingerConfig {
+    int port;
+    const char* query;
+    size_t queryLength;
+    uint32_t connectTimeoutMs;
+    uint32_t timeoutMs;
+    uint32_t intervalMs;
+    uint64_t count;         // rounds; 0 forever
+    size_t parallel;        // probes in flight at once
+};
+
+static struct PingerConfig g_config;
+static struct ProbeTarget* g_targets;
+static size_t g_targetCount;
+static size_t g_targetCapacity;
+static volatile sig_atomic_t g_interrupted;
+
+static uint64_t now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000ULL + (uint64_t)now.tv_nsec / 1000;
+}
+
+static void on_interrupt(int signal)
+{
+    (void)signal;
+    g_interrupted = 1;
+}
+
+static void sleep_ms(uint64_t ms)
+{
+#ifdef _WIN32
+    Sleep((DWORD)ms);
+#else
+    struct timespec delay = { (time_t)(ms / 1000), (long)(ms % 1000) * 1000000L };
+    nanosleep(&delay, NULL);
+#endif
+}
+
+static void raise_fd_limit(void)
+{
+#ifndef _WIN32
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+#endif
+}
+
+// Parses HOST[:PORT] and resolves HOST to an IPv4 address.
+static bool add_target(const char* spec)
+{
+    char host[256];
+    int port = g_config.port;
+    const char* colon = strrchr(spec, ':');
+    size_t hostLength = colon ? (size_t)(colon - spec) : strlen(spec);
+    if (hostLength == 0 || hostLength >= sizeof(host)) {
+        return false;
+    }
+    memcpy(host, spec, hostLength);
+    host[hostLength] = '\0';
+    if (colon) {
+        char* end;
+        long value = strtol(colon + 1, &end, 10);
+        if (*end != '\0' || value <= 0 || value > 65535) {
+            return false;
+        }
+        port = (int)value;
     }
 
-    send(sock, "*IDN?\n", 6, 0);
-    len = recv(sock, buf, sizeof(buf)-1, 0);
-    if (len > 0) {
-        buf[len] = '\0';
-        printf("Yanit: %s", buf);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &address.sin_addr) != 1) {
+        struct addrinfo hints;
+        struct addrinfo* result = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, NULL, &hints, &result) != 0 || !result) {
+            fprintf(stderr, "Cannot resolve %s\n", host);
+            return false;
+        }
+        address.sin_addr = ((struct sockaddr_in*)result->ai_addr)->sin_addr;
+        freeaddrinfo(result);
     }
 
-    closesocket(sock);
-    WSACleanup();
-    return 0;
+    if (g_targetCount == g_targetCapacity) {
+        size_t capacity = g_targetCapacity ? g_targetCapacity * 2 : 64;
+        struct ProbeTarget* grown = (struct ProbeTarget*)realloc(g_targets, capacity * sizeof(*grown));
+        if (!grown) {
+            return false;
+        }
+        g_targets = grown;
+        g_targetCapacity = capacity;
+    }
+    struct ProbeTarget* target = &g_targets[g_targetCount];
+    memset(target, 0, sizeof(*target));
+    target->name = (char*)malloc(strlen(spec) + 1);
+    if (!target->name) {
+        return false;
+    }
+    strcpy(target->name, spec);
+    target->address = address;
+    target->fd = INVALID_SOCKET;
+    target->state = PROBE_IDLE;
+    target->minUs = UINT64_MAX;
+    ++g_targetCount;
+    return true;
+}
+
+static bool add_targets_from_file(const char* path)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+    char line[512];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        char* comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char* start = line;
+        while (*start == ' ' || *start == '\t') {
+            ++start;
+        }
+        char* end = start + strlen(start);
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')) {
+            --end;
+        }
+        *end = '\0';
+        if (*start != '\0' && !add_target(start)) {
+            fprintf(stderr, "Bad target in %s: %s\n", path, start);
+            ok = false;
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+static void finish_probe(struct ProbeTarget* target, uint64_t nowUs, const char* error)
+{
+    if (target->fd != INVALID_SOCKET) {
+        closesocket(target->fd);
+        target->fd = INVALID_SOCKET;
+    }
+    target->state = PROBE_IDLE;
+    ++target->probes;
+    target->up = error == NULL;
+    target->lastError = error;
+    if (error) {
+        ++target->failures;
+        return;
+    }
+
+    uint64_t latency = nowUs - target->startUs;
+    target->totalUs += latency;
+    if (latency < target->minUs) {
+        target->minUs = latency;
+    }
+    if (latency > target->maxUs) {
+        target->maxUs = latency;
+    }
+    target->window[target->windowNext] = latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency;
+    target->windowNext = (target->windowNext + 1) % PINGER_WINDOW;
+    if (target->windowCount < PINGER_WINDOW) {
+        ++target->windowCount;
+    }
+
+    // The reply without its line ending.
+    size_t length = target->replyLength;
+    while (length > 0 && (target->reply[length - 1] == '\n' || target->reply[length - 1] == '\r')) {
+        --length;
+    }
+    memcpy(target->lastReply, target->reply, length);
+    target->lastReply[length] = '\0';
+}
+
+static void connected(struct ProbeTarget* target, uint64_t nowUs)
+{
+    target->connectTotalUs += nowUs - target->startUs;
+    if (g_config.queryLength == 0) {
+        finish_probe(target, nowUs, NULL);
+        return;
+    }
+    target->state = PROBE_WAITING;
+    target->deadlineUs = nowUs + (uint64_t)g_config.timeoutMs * 1000;
+    target->querySent = 0;
+    target->replyLength = 0;
+}
+
+// Returns false if no socket could be had; the probe is retried later.
+static bool start_probe(struct ProbeTarget* target)
+{
+    target->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (target->fd == INVALID_SOCKET) {
+        return false;
+    }
+    uint64_t nowUs = now_us();
+    target->startUs = nowUs;
+    if (set_socket_nonblocking(target->fd) != 0) {
+        finish_probe(target, nowUs, "socket error");
+        return true;
+    }
+    int one = 1;
+    setsockopt(target->fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+    if (connect(target->fd, (struct sockaddr*)&target->address, sizeof(target->address)) == 0) {
+        connected(target, nowUs);
+        return true;
+    }
+    int error = WSAGetLastError();
+    if (!SOCKET_CONNECT_PENDING(error)) {
+        finish_probe(target, nowUs, SOCKET_REFUSED(error) ? "refused" : "connect failed");
+        return true;
+    }
+    target->state = PROBE_CONNECTING;
+    target->deadlineUs = nowUs + (uint64_t)g_config.connectTimeoutMs * 1000;
+    return true;
+}
+
+static void finish_connect(struct ProbeTarget* target, uint64_t nowUs)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(target->fd, SOL_SOCKET, SO_ERROR, (char*)&error, &length) != 0) {
+        finish_probe(target, nowUs, "connect failed");
+    } else if (error != 0) {
+        finish_probe(target, nowUs, SOCKET_REFUSED(error) ? "refused" : "connect failed");
+    } else {
+        connected(target, nowUs);
+    }
+}
+
+static void send_query(struct ProbeTarget* target, uint64_t nowUs)
+{
+    while (target->querySent < g_config.queryLength) {
+        int sent = send(target->fd, g_config.query + target->querySent,
+            (int)(g_config.queryLength - target->querySent), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (!SOCKET_WOULD_BLOCK(WSAGetLastError())) {
+                finish_probe(target, nowUs, "send failed");
+            }
+            return;
+        }
+        target->querySent += (size_t)sent;
+    }
+}
+
+// A reply is complete at its first newline, when it fills the buffer, or
+// when the peer closes after sending something.
+static void read_reply(struct ProbeTarget* target, uint64_t nowUs)
+{
+    while (true) {
+        size_t room = sizeof(target->reply) - 1 - target->replyLength;
+        int received = recv(target->fd, target->reply + target->replyLength, (int)room, 0);
+        if (received < 0) {
+            if (!SOCKET_WOULD_BLOCK(WSAGetLastError())) {
+                finish_probe(target, nowUs, "recv failed");
+            }
+            return;
+        }
+        if (received == 0) {
+            finish_probe(target, nowUs, target->replyLength > 0 ? NULL : "closed");
+            return;
+        }
+        bool line = memchr(target->reply + target->replyLength, '\n', (size_t)received) != NULL;
+        target->replyLength += (size_t)received;
+        if (line || target->replyLength == sizeof(target->reply) - 1) {
+            finish_probe(target, nowUs, NULL);
+            return;
+        }
+    }
+}
+
+static void handle_events(struct ProbeTarget* target, short events, uint64_t nowUs)
+{
+    if (target->state == PROBE_CONNECTING) {
+        if (events & (POLLOUT | POLLERR | POLLHUP)) {
+            finish_connect(target, nowUs);
+        }
+        if (target->state != PROBE_WAITING) {
+            return;
+        }
+        // Connected: the query goes out at once, the socket is writable.
+        events = POLLOUT;
+    }
+    if ((events & POLLOUT) && target->querySent < g_config.queryLength) {
+        send_query(target, nowUs);
+    }
+    if (target->state == PROBE_WAITING && (events & (POLLIN | POLLERR | POLLHUP))) {
+        read_reply(target, nowUs);
+    }
+}
+
+// Probes every target once, at most parallel at a time. Returns those up.
+static size_t run_round(struct ProbeTarget** active, struct pollfd* fds)
+{
+    size_t next = 0;
+    size_t inFlight = 0;
+    size_t up = 0;
+    while (next < g_targetCount || inFlight > 0) {
+        while (next < g_targetCount && inFlight < g_config.parallel) {
+            struct ProbeTarget* target = &g_targets[next];
+            if (!start_probe(target)) {
+                if (inFlight > 0) {
+                    break;      // out of descriptors: wait for a probe to finish
+                }
+                finish_probe(target, now_us(), "socket error");
+            }
+            ++next;
+            if (target->state != PROBE_IDLE) {
+                active[inFlight++] = target;
+            } else if (target->up) {
+                ++up;
+            }
+        }
+        if (inFlight == 0) {
+            continue;
+        }
+
+        uint64_t nowUs = now_us();
+        uint64_t until = UINT64_MAX;
+        for (size_t i = 0; i < inFlight; ++i) {
+            struct ProbeTarget* target = active[i];
+            fds[i].fd = target->fd;
+            fds[i].events = target->state == PROBE_CONNECTING || target->querySent < g_config.queryLength
+                ? POLLOUT : POLLIN;
+            fds[i].revents = 0;
+            if (target->deadlineUs < until) {
+                until = target->deadlineUs;
+            }
+        }
+        int waitMs = until <= nowUs ? 0 : (int)((until - nowUs + 999) / 1000);
+        if (poll(fds, (unsigned)inFlight, waitMs) < 0) {
+#ifndef _WIN32
+            if (errno == EINTR) {
+                continue;
+            }
+#endif
+            print_last_error("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        nowUs = now_us();
+        size_t kept = 0;
+        for (size_t i = 0; i < inFlight; ++i) {
+            struct ProbeTarget* target = active[i];
+            if (fds[i].revents) {
+                handle_events(target, fds[i].revents, nowUs);
+            }
+            if (target->state != PROBE_IDLE && nowUs >= target->deadlineUs) {
+                finish_probe(target, nowUs, target->state == PROBE_CONNECTING ? "connect timeout" : "no reply");
+            }
+            if (target->state != PROBE_IDLE) {
+                active[kept++] = target;
+            } else if (target->up) {
+                ++up;
+            }
+        }
+        inFlight = kept;
+    }
+    return up;
+}
+
+static int compare_uint32(const void* a, const void* b)
+{
+    uint32_t left = *(const uint32_t*)a;
+    uint32_t right = *(const uint32_t*)b;
+    return left < right ? -1 : left > right;
+}
+
+// percentile (0..100) of sorted, nearest rank.
+static uint32_t percentile_of(const uint32_t* sorted, size_t count, double percentile)
+{
+    size_t rank = (size_t)(percentile / 100.0 * (double)count + 0.999999);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void print_report(void)
+{
+    static uint32_t sorted[PINGER_WINDOW];
+    printf("%-24s %7s %6s %8s %8s %8s %8s %8s %8s %8s  %s\n", "target", "probes", "fail", "conn ms", "min ms",
+        "avg ms", "p50 ms", "p95 ms", "p99 ms", "max ms", "last");
+    for (size_t i = 0; i < g_targetCount; ++i) {
+        const struct ProbeTarget* target = &g_targets[i];
+        uint64_t answered = target->probes - target->failures;
+        printf("%-24s %7llu %6llu ", target->name, (unsigned long long)target->probes,
+            (unsigned long long)target->failures);
+        if (answered == 0) {
+            printf("%8s %8s %8s %8s %8s %8s %8s ", "-", "-", "-", "-", "-", "-", "-");
+        } else {
+            memcpy(sorted, target->window, target->windowCount * sizeof(sorted[0]));
+            qsort(sorted, target->windowCount, sizeof(sorted[0]), compare_uint32);
+            printf("%8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f ", target->connectTotalUs / 1000.0 / answered,
+                target->minUs / 1000.0, target->totalUs / 1000.0 / answered,
+                percentile_of(sorted, target->windowCount, 50) / 1000.0,
+                percentile_of(sorted, target->windowCount, 95) / 1000.0,
+                percentile_of(sorted, target->windowCount, 99) / 1000.0, target->maxUs / 1000.0);
+        }
+        if (target->up) {
+            printf(" %s\n", target->lastReply[0] != '\0' ? target->lastReply : "up");
+        } else {
+            printf(" DOWN: %s\n", target->lastError ? target->lastError : "not probed");
+        }
+    }
+}
+
+static void print_usage(const char* program)
+{
+    fprintf(stderr, "Usage: %s [--port N] [--query TEXT] [--connect-timeout MS] [--timeout MS]\n"
+        "          [--interval MS] [--count N] [--parallel N] [--file PATH] [HOST[:PORT] ...]\n", program);
+    fprintf(stderr, "  --port N             port of targets given without one (default %d)\n", PINGER_DEFAULT_PORT);
+    fprintf(stderr, "  --query TEXT         sent after connecting, \\n ending a line (default \"*IDN?\\n\");\n"
+        "                       empty only checks the connect\n");
+    fprintf(stderr, "  --connect-timeout MS connect timeout per target (default %d)\n", PINGER_DEFAULT_CONNECT_TIMEOUT_MS);
+    fprintf(stderr, "  --timeout MS         reply timeout per target, after connecting (default %d)\n",
+        PINGER_DEFAULT_TIMEOUT_MS);
+    fprintf(stderr, "  --interval MS        from one round's start to the next (default %d)\n",
+        PINGER_DEFAULT_INTERVAL_MS);
+    fprintf(stderr, "  --count N            rounds, 0 for no end (default 1)\n");
+    fprintf(stderr, "  --parallel N         probes in flight at once (default %d)\n", PINGER_DEFAULT_PARALLEL);
+    fprintf(stderr, "  --file PATH          more targets, one HOST[:PORT] per line\n");
+}
+
+// Turns the two characters "\n" of a command line query into a newline, in place.
+static size_t unescape_query(char* query)
+{
+    char* out = query;
+    for (const char* in = query; *in; ++in) {
+        if (in[0] == '\\' && in[1] == 'n') {
+            *out++ = '\n';
+            ++in;
+        } else if (in[0] == '\\' && in[1] == 'r') {
+            *out++ = '\r';
+            ++in;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+    return (size_t)(out - query);
+}
+
+static bool parse_args(int argc, char** argv)
+{
+    g_config.port = PINGER_DEFAULT_PORT;
+    g_config.query = PINGER_DEFAULT_QUERY;
+    g_config.queryLength = strlen(PINGER_DEFAULT_QUERY);
+    g_config.connectTimeoutMs = PINGER_DEFAULT_CONNECT_TIMEOUT_MS;
+    g_config.timeoutMs = PINGER_DEFAULT_TIMEOUT_MS;
+    g_config.intervalMs = PINGER_DEFAULT_INTERVAL_MS;
+    g_config.count = 1;
+    g_config.parallel = PINGER_DEFAULT_PARALLEL;
+
+    // Options first: --port applies to every target, wherever it is given.
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            continue;
+        }
+        char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (!value) {
+            return false;
+        }
+        if (strcmp(argv[i], "--port") == 0) {
+            g_config.port = atoi(value);
+        } else if (strcmp(argv[i], "--query") == 0) {
+            g_config.queryLength = unescape_query(value);
+            g_config.query = value;
+        } else if (strcmp(argv[i], "--connect-timeout") == 0) {
+            g_config.connectTimeoutMs = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--timeout") == 0) {
+            g_config.timeoutMs = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--interval") == 0) {
+            g_config.intervalMs = (uint32_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--count") == 0) {
+            g_config.count = strtoull(value, NULL, 10);
+        } else if (strcmp(argv[i], "--parallel") == 0) {
+            g_config.parallel = (size_t)strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--file") != 0) {
+            return false;
+        }
+        ++i;
+    }
+    if (g_config.port <= 0 || g_config.port > 65535 || g_config.connectTimeoutMs == 0 || g_config.timeoutMs == 0
+        || g_config.parallel == 0) {
+        return false;
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--file") == 0) {
+            if (!add_targets_from_file(argv[++i])) {
+                return false;
+            }
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            ++i;
+        } else if (!add_target(argv[i])) {
+            fprintf(stderr, "Bad target: %s\n", argv[i]);
+            return false;
+        }
+    }
+    return g_targetCount > 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (socket_startup() != 0) {
+        return EXIT_FAILURE;
+    }
+    if (!parse_args(argc, argv)) {
+        print_usage(argv[0]);
+        socket_cleanup();
+        return EXIT_FAILURE;
+    }
+    raise_fd_limit();
+    signal(SIGINT, on_interrupt);
+
+    struct ProbeTarget** active = (struct ProbeTarget**)malloc(g_targetCount * sizeof(*active));
+    struct pollfd* fds = (struct pollfd*)malloc(g_targetCount * sizeof(*fds));
+    if (!active || !fds) {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    for (uint64_t round = 1; !g_interrupted && (g_config.count == 0 || round <= g_config.count); ++round) {
+        uint64_t startUs = now_us();
+        size_t up = run_round(active, fds);
+        uint64_t elapsedUs = now_us() - startUs;
+        printf("round %llu: %zu/%zu up in %.3f s\n", (unsigned long long)round, up, g_targetCount,
+            elapsedUs / 1e6);
+        fflush(stdout);
+        if (g_config.count != 0 && round == g_config.count) {
+            break;
+        }
+        uint64_t intervalUs = (uint64_t)g_config.intervalMs * 1000;
+        if (elapsedUs < intervalUs) {
+            sleep_ms((intervalUs - elapsedUs) / 1000);
+        }
+    }
+    print_report();
+
+    bool allUp = true;
+    for (size_t i = 0; i < g_targetCount; ++i) {
+        allUp = allUp && g_targets[i].up;
+        free(g_targets[i].name);
+    }
+    free(g_targets);
+    free(active);
+    free(fds);
+    socket_cleanup();
+    return allUp ? EXIT_SUCCESS : EXIT_FAILURE;
 }
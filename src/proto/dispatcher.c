@@ -0,0 +1,252 @@
+#include "dispatcher.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+static proto_alloc_fn g_alloc = malloc;
+static proto_free_fn g_free = free;
+
+// What every receive buffer has claimed together, against g_recvLimit (0: none).
+static atomic_size_t g_recvBytes;
+static size_t g_recvLimit;
+
+static uint32_t read_u32(const uint8_t* in)
+{
+    return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) | ((uint32_t)in[2] << 8) | (uint32_t)in[3];
+}
+
+void proto_encode_header(uint8_t* out, uint8_t opcode, uint8_t flags, uint32_t length)
+{
+    out[0] = (uint8_t)(length >> 24);
+    out[1] = (uint8_t)(length >> 16);
+    out[2] = (uint8_t)(length >> 8);
+    out[3] = (uint8_t)length;
+    out[4] = opcode;
+    out[5] = flags;
+    out[6] = 0;
+    out[7] = 0;
+}
+
+void proto_dispatcher_init(struct ProtoDispatcher* dispatcher)
+{
+    memset(dispatcher, 0, sizeof(*dispatcher));
+}
+
+void proto_register(struct ProtoDispatcher* dispatcher, uint8_t opcode, proto_handler_fn handler)
+{
+    dispatcher->handlers[opcode] = handler;
+}
+
+void proto_set_allocator(proto_alloc_fn alloc, proto_free_fn release)
+{
+    g_alloc = alloc ? alloc : malloc;
+    g_free = release ? release : free;
+}
+
+void proto_set_recv_limit(size_t bytes)
+{
+    g_recvLimit = bytes;
+}
+
+void proto_recv_init(struct ProtoRecvBuffer* buffer, uint32_t maxPayload)
+{
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->maxPayload = maxPayload ? maxPayload : PROTO_DEFAULT_MAX_PAYLOAD;
+}
+
+void proto_recv_destroy(struct ProtoRecvBuffer* buffer)
+{
+    if (buffer->data) {
+        g_free(buffer->data);
+    }
+    atomic_fetch_sub_explicit(&g_recvBytes, buffer->claimed, memory_order_relaxed);
+    buffer->claimed = 0;
+    buffer->data = NULL;
+    buffer->capacity = 0;
+    buffer->start = 0;
+    buffer->end = 0;
+}
+
+// Capacity the buffer will have grown to once the frame at its start has
+// fully arrived, starting from capacity (frames are slid to the front
+// before every growth).
+static size_t frame_capacity(const struct ProtoRecvBuffer* buffer, size_t capacity)
+{
+    if (buffer->end - buffer->start >= PROTO_HEADER_SIZE) {
+        uint32_t length = read_u32(buffer->data + buffer->start);
+        if (length <= buffer->maxPayload) {
+            size_t needed = PROTO_HEADER_SIZE + (size_t)length + PROTO_RECV_CHUNK;
+            while (capacity < needed) {
+                capacity *= 2;
+            }
+        }
+    }
+    return capacity;
+}
+
+static uint8_t* reserve_space(struct ProtoRecvBuffer* buffer, size_t* available, bool enforce)
+{
+    buffer->limited = false;
+    size_t pending = buffer->end - buffer->start;
+    // One chunk past what has arrived, whatever length the frame declares:
+    // storage follows the bytes a peer actually sends.
+    size_t wanted = pending + PROTO_RECV_CHUNK;
+
+    // Slide the partial frame to the front before growing; it is at most one frame.
+    if (buffer->start > 0 && buffer->capacity - buffer->end < PROTO_RECV_CHUNK) {
+        memmove(buffer->data, buffer->data + buffer->start, pending);
+        buffer->start = 0;
+        buffer->end = pending;
+    }
+
+    if (buffer->capacity - buffer->start < wanted) {
+        size_t newCapacity = buffer->capacity ? buffer->capacity : PROTO_RECV_CHUNK;
+        while (newCapacity - buffer->start < wanted) {
+            newCapacity *= 2;
+        }
+
+        // The limit is charged for the whole frame once its header is in,
+        // so a buffer that got its share can always finish the frame, and
+        // partial frames never wait on each other. The first chunk is
+        // always granted: small frames keep flowing.
+        size_t claim = frame_capacity(buffer, newCapacity);
+        if (claim > buffer->claimed) {
+            size_t extra = claim - buffer->claimed;
+            size_t total = atomic_fetch_add_explicit(&g_recvBytes, extra, memory_order_relaxed) + extra;
+            if (g_recvLimit > 0 && buffer->capacity > 0 && total > g_recvLimit) {
+                buffer->limited = true;
+                if (enforce) {
+                    atomic_fetch_sub_explicit(&g_recvBytes, extra, memory_order_relaxed);
+                    return NULL;
+                }
+            }
+            buffer->claimed = claim;
+        }
+
+        uint8_t* grown = (uint8_t*)g_alloc(newCapacity);
+        if (!grown) {
+            return NULL;
+        }
+        if (buffer->data) {
+            memcpy(grown, buffer->data, buffer->end);
+            g_free(buffer->data);
+        }
+        buffer->data = grown;
+        buffer->capacity = newCapacity;
+    }
+
+    *available = buffer->capacity - buffer->end;
+    return buffer->data + buffer->end;
+}
+
+uint8_t* proto_recv_reserve(struct ProtoRecvBuffer* buffer, size_t* available)
+{
+    return reserve_space(buffer, available, true);
+}
+
+uint8_t* proto_recv_reserve_received(struct ProtoRecvBuffer* buffer, size_t* available)
+{
+    return reserve_space(buffer, available, false);
+}
+
+void proto_recv_commit(struct ProtoRecvBuffer* buffer, size_t received)
+{
+    buffer->end += received;
+}
+
+int proto_recv_dispatch(struct ProtoRecvBuffer* buffer, const struct ProtoDispatcher* dispatcher, void* context)
+{
+    while (buffer->end - buffer->start >= PROTO_HEADER_SIZE) {
+        const uint8_t* header = buffer->data + buffer->start;
+        uint32_t length = read_u32(header);
+        if (length > buffer->maxPayload) {
+            return PROTO_ERR_TOO_LARGE;
+        }
+        if (buffer->end - buffer->start < PROTO_HEADER_SIZE + (size_t)length) {
+            break;
+        }
+
+        struct ProtoFrame frame;
+        frame.opcode = header[4];
+        frame.flags = header[5];
+        frame.encoding = header[PROTO_ENCODING_OFFSET];
+        frame.length = length;
+        frame.payload = header + PROTO_HEADER_SIZE;
+        if (dispatcher->admit && !dispatcher->admit(context, &frame)) {
+            return PROTO_PAUSED;
+        }
+        buffer->start += PROTO_HEADER_SIZE + (size_t)length;
+        ++buffer->frames;
+        if (frame.encoding != 0 && (!dispatcher->decode || !dispatcher->decode(context, &frame))) {
+            return PROTO_ERR_DECODE;
+        }
+
+        proto_handler_fn handler = dispatcher->handlers[frame.opcode];
+        if (!handler) {
+            handler = dispatcher->fallback;
+        }
+        if (handler && handler(context, &frame) != 0) {
+            return PROTO_ERR_HANDLER;
+        }
+    }
+
+    if (buffer->start == buffer->end) {
+        buffer->start = 0;
+        buffer->end = 0;
+    }
+    return PROTO_OK;
+}
+
+void proto_recv_release_idle(struct ProtoRecvBuffer* buffer)
+{
+    if (buffer->data && buffer->start == buffer->end) {
+        proto_recv_destroy(buffer);
+    }
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+bool proto_parse_id(const char* text, uint8_t* id)
+{
+    size_t count = 0;
+    while (*text && count < PROTO_ID_SIZE) {
+        if (*text == '-') {
+            ++text;
+            continue;
+        }
+        int high = hex_value(text[0]);
+        int low = high < 0 ? -1 : hex_value(text[1]);
+        if (low < 0) {
+            return false;
+        }
+        id[count++] = (uint8_t)((high << 4) | low);
+        text += 2;
+    }
+    return count == PROTO_ID_SIZE && *text == '\0';
+}
+
+void proto_format_id(const uint8_t* id, char* out)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < PROTO_ID_SIZE; ++i) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) {
+            *out++ = '-';
+        }
+        *out++ = digits[id[i] >> 4];
+        *out++ = digits[id[i] & 0x0f];
+    }
+    *out = '\0';
+}
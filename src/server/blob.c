@@ -0,0 +1,510 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "blob.h"
+#include "logger.h"
+#include "metrics.h"
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define BLOB_PART_SUFFIX ".part"
+
+struct BlobStore {
+    struct BlobConfig config;
+    char* directory;
+    int directoryFd;
+    atomic_uint_fast64_t usedBytes; // files on disk plus what uploads reserved
+
+    // Publisher thread and its queue of complete uploads, oldest first.
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct BlobPublish* queueHead;
+    struct BlobPublish* queueTail;
+    bool stopping;
+    pthread_t thread;
+    blob_published_fn onPublished;
+    void* context;
+};
+
+static void encode_be(uint8_t* out, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        out[i] = (uint8_t)(value >> (8 * (size - 1 - i)));
+    }
+}
+
+// "<hex id>" plus suffix, relative to the store's directory.
+static void blob_name(const uint8_t* id, const char* suffix, char* out, size_t outSize)
+{
+    for (size_t i = 0; i < PROTO_ID_SIZE; ++i) {
+        snprintf(out + 2 * i, 3, "%02x", id[i]);
+    }
+    snprintf(out + 2 * PROTO_ID_SIZE, outSize - 2 * PROTO_ID_SIZE, "%s", suffix);
+}
+
+static bool is_part_name(const char* name)
+{
+    size_t length = strlen(name);
+    return length > strlen(BLOB_PART_SUFFIX)
+        && strcmp(name + length - strlen(BLOB_PART_SUFFIX), BLOB_PART_SUFFIX) == 0;
+}
+
+// Deletes a part file last written before cutoff, unless an upload holds it.
+// One that opens it meanwhile finds it unlinked once it has the lock, and is
+// refused. Returns the bytes freed.
+static uint64_t expire_part(struct BlobStore* store, const char* name, time_t cutoff)
+{
+    int fd = openat(store->directoryFd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat info;
+    uint64_t freed = 0;
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0 && fstat(fd, &info) == 0 && info.st_nlink > 0
+        && info.st_mtime < cutoff && unlinkat(store->directoryFd, name, 0) == 0) {
+        freed = (uint64_t)info.st_size;
+        metrics_add(METRIC_BLOB_PARTS_EXPIRED, 1);
+    }
+    close(fd);
+    return freed;
+}
+
+// Expires stale part files and, when counting, returns the bytes of
+// everything else in the store.
+static uint64_t scan_directory(struct BlobStore* store, bool count)
+{
+    int fd = dup(store->directoryFd);
+    DIR* dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        log_os_error("blob scan");
+        return 0;
+    }
+    rewinddir(dir);
+    time_t cutoff = time(NULL) - (time_t)store->config.partExpirySeconds;
+    uint64_t bytes = 0;
+    uint64_t freed = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        struct stat info;
+        if (entry->d_name[0] == '.' || fstatat(store->directoryFd, entry->d_name, &info, 0) != 0
+            || !S_ISREG(info.st_mode)) {
+            continue;
+        }
+        uint64_t expired = 0;
+        if (store->config.partExpirySeconds > 0 && is_part_name(entry->d_name) && info.st_mtime < cutoff) {
+            expired = expire_part(store, entry->d_name, cutoff);
+        }
+        freed += expired;
+        bytes += expired > 0 ? 0 : (uint64_t)info.st_size;
+    }
+    closedir(dir);
+    if (freed > 0 && !count) {
+        atomic_fetch_sub(&store->usedBytes, freed);
+    }
+    if (freed > 0) {
+        log_info("blob store: expired %llu bytes of abandoned uploads", (unsigned long long)freed);
+    }
+    return bytes;
+}
+
+// Syncs and renames each upload of the batch, then makes the renames
+// durable with one directory fsync.
+static void publish_batch(struct BlobStore* store, struct BlobPublish* batch)
+{
+    for (struct BlobPublish* publish = batch; publish; publish = publish->next) {
+        char part[2 * PROTO_ID_SIZE + sizeof(BLOB_PART_SUFFIX)];
+        char name[2 * PROTO_ID_SIZE + 1];
+        blob_name(publish->id, BLOB_PART_SUFFIX, part, sizeof(part));
+        blob_name(publish->id, "", name, sizeof(name));
+        publish->ok = fdatasync(publish->fd) == 0
+            && renameat(store->directoryFd, part, store->directoryFd, name) == 0;
+        if (!publish->ok) {
+            log_os_error("blob publish");
+        }
+    }
+    bool synced = fsync(store->directoryFd) == 0;
+    if (!synced) {
+        log_os_error("blob directory sync");
+    }
+
+    while (batch) {
+        struct BlobPublish* publish = batch;
+        batch = batch->next;
+        publish->ok = publish->ok && synced;
+        close(publish->fd);
+        atomic_store(&publish->done, true);
+        blob_publish_release(publish);
+    }
+    if (store->onPublished) {
+        store->onPublished(store->context);
+    }
+}
+
+static void* publisher_thread(void* arg)
+{
+    struct BlobStore* store = (struct BlobStore*)arg;
+    unsigned interval = BLOB_SWEEP_INTERVAL_S;
+    if (store->config.partExpirySeconds > 0 && store->config.partExpirySeconds < interval) {
+        interval = store->config.partExpirySeconds;
+    }
+    struct timespec sweepAt;
+    clock_gettime(CLOCK_REALTIME, &sweepAt);
+    sweepAt.tv_sec += interval;
+
+    pthread_mutex_lock(&store->mutex);
+    while (true) {
+        bool sweep = false;
+        while (!store->queueHead && !store->stopping && !sweep) {
+            if (store->config.partExpirySeconds > 0) {
+                sweep = pthread_cond_timedwait(&store->cond, &store->mutex, &sweepAt) == ETIMEDOUT;
+            } else {
+                pthread_cond_wait(&store->cond, &store->mutex);
+            }
+        }
+        struct BlobPublish* batch = store->queueHead;
+        store->queueHead = NULL;
+        store->queueTail = NULL;
+        bool stopping = store->stopping;
+        pthread_mutex_unlock(&store->mutex);
+
+        if (batch) {
+            publish_batch(store, batch);
+        }
+        if (stopping) {
+            return NULL;
+        }
+        if (sweep) {
+            scan_directory(store, false);
+            clock_gettime(CLOCK_REALTIME, &sweepAt);
+            sweepAt.tv_sec += interval;
+        }
+        pthread_mutex_lock(&store->mutex);
+    }
+}
+
+struct BlobStore* blob_open(const struct BlobConfig* config, blob_published_fn onPublished, void* context)
+{
+    if (mkdir(config->directory, 0700) != 0 && errno != EEXIST) {
+        perror("mkdir blobs");
+        return NULL;
+    }
+    struct BlobStore* store = (struct BlobStore*)calloc(1, sizeof(*store));
+    if (!store) {
+        return NULL;
+    }
+    store->config = *config;
+    store->onPublished = onPublished;
+    store->context = context;
+    store->directory = strdup(config->directory);
+    store->directoryFd = open(config->directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (!store->directory || store->directoryFd < 0) {
+        if (store->directoryFd >= 0) {
+            close(store->directoryFd);
+        }
+        free(store->directory);
+        free(store);
+        return NULL;
+    }
+    atomic_init(&store->usedBytes, scan_directory(store, true));
+    if (config->quotaBytes > 0 && atomic_load(&store->usedBytes) > config->quotaBytes) {
+        log_warn("blob store holds %llu MiB, over its quota of %llu MiB; uploads are refused",
+            (unsigned long long)(atomic_load(&store->usedBytes) >> 20), (unsigned long long)(config->quotaBytes >> 20));
+    }
+
+    pthread_mutex_init(&store->mutex, NULL);
+    pthread_cond_init(&store->cond, NULL);
+    int err = pthread_create(&store->thread, NULL, publisher_thread, store);
+    if (err != 0) {
+        log_error("pthread_create failed for blob publisher: %d", err);
+        pthread_mutex_destroy(&store->mutex);
+        pthread_cond_destroy(&store->cond);
+        close(store->directoryFd);
+        free(store->directory);
+        free(store);
+        return NULL;
+    }
+    return store;
+}
+
+void blob_close(struct BlobStore* store)
+{
+    if (!store) {
+        return;
+    }
+    pthread_mutex_lock(&store->mutex);
+    store->stopping = true;
+    pthread_cond_signal(&store->cond);
+    pthread_mutex_unlock(&store->mutex);
+    pthread_join(store->thread, NULL);
+    pthread_mutex_destroy(&store->mutex);
+    pthread_cond_destroy(&store->cond);
+
+    close(store->directoryFd);
+    free(store->directory);
+    free(store);
+}
+
+void blob_publish_release(struct BlobPublish* publish)
+{
+    if (atomic_fetch_sub(&publish->refs, 1) == 1) {
+        free(publish);
+    }
+}
+
+// Takes bytes of the quota, or refuses if they do not fit.
+static bool reserve_bytes(struct BlobStore* store, uint64_t bytes)
+{
+    uint64_t used = atomic_load(&store->usedBytes);
+    do {
+        if (store->config.quotaBytes > 0 && used + bytes > store->config.quotaBytes) {
+            metrics_add(METRIC_BLOB_QUOTA_REFUSALS, 1);
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&store->usedBytes, &used, used + bytes));
+    return true;
+}
+
+// Hands the complete upload's file to the publisher thread.
+static int queue_publish(struct BlobStore* store, struct BlobUpload* upload)
+{
+    struct BlobPublish* publish = (struct BlobPublish*)malloc(sizeof(*publish));
+    if (!publish) {
+        log_error("malloc failed while publishing a blob");
+        blob_upload_end(store, upload);
+        return -1;
+    }
+    publish->next = NULL;
+    publish->fd = upload->fd;
+    memcpy(publish->id, upload->id, PROTO_ID_SIZE);
+    publish->size = upload->size;
+    publish->ok = false;
+    atomic_init(&publish->done, false);
+    atomic_init(&publish->refs, 2);
+    upload->fd = -1;
+    upload->publish = publish;
+
+    pthread_mutex_lock(&store->mutex);
+    if (store->queueTail) {
+        store->queueTail->next = publish;
+    } else {
+        store->queueHead = publish;
+    }
+    store->queueTail = publish;
+    pthread_cond_signal(&store->cond);
+    pthread_mutex_unlock(&store->mutex);
+    return 0;
+}
+
+int blob_upload_begin(struct BlobStore* store, struct BlobUpload* upload, const uint8_t* id, uint64_t size)
+{
+    upload->fd = -1;
+    memcpy(upload->id, id, PROTO_ID_SIZE);
+    upload->size = size;
+    upload->stored = 0;
+    upload->reserved = 0;
+    upload->publish = NULL;
+    if (size > store->config.maxBytes) {
+        return -1;
+    }
+
+    char name[2 * PROTO_ID_SIZE + sizeof(BLOB_PART_SUFFIX)];
+    blob_name(id, "", name, sizeof(name));
+    struct stat info;
+    if (fstatat(store->directoryFd, name, &info, 0) == 0) {
+        upload->stored = (uint64_t)info.st_size;
+        return upload->stored == size ? 0 : -1;
+    }
+
+    blob_name(id, BLOB_PART_SUFFIX, name, sizeof(name));
+    int fd = openat(store->directoryFd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log_os_error("blob open");
+        return -1;
+    }
+    // One writer per blob; a second connection is refused, not interleaved,
+    // and so is one that comes while it is being published or expired.
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &info) != 0 || info.st_nlink == 0
+        || (uint64_t)info.st_size > size) {
+        close(fd);
+        return -1;
+    }
+    if (!reserve_bytes(store, size - (uint64_t)info.st_size)) {
+        // Over quota: an empty part is only clutter until it expires.
+        if (info.st_size == 0) {
+            unlinkat(store->directoryFd, name, 0);
+        }
+        close(fd);
+        return -1;
+    }
+    upload->fd = fd;
+    upload->stored = (uint64_t)info.st_size;
+    upload->writebackFrom = upload->stored;
+    upload->reserved = size - upload->stored;
+    if (upload->stored == size) {
+        return queue_publish(store, upload);
+    }
+    return 0;
+}
+
+int blob_upload_write(struct BlobStore* store, struct BlobUpload* upload, uint64_t offset, const uint8_t* data,
+    size_t length)
+{
+    if (upload->fd < 0 || offset != upload->stored || length > upload->size - upload->stored) {
+        return -1;
+    }
+    while (length > 0) {
+        ssize_t written = pwrite(upload->fd, data, length, (off_t)offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_os_error("blob write");
+            blob_upload_end(store, upload);
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+        offset += (uint64_t)written;
+        upload->reserved -= (uint64_t)written;
+        metrics_add(METRIC_BLOB_BYTES_IN, (uint64_t)written);
+    }
+    upload->stored = offset;
+
+    if (upload->stored == upload->size) {
+        return queue_publish(store, upload);
+    }
+    if (upload->stored - upload->writebackFrom >= BLOB_WRITEBACK_BYTES) {
+        sync_file_range(upload->fd, (off_t)upload->writebackFrom, (off_t)(upload->stored - upload->writebackFrom),
+            SYNC_FILE_RANGE_WRITE);
+        upload->writebackFrom = upload->stored;
+    }
+    return 0;
+}
+
+void blob_upload_end(struct BlobStore* store, struct BlobUpload* upload)
+{
+    if (upload->fd >= 0) {
+        close(upload->fd);
+        upload->fd = -1;
+    }
+    if (upload->reserved > 0) {
+        atomic_fetch_sub(&store->usedBytes, upload->reserved);
+        upload->reserved = 0;
+    }
+}
+
+int blob_stream_open(struct BlobStore* store, struct BlobStream* stream, const uint8_t* id, uint64_t offset)
+{
+    char name[2 * PROTO_ID_SIZE + 1];
+    blob_name(id, "", name, sizeof(name));
+    int fd = openat(store->directoryFd, name, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || offset > (uint64_t)info.st_size) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    // The whole file is about to be read in order.
+    posix_fadvise(fd, (off_t)offset, 0, POSIX_FADV_SEQUENTIAL);
+    stream->fd = fd;
+    memcpy(stream->id, id, PROTO_ID_SIZE);
+    stream->size = (uint64_t)info.st_size;
+    stream->offset = offset;
+    stream->inFrame = false;
+    return 0;
+}
+
+// Frames the next chunk: header and prefix in stream->header.
+static void start_frame(struct BlobStream* stream)
+{
+    uint64_t left = stream->size - stream->offset;
+    size_t body = left < BLOB_CHUNK_BYTES ? (size_t)left : BLOB_CHUNK_BYTES;
+    proto_encode_header(stream->header, PROTO_OP_BLOB_DATA, 0, (uint32_t)(BLOB_DATA_PREFIX + body));
+    uint8_t* prefix = stream->header + PROTO_HEADER_SIZE;
+    memcpy(prefix, stream->id, PROTO_ID_SIZE);
+    encode_be(prefix + PROTO_ID_SIZE, stream->size, PROTO_SEQ_SIZE);
+    encode_be(prefix + PROTO_ID_SIZE + PROTO_SEQ_SIZE, stream->offset, PROTO_SEQ_SIZE);
+    stream->headerSent = 0;
+    stream->bodyLeft = body;
+    stream->inFrame = true;
+}
+
+enum BlobSendResult blob_stream_send(struct BlobStream* stream, int socketFd)
+{
+    if (stream->fd < 0) {
+        return BLOB_SEND_DONE;
+    }
+    if (!stream->inFrame) {
+        start_frame(stream);
+    }
+
+    while (stream->headerSent < sizeof(stream->header)) {
+        // MSG_MORE: the header and the start of the body share a segment.
+        metrics_add(METRIC_IO_SYSCALLS, 1);
+        ssize_t sent = send(socketFd, stream->header + stream->headerSent, sizeof(stream->header) - stream->headerSent,
+            MSG_NOSIGNAL | (stream->bodyLeft > 0 ? MSG_MORE : 0));
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? BLOB_SEND_BLOCKED : BLOB_SEND_ERROR;
+        }
+        stream->headerSent += (size_t)sent;
+    }
+    while (stream->bodyLeft > 0) {
+        off_t offset = (off_t)stream->offset;
+        metrics_add(METRIC_IO_SYSCALLS, 1);
+        ssize_t sent = sendfile(socketFd, stream->fd, &offset, stream->bodyLeft);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? BLOB_SEND_BLOCKED : BLOB_SEND_ERROR;
+        }
+        if (sent == 0) {
+            // The file shrank under us: nothing sane left to send.
+            return BLOB_SEND_ERROR;
+        }
+        stream->offset += (uint64_t)sent;
+        stream->bodyLeft -= (size_t)sent;
+        metrics_add(METRIC_BLOB_BYTES_OUT, (uint64_t)sent);
+    }
+
+    stream->inFrame = false;
+    metrics_add(METRIC_FRAMES_OUT, 1);
+    if (stream->offset == stream->size) {
+        blob_stream_close(stream);
+        return BLOB_SEND_DONE;
+    }
+    return BLOB_SEND_FRAME;
+}
+
+void blob_stream_close(struct BlobStream* stream)
+{
+    if (stream->fd >= 0) {
+        close(stream->fd);
+        stream->fd = -1;
+    }
+    stream->inFrame = false;
+}
+
+#endif // __linux__
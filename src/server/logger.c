@@ -0,0 +1,674 @@
+#include "socketutil.h"
+#include "logger.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+#define LOG_RING_SIZE 512           // records per thread; a power of two
+#define LOG_RECORD_ARGS 104         // argument bytes per record; 128-byte records on 64-bit
+#define LOG_MAX_BATCH 4096          // records formatted per write
+#define LOG_OUTPUT_CAPACITY (256 * 1024)
+#define LOG_LINE_MAX 1024
+#define LOG_CACHE_LINE 64
+
+enum LogLevel g_logLevel = LOGGER_DEFAULT_LEVEL;
+
+struct LogRecord {
+    uint64_t timeNs;            // CLOCK_REALTIME
+    const char* format;
+    uint8_t level;
+    bool truncated;             // arguments past argBytes did not fit
+    uint16_t argBytes;
+    uint8_t args[LOG_RECORD_ARGS];
+};
+
+// Single producer (its thread), single consumer (the flusher).
+struct LogRing {
+    atomic_size_t head;         // next record the owner writes
+    char headPad[LOG_CACHE_LINE];
+    atomic_size_t tail;         // next record the flusher reads
+    atomic_uint_fast64_t dropped;
+    atomic_bool closed;         // the owner exited; freed once drained
+    char tailPad[LOG_CACHE_LINE];
+
+    // Owner only.
+    uint64_t sampleCount;
+    time_t sampleSecond;
+    unsigned sampledThisSecond;
+
+    struct LogRing* next;       // g_rings; under g_ringsMutex
+    struct LogRecord records[LOG_RING_SIZE];
+};
+
+// A conversion specification, as far as copying and formatting need it.
+enum LogArgKind {
+    LOG_ARG_NONE,       // "%%"
+    LOG_ARG_SIGNED,
+    LOG_ARG_UNSIGNED,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STRING,
+    LOG_ARG_POINTER
+};
+
+enum LogLength {
+    LOG_LENGTH_INT,
+    LOG_LENGTH_LONG,
+    LOG_LENGTH_LONG_LONG,
+    LOG_LENGTH_SIZE,
+    LOG_LENGTH_MAX,
+    LOG_LENGTH_PTRDIFF,
+    LOG_LENGTH_LONG_DOUBLE
+};
+
+struct LogSpec {
+    const char* start;          // the '%'
+    const char* lengthStart;    // the length modifier, or the conversion when there is none
+    const char* end;            // one past the conversion
+    bool widthStar;
+    bool precisionStar;
+    int precision;              // -1 when not given or '*'
+    enum LogLength length;
+    enum LogArgKind kind;
+    char conversion;
+};
+
+static struct LoggerConfig g_config;
+static atomic_bool g_started;
+static pthread_t g_flusher;
+static pthread_mutex_t g_flushMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_flushCond = PTHREAD_COND_INITIALIZER;
+static bool g_stopping = false;
+
+static pthread_mutex_t g_ringsMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct LogRing* g_rings = NULL;
+static pthread_once_t g_ringKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_ringKey;
+static _Thread_local struct LogRing* t_ring = NULL;
+
+static const char* const g_levelNames[] = { "ERROR", "WARN ", "INFO ", "DEBUG" };
+
+bool logger_parse_level(const char* name, enum LogLevel* level)
+{
+    static const char* const names[] = { "error", "warn", "info", "debug" };
+    for (int i = 0; i <= LOG_LEVEL_DEBUG; ++i) {
+        if (strcmp(name, names[i]) == 0) {
+            *level = (enum LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t realtime_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// Parses the specification at *format == '%'.
+static void parse_spec(const char* format, struct LogSpec* spec)
+{
+    const char* p = format + 1;
+    spec->start = format;
+    spec->widthStar = false;
+    spec->precisionStar = false;
+    spec->precision = -1;
+    spec->length = LOG_LENGTH_INT;
+
+    while (*p && strchr("-+ #0'", *p)) {
+        ++p;
+    }
+    if (*p == '*') {
+        spec->widthStar = true;
+        ++p;
+    } else {
+        while (*p >= '0' && *p <= '9') {
+            ++p;
+        }
+    }
+    if (*p == '.') {
+        ++p;
+        if (*p == '*') {
+            spec->precisionStar = true;
+            ++p;
+        } else {
+            spec->precision = 0;
+            while (*p >= '0' && *p <= '9') {
+                spec->precision = spec->precision * 10 + (*p - '0');
+                ++p;
+            }
+        }
+    }
+
+    spec->lengthStart = p;
+    if (p[0] == 'h') {
+        p += p[1] == 'h' ? 2 : 1;
+    } else if (p[0] == 'l') {
+        spec->length = p[1] == 'l' ? LOG_LENGTH_LONG_LONG : LOG_LENGTH_LONG;
+        p += p[1] == 'l' ? 2 : 1;
+    } else if (*p == 'z') {
+        spec->length = LOG_LENGTH_SIZE;
+        ++p;
+    } else if (*p == 'j') {
+        spec->length = LOG_LENGTH_MAX;
+        ++p;
+    } else if (*p == 't') {
+        spec->length = LOG_LENGTH_PTRDIFF;
+        ++p;
+    } else if (*p == 'L') {
+        spec->length = LOG_LENGTH_LONG_DOUBLE;
+        ++p;
+    }
+
+    spec->conversion = *p;
+    spec->end = *p ? p + 1 : p;
+    switch (*p) {
+    case 'd': case 'i': case 'c':
+        spec->kind = LOG_ARG_SIGNED;
+        break;
+    case 'u': case 'o': case 'x': case 'X':
+        spec->kind = LOG_ARG_UNSIGNED;
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        spec->kind = LOG_ARG_DOUBLE;
+        break;
+    case 's':
+        spec->kind = LOG_ARG_STRING;
+        break;
+    case 'p':
+        spec->kind = LOG_ARG_POINTER;
+        break;
+    default:
+        spec->kind = LOG_ARG_NONE;     // "%%", or unsupported: printed as is
+        break;
+    }
+}
+
+static int64_t read_signed(va_list* args, enum LogLength length)
+{
+    switch (length) {
+    case LOG_LENGTH_LONG: return va_arg(*args, long);
+    case LOG_LENGTH_LONG_LONG: return va_arg(*args, long long);
+    case LOG_LENGTH_SIZE: return (int64_t)va_arg(*args, size_t);
+    case LOG_LENGTH_MAX: return va_arg(*args, intmax_t);
+    case LOG_LENGTH_PTRDIFF: return va_arg(*args, ptrdiff_t);
+    default: return va_arg(*args, int);
+    }
+}
+
+static uint64_t read_unsigned(va_list* args, enum LogLength length)
+{
+    switch (length) {
+    case LOG_LENGTH_LONG: return va_arg(*args, unsigned long);
+    case LOG_LENGTH_LONG_LONG: return va_arg(*args, unsigned long long);
+    case LOG_LENGTH_SIZE: return va_arg(*args, size_t);
+    case LOG_LENGTH_MAX: return va_arg(*args, uintmax_t);
+    case LOG_LENGTH_PTRDIFF: return (uint64_t)va_arg(*args, ptrdiff_t);
+    default: return va_arg(*args, unsigned int);
+    }
+}
+
+static bool put_bytes(struct LogRecord* record, const void* data, size_t size)
+{
+    if (record->argBytes + size > LOG_RECORD_ARGS) {
+        record->truncated = true;
+        return false;
+    }
+    memcpy(record->args + record->argBytes, data, size);
+    record->argBytes = (uint16_t)(record->argBytes + size);
+    return true;
+}
+
+// Copies the arguments format consumes, in order: '*' values as int32,
+// numbers as 8 bytes, strings as a length byte and their bytes.
+static void encode_args(struct LogRecord* record, const char* format, va_list* args)
+{
+    record->argBytes = 0;
+    record->truncated = false;
+    for (const char* p = format; *p; ++p) {
+        if (*p != '%') {
+            continue;
+        }
+        struct LogSpec spec;
+        parse_spec(p, &spec);
+        p = spec.end - 1;
+        if (spec.kind == LOG_ARG_NONE) {
+            continue;
+        }
+
+        int32_t star = 0;
+        if (spec.widthStar) {
+            star = (int32_t)va_arg(*args, int);
+            if (!put_bytes(record, &star, sizeof(star))) {
+                return;
+            }
+        }
+        int precision = spec.precision;
+        if (spec.precisionStar) {
+            star = (int32_t)va_arg(*args, int);
+            precision = star;
+            if (!put_bytes(record, &star, sizeof(star))) {
+                return;
+            }
+        }
+
+        bool stored;
+        if (spec.kind == LOG_ARG_SIGNED) {
+            int64_t value = read_signed(args, spec.length);
+            stored = put_bytes(record, &value, sizeof(value));
+        } else if (spec.kind == LOG_ARG_UNSIGNED) {
+            uint64_t value = read_unsigned(args, spec.length);
+            stored = put_bytes(record, &value, sizeof(value));
+        } else if (spec.kind == LOG_ARG_DOUBLE) {
+            double value = spec.length == LOG_LENGTH_LONG_DOUBLE ? (double)va_arg(*args, long double)
+                : va_arg(*args, double);
+            stored = put_bytes(record, &value, sizeof(value));
+        } else if (spec.kind == LOG_ARG_POINTER) {
+            uint64_t value = (uint64_t)(uintptr_t)va_arg(*args, void*);
+            stored = put_bytes(record, &value, sizeof(value));
+        } else {
+            const char* text = va_arg(*args, const char*);
+            if (!text) {
+                text = "(null)";
+            }
+            size_t room = LOG_RECORD_ARGS - record->argBytes;
+            if (room < 2) {
+                record->truncated = true;
+                return;
+            }
+            size_t limit = room - 1 < UINT8_MAX ? room - 1 : UINT8_MAX;
+            if (precision >= 0 && (size_t)precision < limit) {
+                limit = (size_t)precision;
+            }
+            size_t length = 0;
+            while (length < limit && text[length]) {
+                ++length;
+            }
+            if (length == limit && text[length] && (precision < 0 || (size_t)precision > limit)) {
+                record->truncated = true;
+            }
+            uint8_t lengthByte = (uint8_t)length;
+            put_bytes(record, &lengthByte, 1);
+            put_bytes(record, text, length);
+            stored = !record->truncated;
+        }
+        if (!stored) {
+            return;
+        }
+    }
+}
+
+static void free_ring_key(void* value)
+{
+    struct LogRing* ring = (struct LogRing*)value;
+    atomic_store_explicit(&ring->closed, true, memory_order_release);
+}
+
+static void create_ring_key(void)
+{
+    pthread_key_create(&g_ringKey, free_ring_key);
+}
+
+static struct LogRing* attach_ring(void)
+{
+    struct LogRing* ring = (struct LogRing*)calloc(1, sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->closed, false);
+
+    pthread_once(&g_ringKeyOnce, create_ring_key);
+    pthread_setspecific(g_ringKey, ring);
+    pthread_mutex_lock(&g_ringsMutex);
+    ring->next = g_rings;
+    g_rings = ring;
+    pthread_mutex_unlock(&g_ringsMutex);
+    t_ring = ring;
+    return ring;
+}
+
+static void write_now(enum LogLevel level, const char* format, va_list* args)
+{
+    FILE* stream = level <= LOG_LEVEL_WARN ? stderr : stdout;
+    vfprintf(stream, format, *args);
+    fputc('\n', stream);
+}
+
+void log_write(enum LogLevel level, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    struct LogRing* ring = t_ring;
+    if (!atomic_load_explicit(&g_started, memory_order_acquire) || (!ring && !(ring = attach_ring()))) {
+        write_now(level, format, &args);
+        va_end(args);
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        va_end(args);
+        return;
+    }
+    struct LogRecord* record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    record->timeNs = realtime_ns();
+    record->format = format;
+    record->level = (uint8_t)level;
+    encode_args(record, format, &args);
+    va_end(args);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void log_os_error(const char* label)
+{
+    int err = WSAGetLastError();
+#ifdef _WIN32
+    log_error("%s failed with error: %d", label, err);
+#else
+    log_error("%s failed with error: %d (%s)", label, err, strerror(err));
+#endif
+}
+
+bool log_sample(void)
+{
+    struct LogRing* ring = t_ring;
+    if (!ring && !(ring = attach_ring())) {
+        return false;
+    }
+    unsigned every = g_config.sampleEvery ? g_config.sampleEvery : 1;
+    if (++ring->sampleCount % every != 0) {
+        return false;
+    }
+    if (g_config.sampledPerSecond) {
+        time_t second = time(NULL);
+        if (second != ring->sampleSecond) {
+            ring->sampleSecond = second;
+            ring->sampledThisSecond = 0;
+        }
+        if (ring->sampledThisSecond >= g_config.sampledPerSecond) {
+            return false;
+        }
+        ++ring->sampledThisSecond;
+    }
+    return true;
+}
+
+struct LogOutput {
+    FILE* stream;
+    char* data;
+    size_t length;
+};
+
+static void flush_output(struct LogOutput* output)
+{
+    if (output->length > 0) {
+        fwrite(output->data, 1, output->length, output->stream);
+        fflush(output->stream);
+        output->length = 0;
+    }
+}
+
+static size_t read_arg(const struct LogRecord* record, size_t* offset, void* out, size_t size)
+{
+    if (*offset + size > record->argBytes) {
+        return 0;
+    }
+    memcpy(out, record->args + *offset, size);
+    *offset += size;
+    return size;
+}
+
+// Formats one argument with the record's own specification, rewritten for
+// the stored types: integers as long long, doubles without a length.
+static int format_arg(char* out, size_t capacity, const struct LogRecord* record, size_t* offset,
+    const struct LogSpec* spec)
+{
+    char specText[32];
+    size_t prefix = (size_t)(spec->lengthStart - spec->start);
+    if (prefix + 4 > sizeof(specText)) {
+        return -1;
+    }
+    memcpy(specText, spec->start, prefix);
+    size_t at = prefix;
+    if (spec->kind == LOG_ARG_SIGNED || spec->kind == LOG_ARG_UNSIGNED) {
+        if (spec->conversion != 'c') {
+            specText[at++] = 'l';
+            specText[at++] = 'l';
+        }
+    }
+    specText[at++] = spec->conversion;
+    specText[at] = '\0';
+
+    int32_t stars[2];
+    int starCount = 0;
+    if (spec->widthStar && !read_arg(record, offset, &stars[starCount++], sizeof(int32_t))) {
+        return -1;
+    }
+    if (spec->precisionStar && !read_arg(record, offset, &stars[starCount++], sizeof(int32_t))) {
+        return -1;
+    }
+
+#define LOG_FORMAT_VALUE(value) \
+    (starCount == 0 ? snprintf(out, capacity, specText, value) \
+        : starCount == 1 ? snprintf(out, capacity, specText, stars[0], value) \
+        : snprintf(out, capacity, specText, stars[0], stars[1], value))
+
+    if (spec->kind == LOG_ARG_SIGNED || spec->kind == LOG_ARG_UNSIGNED || spec->kind == LOG_ARG_POINTER) {
+        uint64_t value;
+        if (!read_arg(record, offset, &value, sizeof(value))) {
+            return -1;
+        }
+        if (spec->conversion == 'c') {
+            return LOG_FORMAT_VALUE((int)value);
+        }
+        if (spec->kind == LOG_ARG_POINTER) {
+            return LOG_FORMAT_VALUE((void*)(uintptr_t)value);
+        }
+        return spec->kind == LOG_ARG_SIGNED ? LOG_FORMAT_VALUE((long long)value)
+            : LOG_FORMAT_VALUE((unsigned long long)value);
+    }
+    if (spec->kind == LOG_ARG_DOUBLE) {
+        double value;
+        if (!read_arg(record, offset, &value, sizeof(value))) {
+            return -1;
+        }
+        return LOG_FORMAT_VALUE(value);
+    }
+
+    uint8_t length;
+    char text[LOG_RECORD_ARGS + 1];
+    if (!read_arg(record, offset, &length, 1) || !read_arg(record, offset, text, length)) {
+        return -1;
+    }
+    text[length] = '\0';
+    return LOG_FORMAT_VALUE(text);
+#undef LOG_FORMAT_VALUE
+}
+
+static size_t format_record(char* out, size_t capacity, const struct LogRecord* record)
+{
+    time_t seconds = (time_t)(record->timeNs / 1000000000ULL);
+    struct tm local;
+#ifdef _WIN32
+    localtime_s(&local, &seconds);
+#else
+    localtime_r(&seconds, &local);
+#endif
+    size_t length = strftime(out, capacity, "%Y-%m-%d %H:%M:%S", &local);
+    length += (size_t)snprintf(out + length, capacity - length, ".%03u %s ",
+        (unsigned)(record->timeNs / 1000000ULL % 1000), g_levelNames[record->level]);
+
+    size_t offset = 0;
+    const char* p = record->format;
+    while (*p && length + 1 < capacity) {
+        if (*p != '%') {
+            out[length++] = *p++;
+            continue;
+        }
+        struct LogSpec spec;
+        parse_spec(p, &spec);
+        if (spec.kind == LOG_ARG_NONE) {
+            if (spec.conversion == '%') {
+                out[length++] = '%';
+            }
+            p = spec.end;
+            continue;
+        }
+        int written = format_arg(out + length, capacity - length, record, &offset, &spec);
+        if (written < 0) {
+            break;      // the rest did not fit in the record
+        }
+        length += (size_t)written < capacity - length ? (size_t)written : capacity - length - 1;
+        p = spec.end;
+    }
+    if (record->truncated && length + 4 < capacity) {
+        memcpy(out + length, "...", 3);
+        length += 3;
+    }
+    if (length + 1 >= capacity) {
+        length = capacity - 2;
+    }
+    out[length++] = '\n';
+    return length;
+}
+
+static int compare_records(const void* left, const void* right)
+{
+    const struct LogRecord* a = (const struct LogRecord*)left;
+    const struct LogRecord* b = (const struct LogRecord*)right;
+    return a->timeNs < b->timeNs ? -1 : a->timeNs > b->timeNs;
+}
+
+static void write_batch(struct LogRecord* batch, size_t count, struct LogOutput* out, struct LogOutput* err)
+{
+    qsort(batch, count, sizeof(*batch), compare_records);
+    for (size_t i = 0; i < count; ++i) {
+        struct LogOutput* output = batch[i].level <= LOG_LEVEL_WARN ? err : out;
+        if (LOG_OUTPUT_CAPACITY - output->length < LOG_LINE_MAX) {
+            flush_output(output);
+        }
+        output->length += format_record(output->data + output->length, LOG_LINE_MAX, &batch[i]);
+    }
+}
+
+// Moves every ring's records out in batches, oldest first within a batch,
+// and frees the rings of exited threads once they are empty.
+static void drain_rings(struct LogRecord* batch, struct LogOutput* out, struct LogOutput* err)
+{
+    uint64_t dropped = 0;
+    size_t count = 0;
+
+    pthread_mutex_lock(&g_ringsMutex);
+    struct LogRing** link = &g_rings;
+    while (*link) {
+        struct LogRing* ring = *link;
+        bool closed = atomic_load_explicit(&ring->closed, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head) {
+            if (count == LOG_MAX_BATCH) {
+                write_batch(batch, count, out, err);
+                count = 0;
+            }
+            batch[count++] = ring->records[tail & (LOG_RING_SIZE - 1)];
+            ++tail;
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+        dropped += atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+
+        if (closed) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&g_ringsMutex);
+
+    write_batch(batch, count, out, err);
+    if (dropped > 0) {
+        flush_output(err);
+        int written = snprintf(err->data + err->length, LOG_OUTPUT_CAPACITY - err->length,
+            "logger: dropped %llu record(s) from full rings\n", (unsigned long long)dropped);
+        if (written > 0) {
+            err->length += (size_t)written;
+        }
+    }
+    flush_output(out);
+    flush_output(err);
+}
+
+static void* flusher_thread(void* arg)
+{
+    (void)arg;
+    struct LogRecord* batch = (struct LogRecord*)malloc(LOG_MAX_BATCH * sizeof(*batch));
+    struct LogOutput out = { stdout, (char*)malloc(LOG_OUTPUT_CAPACITY), 0 };
+    struct LogOutput err = { stderr, (char*)malloc(LOG_OUTPUT_CAPACITY), 0 };
+    if (!batch || !out.data || !err.data) {
+        // Callers keep filling their rings; nothing is written until restart.
+        fprintf(stderr, "malloc failed while starting the log flusher\n");
+        free(batch);
+        free(out.data);
+        free(err.data);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_flushMutex);
+    while (!g_stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)(g_config.flushIntervalMs % 1000) * 1000000L;
+        deadline.tv_sec += g_config.flushIntervalMs / 1000 + deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&g_flushCond, &g_flushMutex, &deadline);
+
+        pthread_mutex_unlock(&g_flushMutex);
+        drain_rings(batch, &out, &err);
+        pthread_mutex_lock(&g_flushMutex);
+    }
+    pthread_mutex_unlock(&g_flushMutex);
+
+    drain_rings(batch, &out, &err);
+    free(batch);
+    free(out.data);
+    free(err.data);
+    return NULL;
+}
+
+int logger_start(const struct LoggerConfig* config)
+{
+    g_config = *config;
+    if (g_config.flushIntervalMs == 0) {
+        g_config.flushIntervalMs = LOGGER_DEFAULT_FLUSH_INTERVAL_MS;
+    }
+    g_logLevel = config->level;
+    g_stopping = false;
+
+    int err = pthread_create(&g_flusher, NULL, flusher_thread, NULL);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create failed for the log flusher: %d\n", err);
+        return -1;
+    }
+    atomic_store_explicit(&g_started, true, memory_order_release);
+    return 0;
+}
+
+void logger_stop(void)
+{
+    if (!atomic_exchange(&g_started, false)) {
+        return;
+    }
+    pthread_mutex_lock(&g_flushMutex);
+    g_stopping = true;
+    pthread_cond_signal(&g_flushCond);
+    pthread_mutex_unlock(&g_flushMutex);
+    pthread_join(g_flusher, NULL);
+}
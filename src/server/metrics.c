@@ -0,0 +1,275 @@
+#include "socketutil.h"
+#include "metrics.h"
+#include "logger.h"
+
+#include <stdarg.h>
+#include <time.h>
+
+#define METRICS_RENDER_CAPACITY (64 * 1024)
+#define METRICS_REQUEST_TIMEOUT_MS 1000
+
+struct MetricInfo {
+    const char* name;
+    const char* type;
+    const char* help;
+};
+
+static const struct MetricInfo g_metricInfo[METRIC_COUNT] = {
+    [METRIC_FRAMES_IN] = { "chat_frames_received_total", "counter", "Frames received from clients." },
+    [METRIC_BYTES_IN] = { "chat_bytes_received_total", "counter", "Bytes received from clients." },
+    [METRIC_FRAMES_OUT] = { "chat_frames_sent_total", "counter", "Frames fully written to clients." },
+    [METRIC_BYTES_OUT] = { "chat_bytes_sent_total", "counter", "Bytes written to clients." },
+    [METRIC_SEND_ERRORS] = { "chat_send_errors_total", "counter", "Sends that failed other than by blocking." },
+    [METRIC_QUEUE_DROPS] = { "chat_queue_dropped_frames_total", "counter",
+        "Frames discarded by a full outbound queue." },
+    [METRIC_QUEUED_FRAMES] = { "chat_queued_frames", "gauge", "Frames waiting in outbound queues." },
+    [METRIC_QUEUED_BYTES] = { "chat_queued_bytes", "gauge", "Bytes waiting in outbound queues." },
+    [METRIC_CONNECTIONS_OPENED] = { "chat_connections_opened_total", "counter", "Client connections accepted." },
+    [METRIC_CONNECTIONS_CLOSED] = { "chat_connections_closed_total", "counter", "Client connections closed." },
+    [METRIC_FANOUT_RECIPIENTS] = { NULL, NULL, NULL },      // part of the fan-out histogram
+    [METRIC_REGISTRY_LOCKS] = { "chat_registry_lock_acquisitions_total", "counter",
+        "Acquisitions of the connection registry writer mutex." },
+    [METRIC_REGISTRY_LOCK_CONTENDED] = { "chat_registry_lock_contended_total", "counter",
+        "Registry mutex acquisitions that had to wait." },
+    [METRIC_REGISTRY_LOCK_WAIT_NS] = { "chat_registry_lock_wait_seconds_total", "counter",
+        "Time spent waiting for the registry mutex." },
+    [METRIC_REGISTRY_LOCK_HOLD_NS] = { "chat_registry_lock_hold_seconds_total", "counter",
+        "Time the registry mutex was held." },
+    [METRIC_IO_SYSCALLS] = { "chat_io_syscalls_total", "counter",
+        "System calls reactor threads made to accept, receive, send, wait and wake." },
+    [METRIC_ZEROCOPY_SENDS] = { "chat_zerocopy_sends_total", "counter", "Sends made with MSG_ZEROCOPY." },
+    [METRIC_ZEROCOPY_COPIED] = { "chat_zerocopy_copied_total", "counter",
+        "Zero-copy sends the kernel completed by copying the data anyway." },
+    [METRIC_RATE_LIMITED] = { "chat_rate_limited_pauses_total", "counter",
+        "Reads paused because a device or address ran out of tokens." },
+    [METRIC_BACKPRESSURE_PAUSES] = { "chat_backpressure_pauses_total", "counter",
+        "Reads paused because the client's own outbound queue was over half full." },
+    [METRIC_RECV_MEMORY_PAUSES] = { "chat_recv_memory_pauses_total", "counter",
+        "Reads paused because receive buffers held all the memory allowed them." },
+    [METRIC_RATE_TABLE_FULL] = { "chat_rate_table_full_total", "counter",
+        "Frames let through because the rate-limit table had no slot near their key." },
+    [METRIC_BLOB_BYTES_IN] = { "chat_blob_bytes_received_total", "counter",
+        "Attachment bytes written to the blob store." },
+    [METRIC_BLOB_BYTES_OUT] = { "chat_blob_bytes_sent_total", "counter",
+        "Attachment bytes sent to clients straight from the blob store (sendfile)." },
+    [METRIC_BLOB_QUOTA_REFUSALS] = { "chat_blob_quota_refusals_total", "counter",
+        "Uploads refused because the blob store had no room left under its quota." },
+    [METRIC_BLOB_PARTS_EXPIRED] = { "chat_blob_parts_expired_total", "counter",
+        "Abandoned partial uploads deleted from the blob store." },
+    [METRIC_COMPRESSED_FRAMES] = { "chat_compressed_frames_total", "counter", "Frames sent to clients compressed." },
+    [METRIC_COMPRESS_SAVED_BYTES] = { "chat_compression_saved_bytes_total", "counter",
+        "Payload bytes compression kept off the wire." },
+    [METRIC_COMPRESS_SKIPPED] = { "chat_compression_skipped_total", "counter",
+        "Frames sent uncompressed because they would not shrink (ciphertext)." },
+    [METRIC_COMPRESS_NS] = { "chat_compression_seconds_total", "counter",
+        "Time spent compressing outbound and decompressing inbound frames." },
+    [METRIC_POOL_ALLOCS] = { "chat_pool_allocations_total", "counter",
+        "Frame, receive buffer and connection allocations served by the pools." },
+    [METRIC_POOL_DEPOT_TRANSFERS] = { "chat_pool_depot_transfers_total", "counter",
+        "Batches moved between a thread cache and the shared depot." },
+    [METRIC_POOL_MALLOCS] = { "chat_pool_mallocs_total", "counter",
+        "Calls the pools made to malloc (new chunks and oversized blocks)." },
+    [METRIC_POOL_RESERVED_BYTES] = { "chat_pool_reserved_bytes", "gauge",
+        "Memory the pools hold, in use or cached." },
+};
+
+static struct MetricsShard g_shards[METRICS_MAX_SHARDS];
+static atomic_uint g_nextShard;
+
+_Thread_local struct MetricsShard* t_metricsShard = NULL;
+
+static socket_t g_adminFd = INVALID_SOCKET;
+static metrics_extra_fn g_adminExtra = NULL;
+
+struct MetricsShard* metrics_attach(void)
+{
+    unsigned index = atomic_fetch_add_explicit(&g_nextShard, 1, memory_order_relaxed);
+    t_metricsShard = &g_shards[index % METRICS_MAX_SHARDS];
+    return t_metricsShard;
+}
+
+void metrics_record_fanout(size_t recipients)
+{
+    struct MetricsShard* shard = t_metricsShard ? t_metricsShard : metrics_attach();
+    size_t bucket = 0;
+    while (bucket < METRICS_FANOUT_BUCKETS - 1 && ((size_t)1 << bucket) < recipients) {
+        ++bucket;
+    }
+    atomic_fetch_add_explicit(&shard->fanout[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->values[METRIC_FANOUT_RECIPIENTS], recipients, memory_order_relaxed);
+}
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t sum_metric(enum MetricId id)
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < METRICS_MAX_SHARDS; ++i) {
+        total += atomic_load_explicit(&g_shards[i].values[id], memory_order_relaxed);
+    }
+    return total;
+}
+
+struct RenderBuffer {
+    char* out;
+    size_t capacity;
+    size_t length;
+};
+
+static void append(struct RenderBuffer* buffer, const char* format, ...)
+{
+    if (buffer->length + 1 >= buffer->capacity) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(buffer->out + buffer->length, buffer->capacity - buffer->length, format, args);
+    va_end(args);
+    if (written > 0) {
+        buffer->length += (size_t)written;
+        if (buffer->length >= buffer->capacity) {
+            buffer->length = buffer->capacity - 1;
+        }
+    }
+}
+
+static void append_header(struct RenderBuffer* buffer, const char* name, const char* type, const char* help)
+{
+    append(buffer, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+size_t metrics_render(char* out, size_t capacity, metrics_extra_fn extra)
+{
+    struct RenderBuffer buffer = { out, capacity, 0 };
+    if (capacity == 0) {
+        return 0;
+    }
+    out[0] = '\0';
+
+    for (int id = 0; id < METRIC_COUNT; ++id) {
+        const struct MetricInfo* info = &g_metricInfo[id];
+        if (!info->name) {
+            continue;
+        }
+        uint64_t value = sum_metric((enum MetricId)id);
+        append_header(&buffer, info->name, info->type, info->help);
+        if (id == METRIC_REGISTRY_LOCK_WAIT_NS || id == METRIC_REGISTRY_LOCK_HOLD_NS || id == METRIC_COMPRESS_NS) {
+            append(&buffer, "%s %.9f\n", info->name, (double)value / 1e9);
+        } else if (strcmp(info->type, "gauge") == 0) {
+            append(&buffer, "%s %lld\n", info->name, (long long)(int64_t)value);
+        } else {
+            append(&buffer, "%s %llu\n", info->name, (unsigned long long)value);
+        }
+    }
+
+    uint64_t opened = sum_metric(METRIC_CONNECTIONS_OPENED);
+    uint64_t closed = sum_metric(METRIC_CONNECTIONS_CLOSED);
+    append_header(&buffer, "chat_connections", "gauge", "Client connections currently open.");
+    append(&buffer, "chat_connections %lld\n", (long long)(int64_t)(opened - closed));
+
+    append_header(&buffer, "chat_fanout_recipients", "histogram", "Connections each routed frame was queued for.");
+    uint64_t cumulative = 0;
+    for (size_t bucket = 0; bucket < METRICS_FANOUT_BUCKETS; ++bucket) {
+        for (size_t i = 0; i < METRICS_MAX_SHARDS; ++i) {
+            cumulative += atomic_load_explicit(&g_shards[i].fanout[bucket], memory_order_relaxed);
+        }
+        if (bucket < METRICS_FANOUT_BUCKETS - 1) {
+            append(&buffer, "chat_fanout_recipients_bucket{le=\"%llu\"} %llu\n",
+                (unsigned long long)((uint64_t)1 << bucket), (unsigned long long)cumulative);
+        }
+    }
+    append(&buffer, "chat_fanout_recipients_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+    append(&buffer, "chat_fanout_recipients_sum %llu\n", (unsigned long long)sum_metric(METRIC_FANOUT_RECIPIENTS));
+    append(&buffer, "chat_fanout_recipients_count %llu\n", (unsigned long long)cumulative);
+
+    if (extra && buffer.length + 1 < capacity) {
+        buffer.length += extra(out + buffer.length, capacity - buffer.length);
+        if (buffer.length >= capacity) {
+            buffer.length = capacity - 1;
+        }
+        out[buffer.length] = '\0';
+    }
+    return buffer.length;
+}
+
+static void serve_admin_request(socket_t clientFd, char* text)
+{
+    char request[1024];
+    set_socket_recv_timeout(clientFd, METRICS_REQUEST_TIMEOUT_MS);
+    int received = recv(clientFd, request, sizeof(request) - 1, 0);
+    if (received < 0) {
+        received = 0;
+    }
+    request[received] = '\0';
+
+    size_t length = metrics_render(text, METRICS_RENDER_CAPACITY, g_adminExtra);
+    if (strncmp(request, "GET ", 4) == 0) {
+        char header[256];
+        int headerLength = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+            "Connection: close\r\n\r\n", length);
+        if (send_all(clientFd, header, (size_t)headerLength) != 0) {
+            return;
+        }
+    }
+    send_all(clientFd, text, length);
+}
+
+static void* admin_thread(void* arg)
+{
+    (void)arg;
+    char* text = (char*)malloc(METRICS_RENDER_CAPACITY);
+    if (!text) {
+        log_error("malloc failed while starting the admin listener");
+        return NULL;
+    }
+    while (true) {
+        socket_t clientFd = accept(g_adminFd, NULL, NULL);
+        if (clientFd == INVALID_SOCKET) {
+            log_os_error("admin accept");
+            continue;
+        }
+        serve_admin_request(clientFd, text);
+        shutdown(clientFd, SD_BOTH);
+        closesocket(clientFd);
+    }
+    return NULL;
+}
+
+int metrics_start_admin(const char* address, int port, metrics_extra_fn extra)
+{
+    socket_t fd = create_socket();
+    if (fd == INVALID_SOCKET) {
+        return -1;
+    }
+    struct sockaddr_in* adminAddr = createIPv4Address(address, port);
+    if (!adminAddr) {
+        closesocket(fd);
+        return -1;
+    }
+    int bindResult = bind(fd, (struct sockaddr*)adminAddr, sizeof(*adminAddr));
+    free(adminAddr);
+    if (bindResult == SOCKET_ERROR || listen(fd, 16) == SOCKET_ERROR) {
+        log_os_error("admin listener");
+        closesocket(fd);
+        return -1;
+    }
+
+    g_adminFd = fd;
+    g_adminExtra = extra;
+    pthread_t threadId;
+    if (pthread_create(&threadId, NULL, admin_thread, NULL) != 0) {
+        log_error("pthread_create failed for the admin listener");
+        closesocket(fd);
+        g_adminFd = INVALID_SOCKET;
+        return -1;
+    }
+    pthread_detach(threadId);
+    log_info("Metrics on %s:%d", address, port);
+    return 0;
+}
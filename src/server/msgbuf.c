@@ -0,0 +1,36 @@
+#include "msgbuf.h"
+#include "pool.h"
+
+#include <string.h>
+
+struct MsgBuf* msgbuf_create(uint8_t opcode, uint8_t flags, const char* prefix, size_t prefixLength,
+    const void* body, size_t bodyLength)
+{
+    if (prefixLength > MSGBUF_MAX_PREFIX || prefixLength + bodyLength > UINT32_MAX) {
+        return NULL;
+    }
+
+    struct MsgBuf* buf = (struct MsgBuf*)pool_alloc(sizeof(*buf) + bodyLength);
+    if (!buf) {
+        return NULL;
+    }
+
+    atomic_init(&buf->refs, 1);
+    proto_encode_header(buf->head, opcode, flags, (uint32_t)(prefixLength + bodyLength));
+    if (prefixLength > 0) {
+        memcpy(buf->head + PROTO_HEADER_SIZE, prefix, prefixLength);
+    }
+    buf->headLength = (uint32_t)(PROTO_HEADER_SIZE + prefixLength);
+    buf->bodyLength = (uint32_t)bodyLength;
+    if (body && bodyLength > 0) {
+        memcpy(buf->body, body, bodyLength);
+    }
+    return buf;
+}
+
+void msgbuf_release(struct MsgBuf* buf)
+{
+    if (buf && atomic_fetch_sub_explicit(&buf->refs, 1, memory_order_acq_rel) == 1) {
+        pool_free(buf);
+    }
+}
@@ -0,0 +1,868 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "msglog.h"
+#include "logger.h"
+#include "sha256.h"
+#include "storeutil.h"
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MSGLOG_BUCKETS 65536
+#define MSGLOG_TABLE_STRIPES 64
+#define MSGLOG_RECORD_ALIGN 8
+#define MSGLOG_SEGMENT_SUFFIX ".seg"
+
+// On-disk record, host byte order. Sequence numbers start at 1, so a zero
+// seq (the preallocated tail of a segment) marks the end of its data. The
+// flusher fills ciphertextHash in later, so the checksum leaves it out; all
+// zeros means not hashed yet.
+struct MsgLogRecordHeader {
+    uint32_t length;                // protocol header + ciphertext bytes that follow
+    uint32_t checksum;              // over the rest of the header and the payload
+    uint64_t seq;
+    uint64_t createdAtMs;
+    uint32_t protocolHeaderLength;
+    uint32_t reserved;
+    uint8_t messageId[PROTO_ID_SIZE];
+    uint8_t senderDeviceId[PROTO_ID_SIZE];
+    uint8_t ciphertextHash[SHA256_DIGEST_SIZE];     // Message.CiphertextHashSha256
+};
+
+struct MsgLogSegment {
+    uint64_t firstSeq;
+    size_t capacity;
+    size_t used;
+    size_t synced;
+    size_t hashed;      // records before this have their ciphertextHash
+    uint8_t* map;
+};
+
+// Sparse index entry: where record seq starts.
+struct MsgLogIndexEntry {
+    uint64_t seq;
+    uint64_t createdAtMs;
+    size_t segment;
+    size_t offset;
+};
+
+struct MsgLogConversation {
+    uint8_t id[PROTO_ID_SIZE];
+    pthread_mutex_t mutex;
+    bool loaded;
+    char* path;
+
+    struct MsgLogSegment* segments;     // never removed, so indices into it are stable
+    size_t segmentCount;
+    size_t segmentCapacity;
+    struct MsgLogIndexEntry* index;     // ascending seq and createdAtMs
+    size_t indexCount;
+    size_t indexCapacity;
+    uint64_t lastSeq;
+    uint64_t lastCreatedAtMs;
+
+    atomic_bool dirtyQueued;    // on the log's dirty list; set and cleared under dirtyMutex
+    struct MsgLogConversation* dirtyNext;
+    struct MsgLogConversation* next;    // bucket chain; guarded by its table stripe
+};
+
+struct MsgLog {
+    struct MsgLogConfig config;
+    char* directory;
+    size_t pageSize;
+
+    pthread_mutex_t tableMutex[MSGLOG_TABLE_STRIPES];
+    struct MsgLogConversation** buckets;
+
+    pthread_mutex_t dirtyMutex;
+    struct MsgLogConversation* dirtyHead;
+    struct StoreFlusher flusher;
+
+    // Flusher scratch for hashing a segment's new records in one batch.
+    struct Sha256Job* hashJobs;
+    size_t* hashOffsets;    // where each job's record starts
+    size_t hashCapacity;
+};
+
+static uint32_t record_checksum(const struct MsgLogRecordHeader* header, const uint8_t* payload)
+{
+    // The header from seq up to the hash, then the payload; detects torn writes.
+    size_t skip = offsetof(struct MsgLogRecordHeader, seq);
+    size_t end = offsetof(struct MsgLogRecordHeader, ciphertextHash);
+    uint32_t hash = store_fnv1a(STORE_FNV_BASIS, (const uint8_t*)header + skip, end - skip);
+    hash = store_fnv1a(hash, &header->length, sizeof(header->length));
+    return store_fnv1a(hash, payload, header->length);
+}
+
+// UUIDv7: 48-bit millisecond timestamp, then bits mixed from the
+// conversation and seq, which are unique together.
+static void derive_message_id(const struct MsgLogConversation* conversation, uint64_t seq, uint64_t createdAtMs,
+    uint8_t* out)
+{
+    uint64_t random = store_hash_id(conversation->id) ^ (seq * 0xbf58476d1ce4e5b9ULL);
+    random = (random ^ (random >> 31)) * 0x94d049bb133111ebULL;
+    for (int i = 0; i < 6; ++i) {
+        out[i] = (uint8_t)(createdAtMs >> (40 - 8 * i));
+    }
+    out[6] = (uint8_t)(0x70 | ((seq >> 8) & 0x0f));
+    out[7] = (uint8_t)seq;
+    for (int i = 8; i < PROTO_ID_SIZE; ++i) {
+        out[i] = (uint8_t)(random >> (8 * (i - 8)));
+    }
+    out[8] = (uint8_t)(0x80 | (out[8] & 0x3f));
+}
+
+static void segment_path(const struct MsgLogConversation* conversation, uint64_t firstSeq, char* out, size_t outSize)
+{
+    snprintf(out, outSize, "%s/%020" PRIu64 MSGLOG_SEGMENT_SUFFIX, conversation->path, firstSeq);
+}
+
+static bool push_segment(struct MsgLogConversation* conversation, const struct MsgLogSegment* segment)
+{
+    if (conversation->segmentCount == conversation->segmentCapacity) {
+        size_t capacity = conversation->segmentCapacity ? conversation->segmentCapacity * 2 : 4;
+        struct MsgLogSegment* segments = (struct MsgLogSegment*)realloc(conversation->segments,
+            capacity * sizeof(*segments));
+        if (!segments) {
+            return false;
+        }
+        conversation->segments = segments;
+        conversation->segmentCapacity = capacity;
+    }
+    conversation->segments[conversation->segmentCount++] = *segment;
+    return true;
+}
+
+// Indexes the first record of every segment and every indexInterval-th one after.
+static bool note_record(struct MsgLog* log, struct MsgLogConversation* conversation,
+    const struct MsgLogRecordHeader* header, size_t segment, size_t offset)
+{
+    bool first = offset == 0;
+    if (!first && (header->seq - 1) % log->config.indexInterval != 0) {
+        return true;
+    }
+    if (conversation->indexCount == conversation->indexCapacity) {
+        size_t capacity = conversation->indexCapacity ? conversation->indexCapacity * 2 : 16;
+        struct MsgLogIndexEntry* index = (struct MsgLogIndexEntry*)realloc(conversation->index,
+            capacity * sizeof(*index));
+        if (!index) {
+            return false;
+        }
+        conversation->index = index;
+        conversation->indexCapacity = capacity;
+    }
+    struct MsgLogIndexEntry* entry = &conversation->index[conversation->indexCount++];
+    entry->seq = header->seq;
+    entry->createdAtMs = header->createdAtMs;
+    entry->segment = segment;
+    entry->offset = offset;
+    return true;
+}
+
+static void mark_dirty(struct MsgLog* log, struct MsgLogConversation* conversation)
+{
+    // Already queued: the flusher clears the flag before it takes the
+    // conversation lock, so it will see whatever the caller just wrote.
+    if (atomic_load(&conversation->dirtyQueued)) {
+        return;
+    }
+    bool wake = false;
+    pthread_mutex_lock(&log->dirtyMutex);
+    if (!atomic_load(&conversation->dirtyQueued)) {
+        atomic_store(&conversation->dirtyQueued, true);
+        conversation->dirtyNext = log->dirtyHead;
+        wake = !log->dirtyHead;
+        log->dirtyHead = conversation;
+    }
+    pthread_mutex_unlock(&log->dirtyMutex);
+    if (wake) {
+        store_flusher_wake(&log->flusher);
+    }
+}
+
+// Maps an existing segment, indexing its valid records. Returns false if
+// loading must stop here (unreadable, or a gap in the sequence).
+static bool recover_segment(struct MsgLog* log, struct MsgLogConversation* conversation, uint64_t firstSeq)
+{
+    char path[4096];
+    segment_path(conversation, firstSeq, path, sizeof(path));
+    if (firstSeq != conversation->lastSeq + 1) {
+        log_warn("msglog: ignoring %s after a gap in the sequence", path);
+        return false;
+    }
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open segment");
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(struct MsgLogRecordHeader)) {
+        close(fd);
+        return false;
+    }
+
+    struct MsgLogSegment segment;
+    memset(&segment, 0, sizeof(segment));
+    segment.firstSeq = firstSeq;
+    segment.capacity = (size_t)info.st_size;
+    segment.map = (uint8_t*)mmap(NULL, segment.capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment.map == MAP_FAILED) {
+        perror("mmap segment");
+        return false;
+    }
+    if (!push_segment(conversation, &segment)) {
+        munmap(segment.map, segment.capacity);
+        return false;
+    }
+    size_t index = conversation->segmentCount - 1;
+    struct MsgLogSegment* tail = &conversation->segments[index];
+
+    while (tail->used + sizeof(struct MsgLogRecordHeader) <= tail->capacity) {
+        struct MsgLogRecordHeader header;
+        memcpy(&header, tail->map + tail->used, sizeof(header));
+        size_t size = store_align_up(sizeof(header) + header.length, MSGLOG_RECORD_ALIGN);
+        if (header.seq != conversation->lastSeq + 1 || tail->used + size > tail->capacity
+            || header.protocolHeaderLength > header.length
+            || header.checksum != record_checksum(&header, tail->map + tail->used + sizeof(header))) {
+            break;
+        }
+        if (!note_record(log, conversation, &header, index, tail->used)) {
+            break;
+        }
+        if (tail->hashed == tail->used) {
+            static const uint8_t unhashed[SHA256_DIGEST_SIZE];
+            if (memcmp(header.ciphertextHash, unhashed, sizeof(unhashed)) != 0) {
+                tail->hashed += size;
+            }
+        }
+        conversation->lastSeq = header.seq;
+        conversation->lastCreatedAtMs = header.createdAtMs;
+        tail->used += size;
+    }
+    // Clear a torn tail so the next append is not read as its continuation.
+    memset(tail->map + tail->used, 0, tail->capacity - tail->used);
+    tail->synced = tail->used;
+    if (tail->hashed < tail->used) {
+        // Appended before a crash but never hashed: the flusher catches up.
+        mark_dirty(log, conversation);
+    }
+    return true;
+}
+
+static int compare_seq(const void* left, const void* right)
+{
+    uint64_t a = *(const uint64_t*)left;
+    uint64_t b = *(const uint64_t*)right;
+    return a < b ? -1 : a > b;
+}
+
+// The conversation's directory name: its id in hex.
+static void conversation_name(const uint8_t* id, char* name)
+{
+    for (size_t i = 0; i < PROTO_ID_SIZE; ++i) {
+        snprintf(name + 2 * i, 3, "%02x", id[i]);
+    }
+}
+
+// Whether the conversation has a directory, i.e. was ever appended to.
+static bool has_history(struct MsgLog* log, const uint8_t* id)
+{
+    char name[2 * PROTO_ID_SIZE + 1];
+    conversation_name(id, name);
+    char* path = store_join_path(log->directory, name);
+    if (!path) {
+        return false;
+    }
+    struct stat status;
+    bool found = stat(path, &status) == 0 && S_ISDIR(status.st_mode);
+    free(path);
+    return found;
+}
+
+// Maps the conversation's segments and rebuilds its index; caller holds its mutex.
+static bool load_conversation(struct MsgLog* log, struct MsgLogConversation* conversation)
+{
+    char name[2 * PROTO_ID_SIZE + 1];
+    conversation_name(conversation->id, name);
+    conversation->path = store_join_path(log->directory, name);
+    if (!conversation->path) {
+        return false;
+    }
+
+    DIR* dir = opendir(conversation->path);
+    if (dir) {
+        uint64_t* firstSeqs = NULL;
+        size_t count = 0;
+        size_t capacity = 0;
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            char* end;
+            uint64_t firstSeq = strtoull(entry->d_name, &end, 10);
+            if (end == entry->d_name || strcmp(end, MSGLOG_SEGMENT_SUFFIX) != 0) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 8;
+                uint64_t* grown = (uint64_t*)realloc(firstSeqs, capacity * sizeof(*grown));
+                if (!grown) {
+                    break;
+                }
+                firstSeqs = grown;
+            }
+            firstSeqs[count++] = firstSeq;
+        }
+        closedir(dir);
+
+        qsort(firstSeqs, count, sizeof(*firstSeqs), compare_seq);
+        for (size_t i = 0; i < count && recover_segment(log, conversation, firstSeqs[i]); ++i) {
+        }
+        free(firstSeqs);
+    }
+
+    conversation->loaded = true;
+    return true;
+}
+
+static struct MsgLogConversation* find_conversation(struct MsgLog* log, size_t bucket, const uint8_t* id)
+{
+    struct MsgLogConversation* conversation = log->buckets[bucket];
+    while (conversation && memcmp(conversation->id, id, PROTO_ID_SIZE) != 0) {
+        conversation = conversation->next;
+    }
+    return conversation;
+}
+
+// Returns the conversation, loading it on first use, with its mutex held; NULL
+// on failure. Unless create is set, an id with no history in memory or on
+// disk returns NULL too, and is not tracked: reads of unknown ids leave
+// nothing behind.
+static struct MsgLogConversation* lock_conversation(struct MsgLog* log, const uint8_t* id, bool create)
+{
+    size_t bucket = (size_t)store_hash_id(id) & (MSGLOG_BUCKETS - 1);
+    pthread_mutex_t* stripe = &log->tableMutex[bucket % MSGLOG_TABLE_STRIPES];
+
+    pthread_mutex_lock(stripe);
+    struct MsgLogConversation* conversation = find_conversation(log, bucket, id);
+    if (!conversation && !create) {
+        pthread_mutex_unlock(stripe);
+        if (!has_history(log, id)) {
+            return NULL;
+        }
+        pthread_mutex_lock(stripe);
+        conversation = find_conversation(log, bucket, id);
+    }
+    if (!conversation) {
+        conversation = (struct MsgLogConversation*)calloc(1, sizeof(*conversation));
+        if (!conversation) {
+            pthread_mutex_unlock(stripe);
+            log_error("malloc failed while tracking conversation history");
+            return NULL;
+        }
+        memcpy(conversation->id, id, PROTO_ID_SIZE);
+        pthread_mutex_init(&conversation->mutex, NULL);
+        conversation->next = log->buckets[bucket];
+        log->buckets[bucket] = conversation;
+    }
+    pthread_mutex_unlock(stripe);
+
+    // Conversations are never freed before the log, so the pointer stays valid.
+    pthread_mutex_lock(&conversation->mutex);
+    if (!conversation->loaded && !load_conversation(log, conversation)) {
+        pthread_mutex_unlock(&conversation->mutex);
+        return NULL;
+    }
+    return conversation;
+}
+
+// Starts a new tail segment able to hold at least recordSize bytes.
+static struct MsgLogSegment* add_segment(struct MsgLog* log, struct MsgLogConversation* conversation,
+    size_t recordSize)
+{
+    if (mkdir(conversation->path, 0700) != 0 && errno != EEXIST) {
+        perror("mkdir conversation history");
+        return NULL;
+    }
+
+    struct MsgLogSegment segment;
+    memset(&segment, 0, sizeof(segment));
+    segment.firstSeq = conversation->lastSeq + 1;
+    segment.capacity = store_align_up(recordSize, log->pageSize);
+    if (segment.capacity < log->config.segmentBytes) {
+        segment.capacity = store_align_up(log->config.segmentBytes, log->pageSize);
+    }
+
+    char path[4096];
+    segment_path(conversation, segment.firstSeq, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror("create segment");
+        return NULL;
+    }
+    if (ftruncate(fd, (off_t)segment.capacity) != 0) {
+        perror("ftruncate segment");
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    segment.map = (uint8_t*)mmap(NULL, segment.capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment.map == MAP_FAILED) {
+        perror("mmap segment");
+        unlink(path);
+        return NULL;
+    }
+    store_sync_directory(conversation->path);
+
+    if (!push_segment(conversation, &segment)) {
+        munmap(segment.map, segment.capacity);
+        unlink(path);
+        return NULL;
+    }
+    return &conversation->segments[conversation->segmentCount - 1];
+}
+
+// Caller holds conversation->mutex.
+static bool append_locked(struct MsgLog* log, struct MsgLogConversation* conversation, struct MsgLogEntry* entry)
+{
+    size_t length = entry->protocolHeaderLength + entry->ciphertextLength;
+    if (length > UINT32_MAX - sizeof(struct MsgLogRecordHeader)) {
+        return false;
+    }
+    size_t size = store_align_up(sizeof(struct MsgLogRecordHeader) + length, MSGLOG_RECORD_ALIGN);
+    struct MsgLogSegment* tail = conversation->segmentCount
+        ? &conversation->segments[conversation->segmentCount - 1] : NULL;
+    if (!tail || tail->used + size > tail->capacity) {
+        tail = add_segment(log, conversation, size);
+        if (!tail) {
+            return false;
+        }
+    }
+
+    struct MsgLogRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.length = (uint32_t)length;
+    header.seq = conversation->lastSeq + 1;
+    header.createdAtMs = entry->createdAtMs ? entry->createdAtMs : store_wall_clock_ms();
+    if (header.createdAtMs < conversation->lastCreatedAtMs) {
+        header.createdAtMs = conversation->lastCreatedAtMs;
+    }
+    header.protocolHeaderLength = (uint32_t)entry->protocolHeaderLength;
+    if (entry->messageId) {
+        memcpy(header.messageId, entry->messageId, PROTO_ID_SIZE);
+    } else {
+        derive_message_id(conversation, header.seq, header.createdAtMs, header.messageId);
+    }
+    memcpy(header.senderDeviceId, entry->senderDeviceId, PROTO_ID_SIZE);
+
+    size_t segment = conversation->segmentCount - 1;
+    size_t offset = tail->used;
+    if (!note_record(log, conversation, &header, segment, offset)) {
+        return false;
+    }
+
+    uint8_t* payload = tail->map + offset + sizeof(header);
+    if (entry->protocolHeaderLength > 0) {
+        memcpy(payload, entry->protocolHeader, entry->protocolHeaderLength);
+    }
+    if (entry->ciphertextLength > 0) {
+        memcpy(payload + entry->protocolHeaderLength, entry->ciphertext, entry->ciphertextLength);
+    }
+    header.checksum = record_checksum(&header, payload);
+    memcpy(tail->map + offset, &header, sizeof(header));
+
+    tail->used += size;
+    conversation->lastSeq = header.seq;
+    conversation->lastCreatedAtMs = header.createdAtMs;
+    entry->seq = header.seq;
+    return true;
+}
+
+size_t msglog_append(struct MsgLog* log, struct MsgLogEntry* entries, size_t count)
+{
+    size_t stored = 0;
+    while (stored < count) {
+        struct MsgLogConversation* conversation = lock_conversation(log, entries[stored].conversationId, true);
+        if (!conversation) {
+            break;
+        }
+        // Consecutive entries for the same conversation share one lock hold.
+        size_t before = stored;
+        do {
+            if (!append_locked(log, conversation, &entries[stored])) {
+                break;
+            }
+            ++stored;
+        } while (stored < count && memcmp(entries[stored].conversationId, conversation->id, PROTO_ID_SIZE) == 0);
+        bool failed = stored < count && memcmp(entries[stored].conversationId, conversation->id, PROTO_ID_SIZE) == 0;
+        pthread_mutex_unlock(&conversation->mutex);
+
+        if (stored > before) {
+            mark_dirty(log, conversation);
+        }
+        if (failed) {
+            log_error("msglog: could not append message");
+            break;
+        }
+    }
+    return stored;
+}
+
+// Index entry to start a scan for seq from: the last one at or before it.
+static const struct MsgLogIndexEntry* seek_seq(const struct MsgLogConversation* conversation, uint64_t seq)
+{
+    size_t low = 0;
+    size_t high = conversation->indexCount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (conversation->index[middle].seq <= seq) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low > 0 ? &conversation->index[low - 1] : NULL;
+}
+
+static const struct MsgLogIndexEntry* seek_time(const struct MsgLogConversation* conversation, uint64_t timeMs)
+{
+    size_t low = 0;
+    size_t high = conversation->indexCount;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (conversation->index[middle].createdAtMs < timeMs) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low > 0 ? &conversation->index[low - 1] : (conversation->indexCount ? &conversation->index[0] : NULL);
+}
+
+// Walks records from start; fn returning false stops. Caller holds the mutex.
+static size_t walk(const struct MsgLogConversation* conversation, const struct MsgLogIndexEntry* start,
+    uint64_t fromSeq, size_t limit, msglog_record_fn fn, void* context)
+{
+    size_t passed = 0;
+    if (!start) {
+        return 0;
+    }
+    for (size_t segment = start->segment; segment < conversation->segmentCount && passed < limit; ++segment) {
+        const struct MsgLogSegment* current = &conversation->segments[segment];
+        size_t offset = segment == start->segment ? start->offset : 0;
+        while (offset < current->used && passed < limit) {
+            struct MsgLogRecordHeader header;
+            memcpy(&header, current->map + offset, sizeof(header));
+            size_t size = store_align_up(sizeof(header) + header.length, MSGLOG_RECORD_ALIGN);
+            if (header.seq >= fromSeq) {
+                const uint8_t* payload = current->map + offset + sizeof(header);
+                struct MsgLogRecord record;
+                record.seq = header.seq;
+                record.createdAtMs = header.createdAtMs;
+                record.messageId = current->map + offset + offsetof(struct MsgLogRecordHeader, messageId);
+                record.senderDeviceId = current->map + offset + offsetof(struct MsgLogRecordHeader, senderDeviceId);
+                record.ciphertextHash = offset < current->hashed
+                    ? current->map + offset + offsetof(struct MsgLogRecordHeader, ciphertextHash) : NULL;
+                record.protocolHeader = payload;
+                record.protocolHeaderLength = header.protocolHeaderLength;
+                record.ciphertext = payload + header.protocolHeaderLength;
+                record.ciphertextLength = header.length - header.protocolHeaderLength;
+                ++passed;
+                if (!fn(context, &record)) {
+                    return passed;
+                }
+            }
+            offset += size;
+        }
+    }
+    return passed;
+}
+
+size_t msglog_scan(struct MsgLog* log, const uint8_t* conversationId, uint64_t fromSeq, size_t limit,
+    msglog_record_fn fn, void* context)
+{
+    struct MsgLogConversation* conversation = lock_conversation(log, conversationId, false);
+    if (!conversation) {
+        return 0;
+    }
+    if (fromSeq == 0) {
+        fromSeq = 1;
+    }
+    size_t passed = walk(conversation, seek_seq(conversation, fromSeq), fromSeq, limit, fn, context);
+    pthread_mutex_unlock(&conversation->mutex);
+    return passed;
+}
+
+size_t msglog_page_back(struct MsgLog* log, const uint8_t* conversationId, uint64_t beforeSeq, size_t limit,
+    msglog_record_fn fn, void* context)
+{
+    struct MsgLogConversation* conversation = lock_conversation(log, conversationId, false);
+    if (!conversation) {
+        return 0;
+    }
+    uint64_t last = conversation->lastSeq;
+    if (beforeSeq != 0 && beforeSeq <= last) {
+        last = beforeSeq - 1;
+    }
+    size_t passed = 0;
+    if (last > 0 && limit > 0) {
+        uint64_t first = last >= limit ? last - limit + 1 : 1;
+        passed = walk(conversation, seek_seq(conversation, first), first, (size_t)(last - first + 1), fn, context);
+    }
+    pthread_mutex_unlock(&conversation->mutex);
+    return passed;
+}
+
+struct SeqAtSearch {
+    uint64_t timeMs;
+    uint64_t seq;
+};
+
+static bool find_time(void* context, const struct MsgLogRecord* record)
+{
+    struct SeqAtSearch* search = (struct SeqAtSearch*)context;
+    if (record->createdAtMs >= search->timeMs) {
+        search->seq = record->seq;
+        return false;
+    }
+    return true;
+}
+
+uint64_t msglog_seq_at(struct MsgLog* log, const uint8_t* conversationId, uint64_t timeMs)
+{
+    struct MsgLogConversation* conversation = lock_conversation(log, conversationId, false);
+    if (!conversation) {
+        return 1;
+    }
+    struct SeqAtSearch search;
+    search.timeMs = timeMs;
+    search.seq = conversation->lastSeq + 1;
+    const struct MsgLogIndexEntry* start = seek_time(conversation, timeMs);
+    if (start) {
+        walk(conversation, start, start->seq, SIZE_MAX, find_time, &search);
+    }
+    pthread_mutex_unlock(&conversation->mutex);
+    return search.seq;
+}
+
+uint64_t msglog_last_seq(struct MsgLog* log, const uint8_t* conversationId)
+{
+    struct MsgLogConversation* conversation = lock_conversation(log, conversationId, false);
+    if (!conversation) {
+        return 0;
+    }
+    uint64_t last = conversation->lastSeq;
+    pthread_mutex_unlock(&conversation->mutex);
+    return last;
+}
+
+static bool reserve_hash_jobs(struct MsgLog* log, size_t count)
+{
+    if (count <= log->hashCapacity) {
+        return true;
+    }
+    size_t capacity = log->hashCapacity ? log->hashCapacity : 256;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    struct Sha256Job* jobs = (struct Sha256Job*)realloc(log->hashJobs, capacity * sizeof(*jobs));
+    if (jobs) {
+        log->hashJobs = jobs;
+    }
+    size_t* offsets = (size_t*)realloc(log->hashOffsets, capacity * sizeof(*offsets));
+    if (offsets) {
+        log->hashOffsets = offsets;
+    }
+    if (!jobs || !offsets) {
+        return false;
+    }
+    log->hashCapacity = capacity;
+    return true;
+}
+
+// Hashes the ciphertexts appended since the last pass, one batch per
+// segment. Records never change once appended and mappings live as long as
+// the log, so the hashing itself runs without the conversation lock.
+static void hash_new_records(struct MsgLog* log, struct MsgLogConversation* conversation)
+{
+    for (size_t i = 0;; ++i) {
+        pthread_mutex_lock(&conversation->mutex);
+        if (i >= conversation->segmentCount) {
+            pthread_mutex_unlock(&conversation->mutex);
+            return;
+        }
+        struct MsgLogSegment* segment = &conversation->segments[i];
+        uint8_t* map = segment->map;
+        size_t start = segment->hashed;
+        size_t end = segment->used;
+        pthread_mutex_unlock(&conversation->mutex);
+
+        size_t count = 0;
+        for (size_t offset = start; offset < end;) {
+            struct MsgLogRecordHeader header;
+            memcpy(&header, map + offset, sizeof(header));
+            if (!reserve_hash_jobs(log, count + 1)) {
+                end = offset;
+                break;
+            }
+            log->hashJobs[count].data = map + offset + sizeof(header) + header.protocolHeaderLength;
+            log->hashJobs[count].length = header.length - header.protocolHeaderLength;
+            log->hashOffsets[count++] = offset;
+            offset += store_align_up(sizeof(header) + header.length, MSGLOG_RECORD_ALIGN);
+        }
+        if (count == 0) {
+            continue;
+        }
+        sha256_batch(log->hashJobs, count);
+
+        pthread_mutex_lock(&conversation->mutex);
+        segment = &conversation->segments[i];
+        for (size_t j = 0; j < count; ++j) {
+            memcpy(map + log->hashOffsets[j] + offsetof(struct MsgLogRecordHeader, ciphertextHash),
+                log->hashJobs[j].digest, SHA256_DIGEST_SIZE);
+        }
+        segment->hashed = end;
+        if (segment->synced > start) {
+            segment->synced = start;    // the hashes must reach the disk too
+        }
+        pthread_mutex_unlock(&conversation->mutex);
+    }
+}
+
+static void flush_conversation(struct MsgLog* log, struct MsgLogConversation* conversation)
+{
+    hash_new_records(log, conversation);
+
+    pthread_mutex_lock(&conversation->mutex);
+    for (size_t i = 0; i < conversation->segmentCount; ++i) {
+        struct MsgLogSegment* segment = &conversation->segments[i];
+        if (segment->used > segment->synced) {
+            size_t start = segment->synced / log->pageSize * log->pageSize;
+            if (msync(segment->map + start, segment->used - start, MS_SYNC) != 0) {
+                perror("msync segment");
+                continue;
+            }
+            segment->synced = segment->used;
+        }
+    }
+    pthread_mutex_unlock(&conversation->mutex);
+}
+
+static void flush_dirty(void* context)
+{
+    struct MsgLog* log = (struct MsgLog*)context;
+    pthread_mutex_lock(&log->dirtyMutex);
+    struct MsgLogConversation* conversation = log->dirtyHead;
+    log->dirtyHead = NULL;
+    pthread_mutex_unlock(&log->dirtyMutex);
+
+    while (conversation) {
+        // Take the successor before clearing the flag that lets mark_dirty relink it.
+        pthread_mutex_lock(&log->dirtyMutex);
+        struct MsgLogConversation* next = conversation->dirtyNext;
+        atomic_store(&conversation->dirtyQueued, false);
+        pthread_mutex_unlock(&log->dirtyMutex);
+
+        flush_conversation(log, conversation);
+        conversation = next;
+    }
+}
+
+static void destroy_locks(struct MsgLog* log)
+{
+    for (size_t i = 0; i < MSGLOG_TABLE_STRIPES; ++i) {
+        pthread_mutex_destroy(&log->tableMutex[i]);
+    }
+    pthread_mutex_destroy(&log->dirtyMutex);
+}
+
+struct MsgLog* msglog_open(const struct MsgLogConfig* config)
+{
+    if (mkdir(config->directory, 0700) != 0 && errno != EEXIST) {
+        perror("mkdir history");
+        return NULL;
+    }
+
+    struct MsgLog* log = (struct MsgLog*)calloc(1, sizeof(*log));
+    if (!log) {
+        return NULL;
+    }
+    log->config = *config;
+    if (log->config.commitIntervalMs == 0) {
+        log->config.commitIntervalMs = MSGLOG_DEFAULT_COMMIT_INTERVAL_MS;
+    }
+    if (log->config.indexInterval == 0) {
+        log->config.indexInterval = MSGLOG_DEFAULT_INDEX_INTERVAL;
+    }
+    log->directory = strdup(config->directory);
+    log->pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    log->buckets = (struct MsgLogConversation**)calloc(MSGLOG_BUCKETS, sizeof(*log->buckets));
+    if (!log->directory || !log->buckets) {
+        free(log->directory);
+        free(log->buckets);
+        free(log);
+        return NULL;
+    }
+    for (size_t i = 0; i < MSGLOG_TABLE_STRIPES; ++i) {
+        pthread_mutex_init(&log->tableMutex[i], NULL);
+    }
+    pthread_mutex_init(&log->dirtyMutex, NULL);
+
+    if (!store_flusher_start(&log->flusher, STORE_FLUSH_COMMIT_GROUP, log->config.commitIntervalMs, flush_dirty,
+            log)) {
+        destroy_locks(log);
+        free(log->directory);
+        free(log->buckets);
+        free(log);
+        return NULL;
+    }
+    return log;
+}
+
+void msglog_close(struct MsgLog* log)
+{
+    if (!log) {
+        return;
+    }
+
+    store_flusher_stop(&log->flusher);
+
+    for (size_t i = 0; i < MSGLOG_BUCKETS; ++i) {
+        struct MsgLogConversation* conversation = log->buckets[i];
+        while (conversation) {
+            struct MsgLogConversation* next = conversation->next;
+            for (size_t s = 0; s < conversation->segmentCount; ++s) {
+                munmap(conversation->segments[s].map, conversation->segments[s].capacity);
+            }
+            free(conversation->segments);
+            free(conversation->index);
+            free(conversation->path);
+            pthread_mutex_destroy(&conversation->mutex);
+            free(conversation);
+            conversation = next;
+        }
+    }
+    free(log->hashJobs);
+    free(log->hashOffsets);
+    free(log->buckets);
+    free(log->directory);
+    destroy_locks(log);
+    free(log);
+}
+
+#endif // __linux__
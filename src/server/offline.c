@@ -0,0 +1,958 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "offline.h"
+#include "logger.h"
+#include "storeutil.h"
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define OFFLINE_BUCKETS 65536
+#define OFFLINE_TABLE_STRIPES 64     // bucket locks; senders to different devices rarely meet
+#define OFFLINE_RECORD_ALIGN 8
+#define OFFLINE_ACK_FILE "acked"
+#define OFFLINE_SEGMENT_SUFFIX ".seg"
+
+// On-disk record, host byte order. length == 0 marks the end of a segment's data.
+struct OfflineRecordHeader {
+    uint32_t length;
+    uint32_t checksum;      // over seq, sender and body; a torn tail fails it
+    uint64_t seq;
+    uint8_t sender[PROTO_ID_SIZE];
+};
+
+struct OfflineSegment {
+    uint64_t firstSeq;
+    uint64_t lastSeq;       // 0 while empty
+    size_t capacity;
+    size_t used;
+    size_t synced;          // bytes known to be on disk
+    uint8_t* map;           // NULL while unmapped; read and written through the file then
+};
+
+// A record waiting for the flusher to write it into a segment.
+struct OfflineStaged {
+    struct OfflineStaged* next;
+    struct OfflineRecordHeader header;
+    uint8_t body[];
+};
+
+struct OfflineDevice {
+    uint8_t id[PROTO_ID_SIZE];
+    pthread_mutex_t mutex;
+    bool loaded;
+    char* path;
+
+    struct OfflineSegment* segments;    // ordered by firstSeq; the last one takes appends
+    size_t segmentCount;
+    size_t segmentCapacity;
+    uint64_t nextSeq;
+    uint64_t ackedSeq;
+    uint64_t durableAckedSeq;
+
+    // Appends that did not fit a mapped tail, oldest first; they follow the
+    // segments' records.
+    struct OfflineStaged* stagedHead;
+    struct OfflineStaged** stagedTail;
+
+    // Read cursor, so a consumer replaying in batches never rescans.
+    uint64_t cursorSeq;
+    size_t cursorSegment;
+    size_t cursorOffset;
+
+    void* consumer;
+    offline_notify_fn notify;
+
+    atomic_bool dirtyQueued;    // on the store's dirty list; set and cleared under dirtyMutex
+    struct OfflineDevice* dirtyNext;
+    struct OfflineDevice* next;     // bucket chain; guarded by its table stripe
+};
+
+struct OfflineStore {
+    struct OfflineConfig config;
+    char* directory;
+    size_t pageSize;
+
+    pthread_mutex_t tableMutex[OFFLINE_TABLE_STRIPES];
+    struct OfflineDevice** buckets;
+
+    pthread_mutex_t dirtyMutex;
+    struct OfflineDevice* dirtyHead;
+    struct StoreFlusher flusher;
+
+    atomic_size_t stagedBytes;
+    atomic_size_t mappedSegments;
+    bool writeFailing;      // flusher only; logs once per streak
+};
+
+static uint32_t record_checksum(uint64_t seq, const uint8_t* sender, const uint8_t* body, size_t length)
+{
+    uint8_t seqBytes[sizeof(seq)];
+    for (size_t i = 0; i < sizeof(seq); ++i) {
+        seqBytes[i] = (uint8_t)(seq >> (8 * i));
+    }
+    uint32_t hash = store_fnv1a(STORE_FNV_BASIS, seqBytes, sizeof(seqBytes));
+    hash = store_fnv1a(hash, sender, PROTO_ID_SIZE);
+    return store_fnv1a(hash, body, length);
+}
+
+static size_t record_size(size_t length)
+{
+    return store_align_up(sizeof(struct OfflineRecordHeader) + length, OFFLINE_RECORD_ALIGN);
+}
+
+static size_t hash_device(const uint8_t* id)
+{
+    return (size_t)store_hash_id(id) & (OFFLINE_BUCKETS - 1);
+}
+
+static void segment_path(const struct OfflineDevice* device, uint64_t firstSeq, char* out, size_t outSize)
+{
+    snprintf(out, outSize, "%s/%020" PRIu64 OFFLINE_SEGMENT_SUFFIX, device->path, firstSeq);
+}
+
+static bool push_segment(struct OfflineDevice* device, const struct OfflineSegment* segment)
+{
+    if (device->segmentCount == device->segmentCapacity) {
+        size_t capacity = device->segmentCapacity ? device->segmentCapacity * 2 : 4;
+        struct OfflineSegment* segments = (struct OfflineSegment*)realloc(device->segments,
+            capacity * sizeof(*segments));
+        if (!segments) {
+            return false;
+        }
+        device->segments = segments;
+        device->segmentCapacity = capacity;
+    }
+    device->segments[device->segmentCount++] = *segment;
+    return true;
+}
+
+// Finds where an existing segment's valid records end. It is left unmapped
+// until a consumer attaches.
+static bool recover_segment(struct OfflineDevice* device, uint64_t firstSeq)
+{
+    char path[4096];
+    segment_path(device, firstSeq, path, sizeof(path));
+
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open segment");
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(struct OfflineRecordHeader)) {
+        close(fd);
+        unlink(path);
+        return true;
+    }
+
+    struct OfflineSegment segment;
+    memset(&segment, 0, sizeof(segment));
+    segment.firstSeq = firstSeq;
+    segment.capacity = (size_t)info.st_size;
+    segment.map = (uint8_t*)mmap(NULL, segment.capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment.map == MAP_FAILED) {
+        perror("mmap segment");
+        return false;
+    }
+
+    uint64_t expected = firstSeq;
+    while (segment.used + sizeof(struct OfflineRecordHeader) <= segment.capacity) {
+        struct OfflineRecordHeader header;
+        memcpy(&header, segment.map + segment.used, sizeof(header));
+        size_t size = store_align_up(sizeof(header) + header.length, OFFLINE_RECORD_ALIGN);
+        if (header.length == 0 || header.seq != expected || segment.used + size > segment.capacity
+            || header.checksum != record_checksum(header.seq, header.sender,
+                segment.map + segment.used + sizeof(header), header.length)) {
+            break;
+        }
+        segment.lastSeq = header.seq;
+        segment.used += size;
+        ++expected;
+    }
+    // Whatever follows the last good record is a torn write; clear it so
+    // new appends are not mistaken for a continuation of it.
+    memset(segment.map + segment.used, 0, segment.capacity - segment.used);
+    segment.synced = segment.used;
+    munmap(segment.map, segment.capacity);
+    segment.map = NULL;
+
+    if (!push_segment(device, &segment)) {
+        return false;
+    }
+    if (segment.lastSeq >= device->nextSeq) {
+        device->nextSeq = segment.lastSeq + 1;
+    }
+    return true;
+}
+
+static int compare_seq(const void* left, const void* right)
+{
+    uint64_t a = *(const uint64_t*)left;
+    uint64_t b = *(const uint64_t*)right;
+    return a < b ? -1 : a > b;
+}
+
+// Loads the device's acknowledgement and segments; caller holds device->mutex.
+static bool load_device(struct OfflineStore* store, struct OfflineDevice* device)
+{
+    char name[2 * PROTO_ID_SIZE + 1];
+    for (size_t i = 0; i < PROTO_ID_SIZE; ++i) {
+        snprintf(name + 2 * i, 3, "%02x", device->id[i]);
+    }
+    device->path = store_join_path(store->directory, name);
+    if (!device->path) {
+        return false;
+    }
+    device->nextSeq = 1;
+    device->stagedTail = &device->stagedHead;
+
+    char* ackPath = store_join_path(device->path, OFFLINE_ACK_FILE);
+    if (ackPath) {
+        int fd = open(ackPath, O_RDONLY | O_CLOEXEC);
+        uint64_t acked;
+        if (fd >= 0 && pread(fd, &acked, sizeof(acked), 0) == (ssize_t)sizeof(acked)) {
+            device->ackedSeq = acked;
+            device->durableAckedSeq = acked;
+            device->nextSeq = acked + 1;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        free(ackPath);
+    }
+
+    DIR* dir = opendir(device->path);
+    if (dir) {
+        uint64_t* firstSeqs = NULL;
+        size_t count = 0;
+        size_t capacity = 0;
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            char* end;
+            uint64_t firstSeq = strtoull(entry->d_name, &end, 10);
+            if (end == entry->d_name || strcmp(end, OFFLINE_SEGMENT_SUFFIX) != 0) {
+                continue;
+            }
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 8;
+                uint64_t* grown = (uint64_t*)realloc(firstSeqs, capacity * sizeof(*grown));
+                if (!grown) {
+                    break;
+                }
+                firstSeqs = grown;
+            }
+            firstSeqs[count++] = firstSeq;
+        }
+        closedir(dir);
+
+        qsort(firstSeqs, count, sizeof(*firstSeqs), compare_seq);
+        for (size_t i = 0; i < count; ++i) {
+            recover_segment(device, firstSeqs[i]);
+        }
+        free(firstSeqs);
+    }
+
+    device->cursorSeq = 0;
+    device->loaded = true;
+    return true;
+}
+
+// Returns the device, loading it on first use, with its mutex held; NULL on failure.
+static struct OfflineDevice* lock_device(struct OfflineStore* store, const uint8_t* id)
+{
+    size_t bucket = hash_device(id);
+    pthread_mutex_t* stripe = &store->tableMutex[bucket % OFFLINE_TABLE_STRIPES];
+
+    pthread_mutex_lock(stripe);
+    struct OfflineDevice* device = store->buckets[bucket];
+    while (device && memcmp(device->id, id, PROTO_ID_SIZE) != 0) {
+        device = device->next;
+    }
+    if (!device) {
+        device = (struct OfflineDevice*)calloc(1, sizeof(*device));
+        if (!device) {
+            pthread_mutex_unlock(stripe);
+            log_error("malloc failed while tracking offline device");
+            return NULL;
+        }
+        memcpy(device->id, id, PROTO_ID_SIZE);
+        pthread_mutex_init(&device->mutex, NULL);
+        device->next = store->buckets[bucket];
+        store->buckets[bucket] = device;
+    }
+    pthread_mutex_unlock(stripe);
+
+    // Devices are never freed before the store, so the pointer stays valid.
+    pthread_mutex_lock(&device->mutex);
+    if (!device->loaded && !load_device(store, device)) {
+        pthread_mutex_unlock(&device->mutex);
+        return NULL;
+    }
+    return device;
+}
+
+static void mark_dirty(struct OfflineStore* store, struct OfflineDevice* device)
+{
+    // Already queued: the flusher clears the flag before it takes the device
+    // lock, so it will see whatever the caller just wrote.
+    if (atomic_load(&device->dirtyQueued)) {
+        return;
+    }
+    bool wake = false;
+    pthread_mutex_lock(&store->dirtyMutex);
+    if (!atomic_load(&device->dirtyQueued)) {
+        atomic_store(&device->dirtyQueued, true);
+        device->dirtyNext = store->dirtyHead;
+        wake = !store->dirtyHead;
+        store->dirtyHead = device;
+    }
+    pthread_mutex_unlock(&store->dirtyMutex);
+    if (wake) {
+        store_flusher_wake(&store->flusher);
+    }
+}
+
+static bool map_segment(struct OfflineStore* store, struct OfflineDevice* device, struct OfflineSegment* segment)
+{
+    char path[4096];
+    segment_path(device, segment->firstSeq, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open segment");
+        return false;
+    }
+    uint8_t* map = (uint8_t*)mmap(NULL, segment->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap segment");
+        return false;
+    }
+    segment->map = map;
+    atomic_fetch_add(&store->mappedSegments, 1);
+    return true;
+}
+
+static void unmap_segment(struct OfflineStore* store, struct OfflineSegment* segment)
+{
+    if (segment->map) {
+        munmap(segment->map, segment->capacity);
+        segment->map = NULL;
+        atomic_fetch_sub(&store->mappedSegments, 1);
+    }
+}
+
+// Maps the device's segments for its consumer while the store is under its
+// mapping budget; the rest are read through the file. Caller holds device->mutex.
+static void map_segments(struct OfflineStore* store, struct OfflineDevice* device)
+{
+    for (size_t i = 0; i < device->segmentCount; ++i) {
+        if (device->segments[i].map) {
+            continue;
+        }
+        if (atomic_load(&store->mappedSegments) >= store->config.maxMappedSegments
+            || !map_segment(store, device, &device->segments[i])) {
+            break;
+        }
+    }
+}
+
+static bool stage_record(struct OfflineStore* store, struct OfflineDevice* device,
+    const struct OfflineRecordHeader* header, const void* body)
+{
+    size_t size = record_size(header->length);
+    if (atomic_fetch_add(&store->stagedBytes, size) + size > store->config.maxStagedBytes) {
+        atomic_fetch_sub(&store->stagedBytes, size);
+        return false;
+    }
+    struct OfflineStaged* record = (struct OfflineStaged*)malloc(sizeof(*record) + header->length);
+    if (!record) {
+        atomic_fetch_sub(&store->stagedBytes, size);
+        return false;
+    }
+    record->next = NULL;
+    record->header = *header;
+    memcpy(record->body, body, header->length);
+    *device->stagedTail = record;
+    device->stagedTail = &record->next;
+    return true;
+}
+
+int offline_append(struct OfflineStore* store, const uint8_t* deviceId, const uint8_t* sender, const void* body,
+    size_t length, uint64_t* seq)
+{
+    if (length == 0 || length > UINT32_MAX) {
+        return -1;
+    }
+
+    struct OfflineDevice* device = lock_device(store, deviceId);
+    if (!device) {
+        return -1;
+    }
+
+    struct OfflineRecordHeader header;
+    header.length = (uint32_t)length;
+    header.seq = device->nextSeq;
+    memcpy(header.sender, sender, PROTO_ID_SIZE);
+    header.checksum = record_checksum(header.seq, sender, (const uint8_t*)body, length);
+
+    // Copy into the mapped tail when it has room and nothing is staged ahead
+    // of this record; otherwise the flusher writes it, creating the segment
+    // if need be, so no file is touched here.
+    size_t size = record_size(length);
+    struct OfflineSegment* tail = device->segmentCount ? &device->segments[device->segmentCount - 1] : NULL;
+    if (!device->stagedHead && tail && tail->map && tail->used + size <= tail->capacity) {
+        memcpy(tail->map + tail->used + sizeof(header), body, length);
+        memcpy(tail->map + tail->used, &header, sizeof(header));
+        tail->used += size;
+        tail->lastSeq = header.seq;
+    } else if (!stage_record(store, device, &header, body)) {
+        pthread_mutex_unlock(&device->mutex);
+        return -1;
+    }
+    ++device->nextSeq;
+    if (seq) {
+        *seq = header.seq;
+    }
+
+    if (device->consumer) {
+        device->notify(device->consumer);
+    }
+    pthread_mutex_unlock(&device->mutex);
+
+    mark_dirty(store, device);
+    return 0;
+}
+
+uint64_t offline_attach(struct OfflineStore* store, const uint8_t* deviceId, void* consumer, offline_notify_fn notify)
+{
+    struct OfflineDevice* device = lock_device(store, deviceId);
+    if (!device) {
+        return 1;
+    }
+    device->consumer = consumer;
+    device->notify = notify;
+    device->cursorSeq = 0;
+    map_segments(store, device);
+    uint64_t first = device->ackedSeq + 1;
+    pthread_mutex_unlock(&device->mutex);
+    return first;
+}
+
+void offline_detach(struct OfflineStore* store, const uint8_t* deviceId, void* consumer)
+{
+    struct OfflineDevice* device = lock_device(store, deviceId);
+    if (!device) {
+        return;
+    }
+    bool detached = device->consumer == consumer;
+    if (detached) {
+        device->consumer = NULL;
+        device->notify = NULL;
+    }
+    pthread_mutex_unlock(&device->mutex);
+
+    // The flusher unmaps it once it is synced.
+    if (detached) {
+        mark_dirty(store, device);
+    }
+}
+
+// Points at length bytes of the segment at offset: into its mapping, or read
+// into *buffer through *fd, which is opened on first use. NULL on failure.
+static const uint8_t* segment_bytes(const struct OfflineDevice* device, const struct OfflineSegment* segment,
+    size_t offset, size_t length, int* fd, uint8_t** buffer, size_t* bufferSize)
+{
+    if (segment->map) {
+        return segment->map + offset;
+    }
+    if (*fd < 0) {
+        char path[4096];
+        segment_path(device, segment->firstSeq, path, sizeof(path));
+        *fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (*fd < 0) {
+            perror("open segment");
+            return NULL;
+        }
+    }
+    if (length > *bufferSize) {
+        uint8_t* grown = (uint8_t*)realloc(*buffer, length);
+        if (!grown) {
+            return NULL;
+        }
+        *buffer = grown;
+        *bufferSize = length;
+    }
+    if (pread(*fd, *buffer, length, (off_t)offset) != (ssize_t)length) {
+        perror("read segment");
+        return NULL;
+    }
+    return *buffer;
+}
+
+uint64_t offline_read(struct OfflineStore* store, const uint8_t* deviceId, uint64_t fromSeq, offline_record_fn fn,
+    void* context)
+{
+    struct OfflineDevice* device = lock_device(store, deviceId);
+    if (!device) {
+        return fromSeq;
+    }
+
+    // Records below the acknowledgement may already be gone.
+    if (fromSeq <= device->ackedSeq) {
+        fromSeq = device->ackedSeq + 1;
+    }
+
+    size_t index;
+    size_t offset;
+    if (device->cursorSeq != 0 && device->cursorSeq == fromSeq && device->cursorSegment < device->segmentCount) {
+        index = device->cursorSegment;
+        offset = device->cursorOffset;
+    } else {
+        index = 0;
+        while (index + 1 < device->segmentCount && device->segments[index + 1].firstSeq <= fromSeq) {
+            ++index;
+        }
+        offset = 0;
+    }
+
+    uint64_t next = fromSeq;
+    bool more = true;
+    uint8_t* buffer = NULL;
+    size_t bufferSize = 0;
+    for (; more && index < device->segmentCount; ++index, offset = 0) {
+        struct OfflineSegment* segment = &device->segments[index];
+        int fd = -1;
+        while (offset < segment->used) {
+            struct OfflineRecordHeader header;
+            const uint8_t* bytes = segment_bytes(device, segment, offset, sizeof(header), &fd, &buffer, &bufferSize);
+            if (!bytes) {
+                more = false;
+                break;
+            }
+            memcpy(&header, bytes, sizeof(header));
+            size_t size = record_size(header.length);
+            if (header.seq < next) {
+                offset += size;
+                continue;
+            }
+            bytes = segment_bytes(device, segment, offset, sizeof(header) + header.length, &fd, &buffer, &bufferSize);
+            if (!bytes) {
+                more = false;
+                break;
+            }
+            more = fn(context, header.seq, header.sender, bytes + sizeof(header), header.length);
+            next = header.seq + 1;
+            offset += size;
+            if (!more) {
+                break;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!more) {
+            break;
+        }
+    }
+    free(buffer);
+
+    // Staged records come after every segment's; the cursor below still
+    // parks on the tail, where the flusher will write them.
+    for (struct OfflineStaged* record = device->stagedHead; more && record; record = record->next) {
+        if (record->header.seq < next) {
+            continue;
+        }
+        more = fn(context, record->header.seq, record->header.sender, record->body, record->header.length);
+        next = record->header.seq + 1;
+    }
+
+    if (index == device->segmentCount && index > 0) {
+        // Read to the end: park on the tail so the next call resumes there.
+        index = device->segmentCount - 1;
+        offset = device->segments[index].used;
+    }
+    device->cursorSeq = next;
+    device->cursorSegment = index;
+    device->cursorOffset = offset;
+    pthread_mutex_unlock(&device->mutex);
+    return next;
+}
+
+uint64_t offline_first_unacked(struct OfflineStore* store, const uint8_t* deviceId)
+{
+    struct OfflineDevice* device = lock_device(store, deviceId);
+    if (!device) {
+        return 1;
+    }
+    uint64_t first = device->ackedSeq + 1;
+    pthread_mutex_unlock(&device->mutex);
+    return first;
+}
+
+void offline_ack(struct OfflineStore* store, const uint8_t* deviceId, uint64_t seq)
+{
+    struct OfflineDevice* device = lock_device(store, deviceId);
+    if (!device) {
+        return;
+    }
+    if (seq >= device->nextSeq) {
+        seq = device->nextSeq - 1;
+    }
+    bool advanced = seq > device->ackedSeq;
+    if (advanced) {
+        device->ackedSeq = seq;
+    }
+    pthread_mutex_unlock(&device->mutex);
+
+    if (advanced) {
+        mark_dirty(store, device);
+    }
+}
+
+static bool write_ack_file(const struct OfflineDevice* device, uint64_t acked)
+{
+    if (mkdir(device->path, 0700) != 0 && errno != EEXIST) {
+        return false;
+    }
+    char* path = store_join_path(device->path, OFFLINE_ACK_FILE);
+    if (!path) {
+        return false;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    free(path);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = pwrite(fd, &acked, sizeof(acked), 0) == (ssize_t)sizeof(acked) && fdatasync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// Deletes segments whose records are all durably acknowledged; caller holds device->mutex.
+static void compact_device(struct OfflineStore* store, struct OfflineDevice* device)
+{
+    size_t removed = 0;
+    while (removed < device->segmentCount) {
+        struct OfflineSegment* segment = &device->segments[removed];
+        bool isTail = removed + 1 == device->segmentCount;
+        uint64_t last = segment->lastSeq ? segment->lastSeq : segment->firstSeq - 1;
+        // A tail that still has room keeps taking appends unless it is empty of live records.
+        if (last > device->durableAckedSeq || (isTail && segment->lastSeq == 0)) {
+            break;
+        }
+        char path[4096];
+        segment_path(device, segment->firstSeq, path, sizeof(path));
+        unmap_segment(store, segment);
+        unlink(path);
+        ++removed;
+    }
+    if (removed > 0) {
+        memmove(device->segments, device->segments + removed, (device->segmentCount - removed) * sizeof(*device->segments));
+        device->segmentCount -= removed;
+        device->cursorSeq = 0;
+    }
+}
+
+// Creates and sizes a segment file for records from firstSeq on, and makes
+// its name durable. Runs on the flusher without the device lock; on failure
+// errno tells why.
+static bool create_segment(struct OfflineStore* store, const struct OfflineDevice* device, uint64_t firstSeq,
+    size_t recordSize, struct OfflineSegment* segment)
+{
+    if (mkdir(device->path, 0700) != 0 && errno != EEXIST) {
+        return false;
+    }
+
+    memset(segment, 0, sizeof(*segment));
+    segment->firstSeq = firstSeq;
+    segment->capacity = store_align_up(recordSize, store->pageSize);
+    if (segment->capacity < store->config.segmentBytes) {
+        segment->capacity = store_align_up(store->config.segmentBytes, store->pageSize);
+    }
+
+    char path[4096];
+    segment_path(device, firstSeq, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ftruncate(fd, (off_t)segment->capacity) == 0;
+    close(fd);
+    // The new name must survive a crash before records in it can.
+    if (!ok || !store_sync_directory(device->path)) {
+        int saved = errno;
+        unlink(path);
+        errno = saved;
+        return false;
+    }
+    return true;
+}
+
+// Moves staged records into segments, adding segments as they fill.
+// Caller holds device->mutex; it is released while a segment is created,
+// which is safe because only the flusher adds or removes segments and pops
+// staged records.
+static bool write_staged(struct OfflineStore* store, struct OfflineDevice* device)
+{
+    static const uint8_t padding[OFFLINE_RECORD_ALIGN];
+    int fd = -1;
+    size_t fdSegment = 0;
+    bool ok = true;
+
+    while (ok && device->stagedHead) {
+        struct OfflineStaged* record = device->stagedHead;
+        size_t size = record_size(record->header.length);
+        size_t tailIndex = device->segmentCount ? device->segmentCount - 1 : 0;
+        struct OfflineSegment* tail = device->segmentCount ? &device->segments[tailIndex] : NULL;
+        if (!tail || tail->used + size > tail->capacity) {
+            struct OfflineSegment segment;
+            pthread_mutex_unlock(&device->mutex);
+            ok = create_segment(store, device, record->header.seq, size, &segment);
+            if (!ok && !store->writeFailing) {
+                perror("create offline segment");
+            }
+            pthread_mutex_lock(&device->mutex);
+            if (ok && !push_segment(device, &segment)) {
+                char path[4096];
+                segment_path(device, segment.firstSeq, path, sizeof(path));
+                unlink(path);
+                ok = false;
+            }
+            continue;
+        }
+
+        if (fd >= 0 && fdSegment != tailIndex) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd < 0) {
+            char path[4096];
+            segment_path(device, tail->firstSeq, path, sizeof(path));
+            fd = open(path, O_WRONLY | O_CLOEXEC);
+            fdSegment = tailIndex;
+        }
+        // Zero padding too: a recovered tail may hold a cleared torn write there.
+        struct iovec parts[3] = {
+            { &record->header, sizeof(record->header) },
+            { record->body, record->header.length },
+            { (void*)padding, size - sizeof(record->header) - record->header.length }
+        };
+        if (fd < 0 || pwritev(fd, parts, 3, (off_t)tail->used) != (ssize_t)size) {
+            if (!store->writeFailing) {
+                perror("write offline record");
+            }
+            ok = false;
+            break;
+        }
+        tail->used += size;
+        tail->lastSeq = record->header.seq;
+        device->stagedHead = record->next;
+        if (!device->stagedHead) {
+            device->stagedTail = &device->stagedHead;
+        }
+        atomic_fetch_sub(&store->stagedBytes, size);
+        free(record);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ok;
+}
+
+static bool sync_segment(struct OfflineStore* store, const struct OfflineDevice* device, struct OfflineSegment* segment)
+{
+    if (segment->map) {
+        size_t start = segment->synced / store->pageSize * store->pageSize;
+        if (msync(segment->map + start, segment->used - start, MS_SYNC) != 0) {
+            perror("msync segment");
+            return false;
+        }
+        return true;
+    }
+    char path[4096];
+    segment_path(device, segment->firstSeq, path, sizeof(path));
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    bool ok = fd >= 0 && fdatasync(fd) == 0;
+    if (!ok) {
+        perror("sync segment");
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ok;
+}
+
+static void flush_device(struct OfflineStore* store, struct OfflineDevice* device)
+{
+    pthread_mutex_lock(&device->mutex);
+
+    // Retried on the next pass while the disk refuses it; appends keep being
+    // staged, up to the store's limit.
+    bool written = write_staged(store, device);
+    if (written != !store->writeFailing) {
+        if (written) {
+            log_info("offline store: staged records written again");
+        }
+        store->writeFailing = !written;
+    }
+    if (device->consumer) {
+        map_segments(store, device);
+    }
+
+    for (size_t i = 0; i < device->segmentCount; ++i) {
+        struct OfflineSegment* segment = &device->segments[i];
+        if (segment->used > segment->synced && sync_segment(store, device, segment)) {
+            segment->synced = segment->used;
+        }
+    }
+
+    if (device->ackedSeq > device->durableAckedSeq) {
+        if (write_ack_file(device, device->ackedSeq)) {
+            device->durableAckedSeq = device->ackedSeq;
+            compact_device(store, device);
+        } else {
+            perror("write offline ack");
+        }
+    }
+
+    // Only devices with a consumer keep mappings, which bounds them by the
+    // connected devices rather than every device ever written to.
+    if (!device->consumer) {
+        for (size_t i = 0; i < device->segmentCount; ++i) {
+            unmap_segment(store, &device->segments[i]);
+        }
+    }
+
+    pthread_mutex_unlock(&device->mutex);
+
+    if (!written) {
+        mark_dirty(store, device);
+    }
+}
+
+static void flush_dirty(void* context)
+{
+    struct OfflineStore* store = (struct OfflineStore*)context;
+    pthread_mutex_lock(&store->dirtyMutex);
+    struct OfflineDevice* device = store->dirtyHead;
+    store->dirtyHead = NULL;
+    pthread_mutex_unlock(&store->dirtyMutex);
+
+    while (device) {
+        // mark_dirty only relinks a device once dirtyQueued is clear, so take
+        // the successor before clearing it. Appends racing with the flush
+        // requeue the device for the next round.
+        pthread_mutex_lock(&store->dirtyMutex);
+        struct OfflineDevice* next = device->dirtyNext;
+        atomic_store(&device->dirtyQueued, false);
+        pthread_mutex_unlock(&store->dirtyMutex);
+
+        flush_device(store, device);
+        device = next;
+    }
+}
+
+struct OfflineStore* offline_open(const struct OfflineConfig* config)
+{
+    if (mkdir(config->directory, 0700) != 0 && errno != EEXIST) {
+        perror("mkdir spool");
+        return NULL;
+    }
+
+    struct OfflineStore* store = (struct OfflineStore*)calloc(1, sizeof(*store));
+    if (!store) {
+        return NULL;
+    }
+    store->config = *config;
+    if (store->config.commitIntervalMs == 0) {
+        store->config.commitIntervalMs = OFFLINE_DEFAULT_COMMIT_INTERVAL_MS;
+    }
+    if (store->config.maxStagedBytes == 0) {
+        store->config.maxStagedBytes = OFFLINE_DEFAULT_MAX_STAGED_BYTES;
+    }
+    if (store->config.maxMappedSegments == 0) {
+        store->config.maxMappedSegments = OFFLINE_DEFAULT_MAX_MAPPED_SEGMENTS;
+    }
+    store->directory = strdup(config->directory);
+    store->pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    store->buckets = (struct OfflineDevice**)calloc(OFFLINE_BUCKETS, sizeof(*store->buckets));
+    if (!store->directory || !store->buckets) {
+        free(store->directory);
+        free(store->buckets);
+        free(store);
+        return NULL;
+    }
+    for (size_t i = 0; i < OFFLINE_TABLE_STRIPES; ++i) {
+        pthread_mutex_init(&store->tableMutex[i], NULL);
+    }
+    pthread_mutex_init(&store->dirtyMutex, NULL);
+
+    if (!store_flusher_start(&store->flusher, STORE_FLUSH_COMMIT_GROUP, store->config.commitIntervalMs, flush_dirty,
+            store)) {
+        pthread_mutex_destroy(&store->dirtyMutex);
+        for (size_t i = 0; i < OFFLINE_TABLE_STRIPES; ++i) {
+            pthread_mutex_destroy(&store->tableMutex[i]);
+        }
+        free(store->directory);
+        free(store->buckets);
+        free(store);
+        return NULL;
+    }
+    return store;
+}
+
+void offline_close(struct OfflineStore* store)
+{
+    if (!store) {
+        return;
+    }
+
+    store_flusher_stop(&store->flusher);
+
+    for (size_t i = 0; i < OFFLINE_BUCKETS; ++i) {
+        struct OfflineDevice* device = store->buckets[i];
+        while (device) {
+            struct OfflineDevice* next = device->next;
+            for (size_t s = 0; s < device->segmentCount; ++s) {
+                unmap_segment(store, &device->segments[s]);
+            }
+            // Left over only if the last flush failed.
+            while (device->stagedHead) {
+                struct OfflineStaged* record = device->stagedHead;
+                device->stagedHead = record->next;
+                free(record);
+            }
+            free(device->segments);
+            free(device->path);
+            pthread_mutex_destroy(&device->mutex);
+            free(device);
+            device = next;
+        }
+    }
+    free(store->buckets);
+    free(store->directory);
+    pthread_mutex_destroy(&store->dirtyMutex);
+    for (size_t i = 0; i < OFFLINE_TABLE_STRIPES; ++i) {
+        pthread_mutex_destroy(&store->tableMutex[i]);
+    }
+    free(store);
+}
+
+#endif // __linux__
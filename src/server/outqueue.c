@@ -0,0 +1,526 @@
+#include "outqueue.h"
+#include "metrics.h"
+#include "logger.h"
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+#endif
+
+#define OUTQ_INITIAL_CAPACITY 8
+// Segments (two per frame) one flush hands to sendmsg.
+#define OUTQ_FLUSH_IOV 64
+
+void outqueue_default_config(struct OutQueueConfig* config)
+{
+    config->maxFrames = OUTQ_DEFAULT_MAX_FRAMES;
+    config->highWaterBytes = OUTQ_DEFAULT_HIGH_WATER_BYTES;
+    config->policy = OUTQ_DROP_OLDEST;
+    config->zeroCopyMinBytes = OUTQ_DEFAULT_ZEROCOPY_MIN_BYTES;
+}
+
+bool outqueue_parse_policy(const char* name, enum OutQueuePolicy* policy)
+{
+    if (strcmp(name, "drop-oldest") == 0) {
+        *policy = OUTQ_DROP_OLDEST;
+    } else if (strcmp(name, "drop-newest") == 0) {
+        *policy = OUTQ_DROP_NEWEST;
+    } else if (strcmp(name, "disconnect") == 0) {
+        *policy = OUTQ_DISCONNECT;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void outqueue_init(struct OutQueue* queue, const struct OutQueueConfig* config)
+{
+    memset(queue, 0, sizeof(*queue));
+    pthread_mutex_init(&queue->mutex, NULL);
+    queue->config = config;
+}
+
+void outqueue_destroy(struct OutQueue* queue)
+{
+    if (queue->count > 0) {
+        metrics_adjust(METRIC_QUEUED_FRAMES, -(int64_t)queue->count);
+        metrics_adjust(METRIC_QUEUED_BYTES, -(int64_t)queue->queuedBytes);
+    }
+    for (size_t i = 0; i < queue->count; ++i) {
+        msgbuf_release(queue->frames[(queue->head + i) % queue->capacity].buf);
+    }
+    free(queue->frames);
+    // Pages of a zero-copy send still in flight stay pinned by the kernel.
+    for (size_t i = 0; i < queue->zeroCopyCount; ++i) {
+        msgbuf_release(queue->zeroCopyBufs[(queue->zeroCopyHead + i) % queue->zeroCopyCapacity]);
+    }
+    free(queue->zeroCopyBufs);
+    pthread_mutex_destroy(&queue->mutex);
+    memset(queue, 0, sizeof(*queue));
+}
+
+static void pop_front_locked(struct OutQueue* queue)
+{
+    struct OutFrame* frame = &queue->frames[queue->head];
+    size_t unsent = msgbuf_size(frame->buf) - frame->offset;
+    queue->queuedBytes -= unsent;
+    metrics_adjust(METRIC_QUEUED_FRAMES, -1);
+    if (unsent > 0) {
+        metrics_adjust(METRIC_QUEUED_BYTES, -(int64_t)unsent);
+    }
+    msgbuf_release(frame->buf);
+    frame->buf = NULL;
+    queue->head = (queue->head + 1) % queue->capacity;
+    --queue->count;
+    if (queue->encodeNext > 0) {
+        --queue->encodeNext;
+    }
+}
+
+static bool grow_locked(struct OutQueue* queue)
+{
+    size_t newCapacity = queue->capacity ? queue->capacity * 2 : OUTQ_INITIAL_CAPACITY;
+    if (newCapacity > queue->config->maxFrames) {
+        newCapacity = queue->config->maxFrames;
+    }
+
+    struct OutFrame* frames = (struct OutFrame*)malloc(newCapacity * sizeof(*frames));
+    if (!frames) {
+        log_error("malloc failed while growing outbound queue");
+        return false;
+    }
+    for (size_t i = 0; i < queue->count; ++i) {
+        frames[i] = queue->frames[(queue->head + i) % queue->capacity];
+    }
+    free(queue->frames);
+    queue->frames = frames;
+    queue->capacity = newCapacity;
+    queue->head = 0;
+    return true;
+}
+
+static bool is_full_locked(const struct OutQueue* queue, size_t length)
+{
+    return queue->count >= queue->config->maxFrames
+        || queue->queuedBytes + length > queue->config->highWaterBytes;
+}
+
+enum OutQueueResult outqueue_push(struct OutQueue* queue, struct MsgBuf* buf)
+{
+    size_t length = msgbuf_size(buf);
+    if (length > queue->config->highWaterBytes) {
+        pthread_mutex_lock(&queue->mutex);
+        ++queue->droppedFrames;
+        metrics_add(METRIC_QUEUE_DROPS, 1);
+        pthread_mutex_unlock(&queue->mutex);
+        return OUTQ_DROPPED;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+
+    if (queue->overflowed) {
+        pthread_mutex_unlock(&queue->mutex);
+        return OUTQ_OVERFLOW;
+    }
+
+    if (is_full_locked(queue, length)) {
+        switch (queue->config->policy) {
+        case OUTQ_DROP_NEWEST:
+            ++queue->droppedFrames;
+            metrics_add(METRIC_QUEUE_DROPS, 1);
+            pthread_mutex_unlock(&queue->mutex);
+            return OUTQ_DROPPED;
+        case OUTQ_DISCONNECT:
+            queue->overflowed = true;
+            pthread_mutex_unlock(&queue->mutex);
+            return OUTQ_OVERFLOW;
+        case OUTQ_DROP_OLDEST:
+            // A partially written head frame must finish, or the stream desyncs;
+            // frames an asynchronous send still reads must stay alive, and
+            // so must encoded ones.
+            while (is_full_locked(queue, length) && queue->count > 0 && queue->pinned == 0
+                && queue->frames[queue->head].offset == 0 && !queue->frames[queue->head].encoded) {
+                pop_front_locked(queue);
+                ++queue->droppedFrames;
+                metrics_add(METRIC_QUEUE_DROPS, 1);
+            }
+            if (is_full_locked(queue, length)) {
+                ++queue->droppedFrames;
+                metrics_add(METRIC_QUEUE_DROPS, 1);
+                pthread_mutex_unlock(&queue->mutex);
+                return OUTQ_DROPPED;
+            }
+            break;
+        }
+    }
+
+    if (queue->count == queue->capacity && !grow_locked(queue)) {
+        ++queue->droppedFrames;
+        metrics_add(METRIC_QUEUE_DROPS, 1);
+        pthread_mutex_unlock(&queue->mutex);
+        return OUTQ_DROPPED;
+    }
+
+    bool wasEmpty = queue->count == 0;
+    struct OutFrame* frame = &queue->frames[(queue->head + queue->count) % queue->capacity];
+    msgbuf_retain(buf);
+    frame->buf = buf;
+    frame->offset = 0;
+    frame->encoded = false;
+    ++queue->count;
+    queue->queuedBytes += length;
+
+    pthread_mutex_unlock(&queue->mutex);
+    metrics_add(METRIC_QUEUED_FRAMES, 1);
+    metrics_add(METRIC_QUEUED_BYTES, length);
+    return wasEmpty ? OUTQ_QUEUED_FIRST : OUTQ_QUEUED;
+}
+
+bool outqueue_has_headroom(struct OutQueue* queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    bool headroom = !queue->overflowed && (queue->count == 0
+        || (queue->count < queue->config->maxFrames / 2 && queue->queuedBytes < queue->config->highWaterBytes / 2));
+    pthread_mutex_unlock(&queue->mutex);
+    return headroom;
+}
+
+size_t outqueue_length(struct OutQueue* queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    size_t count = queue->count;
+    pthread_mutex_unlock(&queue->mutex);
+    return count;
+}
+
+// Accounts for written bytes from the head of the queue; returns how many
+// frames they completed.
+static size_t advance_locked(struct OutQueue* queue, size_t written)
+{
+    size_t framesSent = 0;
+    queue->queuedBytes -= written;
+    while (written > 0 && queue->count > 0) {
+        struct OutFrame* frame = &queue->frames[queue->head];
+        size_t unsent = msgbuf_size(frame->buf) - frame->offset;
+        if (written < unsent) {
+            frame->offset += written;
+            break;
+        }
+        written -= unsent;
+        frame->offset += unsent;
+        pop_front_locked(queue);
+        ++framesSent;
+    }
+    return framesSent;
+}
+
+void outqueue_set_encoder(struct OutQueue* queue, outqueue_encode_fn encode, void* context)
+{
+    pthread_mutex_lock(&queue->mutex);
+    queue->encode = encode;
+    queue->encodeContext = context;
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// Passes the first limit frames (as many as one send can gather) through the
+// encoder, each once and in queue order, dropping the mutex around every
+// call. The caller holds the mutex, and has it again on return. A claimed
+// frame stays put meanwhile: only the owning thread (the caller) sends, and
+// drop-oldest stops at an encoded head. The ring may grow, so the frame is
+// looked up again after.
+static void encode_ahead_locked(struct OutQueue* queue, size_t limit)
+{
+    while (queue->encode && queue->encodeNext < queue->count && queue->encodeNext < limit) {
+        size_t index = queue->encodeNext++;
+        struct OutFrame* frame = &queue->frames[(queue->head + index) % queue->capacity];
+        if (frame->offset > 0) {
+            continue;
+        }
+        frame->encoded = true;
+        struct MsgBuf* buf = frame->buf;
+        pthread_mutex_unlock(&queue->mutex);
+        struct MsgBuf* encoded = queue->encode(queue->encodeContext, buf);
+        pthread_mutex_lock(&queue->mutex);
+        if (!encoded) {
+            continue;
+        }
+        frame = &queue->frames[(queue->head + index) % queue->capacity];
+        size_t before = msgbuf_size(frame->buf);
+        size_t after = msgbuf_size(encoded);
+        queue->queuedBytes = queue->queuedBytes - before + after;
+        metrics_adjust(METRIC_QUEUED_BYTES, (int64_t)after - (int64_t)before);
+        msgbuf_release(frame->buf);
+        frame->buf = encoded;
+    }
+}
+
+#ifndef _WIN32
+// Describes queued bytes, from the first unwritten one, in at most maxIov
+// segments and sets *frames to the frames they cover. With zeroCopy given, a
+// frame large enough for MSG_ZEROCOPY is gathered alone and flags it.
+static int gather_locked(struct OutQueue* queue, struct iovec* iov, int maxIov, size_t* frames, bool* zeroCopy)
+{
+    int segments = 0;
+    size_t count = 0;
+    while (count < queue->count && segments + 2 <= maxIov && (!queue->encode || count < queue->encodeNext)) {
+        struct OutFrame* frame = &queue->frames[(queue->head + count) % queue->capacity];
+        struct MsgBuf* buf = frame->buf;
+        bool large = zeroCopy && queue->zeroCopy && buf->bodyLength >= queue->config->zeroCopyMinBytes;
+        if (large && count > 0) {
+            break;
+        }
+        if (frame->offset < buf->headLength) {
+            iov[segments].iov_base = buf->head + frame->offset;
+            iov[segments].iov_len = buf->headLength - frame->offset;
+            ++segments;
+            if (buf->bodyLength > 0) {
+                iov[segments].iov_base = buf->body;
+                iov[segments].iov_len = buf->bodyLength;
+                ++segments;
+            }
+        } else {
+            iov[segments].iov_base = buf->body + (frame->offset - buf->headLength);
+            iov[segments].iov_len = msgbuf_size(buf) - frame->offset;
+            ++segments;
+        }
+        ++count;
+        if (large) {
+            *zeroCopy = true;
+            break;
+        }
+    }
+    *frames = count;
+    return segments;
+}
+#endif
+
+#ifdef __linux__
+// Makes room to remember one more zero-copy send.
+static bool reserve_zerocopy_locked(struct OutQueue* queue)
+{
+    if (queue->zeroCopyCount < queue->zeroCopyCapacity) {
+        return true;
+    }
+    size_t newCapacity = queue->zeroCopyCapacity ? queue->zeroCopyCapacity * 2 : OUTQ_INITIAL_CAPACITY;
+    struct MsgBuf** bufs = (struct MsgBuf**)malloc(newCapacity * sizeof(*bufs));
+    if (!bufs) {
+        return false;
+    }
+    for (size_t i = 0; i < queue->zeroCopyCount; ++i) {
+        bufs[i] = queue->zeroCopyBufs[(queue->zeroCopyHead + i) % queue->zeroCopyCapacity];
+    }
+    free(queue->zeroCopyBufs);
+    queue->zeroCopyBufs = bufs;
+    queue->zeroCopyCapacity = newCapacity;
+    queue->zeroCopyHead = 0;
+    return true;
+}
+#endif
+
+// Sends from the head of the queue; returns what send returned and sets
+// *attempted to the bytes offered.
+static int send_queued_locked(struct OutQueue* queue, socket_t sockfd, size_t* attempted)
+{
+#ifdef _WIN32
+    struct OutFrame* frame = &queue->frames[queue->head];
+    const struct MsgBuf* buf = frame->buf;
+    *attempted = msgbuf_size(buf) - frame->offset;
+    if (frame->offset < buf->headLength) {
+        return send_two(sockfd, buf->head + frame->offset, buf->headLength - frame->offset,
+            buf->body, buf->bodyLength);
+    }
+    return send(sockfd, (const char*)buf->body + (frame->offset - buf->headLength), (int)*attempted,
+        MSG_NOSIGNAL);
+#else
+    struct iovec iov[OUTQ_FLUSH_IOV];
+    size_t frames;
+    bool zeroCopy = false;
+    int segments = gather_locked(queue, iov, OUTQ_FLUSH_IOV, &frames, &zeroCopy);
+    *attempted = 0;
+    for (int i = 0; i < segments; ++i) {
+        *attempted += iov[i].iov_len;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t)segments;
+    int flags = MSG_NOSIGNAL;
+#ifdef __linux__
+    if (zeroCopy && reserve_zerocopy_locked(queue)) {
+        flags |= MSG_ZEROCOPY;
+    }
+#endif
+    ssize_t sent = sendmsg(sockfd, &msg, flags);
+#ifdef __linux__
+    if (flags & MSG_ZEROCOPY) {
+        if (sent >= 0) {
+            // Every successful zero-copy send takes the next notification id.
+            struct MsgBuf* buf = queue->frames[queue->head].buf;
+            msgbuf_retain(buf);
+            queue->zeroCopyBufs[(queue->zeroCopyHead + queue->zeroCopyCount) % queue->zeroCopyCapacity] = buf;
+            ++queue->zeroCopyCount;
+            metrics_add(METRIC_ZEROCOPY_SENDS, 1);
+        } else if (errno == ENOBUFS) {
+            // Out of optmem for notifications: copy this one.
+            metrics_add(METRIC_IO_SYSCALLS, 1);
+            sent = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+        }
+    }
+#endif
+    return sent < 0 ? SOCKET_ERROR : (int)sent;
+#endif
+}
+
+enum OutQueueFlushResult outqueue_flush(struct OutQueue* queue, socket_t sockfd)
+{
+    enum OutQueueFlushResult result = OUTQ_FLUSH_DRAINED;
+    uint64_t framesSent = 0;
+    uint64_t bytesSent = 0;
+
+    pthread_mutex_lock(&queue->mutex);
+
+    if (queue->overflowed) {
+        pthread_mutex_unlock(&queue->mutex);
+        return OUTQ_FLUSH_ERROR;
+    }
+
+    while (queue->count > 0) {
+        encode_ahead_locked(queue, OUTQ_FLUSH_IOV);
+        if (queue->overflowed) {
+            result = OUTQ_FLUSH_ERROR;
+            break;
+        }
+        size_t attempted;
+        int sent = send_queued_locked(queue, sockfd, &attempted);
+        metrics_add(METRIC_IO_SYSCALLS, 1);
+        if (sent == SOCKET_ERROR) {
+            int err = WSAGetLastError();
+#ifndef _WIN32
+            if (err == EINTR) {
+                continue;
+            }
+#endif
+            result = SOCKET_WOULD_BLOCK(err) ? OUTQ_FLUSH_BLOCKED : OUTQ_FLUSH_ERROR;
+            if (result == OUTQ_FLUSH_ERROR) {
+                log_os_error("queued send");
+                metrics_add(METRIC_SEND_ERRORS, 1);
+            }
+            break;
+        }
+
+        framesSent += advance_locked(queue, (size_t)sent);
+        bytesSent += (size_t)sent;
+        // A short write means the socket buffer is full; writability is
+        // reported once it drains, so asking again would only fail.
+        if ((size_t)sent < attempted) {
+            result = OUTQ_FLUSH_BLOCKED;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&queue->mutex);
+    if (bytesSent > 0) {
+        metrics_add(METRIC_FRAMES_OUT, framesSent);
+        metrics_add(METRIC_BYTES_OUT, bytesSent);
+        metrics_adjust(METRIC_QUEUED_BYTES, -(int64_t)bytesSent);
+    }
+    return result;
+}
+
+#ifdef __linux__
+void outqueue_enable_zerocopy(struct OutQueue* queue)
+{
+    queue->zeroCopy = queue->config->zeroCopyMinBytes > 0;
+}
+
+// Releases the frames of zero-copy sends first..last (notification ids).
+static void complete_zerocopy(struct OutQueue* queue, uint32_t first, uint32_t last)
+{
+    uint32_t begin = first - queue->zeroCopyFirstId;
+    uint32_t end = last - queue->zeroCopyFirstId;
+    for (uint32_t i = begin; i <= end && i < queue->zeroCopyCount; ++i) {
+        struct MsgBuf** slot = &queue->zeroCopyBufs[(queue->zeroCopyHead + i) % queue->zeroCopyCapacity];
+        msgbuf_release(*slot);
+        *slot = NULL;
+    }
+    while (queue->zeroCopyCount > 0 && !queue->zeroCopyBufs[queue->zeroCopyHead]) {
+        queue->zeroCopyHead = (queue->zeroCopyHead + 1) % queue->zeroCopyCapacity;
+        --queue->zeroCopyCount;
+        ++queue->zeroCopyFirstId;
+    }
+}
+
+bool outqueue_reap_zerocopy(struct OutQueue* queue, socket_t sockfd)
+{
+    while (true) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        metrics_add(METRIC_IO_SYSCALLS, 1);
+        if (recvmsg(sockfd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) {
+                continue;
+            }
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0) {
+                continue;
+            }
+            complete_zerocopy(queue, err.ee_info, err.ee_data);
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // The route can't send from user pages (loopback, or no
+                // scatter-gather): the kernel copied after all, so stop
+                // paying for notifications on this socket.
+                metrics_add(METRIC_ZEROCOPY_COPIED, err.ee_data - err.ee_info + 1);
+                queue->zeroCopy = false;
+            }
+        }
+    }
+}
+#endif
+
+#ifndef _WIN32
+int outqueue_gather(struct OutQueue* queue, struct iovec* iov, int maxIov)
+{
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->overflowed) {
+        pthread_mutex_unlock(&queue->mutex);
+        return -1;
+    }
+
+    encode_ahead_locked(queue, (size_t)maxIov);
+    if (queue->overflowed) {
+        pthread_mutex_unlock(&queue->mutex);
+        return -1;
+    }
+    size_t frames;
+    int segments = gather_locked(queue, iov, maxIov, &frames, NULL);
+    queue->pinned = frames;
+
+    pthread_mutex_unlock(&queue->mutex);
+    return segments;
+}
+
+void outqueue_complete(struct OutQueue* queue, size_t written)
+{
+    pthread_mutex_lock(&queue->mutex);
+    uint64_t framesSent = advance_locked(queue, written);
+    queue->pinned = 0;
+    pthread_mutex_unlock(&queue->mutex);
+
+    if (written > 0) {
+        metrics_add(METRIC_FRAMES_OUT, framesSent);
+        metrics_add(METRIC_BYTES_OUT, written);
+        metrics_adjust(METRIC_QUEUED_BYTES, -(int64_t)written);
+    }
+}
+#endif
@@ -0,0 +1,272 @@
+#include "pool.h"
+#include "metrics.h"
+
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define POOL_LARGE_CLASS UINT32_MAX
+#define POOL_MAX_BLOCK ((size_t)1 << (POOL_MIN_SHIFT + POOL_CLASS_COUNT - 1))
+#define POOL_CACHE_LIMIT (2 * POOL_BATCH)   // a thread spills a batch past this many blocks
+
+// Precedes every block handed out; keeps the caller's bytes aligned.
+union PoolHeader {
+    uint32_t sizeClass;
+    max_align_t align;
+};
+
+// A free block, linked through its own first bytes.
+struct PoolBlock {
+    struct PoolBlock* next;
+};
+
+struct PoolDepot {
+    pthread_mutex_t mutex;
+    struct PoolBlock* blocks;
+    size_t count;
+};
+
+struct PoolCache {
+    struct PoolBlock* blocks[POOL_CLASS_COUNT];
+    uint32_t counts[POOL_CLASS_COUNT];
+    bool registered;    // the thread-exit destructor will return the blocks
+    bool closed;        // the thread is exiting; frees go straight to the depot
+};
+
+static struct PoolDepot g_depots[POOL_CLASS_COUNT];
+static pthread_once_t g_poolOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_cacheKey;
+static _Thread_local struct PoolCache t_cache;
+
+static size_t block_size(size_t sizeClass)
+{
+    return (size_t)1 << (sizeClass + POOL_MIN_SHIFT);
+}
+
+static size_t size_class(size_t size)
+{
+    size_t total = size + sizeof(union PoolHeader);
+    size_t sizeClass = 0;
+    while (block_size(sizeClass) < total) {
+        ++sizeClass;
+    }
+    return sizeClass;
+}
+
+static void depot_put(size_t sizeClass, struct PoolBlock* first, struct PoolBlock* last, size_t count)
+{
+    struct PoolDepot* depot = &g_depots[sizeClass];
+    pthread_mutex_lock(&depot->mutex);
+    last->next = depot->blocks;
+    depot->blocks = first;
+    depot->count += count;
+    pthread_mutex_unlock(&depot->mutex);
+}
+
+static void return_cache(void* value)
+{
+    struct PoolCache* cache = (struct PoolCache*)value;
+    cache->closed = true;
+    for (size_t sizeClass = 0; sizeClass < POOL_CLASS_COUNT; ++sizeClass) {
+        struct PoolBlock* first = cache->blocks[sizeClass];
+        if (!first) {
+            continue;
+        }
+        struct PoolBlock* last = first;
+        while (last->next) {
+            last = last->next;
+        }
+        depot_put(sizeClass, first, last, cache->counts[sizeClass]);
+        cache->blocks[sizeClass] = NULL;
+        cache->counts[sizeClass] = 0;
+    }
+}
+
+static void init_pools(void)
+{
+    for (size_t sizeClass = 0; sizeClass < POOL_CLASS_COUNT; ++sizeClass) {
+        pthread_mutex_init(&g_depots[sizeClass].mutex, NULL);
+    }
+    pthread_key_create(&g_cacheKey, return_cache);
+}
+
+static void register_cache(struct PoolCache* cache)
+{
+    pthread_once(&g_poolOnce, init_pools);
+    pthread_setspecific(g_cacheKey, cache);
+    cache->registered = true;
+}
+
+// Carves a chunk into blocks of one class; the depot mutex is held.
+static int grow_depot(size_t sizeClass)
+{
+    size_t size = block_size(sizeClass);
+    uint8_t* chunk = (uint8_t*)malloc(POOL_CHUNK_SIZE);
+    if (!chunk) {
+        return -1;
+    }
+    metrics_add(METRIC_POOL_MALLOCS, 1);
+    metrics_adjust(METRIC_POOL_RESERVED_BYTES, POOL_CHUNK_SIZE);
+
+    struct PoolDepot* depot = &g_depots[sizeClass];
+    for (size_t offset = 0; offset + size <= POOL_CHUNK_SIZE; offset += size) {
+        struct PoolBlock* block = (struct PoolBlock*)(chunk + offset);
+        block->next = depot->blocks;
+        depot->blocks = block;
+        ++depot->count;
+    }
+    return 0;
+}
+
+// Moves up to a batch (one block once the thread is exiting) from the
+// depot into the cache, carving a new chunk if the depot is empty.
+static int refill(struct PoolCache* cache, size_t sizeClass)
+{
+    if (!cache->registered) {
+        register_cache(cache);
+    }
+    size_t wanted = cache->closed ? 1 : POOL_BATCH;
+    struct PoolDepot* depot = &g_depots[sizeClass];
+
+    pthread_mutex_lock(&depot->mutex);
+    if (!depot->blocks && grow_depot(sizeClass) != 0) {
+        pthread_mutex_unlock(&depot->mutex);
+        return -1;
+    }
+    struct PoolBlock* first = depot->blocks;
+    struct PoolBlock* last = first;
+    size_t count = 1;
+    while (count < wanted && last->next) {
+        last = last->next;
+        ++count;
+    }
+    depot->blocks = last->next;
+    depot->count -= count;
+    pthread_mutex_unlock(&depot->mutex);
+
+    last->next = cache->blocks[sizeClass];
+    cache->blocks[sizeClass] = first;
+    cache->counts[sizeClass] += (uint32_t)count;
+    metrics_add(METRIC_POOL_DEPOT_TRANSFERS, 1);
+    return 0;
+}
+
+// Hands a batch (everything once the thread is exiting) back to the depot.
+static void spill(struct PoolCache* cache, size_t sizeClass)
+{
+    size_t count = cache->closed ? cache->counts[sizeClass] : POOL_BATCH;
+    struct PoolBlock* first = cache->blocks[sizeClass];
+    struct PoolBlock* last = first;
+    for (size_t i = 1; i < count; ++i) {
+        last = last->next;
+    }
+    cache->blocks[sizeClass] = last->next;
+    cache->counts[sizeClass] -= (uint32_t)count;
+    depot_put(sizeClass, first, last, count);
+    metrics_add(METRIC_POOL_DEPOT_TRANSFERS, 1);
+}
+
+void* pool_alloc(size_t size)
+{
+    metrics_add(METRIC_POOL_ALLOCS, 1);
+    if (size > POOL_MAX_BLOCK - sizeof(union PoolHeader)) {
+        union PoolHeader* header = (union PoolHeader*)malloc(sizeof(*header) + size);
+        if (!header) {
+            return NULL;
+        }
+        metrics_add(METRIC_POOL_MALLOCS, 1);
+        header->sizeClass = POOL_LARGE_CLASS;
+        return header + 1;
+    }
+
+    size_t sizeClass = size_class(size);
+    struct PoolCache* cache = &t_cache;
+    if (!cache->blocks[sizeClass] && refill(cache, sizeClass) != 0) {
+        return NULL;
+    }
+    struct PoolBlock* block = cache->blocks[sizeClass];
+    cache->blocks[sizeClass] = block->next;
+    --cache->counts[sizeClass];
+
+    union PoolHeader* header = (union PoolHeader*)block;
+    header->sizeClass = (uint32_t)sizeClass;
+    return header + 1;
+}
+
+void pool_free(void* block)
+{
+    if (!block) {
+        return;
+    }
+    union PoolHeader* header = (union PoolHeader*)block - 1;
+    if (header->sizeClass == POOL_LARGE_CLASS) {
+        free(header);
+        return;
+    }
+
+    size_t sizeClass = header->sizeClass;
+    struct PoolCache* cache = &t_cache;
+    if (!cache->registered) {
+        register_cache(cache);
+    }
+    struct PoolBlock* freed = (struct PoolBlock*)header;
+    freed->next = cache->blocks[sizeClass];
+    cache->blocks[sizeClass] = freed;
+    ++cache->counts[sizeClass];
+    if (cache->closed || cache->counts[sizeClass] > POOL_CACHE_LIMIT) {
+        spill(cache, sizeClass);
+    }
+}
+
+void slab_init(struct Slab* slab, size_t objectSize)
+{
+    size_t alignment = alignof(max_align_t);
+    if (objectSize < sizeof(void*)) {
+        objectSize = sizeof(void*);
+    }
+    pthread_mutex_init(&slab->mutex, NULL);
+    slab->objectSize = (objectSize + alignment - 1) / alignment * alignment;
+    slab->freeList = NULL;
+}
+
+void* slab_alloc(struct Slab* slab)
+{
+    metrics_add(METRIC_POOL_ALLOCS, 1);
+    pthread_mutex_lock(&slab->mutex);
+    if (!slab->freeList) {
+        size_t perChunk = POOL_CHUNK_SIZE / slab->objectSize;
+        if (perChunk == 0) {
+            perChunk = 1;
+        }
+        uint8_t* chunk = (uint8_t*)malloc(perChunk * slab->objectSize);
+        if (!chunk) {
+            pthread_mutex_unlock(&slab->mutex);
+            return NULL;
+        }
+        metrics_add(METRIC_POOL_MALLOCS, 1);
+        metrics_adjust(METRIC_POOL_RESERVED_BYTES, (int64_t)(perChunk * slab->objectSize));
+        for (size_t i = perChunk; i-- > 0;) {
+            void* object = chunk + i * slab->objectSize;
+            *(void**)object = slab->freeList;
+            slab->freeList = object;
+        }
+    }
+    void* object = slab->freeList;
+    slab->freeList = *(void**)object;
+    pthread_mutex_unlock(&slab->mutex);
+
+    memset(object, 0, slab->objectSize);
+    return object;
+}
+
+void slab_free(struct Slab* slab, void* object)
+{
+    if (!object) {
+        return;
+    }
+    pthread_mutex_lock(&slab->mutex);
+    *(void**)object = slab->freeList;
+    slab->freeList = object;
+    pthread_mutex_unlock(&slab->mutex);
+}
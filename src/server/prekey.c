@@ -0,0 +1,703 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "prekey.h"
+#include "logger.h"
+#include "storeutil.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define PREKEY_BUCKETS 65536
+#define PREKEY_JOURNAL_NAME "journal"
+#define PREKEY_COMPACT_NAME "journal.tmp"
+// Claims waiting on a journal that has failed every write for this long are failed.
+#define PREKEY_GIVE_UP_MS 1000
+
+enum PrekeyRecordKind {
+    PREKEY_RECORD_UPLOAD = 1,
+    PREKEY_RECORD_CONSUMED = 2
+};
+
+// Journal record, host byte order, followed by length key bytes (none for
+// a tombstone). A bad checksum marks a torn tail.
+struct PrekeyRecord {
+    uint32_t checksum;      // over the rest of the record and the key
+    uint8_t kind;
+    uint8_t reserved;
+    uint16_t length;
+    uint64_t atMs;          // PublishedAt or ConsumedAt
+    uint8_t deviceId[PROTO_ID_SIZE];
+    uint8_t keyId[PROTO_ID_SIZE];
+};
+
+struct PrekeyKey;
+
+// Something for the journal thread to write; pushed on a lock-free stack.
+struct PrekeyJournalEntry {
+    struct PrekeyJournalEntry* next;
+    struct PrekeyKey* key;
+    uint8_t kind;
+};
+
+struct PrekeyKey {
+    // Both are pushed at most once: published on upload, consumed on claim.
+    struct PrekeyJournalEntry published;
+    struct PrekeyJournalEntry consumed;
+    uint8_t deviceId[PROTO_ID_SIZE];
+    uint8_t keyId[PROTO_ID_SIZE];
+    uint64_t publishedAtMs;
+    uint64_t consumedAtMs;
+    uint16_t length;
+    uint8_t publicKey[];
+};
+
+struct PrekeyDevice {
+    uint8_t id[PROTO_ID_SIZE];
+    _Atomic(struct PrekeyDevice*) next;     // bucket chain; devices are never removed
+
+    // Ring of waiting keys: [head, tail). Claimers advance head by CAS; only
+    // the uploader (under mutex) writes slots and advances tail.
+    atomic_uint_fast64_t head;
+    char padding[64];       // keeps the claimers' line apart from the uploader's
+    atomic_uint_fast64_t tail;
+    _Atomic(struct PrekeyKey*)* slots;      // allocated by the first upload, before tail moves
+    atomic_bool lowNotified;
+
+    pthread_mutex_t mutex;  // uploads and the consumer; never taken by claims
+    void* consumer;
+    prekey_notify_fn notify;
+};
+
+struct PrekeyStore {
+    struct PrekeyConfig config;
+    size_t mask;            // capacity - 1
+    char* journalPath;
+    int journalFd;
+    _Atomic(struct PrekeyDevice*)* buckets;
+
+    _Atomic(struct PrekeyJournalEntry*) journalHead;
+    atomic_uint_fast64_t swapGeneration;    // batches taken off the stack
+    atomic_uint_fast64_t durableGeneration; // batches written and synced
+    atomic_uint_fast64_t failedGeneration;  // batches whose claims were given up on
+    prekey_durable_fn onDurable;
+    void* onDurableContext;
+
+    // Journal thread only: records not yet durable, oldest first, and since
+    // when writing them has failed (0: it has not).
+    struct PrekeyJournalEntry* unwritten;
+    struct PrekeyJournalEntry* unwrittenTail;
+    uint64_t failingSinceMs;
+
+    struct StoreFlusher writer;
+};
+
+static uint32_t record_checksum(const struct PrekeyRecord* record, const uint8_t* key)
+{
+    size_t skip = sizeof(record->checksum);
+    uint32_t hash = store_fnv1a(STORE_FNV_BASIS, (const uint8_t*)record + skip, sizeof(*record) - skip);
+    return store_fnv1a(hash, key, record->length);
+}
+
+static size_t hash_device(const uint8_t* id)
+{
+    return (size_t)store_hash_id(id) & (PREKEY_BUCKETS - 1);
+}
+
+static struct PrekeyDevice* find_device(struct PrekeyStore* store, const uint8_t* id, bool create)
+{
+    _Atomic(struct PrekeyDevice*)* bucket = &store->buckets[hash_device(id)];
+    struct PrekeyDevice* created = NULL;
+
+    while (true) {
+        struct PrekeyDevice* first = atomic_load_explicit(bucket, memory_order_acquire);
+        for (struct PrekeyDevice* device = first; device;
+            device = atomic_load_explicit(&device->next, memory_order_acquire)) {
+            if (memcmp(device->id, id, PROTO_ID_SIZE) == 0) {
+                if (created) {
+                    // Lost the race to insert it.
+                    pthread_mutex_destroy(&created->mutex);
+                    free(created);
+                }
+                return device;
+            }
+        }
+        if (!create) {
+            return NULL;
+        }
+
+        if (!created) {
+            created = (struct PrekeyDevice*)calloc(1, sizeof(*created));
+            if (!created) {
+                log_error("malloc failed while creating a prekey pool");
+                return NULL;
+            }
+            memcpy(created->id, id, PROTO_ID_SIZE);
+            pthread_mutex_init(&created->mutex, NULL);
+        }
+        atomic_store_explicit(&created->next, first, memory_order_relaxed);
+        if (atomic_compare_exchange_strong_explicit(bucket, &first, created, memory_order_release,
+                memory_order_acquire)) {
+            return created;
+        }
+    }
+}
+
+static void push_journal(struct PrekeyStore* store, struct PrekeyJournalEntry* entry)
+{
+    struct PrekeyJournalEntry* head = atomic_load(&store->journalHead);
+    do {
+        entry->next = head;
+    } while (!atomic_compare_exchange_weak(&store->journalHead, &head, entry));
+
+    // Only the push that made the stack non-empty wakes the writer.
+    if (!head) {
+        store_flusher_wake(&store->writer);
+    }
+}
+
+static struct PrekeyKey* create_key(const uint8_t* deviceId, const uint8_t* keyId, const uint8_t* publicKey,
+    size_t length, uint64_t publishedAtMs)
+{
+    struct PrekeyKey* key = (struct PrekeyKey*)calloc(1, sizeof(*key) + length);
+    if (!key) {
+        return NULL;
+    }
+    key->published.key = key;
+    key->published.kind = PREKEY_RECORD_UPLOAD;
+    key->consumed.key = key;
+    key->consumed.kind = PREKEY_RECORD_CONSUMED;
+    memcpy(key->deviceId, deviceId, PROTO_ID_SIZE);
+    memcpy(key->keyId, keyId, PROTO_ID_SIZE);
+    key->publishedAtMs = publishedAtMs;
+    key->length = (uint16_t)length;
+    memcpy(key->publicKey, publicKey, length);
+    return key;
+}
+
+// Appends keys to the ring; caller holds device->mutex. Returns how many fit.
+// Journaled keys are pushed before claimers can see them, so their upload
+// records always precede their tombstones.
+static size_t publish_keys(struct PrekeyStore* store, struct PrekeyDevice* device, struct PrekeyKey** keys,
+    size_t count, bool journal)
+{
+    uint64_t tail = atomic_load_explicit(&device->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&device->head, memory_order_acquire);
+    size_t room = (store->mask + 1) - (size_t)(tail - head);
+    size_t taken = count < room ? count : room;
+    if (taken > 0 && !device->slots) {
+        device->slots = (_Atomic(struct PrekeyKey*)*)calloc(store->mask + 1, sizeof(*device->slots));
+        if (!device->slots) {
+            log_error("malloc failed while creating a prekey pool");
+            return 0;
+        }
+    }
+
+    // A slot is only reused once head has passed it, so a claimer that read
+    // the old pointer fails its CAS.
+    for (size_t i = 0; i < taken; ++i) {
+        if (journal) {
+            push_journal(store, &keys[i]->published);
+        }
+        atomic_store_explicit(&device->slots[(tail + i) & store->mask], keys[i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&device->tail, tail + taken, memory_order_release);
+
+    if (tail + taken - atomic_load(&device->head) >= store->config.lowWatermark) {
+        atomic_store(&device->lowNotified, false);
+    }
+    return taken;
+}
+
+size_t prekey_upload(struct PrekeyStore* store, const uint8_t* deviceId, const struct PrekeyUpload* keys,
+    size_t count)
+{
+    struct PrekeyDevice* device = find_device(store, deviceId, true);
+    if (!device || count == 0) {
+        return 0;
+    }
+    struct PrekeyKey** created = (struct PrekeyKey**)malloc(count * sizeof(*created));
+    if (!created) {
+        return 0;
+    }
+
+    size_t valid = 0;
+    uint64_t nowMs = store_wall_clock_ms();
+    for (size_t i = 0; i < count; ++i) {
+        if (keys[i].length == 0 || keys[i].length > PREKEY_MAX_KEY_SIZE) {
+            break;
+        }
+        created[valid] = create_key(deviceId, keys[i].keyId, keys[i].publicKey, keys[i].length, nowMs);
+        if (!created[valid]) {
+            break;
+        }
+        ++valid;
+    }
+
+    pthread_mutex_lock(&device->mutex);
+    size_t taken = publish_keys(store, device, created, valid, true);
+    pthread_mutex_unlock(&device->mutex);
+
+    for (size_t i = taken; i < valid; ++i) {
+        free(created[i]);
+    }
+    free(created);
+    return taken;
+}
+
+bool prekey_claim(struct PrekeyStore* store, const uint8_t* deviceId, struct PrekeyClaim* claim)
+{
+    struct PrekeyDevice* device = find_device(store, deviceId, false);
+    if (!device) {
+        return false;
+    }
+
+    uint64_t head = atomic_load_explicit(&device->head, memory_order_acquire);
+    struct PrekeyKey* key;
+    uint64_t tail;
+    while (true) {
+        tail = atomic_load_explicit(&device->tail, memory_order_acquire);
+        if (head >= tail) {
+            return false;
+        }
+        key = atomic_load_explicit(&device->slots[head & store->mask], memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(&device->head, &head, head + 1, memory_order_acq_rel,
+                memory_order_acquire)) {
+            break;
+        }
+    }
+
+    // Ours alone now; copy it out before the journal thread may free it.
+    memcpy(claim->keyId, key->keyId, PROTO_ID_SIZE);
+    memcpy(claim->publicKey, key->publicKey, key->length);
+    claim->length = key->length;
+    key->consumedAtMs = store_wall_clock_ms();
+    push_journal(store, &key->consumed);
+    // The writer bumps swapGeneration before taking the stack, so the batch
+    // holding this tombstone is at most one past what is visible now.
+    claim->generation = atomic_load(&store->swapGeneration) + 1;
+
+    if (tail - (head + 1) < store->config.lowWatermark && !atomic_exchange(&device->lowNotified, true)) {
+        pthread_mutex_lock(&device->mutex);
+        if (device->notify) {
+            device->notify(device->consumer);
+        }
+        pthread_mutex_unlock(&device->mutex);
+    }
+    return true;
+}
+
+uint64_t prekey_durable_generation(struct PrekeyStore* store)
+{
+    return atomic_load(&store->durableGeneration);
+}
+
+uint64_t prekey_failed_generation(struct PrekeyStore* store)
+{
+    return atomic_load(&store->failedGeneration);
+}
+
+size_t prekey_available(struct PrekeyStore* store, const uint8_t* deviceId)
+{
+    struct PrekeyDevice* device = find_device(store, deviceId, false);
+    if (!device) {
+        return 0;
+    }
+    uint64_t head = atomic_load(&device->head);
+    uint64_t tail = atomic_load(&device->tail);
+    return tail > head ? (size_t)(tail - head) : 0;
+}
+
+bool prekey_attach(struct PrekeyStore* store, const uint8_t* deviceId, void* consumer, prekey_notify_fn notify)
+{
+    struct PrekeyDevice* device = find_device(store, deviceId, true);
+    if (!device) {
+        return false;
+    }
+    pthread_mutex_lock(&device->mutex);
+    device->consumer = consumer;
+    device->notify = notify;
+    bool low = prekey_available(store, deviceId) < store->config.lowWatermark;
+    if (low) {
+        atomic_store(&device->lowNotified, true);
+    }
+    pthread_mutex_unlock(&device->mutex);
+    return low;
+}
+
+void prekey_detach(struct PrekeyStore* store, const uint8_t* deviceId, void* consumer)
+{
+    struct PrekeyDevice* device = find_device(store, deviceId, false);
+    if (!device) {
+        return;
+    }
+    pthread_mutex_lock(&device->mutex);
+    if (device->consumer == consumer) {
+        device->consumer = NULL;
+        device->notify = NULL;
+    }
+    pthread_mutex_unlock(&device->mutex);
+}
+
+static void encode_record(uint8_t* out, uint8_t kind, const struct PrekeyKey* key)
+{
+    struct PrekeyRecord record;
+    memset(&record, 0, sizeof(record));
+    record.kind = kind;
+    record.length = kind == PREKEY_RECORD_UPLOAD ? key->length : 0;
+    record.atMs = kind == PREKEY_RECORD_UPLOAD ? key->publishedAtMs : key->consumedAtMs;
+    memcpy(record.deviceId, key->deviceId, PROTO_ID_SIZE);
+    memcpy(record.keyId, key->keyId, PROTO_ID_SIZE);
+    record.checksum = record_checksum(&record, key->publicKey);
+    memcpy(out, &record, sizeof(record));
+    memcpy(out + sizeof(record), key->publicKey, record.length);
+}
+
+static size_t record_size(const struct PrekeyJournalEntry* entry)
+{
+    return sizeof(struct PrekeyRecord) + (entry->kind == PREKEY_RECORD_UPLOAD ? entry->key->length : 0);
+}
+
+// Writes the unwritten records with one write and one fdatasync. On failure
+// the journal is cut back so a torn tail cannot hide later batches.
+static bool write_unwritten(struct PrekeyStore* store)
+{
+    size_t bytes = 0;
+    for (struct PrekeyJournalEntry* entry = store->unwritten; entry; entry = entry->next) {
+        bytes += record_size(entry);
+    }
+    uint8_t* buffer = (uint8_t*)malloc(bytes);
+    if (!buffer) {
+        log_error("malloc failed while writing the prekey journal");
+        return false;
+    }
+    size_t used = 0;
+    for (struct PrekeyJournalEntry* entry = store->unwritten; entry; entry = entry->next) {
+        encode_record(buffer + used, entry->kind, entry->key);
+        used += record_size(entry);
+    }
+
+    off_t end = lseek(store->journalFd, 0, SEEK_END);
+    bool ok = end >= 0 && store_write_all(store->journalFd, buffer, used) && fdatasync(store->journalFd) == 0;
+    if (!ok) {
+        if (store->failingSinceMs == 0) {
+            perror("prekey journal");
+        }
+        if (end >= 0 && ftruncate(store->journalFd, end) != 0) {
+            perror("truncate prekey journal");
+        }
+    }
+    free(buffer);
+    return ok;
+}
+
+// Takes everything off the stack, oldest first, and makes it durable with
+// one write and one fdatasync per batch. A batch that fails stays queued
+// ahead of the next and is retried after another commit interval; its
+// claims wait and its consumed keys stay allocated until it lands. Once
+// writes have failed for PREKEY_GIVE_UP_MS, the waiting claims are failed
+// instead while the retries go on.
+static void write_batches(void* context)
+{
+    struct PrekeyStore* store = (struct PrekeyStore*)context;
+    while (store->unwritten || atomic_load(&store->journalHead)) {
+        uint64_t generation = atomic_load(&store->swapGeneration) + 1;
+        atomic_store(&store->swapGeneration, generation);
+        struct PrekeyJournalEntry* entry = atomic_exchange(&store->journalHead, NULL);
+
+        struct PrekeyJournalEntry* ordered = NULL;
+        struct PrekeyJournalEntry* last = entry;
+        while (entry) {
+            struct PrekeyJournalEntry* next = entry->next;
+            entry->next = ordered;
+            ordered = entry;
+            entry = next;
+        }
+        if (ordered) {
+            if (store->unwrittenTail) {
+                store->unwrittenTail->next = ordered;
+            } else {
+                store->unwritten = ordered;
+            }
+            store->unwrittenTail = last;
+        }
+
+        if (!write_unwritten(store)) {
+            uint64_t nowMs = store_wall_clock_ms();
+            if (store->failingSinceMs == 0) {
+                store->failingSinceMs = nowMs;
+            } else if (nowMs - store->failingSinceMs >= PREKEY_GIVE_UP_MS) {
+                if (atomic_load(&store->failedGeneration) <= atomic_load(&store->durableGeneration)) {
+                    log_error("prekey journal: failing claims after %" PRIu64 " ms of write errors",
+                        nowMs - store->failingSinceMs);
+                }
+                atomic_store(&store->failedGeneration, generation);
+                if (store->onDurable) {
+                    store->onDurable(store->onDurableContext);
+                }
+            }
+            store_flusher_wake(&store->writer);     // retry after another interval
+            return;
+        }
+        store->failingSinceMs = 0;
+
+        entry = store->unwritten;
+        store->unwritten = NULL;
+        store->unwrittenTail = NULL;
+        while (entry) {
+            struct PrekeyJournalEntry* next = entry->next;
+            if (entry->kind == PREKEY_RECORD_CONSUMED) {
+                free(entry->key);
+            }
+            entry = next;
+        }
+
+        atomic_store(&store->durableGeneration, generation);
+        if (store->onDurable) {
+            store->onDurable(store->onDurableContext);
+        }
+    }
+}
+
+struct PrekeyTombstone {
+    uint8_t deviceId[PROTO_ID_SIZE];
+    uint8_t keyId[PROTO_ID_SIZE];
+};
+
+static int compare_tombstones(const void* left, const void* right)
+{
+    return memcmp(left, right, sizeof(struct PrekeyTombstone));
+}
+
+static bool read_file(const char* path, uint8_t** data, size_t* length)
+{
+    *data = NULL;
+    *length = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT;
+    }
+    struct stat info;
+    bool ok = fstat(fd, &info) == 0;
+    if (ok && info.st_size > 0) {
+        *data = (uint8_t*)malloc((size_t)info.st_size);
+        ok = *data != NULL;
+        while (ok && *length < (size_t)info.st_size) {
+            ssize_t got = read(fd, *data + *length, (size_t)info.st_size - *length);
+            if (got <= 0) {
+                ok = got == 0 || errno == EINTR;
+                if (got == 0) {
+                    break;
+                }
+                continue;
+            }
+            *length += (size_t)got;
+        }
+    }
+    close(fd);
+    return ok;
+}
+
+// Replays the journal into the rings, then rewrites it with only the live
+// keys so it never grows past one record per waiting key plus recent traffic.
+static bool load_journal(struct PrekeyStore* store)
+{
+    uint8_t* data;
+    size_t length;
+    if (!read_file(store->journalPath, &data, &length)) {
+        perror("read prekey journal");
+        return false;
+    }
+
+    struct PrekeyTombstone* tombstones = NULL;
+    size_t tombstoneCount = 0;
+    size_t offset = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        size_t count = 0;
+        for (offset = 0; offset + sizeof(struct PrekeyRecord) <= length;) {
+            struct PrekeyRecord record;
+            memcpy(&record, data + offset, sizeof(record));
+            const uint8_t* key = data + offset + sizeof(record);
+            if (offset + sizeof(record) + record.length > length || record.checksum != record_checksum(&record, key)) {
+                break;
+            }
+            if (record.kind == PREKEY_RECORD_CONSUMED) {
+                if (tombstones) {
+                    memcpy(tombstones[count].deviceId, record.deviceId, PROTO_ID_SIZE);
+                    memcpy(tombstones[count].keyId, record.keyId, PROTO_ID_SIZE);
+                }
+                ++count;
+            }
+            offset += sizeof(record) + record.length;
+        }
+        // First pass counts, second fills.
+        if (pass == 0) {
+            tombstoneCount = count;
+            tombstones = (struct PrekeyTombstone*)malloc((count ? count : 1) * sizeof(*tombstones));
+            if (!tombstones) {
+                free(data);
+                return false;
+            }
+        }
+    }
+    if (offset < length) {
+        log_warn("prekey journal: ignoring %zu torn bytes", length - offset);
+        length = offset;
+    }
+    qsort(tombstones, tombstoneCount, sizeof(*tombstones), compare_tombstones);
+
+    char* compactPath = store_join_path(store->config.directory, PREKEY_COMPACT_NAME);
+    int fd = compactPath ? open(compactPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+    bool ok = fd >= 0;
+    size_t live = 0;
+    for (offset = 0; ok && offset < length;) {
+        struct PrekeyRecord record;
+        memcpy(&record, data + offset, sizeof(record));
+        const uint8_t* keyBytes = data + offset + sizeof(record);
+        offset += sizeof(record) + record.length;
+
+        struct PrekeyTombstone probe;
+        memcpy(probe.deviceId, record.deviceId, PROTO_ID_SIZE);
+        memcpy(probe.keyId, record.keyId, PROTO_ID_SIZE);
+        if (record.kind != PREKEY_RECORD_UPLOAD || record.length == 0 || record.length > PREKEY_MAX_KEY_SIZE
+            || bsearch(&probe, tombstones, tombstoneCount, sizeof(*tombstones), compare_tombstones)) {
+            continue;
+        }
+
+        struct PrekeyDevice* device = find_device(store, record.deviceId, true);
+        struct PrekeyKey* key = create_key(record.deviceId, record.keyId, keyBytes, record.length, record.atMs);
+        if (!device || !key || publish_keys(store, device, &key, 1, false) != 1) {
+            free(key);
+            continue;
+        }
+        ok = store_write_all(fd, data + offset - sizeof(record) - record.length, sizeof(record) + record.length);
+        ++live;
+    }
+    free(tombstones);
+    free(data);
+
+    if (ok && fdatasync(fd) == 0 && rename(compactPath, store->journalPath) == 0) {
+        store_sync_directory(store->config.directory);
+    } else {
+        perror("compact prekey journal");
+        ok = false;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(compactPath);
+    if (ok && live > 0) {
+        log_info("Loaded %zu waiting prekey(s)", live);
+    }
+    return ok;
+}
+
+static void free_devices(struct PrekeyStore* store)
+{
+    for (size_t i = 0; i < PREKEY_BUCKETS; ++i) {
+        struct PrekeyDevice* device = atomic_load(&store->buckets[i]);
+        while (device) {
+            struct PrekeyDevice* next = atomic_load(&device->next);
+            uint64_t tail = atomic_load(&device->tail);
+            for (uint64_t slot = atomic_load(&device->head); slot < tail; ++slot) {
+                free(atomic_load(&device->slots[slot & store->mask]));
+            }
+            free(device->slots);
+            pthread_mutex_destroy(&device->mutex);
+            free(device);
+            device = next;
+        }
+    }
+    free(store->buckets);
+}
+
+struct PrekeyStore* prekey_open(const struct PrekeyConfig* config, prekey_durable_fn onDurable, void* context)
+{
+    if (mkdir(config->directory, 0700) != 0 && errno != EEXIST) {
+        perror("mkdir prekeys");
+        return NULL;
+    }
+
+    struct PrekeyStore* store = (struct PrekeyStore*)calloc(1, sizeof(*store));
+    if (!store) {
+        return NULL;
+    }
+    store->config = *config;
+    if (store->config.commitIntervalMs == 0) {
+        store->config.commitIntervalMs = PREKEY_DEFAULT_COMMIT_INTERVAL_MS;
+    }
+    size_t capacity = 1;
+    while (capacity < config->capacity) {
+        capacity *= 2;
+    }
+    store->mask = capacity - 1;
+    store->onDurable = onDurable;
+    store->onDurableContext = context;
+    store->journalFd = -1;
+    store->journalPath = store_join_path(config->directory, PREKEY_JOURNAL_NAME);
+    store->buckets = (_Atomic(struct PrekeyDevice*)*)calloc(PREKEY_BUCKETS, sizeof(*store->buckets));
+    if (!store->journalPath || !store->buckets) {
+        goto fail;
+    }
+    if (!load_journal(store)) {
+        goto fail;
+    }
+    store->journalFd = open(store->journalPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (store->journalFd < 0) {
+        perror("open prekey journal");
+        goto fail;
+    }
+
+    if (!store_flusher_start(&store->writer, STORE_FLUSH_COMMIT_GROUP, store->config.commitIntervalMs,
+            write_batches, store)) {
+        goto fail;
+    }
+    return store;
+
+fail:
+    if (store->journalFd >= 0) {
+        close(store->journalFd);
+    }
+    if (store->buckets) {
+        free_devices(store);
+    }
+    free(store->journalPath);
+    free(store);
+    return NULL;
+}
+
+void prekey_close(struct PrekeyStore* store)
+{
+    if (!store) {
+        return;
+    }
+
+    store_flusher_stop(&store->writer);
+
+    // Tombstones the last pass could not write; their keys are out of the rings.
+    for (struct PrekeyJournalEntry* entry = store->unwritten; entry;) {
+        struct PrekeyJournalEntry* next = entry->next;
+        if (entry->kind == PREKEY_RECORD_CONSUMED) {
+            free(entry->key);
+        }
+        entry = next;
+    }
+
+    close(store->journalFd);
+    free_devices(store);
+    free(store->journalPath);
+    free(store);
+}
+
+#endif // __linux__
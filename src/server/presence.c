@@ -0,0 +1,338 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "presence.h"
+#include "logger.h"
+#include "storeutil.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define PRESENCE_BUCKETS 65536
+#define PRESENCE_TABLE_STRIPES 64
+// Compact once the journal holds this many records per known device...
+#define PRESENCE_COMPACT_FACTOR 4
+// ...and is at least this large.
+#define PRESENCE_COMPACT_MIN_BYTES (1024 * 1024)
+
+// Journal record, host byte order; the newest record of a device wins. A bad
+// checksum marks a torn tail.
+struct PresenceRecord {
+    uint32_t checksum;      // over the rest of the record
+    uint8_t status;
+    uint8_t reserved;
+    uint16_t port;
+    uint32_t address;
+    uint32_t reserved2;
+    uint64_t lastSeenAtMs;
+    uint8_t deviceId[PROTO_ID_SIZE];
+    uint8_t userId[PROTO_ID_SIZE];
+};
+
+// Guarded by its table stripe, like the bucket chain it is on.
+struct PresenceDevice {
+    uint8_t id[PROTO_ID_SIZE];
+    struct PresenceState state;
+    unsigned connections;
+    bool dirty;                         // on its stripe's dirty list
+    struct PresenceDevice* dirtyNext;
+    struct PresenceDevice* next;        // bucket chain
+};
+
+struct PresenceStore {
+    struct PresenceConfig config;
+    struct StoreJournal journal;    // and the flusher's scratch records
+    atomic_size_t deviceCount;     // decides when to compact
+
+    pthread_mutex_t tableMutex[PRESENCE_TABLE_STRIPES];
+    struct PresenceDevice* dirtyHead[PRESENCE_TABLE_STRIPES];
+    struct PresenceDevice** buckets;
+
+    struct StoreFlusher flusher;
+};
+
+static size_t hash_device(const uint8_t* id)
+{
+    return (size_t)store_hash_id(id) & (PRESENCE_BUCKETS - 1);
+}
+
+// Returns the device with its stripe locked (*stripe set), or NULL with
+// nothing locked if it is unknown and create is false or allocation failed.
+static struct PresenceDevice* lock_device(struct PresenceStore* store, const uint8_t* id, bool create,
+    pthread_mutex_t** stripe)
+{
+    size_t bucket = hash_device(id);
+    *stripe = &store->tableMutex[bucket % PRESENCE_TABLE_STRIPES];
+
+    pthread_mutex_lock(*stripe);
+    struct PresenceDevice* device = store->buckets[bucket];
+    while (device && memcmp(device->id, id, PROTO_ID_SIZE) != 0) {
+        device = device->next;
+    }
+    if (!device && create) {
+        device = (struct PresenceDevice*)calloc(1, sizeof(*device));
+        if (!device) {
+            log_error("malloc failed while tracking presence");
+        } else {
+            memcpy(device->id, id, PROTO_ID_SIZE);
+            device->next = store->buckets[bucket];
+            store->buckets[bucket] = device;
+            atomic_fetch_add(&store->deviceCount, 1);
+        }
+    }
+    if (!device) {
+        pthread_mutex_unlock(*stripe);
+    }
+    return device;
+}
+
+static void mark_dirty(struct PresenceStore* store, struct PresenceDevice* device)
+{
+    if (!device->dirty) {
+        size_t stripe = hash_device(device->id) % PRESENCE_TABLE_STRIPES;
+        device->dirty = true;
+        device->dirtyNext = store->dirtyHead[stripe];
+        store->dirtyHead[stripe] = device;
+    }
+}
+
+bool presence_connect(struct PresenceStore* store, const uint8_t* deviceId, const uint8_t* userId,
+    uint32_t address, uint16_t port)
+{
+    pthread_mutex_t* stripe;
+    struct PresenceDevice* device = lock_device(store, deviceId, true, &stripe);
+    if (!device) {
+        return false;
+    }
+    bool cameOnline = device->connections++ == 0;
+    memcpy(device->state.userId, userId, PROTO_ID_SIZE);
+    device->state.status = PRESENCE_ONLINE;
+    device->state.lastSeenAtMs = store_wall_clock_ms();
+    device->state.address = address;
+    device->state.port = port;
+    mark_dirty(store, device);
+    pthread_mutex_unlock(stripe);
+    return cameOnline;
+}
+
+bool presence_disconnect(struct PresenceStore* store, const uint8_t* deviceId)
+{
+    pthread_mutex_t* stripe;
+    struct PresenceDevice* device = lock_device(store, deviceId, false, &stripe);
+    if (!device) {
+        return false;
+    }
+    bool wentOffline = device->connections > 0 && --device->connections == 0;
+    device->state.lastSeenAtMs = store_wall_clock_ms();
+    if (wentOffline) {
+        device->state.status = PRESENCE_OFFLINE;
+    }
+    mark_dirty(store, device);
+    pthread_mutex_unlock(stripe);
+    return wentOffline;
+}
+
+void presence_touch(struct PresenceStore* store, const uint8_t* deviceId)
+{
+    pthread_mutex_t* stripe;
+    struct PresenceDevice* device = lock_device(store, deviceId, false, &stripe);
+    if (device) {
+        device->state.lastSeenAtMs = store_wall_clock_ms();
+        mark_dirty(store, device);
+        pthread_mutex_unlock(stripe);
+    }
+}
+
+bool presence_get(struct PresenceStore* store, const uint8_t* deviceId, struct PresenceState* state)
+{
+    pthread_mutex_t* stripe;
+    struct PresenceDevice* device = lock_device(store, deviceId, false, &stripe);
+    if (!device) {
+        return false;
+    }
+    *state = device->state;
+    pthread_mutex_unlock(stripe);
+    return true;
+}
+
+static void encode_record(struct PresenceRecord* record, const struct PresenceDevice* device)
+{
+    memset(record, 0, sizeof(*record));
+    record->status = device->state.status;
+    record->port = device->state.port;
+    record->address = device->state.address;
+    record->lastSeenAtMs = device->state.lastSeenAtMs;
+    memcpy(record->deviceId, device->id, PROTO_ID_SIZE);
+    memcpy(record->userId, device->state.userId, PROTO_ID_SIZE);
+}
+
+// Copies one record per device (all of them, or only the dirty ones) into
+// the journal's scratch array. Returns the record count. Taking a dirty
+// device clears its mark; one that finds no room stays marked.
+static size_t collect_records(struct PresenceStore* store, bool all)
+{
+    size_t count = 0;
+    for (size_t stripe = 0; stripe < PRESENCE_TABLE_STRIPES; ++stripe) {
+        pthread_mutex_lock(&store->tableMutex[stripe]);
+        struct PresenceDevice* device;
+        while (!all && (device = store->dirtyHead[stripe]) != NULL) {
+            struct PresenceRecord* record = store_journal_slot(&store->journal, count);
+            if (!record) {
+                break;
+            }
+            encode_record(record, device);
+            ++count;
+            store->dirtyHead[stripe] = device->dirtyNext;
+            device->dirty = false;
+            device->dirtyNext = NULL;
+        }
+
+        for (size_t bucket = stripe; all && bucket < PRESENCE_BUCKETS; bucket += PRESENCE_TABLE_STRIPES) {
+            for (device = store->buckets[bucket]; device; device = device->next) {
+                struct PresenceRecord* record = store_journal_slot(&store->journal, count);
+                if (record) {
+                    encode_record(record, device);
+                    ++count;
+                }
+            }
+        }
+        pthread_mutex_unlock(&store->tableMutex[stripe]);
+    }
+    return count;
+}
+
+// The first count scratch records were not written: marks their devices
+// dirty again, so the next pass writes whatever their state is by then.
+static void requeue_records(struct PresenceStore* store, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        const struct PresenceRecord* record = (const struct PresenceRecord*)store_journal_slot(&store->journal, i);
+        pthread_mutex_t* stripe;
+        struct PresenceDevice* device = lock_device(store, record->deviceId, false, &stripe);
+        if (device) {
+            mark_dirty(store, device);
+            pthread_mutex_unlock(stripe);
+        }
+    }
+}
+
+// Replaces the journal with one record per device. Leaves the dirty marks
+// alone: if it fails, nothing is lost.
+static bool compact_journal(struct PresenceStore* store)
+{
+    return store_journal_replace(&store->journal, collect_records(store, true));
+}
+
+static void flush_dirty(void* context)
+{
+    struct PresenceStore* store = (struct PresenceStore*)context;
+    if (store_journal_oversized(&store->journal, atomic_load(&store->deviceCount), PRESENCE_COMPACT_FACTOR,
+            PRESENCE_COMPACT_MIN_BYTES)) {
+        compact_journal(store);
+    }
+    size_t count = collect_records(store, false);
+    if (!store_journal_append(&store->journal, count)) {
+        requeue_records(store, count);
+    }
+}
+
+// Applies one journal record; the newest record of each device wins.
+// Everyone starts offline: no connection survived the restart.
+static bool load_record(void* context, const void* data)
+{
+    struct PresenceStore* store = (struct PresenceStore*)context;
+    const struct PresenceRecord* record = (const struct PresenceRecord*)data;
+    pthread_mutex_t* stripe;
+    struct PresenceDevice* device = lock_device(store, record->deviceId, true, &stripe);
+    if (!device) {
+        return false;
+    }
+    memcpy(device->state.userId, record->userId, PROTO_ID_SIZE);
+    device->state.status = PRESENCE_OFFLINE;
+    device->state.lastSeenAtMs = record->lastSeenAtMs;
+    device->state.address = record->address;
+    device->state.port = record->port;
+    pthread_mutex_unlock(stripe);
+    return true;
+}
+
+static void free_store(struct PresenceStore* store)
+{
+    for (size_t i = 0; store->buckets && i < PRESENCE_BUCKETS; ++i) {
+        struct PresenceDevice* device = store->buckets[i];
+        while (device) {
+            struct PresenceDevice* next = device->next;
+            free(device);
+            device = next;
+        }
+    }
+    for (size_t i = 0; i < PRESENCE_TABLE_STRIPES; ++i) {
+        pthread_mutex_destroy(&store->tableMutex[i]);
+    }
+    store_journal_free(&store->journal);
+    free(store->buckets);
+    free(store);
+}
+
+struct PresenceStore* presence_open(const struct PresenceConfig* config)
+{
+    if (mkdir(config->directory, 0700) != 0 && errno != EEXIST) {
+        perror("mkdir presence");
+        return NULL;
+    }
+
+    struct PresenceStore* store = (struct PresenceStore*)calloc(1, sizeof(*store));
+    if (!store) {
+        return NULL;
+    }
+    store->config = *config;
+    if (store->config.persistIntervalMs == 0) {
+        store->config.persistIntervalMs = PRESENCE_DEFAULT_PERSIST_INTERVAL_MS;
+    }
+    for (size_t i = 0; i < PRESENCE_TABLE_STRIPES; ++i) {
+        pthread_mutex_init(&store->tableMutex[i], NULL);
+    }
+
+    store->buckets = (struct PresenceDevice**)calloc(PRESENCE_BUCKETS, sizeof(*store->buckets));
+    if (!store_journal_init(&store->journal, config->directory, sizeof(struct PresenceRecord), "presence journal")
+        || !store->buckets) {
+        free_store(store);
+        return NULL;
+    }
+    // Compacting also creates the journal, and writes out the statuses reset to offline.
+    if (!store_journal_load(&store->journal, load_record, store) || !compact_journal(store)) {
+        free_store(store);
+        return NULL;
+    }
+
+    if (!store_flusher_start(&store->flusher, STORE_FLUSH_PERIODIC, store->config.persistIntervalMs, flush_dirty,
+            store)) {
+        free_store(store);
+        return NULL;
+    }
+    size_t deviceCount = atomic_load(&store->deviceCount);
+    if (deviceCount > 0) {
+        log_info("Loaded presence of %zu device(s)", deviceCount);
+    }
+    return store;
+}
+
+void presence_close(struct PresenceStore* store)
+{
+    if (!store) {
+        return;
+    }
+    // The flusher makes one last pass on its way out.
+    store_flusher_stop(&store->flusher);
+    free_store(store);
+}
+
+#endif // __linux__
@@ -0,0 +1,162 @@
+#include "ratelimit.h"
+#include "metrics.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define RATE_MILLI 1000ULL
+#define RATE_STAMP_BITS 36      // refill time wraps after about 795 days
+#define RATE_STAMP_MASK ((1ULL << RATE_STAMP_BITS) - 1)
+#define RATE_MAX_BURST_MILLI ((1ULL << (64 - RATE_STAMP_BITS)) - 1)
+#define RATE_MAX_SKEW_MS 60000  // how far threads' clocks may trail a stamp
+
+static uint64_t mix(uint64_t value)
+{
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ULL;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebULL;
+    value ^= value >> 31;
+    return value;
+}
+
+uint64_t ratelimit_key_ipv4(uint32_t address)
+{
+    uint64_t key = mix(((uint64_t)1 << 32) | address);
+    return key & 1 ? key : key | 1;     // odd: addresses
+}
+
+uint64_t ratelimit_key_id(const uint8_t* id)
+{
+    uint64_t low, high;
+    memcpy(&low, id, sizeof(low));
+    memcpy(&high, id + sizeof(low), sizeof(high));
+    uint64_t key = mix(low ^ mix(high));
+    key &= ~(uint64_t)1;                // even and non-zero: ids
+    return key ? key : 2;
+}
+
+int ratelimit_init(struct RateTable* table, const struct RateLimitConfig* config)
+{
+    memset(table, 0, sizeof(*table));
+    size_t perShard = 1;
+    size_t wanted = config->slots > RATE_SHARDS ? config->slots / RATE_SHARDS : 1;
+    while (perShard < wanted) {
+        perShard <<= 1;
+    }
+    for (size_t i = 0; i < RATE_SHARDS; ++i) {
+        struct RateShard* shard = &table->shards[i];
+        shard->slots = (struct RateSlot*)calloc(perShard, sizeof(struct RateSlot));
+        if (!shard->slots) {
+            ratelimit_destroy(table);
+            return -1;
+        }
+        shard->mask = perShard - 1;
+    }
+
+    uint64_t burst = config->burst ? config->burst : 2ULL * config->ratePerSecond;
+    table->ratePerMs = config->ratePerSecond;
+    table->burstMilli = burst * RATE_MILLI < RATE_MAX_BURST_MILLI ? burst * RATE_MILLI : RATE_MAX_BURST_MILLI;
+    if (table->burstMilli < RATE_MILLI) {
+        table->burstMilli = RATE_MILLI;
+    }
+    return 0;
+}
+
+void ratelimit_destroy(struct RateTable* table)
+{
+    for (size_t i = 0; i < RATE_SHARDS; ++i) {
+        free(table->shards[i].slots);
+    }
+    memset(table, 0, sizeof(*table));
+}
+
+// Milli-tokens in a bucket word at nowMs.
+static uint64_t refill(const struct RateTable* table, uint64_t bucket, uint64_t nowMs)
+{
+    if (bucket == 0) {
+        return table->burstMilli;
+    }
+    uint64_t tokens = bucket >> RATE_STAMP_BITS;
+    uint64_t elapsed = (nowMs - bucket) & RATE_STAMP_MASK;
+    // Threads' clocks lag each other a little: a stamp just ahead adds
+    // nothing. Any other reading is a real (possibly wrapped) idle time,
+    // and one past the burst's worth of milliseconds refills it whole.
+    if (elapsed > RATE_STAMP_MASK - RATE_MAX_SKEW_MS) {
+        elapsed = 0;
+    }
+    if (table->ratePerMs > 0 && elapsed >= table->burstMilli) {
+        return table->burstMilli;
+    }
+    tokens += elapsed * table->ratePerMs;
+    return tokens < table->burstMilli ? tokens : table->burstMilli;
+}
+
+// The slot of key, claiming a free or refilled one; NULL if none is near.
+static struct RateSlot* find_slot(struct RateTable* table, uint64_t key, uint64_t nowMs)
+{
+    struct RateShard* shard = &table->shards[(key >> 60) & (RATE_SHARDS - 1)];
+    size_t index = (size_t)(key >> 4);
+    for (size_t probe = 0; probe < RATE_MAX_PROBE; ++probe) {
+        struct RateSlot* slot = &shard->slots[(index + probe) & shard->mask];
+        uint64_t current = atomic_load_explicit(&slot->key, memory_order_acquire);
+        if (current == key) {
+            return slot;
+        }
+        if (current == 0) {
+            if (atomic_compare_exchange_strong(&slot->key, &current, key)) {
+                atomic_fetch_add_explicit(&shard->used, 1, memory_order_relaxed);
+                return slot;
+            }
+            if (current == key) {
+                return slot;
+            }
+            continue;
+        }
+        // A full bucket is as good as none: take the slot over. A thread
+        // still updating it for the old key only costs that key a token.
+        uint64_t bucket = atomic_load_explicit(&slot->bucket, memory_order_relaxed);
+        if (refill(table, bucket, nowMs) == table->burstMilli
+            && atomic_compare_exchange_strong(&slot->key, &current, key)) {
+            atomic_store_explicit(&slot->bucket, 0, memory_order_relaxed);
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+uint32_t ratelimit_take(struct RateTable* table, uint64_t key, uint64_t nowMs)
+{
+    uint64_t now = nowMs & RATE_STAMP_MASK;
+    struct RateSlot* slot = find_slot(table, key, now);
+    if (!slot) {
+        metrics_add(METRIC_RATE_TABLE_FULL, 1);
+        return 0;
+    }
+
+    uint64_t bucket = atomic_load_explicit(&slot->bucket, memory_order_relaxed);
+    while (true) {
+        uint64_t tokens = refill(table, bucket, now);
+        if (tokens < RATE_MILLI) {
+            if (table->ratePerMs == 0) {
+                return UINT32_MAX;
+            }
+            return (uint32_t)((RATE_MILLI - tokens + table->ratePerMs - 1) / table->ratePerMs);
+        }
+        // A stamp of 0 would read as a full bucket; a millisecond off is harmless.
+        uint64_t next = (tokens - RATE_MILLI) << RATE_STAMP_BITS | (now ? now : 1);
+        if (atomic_compare_exchange_weak_explicit(&slot->bucket, &bucket, next, memory_order_relaxed,
+                memory_order_relaxed)) {
+            return 0;
+        }
+    }
+}
+
+size_t ratelimit_used(const struct RateTable* table)
+{
+    size_t used = 0;
+    for (size_t i = 0; i < RATE_SHARDS; ++i) {
+        used += atomic_load_explicit(&table->shards[i].used, memory_order_relaxed);
+    }
+    return used;
+}
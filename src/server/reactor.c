@@ -0,0 +1,3163 @@
+#include "socketutil.h"
+#include "reactor.h"
+#include "dispatcher.h"
+#include "msgbuf.h"
+#include "registry.h"
+#include "routing.h"
+#include "offline.h"
+#include "msglog.h"
+#include "prekey.h"
+#include "presence.h"
+#include "receipts.h"
+#include "timerwheel.h"
+#include "metrics.h"
+#include "logger.h"
+#include "pool.h"
+#include "uring.h"
+#include "ratelimit.h"
+#include "blob.h"
+#include "lz.h"
+
+#ifdef __linux__
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+
+#define REACTOR_MAX_EVENTS 256
+// How soon a worker with retired connections retries freeing them when idle.
+#define REACTOR_RECLAIM_INTERVAL_MS 10
+// Leaves room for the "[ip:port] " prefix so relayed frames stay within clients' limit.
+#define REACTOR_MAX_INBOUND_PAYLOAD (PROTO_DEFAULT_MAX_PAYLOAD - MSGBUF_MAX_PREFIX)
+// Retry backoff stops doubling after this many attempts (before retryMaxMs caps it).
+#define REACTOR_MAX_RETRY_SHIFT 16
+// Timer lag worth a warning: the loop is too busy to run timers on time.
+#define REACTOR_TIMER_LAG_WARN_MS 100
+// How soon a connection paused at the receive-memory limit tries again.
+#define REACTOR_RECV_MEMORY_RETRY_MS 10
+// Most messages one HISTORY request may ask for.
+#define REACTOR_MAX_HISTORY_PAGE 1000
+// Per message in a HISTORY reply: seq, createdAtMs, sender deviceId, length.
+#define REACTOR_HISTORY_RECORD_HEADER (2 * PROTO_SEQ_SIZE + PROTO_ID_SIZE + 4)
+// Per key in a PREKEY_UPLOAD: keyId, uint16 length.
+#define REACTOR_PREKEY_UPLOAD_HEADER (PROTO_ID_SIZE + 2)
+#define REACTOR_BLOB_PUT_HEADER (PROTO_ID_SIZE + 2 * PROTO_SEQ_SIZE)    // blobId, uint64 size, uint64 offset
+// Per device in a PRESENCE frame: deviceId, status, lastSeenAtMs.
+#define REACTOR_PRESENCE_ENTRY (PROTO_ID_SIZE + 1 + PROTO_SEQ_SIZE)
+// Most devices one PRESENCE frame carries; larger batches are split.
+#define REACTOR_MAX_PRESENCE_ENTRIES 4096
+// Per ack in a RECEIPT notification: reader deviceId, kind, fromSeq, toSeq.
+#define REACTOR_RECEIPT_ENTRY (PROTO_ID_SIZE + 1 + 2 * PROTO_SEQ_SIZE)
+// Most acks one RECEIPT notification carries; larger batches are split.
+#define REACTOR_MAX_RECEIPT_ENTRIES 4096
+// Most messages per conversation a receipt batch looks up senders for,
+// counted back from the newest acknowledged one.
+#define REACTOR_MAX_RECEIPT_SCAN 4096
+// Segments (two per frame) one io_uring SENDMSG carries; its completion sends the rest.
+#define REACTOR_URING_SEND_IOV 32
+
+struct ReactorWorker;
+
+struct Connection {
+    socket_t fd;
+    struct sockaddr_in address;
+    char peerName[INET_ADDRSTRLEN + 8];     // "ip:port", formatted once at accept
+    char prefix[MSGBUF_MAX_PREFIX];         // "[ip:port] " prepended to relayed messages
+    size_t prefixLength;
+    struct ReactorWorker* owner;
+    struct OutQueue outQueue;
+    struct ProtoRecvBuffer recvBuffer;
+
+    // Owner's drain list; guarded by owner->drainMutex.
+    bool drainQueued;
+    struct Connection* drainNext;
+
+    uint32_t slot;      // registry slot id
+    bool closed;        // owner thread only; the fd is gone, memory not yet reclaimed
+
+    // Identity and memberships from HELLO/JOIN; owner thread only.
+    bool identified;
+    uint8_t userId[PROTO_ID_SIZE];
+    uint8_t deviceId[PROTO_ID_SIZE];
+    uint8_t (*joined)[PROTO_ID_SIZE];
+    size_t joinedCount;
+    size_t joinedCapacity;
+
+    // Stored deliveries for deviceId; owner thread only, except offlinePending.
+    bool offlineAttached;
+    uint64_t replaySeq;             // next stored seq to queue
+    atomic_bool offlinePending;     // records may be waiting; set by the store's notify
+
+    // One-time prekey pool of deviceId; owner thread only, except prekeyLow.
+    bool prekeyAttached;
+    atomic_bool prekeyLow;          // pool fell below its watermark; set by the store's notify
+
+    // Counted as one of deviceId's connections in the presence store; owner thread only.
+    bool presenceOnline;
+    uint64_t presenceTouchedMs;     // last LastSeenAt update, in lastActivityMs terms
+
+    // Timers on the owner's wheel; owner thread only.
+    uint64_t lastActivityMs;        // last time anything was received
+    bool pinged;                    // PING sent since then
+    struct TimerNode idleTimer;     // heartbeat, then idle reaping
+    struct TimerNode retryTimer;    // NextRetryAt of unacked device messages
+    unsigned retryAttempt;
+    uint64_t retryFirstSeq;         // first unacked seq when the timer was armed
+
+    // io_uring backend; owner thread only. While a request is outstanding
+    // the ring refers to conn, so closing waits for its completion.
+    bool recvArmed;                 // a multishot recv is outstanding
+    bool sendInFlight;              // a SENDMSG of sendIov is outstanding
+    bool writableArmed;             // a POLL_ADD waits for room to stream a blob
+    struct msghdr sendMsg;
+    struct iovec sendIov[REACTOR_URING_SEND_IOV];
+
+    // SO_ZEROCOPY is set (epoll backend): completions raise EPOLLERR.
+    bool zeroCopy;
+
+    // Flow control; owner thread only. While paused nothing more is read:
+    // the kernel's receive buffer fills and TCP pushes back on the client.
+    bool readPaused;
+    struct TimerNode resumeTimer;   // armed while waiting for tokens
+    uint64_t limitKey;              // device bucket: deviceId once identified, this connection before
+    uint32_t framesAdmitted;        // since connecting, wrapping
+    uint32_t creditLimit;           // the last CREDIT grant
+
+    // Attachments; owner thread only. One upload and one download at a time.
+    struct BlobUpload blobUpload;
+    struct BlobStream blobStream;
+
+    // PROTO_FEATURE_LZ streams, once FEATURES enabled it; owner thread only.
+    // The encoder runs from the outbound queue's gather, the decoder from dispatch.
+    struct LzEncoder* encoder;
+    struct LzDecoder* decoder;
+};
+
+// A claimed prekey, sent once its tombstone is durable.
+struct PrekeyReply {
+    struct Connection* conn;    // NULL once the claimer closed
+    struct MsgBuf* buf;
+    uint64_t generation;
+    uint8_t deviceId[PROTO_ID_SIZE];    // for the empty reply if the claim fails
+};
+
+// The reply to the BLOB_PUT that completed a blob, sent once it is published.
+struct BlobReply {
+    struct Connection* conn;    // NULL once the uploader closed
+    struct BlobPublish* publish;
+};
+
+// A conversation message waiting for its seq; routed once the history log
+// assigned it.
+struct HistoryMessage {
+    struct MsgBuf* buf;
+    const struct Connection* sender;    // only compared, never dereferenced
+};
+
+// A device whose presence the conversation's members should hear about.
+struct PresenceChange {
+    uint8_t conversationId[PROTO_ID_SIZE];
+    uint8_t deviceId[PROTO_ID_SIZE];
+};
+
+// Seqs a device acknowledged, to be passed on to the messages' senders.
+struct ReceiptChange {
+    uint8_t conversationId[PROTO_ID_SIZE];
+    uint8_t deviceId[PROTO_ID_SIZE];
+    uint8_t kind;           // enum ReceiptKind
+    uint64_t fromSeq;
+    uint64_t toSeq;
+};
+
+// Who sent a message, looked up for a receipt batch.
+struct ReceiptSender {
+    uint64_t seq;
+    uint8_t deviceId[PROTO_ID_SIZE];
+};
+
+struct ReactorWorker {
+    int index;
+    int epollFd;
+    int wakeFd;
+    socket_t listenFd;
+    bool ownsListener;      // sharded: a SO_REUSEPORT listener of its own
+    pthread_t threadId;
+    struct Registry* registry;  // g_registry, or shardRegistry when sharded
+    struct Registry shardRegistry;
+    struct RegistryReader* reader;
+    // g_routing is global even when sharded; its epochs are g_registry's, so
+    // shards read it through a second reader (the same one when not sharded).
+    struct RegistryReader* routingReader;
+    bool* shardTargets;     // scratch: shards a conversation message must reach
+
+    // Cross-shard bus: frames other shards broadcast, fanned out here.
+    pthread_mutex_t inboxMutex;
+    struct MsgBuf** inbox;
+    size_t inboxCount;
+    size_t inboxCapacity;
+
+    // Connections that other threads queued frames for while their queue was empty.
+    pthread_mutex_t drainMutex;
+    struct Connection* drainHead;
+
+    // Conversation messages received during this epoll batch, appended to
+    // the history log in one call after it and only then routed, carrying
+    // their seq; owner thread only.
+    struct HistoryMessage* history;
+    struct MsgLogEntry* historyEntries;
+    size_t historyCount;
+    size_t historyCapacity;
+
+    // Claim replies in claim order (so in generation order); owner thread
+    // only, except prekeyWaiting, which the journal thread reads.
+    struct PrekeyReply* prekeyReplies;
+    size_t prekeyReplyCount;
+    size_t prekeyReplyCapacity;
+    atomic_bool prekeyWaiting;
+
+    // Completed uploads in publish order; owner thread only, except
+    // blobWaiting, which the blob publisher reads.
+    struct BlobReply* blobReplies;
+    size_t blobReplyCount;
+    size_t blobReplyCapacity;
+    atomic_bool blobWaiting;
+
+    // Presence changes since presenceTimer was armed, announced together when
+    // it fires; owner thread only.
+    struct PresenceChange* presenceChanges;
+    size_t presenceCount;
+    size_t presenceCapacity;
+    struct TimerNode presenceTimer;
+
+    // Acks since receiptTimer was armed, passed on together when it fires;
+    // owner thread only.
+    struct ReceiptChange* receiptChanges;
+    size_t receiptCount;
+    size_t receiptCapacity;
+    struct TimerNode receiptTimer;
+
+    // io_uring backend, when its ring could be set up (fixed before the
+    // thread starts); the rest is owner thread only.
+    bool useUring;
+    struct Uring ring;
+    uint64_t wakeValue;         // the wake eventfd's counter, read through the ring
+
+    // Connections are on the drain list; they are drained before the next
+    // wait, or once drainDueMs passes while corking. Owner thread only.
+    bool drainPending;
+    uint64_t drainDueMs;
+
+    struct TimerWheel wheel;
+    uint64_t nowMs;             // monotonic, refreshed after every wait
+    uint64_t lagWarnedMs;       // largest timer lag already reported
+};
+
+static struct Registry g_registry;
+static struct RoutingTable g_routing;   // members are tagged with their owner's worker index
+static struct ReactorWorker* g_workers = NULL;
+static atomic_int g_workerCount;    // workers whose threads are running
+static bool g_sharded = false;
+static struct ReactorConfig g_config;
+static const struct OutQueueConfig* g_outQueueConfig = NULL;
+static struct ProtoDispatcher g_dispatcher;
+static struct Slab g_connectionSlab;
+static struct OfflineStore* g_offline = NULL;
+static struct MsgLog* g_msglog = NULL;
+static struct PrekeyStore* g_prekeys = NULL;
+static struct PresenceStore* g_presence = NULL;
+static struct ReceiptStore* g_receipts = NULL;
+static struct BlobStore* g_blobs = NULL;
+static struct RateTable g_deviceLimits;
+static struct RateTable g_addressLimits;
+static atomic_uint_fast64_t g_connectionSerial;
+
+// Distinguishes the wake eventfd from the listener (NULL) in epoll data.
+static char g_wakeToken;
+
+// io_uring requests carry what they are for in the low bits of user_data;
+// the rest is the connection, if any (slab objects are 16-byte aligned).
+enum ReactorUringOp {
+    REACTOR_OP_ACCEPT = 1,
+    REACTOR_OP_WAKE,
+    REACTOR_OP_RECV,
+    REACTOR_OP_SEND,
+    REACTOR_OP_CANCEL,
+    REACTOR_OP_WRITABLE
+};
+#define REACTOR_OP_MASK 7
+
+static _Thread_local struct ReactorWorker* t_worker = NULL;
+
+static void cache_peer_name(struct Connection* conn)
+{
+    char ipStr[INET_ADDRSTRLEN];
+    if (!inet_ntop(AF_INET, &conn->address.sin_addr, ipStr, sizeof(ipStr))) {
+        strncpy(ipStr, "unknown", sizeof(ipStr));
+        ipStr[sizeof(ipStr) - 1] = '\0';
+    }
+    int port = ntohs(conn->address.sin_port);
+
+    snprintf(conn->peerName, sizeof(conn->peerName), "%s:%d", ipStr, port);
+    int prefixLength = snprintf(conn->prefix, sizeof(conn->prefix), "[%s] ", conn->peerName);
+    conn->prefixLength = prefixLength > 0 ? (size_t)prefixLength : 0;
+}
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static void raise_fd_limit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+        return;
+    }
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            log_os_error("setrlimit");
+        }
+    }
+}
+
+static void wake_worker(struct ReactorWorker* worker)
+{
+    uint64_t one = 1;
+    metrics_add(METRIC_IO_SYSCALLS, 1);
+    if (write(worker->wakeFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_os_error("eventfd write");
+    }
+}
+
+// Asks the owning worker to drain conn's queue. Safe from any thread as long
+// as conn is still reachable (caller is in a registry read section or is the owner).
+static void schedule_drain(struct Connection* conn)
+{
+    struct ReactorWorker* worker = conn->owner;
+    bool wake = false;
+
+    pthread_mutex_lock(&worker->drainMutex);
+    if (!conn->drainQueued) {
+        conn->drainQueued = true;
+        conn->drainNext = worker->drainHead;
+        wake = worker->drainHead == NULL;
+        worker->drainHead = conn;
+    }
+    pthread_mutex_unlock(&worker->drainMutex);
+
+    // The owner runs its own drains before it waits again: no eventfd write.
+    if (wake && worker == t_worker) {
+        worker->drainPending = true;
+    } else if (wake) {
+        wake_worker(worker);
+    }
+}
+
+static void unschedule_drain(struct Connection* conn)
+{
+    struct ReactorWorker* worker = conn->owner;
+
+    pthread_mutex_lock(&worker->drainMutex);
+    if (conn->drainQueued) {
+        struct Connection** current = &worker->drainHead;
+        while (*current && *current != conn) {
+            current = &(*current)->drainNext;
+        }
+        if (*current) {
+            *current = conn->drainNext;
+        }
+        conn->drainQueued = false;
+        conn->drainNext = NULL;
+    }
+    pthread_mutex_unlock(&worker->drainMutex);
+}
+
+// Registry free callback. Runs on the owner once no broadcaster can still
+// reach conn, so nothing can schedule it for draining again.
+static void free_connection(void* item)
+{
+    struct Connection* conn = (struct Connection*)item;
+    unschedule_drain(conn);
+    outqueue_destroy(&conn->outQueue);
+    lz_encoder_destroy(conn->encoder);
+    free(conn->joined);
+    slab_free(&g_connectionSlab, conn);
+}
+
+static void disconnect_presence(struct Connection* conn);
+
+// The last step of closing, once nothing but broadcasters can refer to conn.
+static void release_connection(struct Connection* conn)
+{
+    // Broadcasters may still hold conn from a read section; it is only
+    // unlinked here and freed by free_connection once they are done.
+    registry_remove(conn->owner->registry, conn->owner->reader, conn->slot);
+    if (!conn->owner->useUring) {
+        epoll_ctl(conn->owner->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+    closesocket(conn->fd);
+    conn->fd = INVALID_SOCKET;
+    proto_recv_destroy(&conn->recvBuffer);
+    lz_decoder_destroy(conn->decoder);
+    conn->decoder = NULL;
+}
+
+static void close_connection(struct Connection* conn)
+{
+    log_info("Client disconnected: %s", conn->peerName);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+
+    // Leave conversations first: the member arrays that still list conn are
+    // then retired no later than conn itself.
+    struct ReactorWorker* worker = conn->owner;
+    disconnect_presence(conn);
+    for (size_t i = 0; i < conn->joinedCount; ++i) {
+        routing_leave(&g_routing, worker->routingReader, conn->joined[i], conn);
+    }
+    conn->joinedCount = 0;
+    // After this the store never notifies conn again.
+    if (conn->offlineAttached) {
+        offline_detach(g_offline, conn->deviceId, conn);
+        conn->offlineAttached = false;
+    }
+    if (conn->prekeyAttached) {
+        prekey_detach(g_prekeys, conn->deviceId, conn);
+        conn->prekeyAttached = false;
+    }
+    for (size_t i = 0; i < worker->prekeyReplyCount; ++i) {
+        if (worker->prekeyReplies[i].conn == conn) {
+            worker->prekeyReplies[i].conn = NULL;
+        }
+    }
+    for (size_t i = 0; i < worker->blobReplyCount; ++i) {
+        if (worker->blobReplies[i].conn == conn) {
+            worker->blobReplies[i].conn = NULL;
+        }
+    }
+    timerwheel_cancel(&worker->wheel, &conn->idleTimer);
+    timerwheel_cancel(&worker->wheel, &conn->retryTimer);
+    timerwheel_cancel(&worker->wheel, &conn->resumeTimer);
+    blob_upload_end(g_blobs, &conn->blobUpload);
+    blob_stream_close(&conn->blobStream);
+
+    conn->closed = true;
+    if (conn->recvArmed || conn->sendInFlight || conn->writableArmed) {
+        // The ring still refers to conn and its queued frames: cancel, and
+        // release once the last completion is in.
+        struct io_uring_sqe* sqe = uring_get_sqe(&worker->ring);
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = conn->fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = REACTOR_OP_CANCEL;
+        } else {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+        return;
+    }
+    release_connection(conn);
+}
+
+// Enqueues buf for every connection in worker's registry except sender.
+// Runs on worker's own thread, so its reader is free to use.
+static void fan_out(struct ReactorWorker* worker, struct MsgBuf* buf, const struct Connection* sender)
+{
+    struct RegistryReader* reader = worker->reader;
+    size_t recipients = 0;
+    struct RegistrySlots* slots = registry_read_begin(worker->registry, reader);
+    size_t used = registry_slots_used(slots);
+    for (size_t i = 0; i < used; ++i) {
+        struct Connection* conn = (struct Connection*)registry_slot_item(slots, i);
+        if (!conn || conn == sender) {
+            continue;
+        }
+        ++recipients;
+        enum OutQueueResult result = outqueue_push(&conn->outQueue, buf);
+        if (result == OUTQ_QUEUED_FIRST || result == OUTQ_OVERFLOW) {
+            schedule_drain(conn);
+        }
+    }
+    registry_read_end(reader);
+    metrics_record_fanout(recipients);
+}
+
+// Hands buf to another shard's inbox; that shard fans it out on its own thread.
+static void post_to_shard(struct ReactorWorker* worker, struct MsgBuf* buf)
+{
+    bool wake = false;
+
+    pthread_mutex_lock(&worker->inboxMutex);
+    if (worker->inboxCount == worker->inboxCapacity) {
+        size_t capacity = worker->inboxCapacity ? worker->inboxCapacity * 2 : 64;
+        struct MsgBuf** inbox = (struct MsgBuf**)realloc(worker->inbox, capacity * sizeof(*inbox));
+        if (!inbox) {
+            pthread_mutex_unlock(&worker->inboxMutex);
+            log_error("malloc failed while posting to shard %d", worker->index);
+            return;
+        }
+        worker->inbox = inbox;
+        worker->inboxCapacity = capacity;
+    }
+    msgbuf_retain(buf);
+    wake = worker->inboxCount == 0;
+    worker->inbox[worker->inboxCount++] = buf;
+    pthread_mutex_unlock(&worker->inboxMutex);
+
+    if (wake) {
+        wake_worker(worker);
+    }
+}
+
+static void post_to_other_shards(struct ReactorWorker* self, struct MsgBuf* buf)
+{
+    if (!g_sharded) {
+        return;
+    }
+    int workerCount = atomic_load(&g_workerCount);
+    for (int i = 0; i < workerCount; ++i) {
+        if (&g_workers[i] != self) {
+            post_to_shard(&g_workers[i], buf);
+        }
+    }
+}
+
+// Enqueue only: the socket is written by the owning worker, never here. The
+// frame is composed once and every recipient queue shares it.
+static void broadcast_message(struct Connection* sender, const uint8_t* data, size_t length)
+{
+    if (!sender || !data || length == 0) {
+        return;
+    }
+
+    struct MsgBuf* buf = msgbuf_create(PROTO_OP_CHAT, 0, sender->prefix, sender->prefixLength, data, length);
+    if (!buf) {
+        log_error("malloc failed while composing broadcast");
+        return;
+    }
+
+    fan_out(sender->owner, buf, sender);
+    post_to_other_shards(sender->owner, buf);
+    msgbuf_release(buf);
+}
+
+// Delivers a frame whose prefix starts with a conversationId to the
+// conversation's members, except sender; Broadcast conversations go to every
+// connection. A RECEIPT frame only goes to the members that joined as the
+// device named after the conversationId. When this shard originated it
+// (forward), members on other shards get the frame through their inbox; an
+// inbox delivery only serves this shard's members. Shards never touch each
+// other's connections.
+static void route_conversation(struct ReactorWorker* worker, struct MsgBuf* buf, const struct Connection* sender,
+    bool forward)
+{
+    if (buf->head[5] == PROTO_CONV_BROADCAST) {
+        fan_out(worker, buf, sender);
+        if (forward) {
+            post_to_other_shards(worker, buf);
+        }
+        return;
+    }
+
+    int workerCount = atomic_load(&g_workerCount);
+    bool remote = false;
+    if (g_sharded && forward) {
+        memset(worker->shardTargets, 0, (size_t)workerCount * sizeof(*worker->shardTargets));
+    }
+
+    const uint8_t* conversationId = buf->head + PROTO_HEADER_SIZE;
+    const uint8_t* device = buf->head[4] == PROTO_OP_RECEIPT ? conversationId + PROTO_ID_SIZE : NULL;
+    struct RegistryReader* reader = worker->routingReader;
+    registry_read_begin(&g_registry, reader);
+    const struct RoutingMembers* members = routing_members(routing_find(&g_routing, conversationId));
+    size_t count = routing_member_slots(members);
+    size_t recipients = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const struct RoutingMember* member = &members->members[i];
+        void* endpoint = routing_member_endpoint(member);
+        if (!endpoint || endpoint == sender || (device && memcmp(member->deviceId, device, PROTO_ID_SIZE) != 0)) {
+            continue;
+        }
+        if (g_sharded && member->shard != (uint32_t)worker->index) {
+            if (forward && member->shard < (uint32_t)workerCount) {
+                worker->shardTargets[member->shard] = true;
+                remote = true;
+            }
+            continue;
+        }
+        struct Connection* conn = (struct Connection*)endpoint;
+        ++recipients;
+        enum OutQueueResult result = outqueue_push(&conn->outQueue, buf);
+        if (result == OUTQ_QUEUED_FIRST || result == OUTQ_OVERFLOW) {
+            schedule_drain(conn);
+        }
+    }
+    registry_read_end(reader);
+    // Per shard: members on other shards are counted where they are queued.
+    metrics_record_fanout(recipients);
+
+    for (int i = 0; remote && i < workerCount; ++i) {
+        if (worker->shardTargets[i]) {
+            post_to_shard(&g_workers[i], buf);
+        }
+    }
+}
+
+// Store notify: runs on the appending thread with the device locked, and
+// never after offline_detach, so conn is still registered.
+static void notify_offline(void* consumer)
+{
+    struct Connection* conn = (struct Connection*)consumer;
+    atomic_store(&conn->offlinePending, true);
+    schedule_drain(conn);
+}
+
+// Prekey notify: like notify_offline, never runs after prekey_detach.
+static void notify_prekey_low(void* consumer)
+{
+    struct Connection* conn = (struct Connection*)consumer;
+    atomic_store(&conn->prekeyLow, true);
+    schedule_drain(conn);
+}
+
+// Journal thread, after every durable or failed batch: wakes the workers holding
+// claim replies. A worker that starts waiting concurrently checks the
+// durable generation itself at the end of its epoll batch.
+static void prekeys_durable(void* context)
+{
+    (void)context;
+    int workerCount = atomic_load(&g_workerCount);
+    for (int i = 0; i < workerCount; ++i) {
+        if (atomic_load(&g_workers[i].prekeyWaiting)) {
+            wake_worker(&g_workers[i]);
+        }
+    }
+}
+
+// Blob publisher, after every batch: the same for held BLOB_PUT replies.
+static void blobs_published(void* context)
+{
+    (void)context;
+    int workerCount = atomic_load(&g_workerCount);
+    for (int i = 0; i < workerCount; ++i) {
+        if (atomic_load(&g_workers[i].blobWaiting)) {
+            wake_worker(&g_workers[i]);
+        }
+    }
+}
+
+static void encode_be(uint8_t* out, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        out[i] = (uint8_t)(value >> (8 * (size - 1 - i)));
+    }
+}
+
+static uint64_t decode_be(const uint8_t* in, size_t size)
+{
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+static int compare_presence_changes(const void* left, const void* right)
+{
+    return memcmp(left, right, sizeof(struct PresenceChange));
+}
+
+// Sends one PRESENCE frame per conversation with the current state of every
+// device that changed in it; a device that flapped several times since the
+// timer was armed is announced once. Broadcast conversations are skipped:
+// announcing everyone to everyone is the write storm this avoids.
+static void announce_presence(struct ReactorWorker* worker)
+{
+    struct PresenceChange* changes = worker->presenceChanges;
+    size_t count = worker->presenceCount;
+    worker->presenceCount = 0;
+    qsort(changes, count, sizeof(*changes), compare_presence_changes);
+
+    uint8_t* body = (uint8_t*)malloc(REACTOR_MAX_PRESENCE_ENTRIES * REACTOR_PRESENCE_ENTRY);
+    if (!body) {
+        log_error("malloc failed while announcing presence");
+        return;
+    }
+    size_t next = 0;
+    while (next < count) {
+        const uint8_t* conversationId = changes[next].conversationId;
+        size_t end = next;
+        while (end < count && memcmp(changes[end].conversationId, conversationId, PROTO_ID_SIZE) == 0) {
+            ++end;
+        }
+
+        registry_read_begin(&g_registry, worker->routingReader);
+        struct RoutingConversation* conversation = routing_find(&g_routing, conversationId);
+        int type = conversation ? conversation->type : PROTO_CONV_BROADCAST;
+        registry_read_end(worker->routingReader);
+
+        size_t entries = 0;
+        for (size_t i = next; type != PROTO_CONV_BROADCAST && i < end; ++i) {
+            struct PresenceState state;
+            bool repeated = i > next && memcmp(&changes[i], &changes[i - 1], sizeof(*changes)) == 0;
+            if (!repeated && presence_get(g_presence, changes[i].deviceId, &state)) {
+                uint8_t* entry = body + entries * REACTOR_PRESENCE_ENTRY;
+                memcpy(entry, changes[i].deviceId, PROTO_ID_SIZE);
+                entry[PROTO_ID_SIZE] = state.status;
+                encode_be(entry + PROTO_ID_SIZE + 1, state.lastSeenAtMs, PROTO_SEQ_SIZE);
+                ++entries;
+            }
+            if (entries == 0 || (entries < REACTOR_MAX_PRESENCE_ENTRIES && i + 1 < end)) {
+                continue;
+            }
+
+            struct MsgBuf* buf = msgbuf_create(PROTO_OP_PRESENCE, (uint8_t)type, (const char*)conversationId,
+                PROTO_ID_SIZE, body, entries * REACTOR_PRESENCE_ENTRY);
+            if (!buf) {
+                log_error("malloc failed while announcing presence");
+            } else {
+                route_conversation(worker, buf, NULL, true);
+                msgbuf_release(buf);
+            }
+            entries = 0;
+        }
+        next = end;
+    }
+    free(body);
+}
+
+static void presence_timer_expired(struct TimerNode* timer)
+{
+    announce_presence((struct ReactorWorker*)timer->context);
+}
+
+static void stage_presence_change(struct ReactorWorker* worker, const uint8_t* conversationId,
+    const uint8_t* deviceId)
+{
+    if (worker->presenceCount == worker->presenceCapacity) {
+        size_t capacity = worker->presenceCapacity ? worker->presenceCapacity * 2 : 64;
+        struct PresenceChange* changes = (struct PresenceChange*)realloc(worker->presenceChanges,
+            capacity * sizeof(*changes));
+        if (!changes) {
+            log_error("malloc failed while staging presence");
+            return;
+        }
+        worker->presenceChanges = changes;
+        worker->presenceCapacity = capacity;
+    }
+    struct PresenceChange* change = &worker->presenceChanges[worker->presenceCount++];
+    memcpy(change->conversationId, conversationId, PROTO_ID_SIZE);
+    memcpy(change->deviceId, deviceId, PROTO_ID_SIZE);
+    if (!timer_pending(&worker->presenceTimer)) {
+        timerwheel_schedule(&worker->wheel, &worker->presenceTimer, worker->nowMs + g_config.presenceNotifyMs);
+    }
+}
+
+// Queues the device's new status for every conversation conn has joined.
+static void stage_presence(struct Connection* conn)
+{
+    for (size_t i = 0; i < conn->joinedCount; ++i) {
+        stage_presence_change(conn->owner, conn->joined[i], conn->deviceId);
+    }
+}
+
+static void disconnect_presence(struct Connection* conn)
+{
+    if (conn->presenceOnline) {
+        if (presence_disconnect(g_presence, conn->deviceId)) {
+            stage_presence(conn);
+        }
+        conn->presenceOnline = false;
+    }
+}
+
+static int compare_receipt_changes(const void* left, const void* right)
+{
+    const struct ReceiptChange* a = (const struct ReceiptChange*)left;
+    const struct ReceiptChange* b = (const struct ReceiptChange*)right;
+    int order = memcmp(a->conversationId, b->conversationId, PROTO_ID_SIZE);
+    if (order == 0) {
+        order = memcmp(a->deviceId, b->deviceId, PROTO_ID_SIZE);
+    }
+    if (order == 0 && a->kind != b->kind) {
+        order = a->kind < b->kind ? -1 : 1;
+    }
+    if (order == 0 && a->fromSeq != b->fromSeq) {
+        order = a->fromSeq < b->fromSeq ? -1 : 1;
+    }
+    return order;
+}
+
+static int compare_ids(const void* left, const void* right)
+{
+    return memcmp(left, right, PROTO_ID_SIZE);
+}
+
+struct ReceiptScan {
+    struct ReceiptSender* senders;     // ascending seq
+    size_t count;
+};
+
+static bool collect_sender(void* context, const struct MsgLogRecord* record)
+{
+    struct ReceiptScan* scan = (struct ReceiptScan*)context;
+    scan->senders[scan->count].seq = record->seq;
+    memcpy(scan->senders[scan->count].deviceId, record->senderDeviceId, PROTO_ID_SIZE);
+    ++scan->count;
+    return true;
+}
+
+// Index of the first scanned message with a seq of at least seq.
+static size_t find_sender(const struct ReceiptScan* scan, uint64_t seq)
+{
+    size_t low = 0;
+    size_t high = scan->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (scan->senders[middle].seq < seq) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Merges each device's adjacent and overlapping ranges of one kind.
+// Returns the new count.
+static size_t merge_receipt_changes(struct ReceiptChange* changes, size_t count)
+{
+    size_t merged = 0;
+    for (size_t i = 0; i < count; ++i) {
+        struct ReceiptChange* last = merged > 0 ? &changes[merged - 1] : NULL;
+        if (last && last->kind == changes[i].kind && changes[i].fromSeq <= last->toSeq + 1
+            && memcmp(last->deviceId, changes[i].deviceId, PROTO_ID_SIZE) == 0
+            && memcmp(last->conversationId, changes[i].conversationId, PROTO_ID_SIZE) == 0) {
+            if (changes[i].toSeq > last->toSeq) {
+                last->toSeq = changes[i].toSeq;
+            }
+        } else {
+            changes[merged++] = changes[i];
+        }
+    }
+    return merged;
+}
+
+struct ReceiptBatch {
+    struct ReceiptScan scan;
+    uint8_t (*senders)[PROTO_ID_SIZE];  // distinct senders of the scanned messages
+    size_t* counts;     // counts[i]: scanned messages before i from the sender at hand
+    uint8_t* body;
+};
+
+// Sends sender one RECEIPT frame (more if it is large) with every ack in
+// changes that covers at least one of its scanned messages.
+static void announce_receipts_to(struct ReactorWorker* worker, struct ReceiptBatch* batch, uint8_t type,
+    const uint8_t* sender, const struct ReceiptChange* changes, size_t count)
+{
+    const struct ReceiptScan* scan = &batch->scan;
+    batch->counts[0] = 0;
+    for (size_t i = 0; i < scan->count; ++i) {
+        bool sent = memcmp(scan->senders[i].deviceId, sender, PROTO_ID_SIZE) == 0;
+        batch->counts[i + 1] = batch->counts[i] + (sent ? 1 : 0);
+    }
+
+    uint8_t prefix[2 * PROTO_ID_SIZE];
+    memcpy(prefix, changes[0].conversationId, PROTO_ID_SIZE);
+    memcpy(prefix + PROTO_ID_SIZE, sender, PROTO_ID_SIZE);
+    size_t entries = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const struct ReceiptChange* change = &changes[i];
+        size_t first = find_sender(scan, change->fromSeq);
+        size_t end = change->toSeq < UINT64_MAX ? find_sender(scan, change->toSeq + 1) : scan->count;
+        bool covers = batch->counts[end] > batch->counts[first];
+        if (covers && memcmp(change->deviceId, sender, PROTO_ID_SIZE) != 0) {
+            uint8_t* entry = batch->body + entries * REACTOR_RECEIPT_ENTRY;
+            memcpy(entry, change->deviceId, PROTO_ID_SIZE);
+            entry[PROTO_ID_SIZE] = change->kind;
+            encode_be(entry + PROTO_ID_SIZE + 1, change->fromSeq, PROTO_SEQ_SIZE);
+            encode_be(entry + PROTO_ID_SIZE + 1 + PROTO_SEQ_SIZE, change->toSeq, PROTO_SEQ_SIZE);
+            ++entries;
+        }
+        if (entries == 0 || (entries < REACTOR_MAX_RECEIPT_ENTRIES && i + 1 < count)) {
+            continue;
+        }
+
+        struct MsgBuf* buf = msgbuf_create(PROTO_OP_RECEIPT, type, (const char*)prefix, sizeof(prefix),
+            batch->body, entries * REACTOR_RECEIPT_ENTRY);
+        if (!buf) {
+            log_error("malloc failed while passing on receipts");
+        } else {
+            route_conversation(worker, buf, NULL, true);
+            msgbuf_release(buf);
+        }
+        entries = 0;
+    }
+}
+
+// Passes the acks staged since the timer was armed on to the senders of the
+// acknowledged messages: per conversation, one frame to each sender listing
+// every reader's merged ranges, however many acks arrived in between. Only
+// the newest REACTOR_MAX_RECEIPT_SCAN messages of a batch are looked at; a
+// sender of anything older only learns of it from later acks. Broadcast
+// conversations are skipped, as for presence.
+static void announce_receipts(struct ReactorWorker* worker)
+{
+    struct ReceiptChange* changes = worker->receiptChanges;
+    qsort(changes, worker->receiptCount, sizeof(*changes), compare_receipt_changes);
+    size_t count = merge_receipt_changes(changes, worker->receiptCount);
+    worker->receiptCount = 0;
+
+    struct ReceiptBatch batch;
+    batch.scan.senders = (struct ReceiptSender*)malloc(REACTOR_MAX_RECEIPT_SCAN * sizeof(*batch.scan.senders));
+    batch.senders = (uint8_t (*)[PROTO_ID_SIZE])malloc(REACTOR_MAX_RECEIPT_SCAN * sizeof(*batch.senders));
+    batch.counts = (size_t*)malloc((REACTOR_MAX_RECEIPT_SCAN + 1) * sizeof(*batch.counts));
+    batch.body = (uint8_t*)malloc(REACTOR_MAX_RECEIPT_ENTRIES * REACTOR_RECEIPT_ENTRY);
+    if (!batch.scan.senders || !batch.senders || !batch.counts || !batch.body) {
+        log_error("malloc failed while passing on receipts");
+        count = 0;
+    }
+
+    size_t next = 0;
+    while (next < count) {
+        const uint8_t* conversationId = changes[next].conversationId;
+        uint64_t fromSeq = changes[next].fromSeq;
+        uint64_t toSeq = changes[next].toSeq;
+        size_t end = next;
+        while (end < count && memcmp(changes[end].conversationId, conversationId, PROTO_ID_SIZE) == 0) {
+            fromSeq = changes[end].fromSeq < fromSeq ? changes[end].fromSeq : fromSeq;
+            toSeq = changes[end].toSeq > toSeq ? changes[end].toSeq : toSeq;
+            ++end;
+        }
+
+        registry_read_begin(&g_registry, worker->routingReader);
+        struct RoutingConversation* conversation = routing_find(&g_routing, conversationId);
+        int type = conversation ? conversation->type : PROTO_CONV_BROADCAST;
+        registry_read_end(worker->routingReader);
+
+        batch.scan.count = 0;
+        if (type != PROTO_CONV_BROADCAST) {
+            if (toSeq - fromSeq >= REACTOR_MAX_RECEIPT_SCAN) {
+                fromSeq = toSeq - REACTOR_MAX_RECEIPT_SCAN + 1;
+            }
+            msglog_scan(g_msglog, conversationId, fromSeq, (size_t)(toSeq - fromSeq + 1), collect_sender,
+                &batch.scan);
+        }
+
+        for (size_t i = 0; i < batch.scan.count; ++i) {
+            memcpy(batch.senders[i], batch.scan.senders[i].deviceId, PROTO_ID_SIZE);
+        }
+        qsort(batch.senders, batch.scan.count, sizeof(*batch.senders), compare_ids);
+        for (size_t i = 0; i < batch.scan.count; ++i) {
+            if (i == 0 || memcmp(batch.senders[i], batch.senders[i - 1], PROTO_ID_SIZE) != 0) {
+                announce_receipts_to(worker, &batch, (uint8_t)type, batch.senders[i], &changes[next], end - next);
+            }
+        }
+        next = end;
+    }
+    free(batch.scan.senders);
+    free(batch.senders);
+    free(batch.counts);
+    free(batch.body);
+}
+
+static void receipt_timer_expired(struct TimerNode* timer)
+{
+    announce_receipts((struct ReactorWorker*)timer->context);
+}
+
+static void stage_receipt(struct ReactorWorker* worker, const uint8_t* conversationId, const uint8_t* deviceId,
+    uint8_t kind, uint64_t fromSeq, uint64_t toSeq)
+{
+    if (worker->receiptCount == worker->receiptCapacity) {
+        size_t capacity = worker->receiptCapacity ? worker->receiptCapacity * 2 : 64;
+        struct ReceiptChange* changes = (struct ReceiptChange*)realloc(worker->receiptChanges,
+            capacity * sizeof(*changes));
+        if (!changes) {
+            log_error("malloc failed while staging receipts");
+            return;
+        }
+        worker->receiptChanges = changes;
+        worker->receiptCapacity = capacity;
+    }
+    struct ReceiptChange* change = &worker->receiptChanges[worker->receiptCount++];
+    memcpy(change->conversationId, conversationId, PROTO_ID_SIZE);
+    memcpy(change->deviceId, deviceId, PROTO_ID_SIZE);
+    change->kind = kind;
+    change->fromSeq = fromSeq;
+    change->toSeq = toSeq;
+    if (!timer_pending(&worker->receiptTimer)) {
+        timerwheel_schedule(&worker->wheel, &worker->receiptTimer, worker->nowMs + g_config.receiptNotifyMs);
+    }
+}
+
+// Writes the batch's conversation messages to the history log: one call, so
+// each conversation is locked once per batch rather than once per message.
+// Then stamps each frame with its seq, before anyone else holds it, and
+// routes it; a message the log could not take still goes out, with seq 0.
+static void append_history(struct ReactorWorker* worker)
+{
+    for (size_t i = 0; i < worker->historyCount; ++i) {
+        const struct MsgBuf* buf = worker->history[i].buf;
+        struct MsgLogEntry* entry = &worker->historyEntries[i];
+        memset(entry, 0, sizeof(*entry));
+        entry->conversationId = buf->head + PROTO_HEADER_SIZE;
+        entry->senderDeviceId = buf->head + PROTO_HEADER_SIZE + PROTO_ID_SIZE;
+        entry->ciphertext = buf->body;
+        entry->ciphertextLength = buf->bodyLength;
+    }
+    size_t stored = msglog_append(g_msglog, worker->historyEntries, worker->historyCount);
+    if (stored < worker->historyCount) {
+        log_warn("worker %d: %zu message(s) missing from history", worker->index,
+            worker->historyCount - stored);
+    }
+    for (size_t i = 0; i < worker->historyCount; ++i) {
+        struct MsgBuf* buf = worker->history[i].buf;
+        encode_be(buf->head + PROTO_HEADER_SIZE + 2 * PROTO_ID_SIZE, worker->historyEntries[i].seq, PROTO_SEQ_SIZE);
+        route_conversation(worker, buf, worker->history[i].sender, true);
+        msgbuf_release(buf);
+    }
+    worker->historyCount = 0;
+}
+
+// Returns false if the message could not be staged; the caller routes it
+// right away instead.
+static bool stage_history(struct ReactorWorker* worker, struct MsgBuf* buf, const struct Connection* sender)
+{
+    if (worker->historyCount == worker->historyCapacity) {
+        size_t capacity = worker->historyCapacity ? worker->historyCapacity * 2 : 64;
+        struct HistoryMessage* history = (struct HistoryMessage*)realloc(worker->history,
+            capacity * sizeof(*history));
+        if (history) {
+            worker->history = history;
+        }
+        struct MsgLogEntry* entries = (struct MsgLogEntry*)realloc(worker->historyEntries,
+            capacity * sizeof(*entries));
+        if (entries) {
+            worker->historyEntries = entries;
+        }
+        if (!history || !entries) {
+            // Keep what fits; write the staged batch out now to make room.
+            if (worker->historyCount == 0) {
+                log_error("malloc failed while staging message history");
+                return false;
+            }
+            append_history(worker);
+        } else {
+            worker->historyCapacity = capacity;
+        }
+    }
+    msgbuf_retain(buf);
+    worker->history[worker->historyCount].buf = buf;
+    worker->history[worker->historyCount].sender = sender;
+    ++worker->historyCount;
+    return true;
+}
+
+static int handle_chat(void* context, const struct ProtoFrame* frame)
+{
+    struct Connection* conn = (struct Connection*)context;
+
+    log_sampled("Received from %s -> %.*s", conn->peerName, (int)frame->length, (const char*)frame->payload);
+
+    broadcast_message(conn, frame->payload, frame->length);
+    return 0;
+}
+
+// Members are listed with the user and device they joined as; lists conn
+// again under its new ones.
+static void rejoin_conversations(struct Connection* conn)
+{
+    struct ReactorWorker* worker = conn->owner;
+    for (size_t i = 0; i < conn->joinedCount; ++i) {
+        registry_read_begin(&g_registry, worker->routingReader);
+        struct RoutingConversation* conversation = routing_find(&g_routing, conn->joined[i]);
+        uint8_t type = conversation ? conversation->type : PROTO_CONV_GROUP;
+        registry_read_end(worker->routingReader);
+
+        routing_leave(&g_routing, worker->routingReader, conn->joined[i], conn);
+        if (routing_join(&g_routing, worker->routingReader, conn->joined[i], type, conn, (uint32_t)worker->index,
+                conn->userId, conn->deviceId) != ROUTING_OK) {
+            log_warn("%s could not rejoin conversation", conn->peerName);
+            memcpy(conn->joined[i], conn->joined[--conn->joinedCount], PROTO_ID_SIZE);
+            --i;
+        }
+    }
+}
+
+static int handle_hello(void* context, const struct ProtoFrame* frame)
+{
+    struct Connection* conn = (struct Connection*)context;
+    struct ReactorWorker* worker = conn->owner;
+    if (frame->length != 2 * PROTO_ID_SIZE) {
+        return -1;
+    }
+
+    bool changed = memcmp(conn->deviceId, frame->payload + PROTO_ID_SIZE, PROTO_ID_SIZE) != 0;
+    bool userChanged = memcmp(conn->userId, frame->payload, PROTO_ID_SIZE) != 0;
+    if (changed) {
+        if (conn->offlineAttached) {
+            offline_detach(g_offline, conn->deviceId, conn);
+            conn->offlineAttached = false;
+            timerwheel_cancel(&worker->wheel, &conn->retryTimer);
+        }
+        if (conn->prekeyAttached) {
+            prekey_detach(g_prekeys, conn->deviceId, conn);
+            conn->prekeyAttached = false;
+        }
+        disconnect_presence(conn);
+    }
+    memcpy(conn->userId, frame->payload, PROTO_ID_SIZE);
+    memcpy(conn->deviceId, frame->payload + PROTO_ID_SIZE, PROTO_ID_SIZE);
+    conn->identified = true;
+    // Every connection of the device now draws from one bucket.
+    conn->limitKey = ratelimit_key_id(conn->deviceId);
+    if (changed || userChanged) {
+        rejoin_conversations(conn);
+    }
+
+    // Start replaying whatever the device has not acknowledged yet.
+    if (g_offline && !conn->offlineAttached) {
+        conn->replaySeq = offline_attach(g_offline, conn->deviceId, conn, notify_offline);
+        conn->offlineAttached = true;
+        conn->retryAttempt = 0;
+        conn->retryFirstSeq = conn->replaySeq;
+        atomic_store(&conn->offlinePending, true);
+        schedule_drain(conn);
+    }
+    if (g_presence && !conn->presenceOnline) {
+        conn->presenceOnline = true;
+        conn->presenceTouchedMs = conn->lastActivityMs;
+        if (presence_connect(g_presence, conn->deviceId, conn->userId, conn->address.sin_addr.s_addr,
+                conn->address.sin_port)) {
+            stage_presence(conn);
+        }
+    }
+    if (g_prekeys && !conn->prekeyAttached) {
+        conn->prekeyAttached = true;
+        if (prekey_attach(g_prekeys, conn->deviceId, conn, notify_prekey_low)) {
+            atomic_store(&conn->prekeyLow, true);
+            schedule_drain(conn);
+        }
+    }
+    return 0;
+}
+
+static int handle_join(void* context, const struct ProtoFrame* frame)
+{
+    struct Connection* conn = (struct Connection*)context;
+    struct ReactorWorker* worker = conn->owner;
+    if (frame->length != PROTO_ID_SIZE + 1 || frame->payload[PROTO_ID_SIZE] > PROTO_CONV_BROADCAST) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < conn->joinedCount; ++i) {
+        if (memcmp(conn->joined[i], frame->payload, PROTO_ID_SIZE) == 0) {
+            return 0;
+        }
+    }
+    if (conn->joinedCount == conn->joinedCapacity) {
+        size_t capacity = conn->joinedCapacity ? conn->joinedCapacity * 2 : 4;
+        uint8_t (*joined)[PROTO_ID_SIZE] = (uint8_t (*)[PROTO_ID_SIZE])realloc(conn->joined,
+            capacity * sizeof(*joined));
+        if (!joined) {
+            log_error("malloc failed while joining conversation");
+            return 0;
+        }
+        conn->joined = joined;
+        conn->joinedCapacity = capacity;
+    }
+
+    int status = routing_join(&g_routing, worker->routingReader, frame->payload, frame->payload[PROTO_ID_SIZE], conn,
+        (uint32_t)worker->index, conn->identified ? conn->userId : NULL, conn->identified ? conn->deviceId : NULL);
+    if (status != ROUTING_OK) {
+        log_warn("%s could not join conversation: %d", conn->peerName, status);
+        return 0;
+    }
+    memcpy(conn->joined[conn->joinedCount++], frame->payload, PROTO_ID_SIZE);
+    // The conversation's members learn the newcomer is here.
+    if (conn->presenceOnline) {
+        stage_presence_change(worker, frame->payload, conn->deviceId);
+    }
+    return 0;
+}
+
+static int handle_leave(void* context, const struct ProtoFrame* frame)
+{
+    struct Connection* conn = (struct Connection*)context;
+    if (frame->length != PROTO_ID_SIZE) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < conn->joinedCount; ++i) {
+        if (memcmp(conn->joined[i], frame->payload, PROTO_ID_SIZE) == 0) {
+            routing_leave(&g_routing, conn->owner->routingReader, frame->payload, conn);
+            memcpy(conn->joined[i], conn->joined[--conn->joinedCount], PROTO_ID_SIZE);
+            break;
+        }
+    }
+    return 0;
+}
+
+static int handle_conv_msg(void* context, const struct ProtoFrame* frame)
+{
+    struct Connection* conn = (struct Connection*)context;
+    struct ReactorWorker* worker = conn->owner;
+    if (frame->length < PROTO_ID_SIZE) {
+        return -1;
+    }
+    if (frame->length == PROTO_ID_SIZE) {
+        return 0;
+    }
+
+    registry_read_begin(&g_registry, worker->routingReader);
+    struct RoutingConversation* conversation = routing_find(&g_routing, frame->payload);
+    bool member = routing_is_member(routing_members(conversation), conn);
+    uint8_t type = conversation ? conversation->type : PROTO_CONV_GROUP;
+    registry_read_end(worker->routingReader);
+    if (!member) {
+        log_warn("%s sent to a conversation it has not joined", conn->peerName);
+        return 0;
+    }
+    log_sampled("Conversation message from %s, %u byte(s)", conn->peerName,
+        (unsigned)(frame->length - PROTO_ID_SIZE));
+
+    // Recipients see conversationId + sender deviceId + seq ahead of the body.
+    uint8_t prefix[2 * PROTO_ID_SIZE + PROTO_SEQ_SIZE];
+    memcpy(prefix, frame->payload, PROTO_ID_SIZE);
+    memcpy(prefix + PROTO_ID_SIZE, conn->deviceId, PROTO_ID_SIZE);
+    memset(prefix + 2 * PROTO_ID_SIZE, 0, PROTO_SEQ_SIZE);
+    struct MsgBuf* buf = msgbuf_create(PROTO_OP_CONV_MSG, type, (const char*)prefix, sizeof(prefix),
+        frame->payload + PROTO_ID_SIZE, frame->length - PROTO_ID_SIZE);
+    if (!buf) {
+        log_error("malloc failed while composing conversation message");
+        return 0;
+    }
+
+    // With history, the seq is only known after the batch's append.
+    if (!g_msglog || !stage_history(worker, buf, conn)) {
+        route_conversation(worker, buf, conn, true);
+    }
+    msgbuf_release(buf);
+    return 0;
+}
+
+// Receiving it already refreshed lastActivityMs; nothing else to do.
+static int handle_pong(void* context, const struct ProtoFrame* frame)
+{
+    (void)context;
+    return frame->length == 0 ? 0 : -1;
+}
+
+static void push_reply(struct Connection* conn, struct MsgBuf* buf)
+{
+    enum OutQueueResult result = outqueue_push(&conn->outQueue, buf);
+    if (result == OUTQ_QUEUED_FIRST || result == OUTQ_OVERFLOW) {
+        schedule_drain(conn);
+    }
+}
+
+static int handle_device_msg(void* context, const struct ProtoFrame* frame)
+{
+    struct Connection* conn = (struct Connection*)context;
+    if (frame->length < PROTO_ID_SIZE) {
+        return -1;
+    }
+    if (frame->length == PROTO_ID_SIZE) {
+        return 0;
+    }
+    if (!conn->identified) {
+        log_warn("%s sent a device message before HELLO", conn->peerName);
+        return 0;
+    }
+
+    // Always through the store, online or not: the recipient's owner is
+    // notified and replays it, so delivery is ordered, durable and shard-safe.
+    if (offline_append(g_offline, frame->payload, conn->deviceId, frame->payload + PROTO_ID_SIZE,
+            frame->length - PROTO_ID_SIZE, NULL) != 0) {
+        log_warn("%s: could not store device message", conn->peerName);
+        // The sender still has it and can retry; nothing else would tell it.
+        struct MsgBuf* buf = msgbuf_create(PROTO_OP_DEVICE_MSG, PROTO_DEVICE_REFUSED, NULL, 0, frame->payload,
+            PROTO_ID_SIZE);
+        if (buf) {
+            push_reply(conn, buf);
+            msgbuf_release(buf);
+        }
+    }
+    return 0;
+}
+
+static int handle_ack(void* context, const struct ProtoFrame* frame)
+{
+    struct Connection* conn = (struct Connection*)context;
+    if (frame->length != PROTO_SEQ_SIZE) {
+        return -1;
+    }
+    if (!conn->offlineAttached) {
+        return 0;
+    }
+
+    uint64_t seq = 0;
+    for (size_t i = 0; i < PROTO_SEQ_SIZE; ++i) {
+        seq = (seq << 8) | frame->payload[i];
+    }
+    offline_ack(g_offline, conn->deviceId, seq);
+    return 0;
+}
+
+struct HistoryReply {
+    uint8_t* data;
+    size_t length;
+    size_t capacity;
+    size_t* offsets;    // where each record starts in data
+    size_t count;
+    bool failed;
+};
+
+static bool collect_history(void* context, const struct MsgLogRecord* record)
+{
+    struct HistoryReply* reply = (struct HistoryReply*)context;
+    size_t size = REACTOR_HISTORY_RECORD_HEADER + record->ciphertextLength;
+    if (reply->length + size > reply->capacity) {
+        size_t capacity = reply->capacity ? reply->capacity : 4096;
+        while (capacity < reply->length + size) {
+            capacity *= 2;
+        }
+        uint8_t* data = (uint8_t*)realloc(reply->data, capacity);
+        if (!data) {
+            reply->failed = true;
+            return false;
+        }
+        reply->data = data;
+        reply->capacity = capacity;
+    }
+
+    uint8_t* out = reply->data + reply->length;
+    encode_be(out, record->seq, PROTO_SEQ_SIZE);
+    encode_be(out + PROTO_SEQ_SIZE, record->createdAtMs, PROTO_SEQ_SIZE);
+    memcpy(out + 2 * PROTO_SEQ_SIZE, record->senderDeviceId, PROTO_ID_SIZE);
+    encode_be(out + 2 * PROTO_SEQ_SIZE + PROTO_ID_SIZE, record->ciphertextLength, 4);
+    memcpy(out + REACTOR_HISTORY_RECORD_HEADER, record->ciphertext, record->ciphertextLength);
+    reply->offsets[reply->count++] = reply->length;
+    reply->length += size;
+    return true;
+}
+
+// Answers with one page of the conversation's history; members only.
+static int handle_history(void* context, const struct ProtoFrame* frame)
+{
+    struct Connection* conn = (struct Connection*)context;
+    struct ReactorWorker* worker = conn->owner;
+    if (frame->length != PROTO_ID_SIZE + PROTO_SEQ_SIZE + 2) {
+        return -1;
+    }
+
+    registry_read_begin(&g_registry, worker->routingReader);
+    bool member = routing_is_member(routing_members(routing_find(&g_routing, frame->payload)), conn);
+    registry_read_end(worker->routingReader);
+    if (!member) {
+        log_warn("%s asked for the history of a conversation it has not joined", conn->peerName);
+        return 0;
+    }
+
+    uint64_t beforeSeq = decode_be(frame->payload + PROTO_ID_SIZE, PROTO_SEQ_SIZE);
+    size_t limit = (size_t)decode_be(frame->payload + PROTO_ID_SIZE + PROTO_SEQ_SIZE, 2);
+    if (limit > REACTOR_MAX_HISTORY_PAGE) {
+        limit = REACTOR_MAX_HISTORY_PAGE;
+    }
+
+    // Read-your-writes: messages staged earlier in this batch go in first.
+    if (worker->historyCount > 0) {
+        append_history(worker);
+    }
+
+    struct HistoryReply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.offsets = (size_t*)malloc((limit ? limit : 1) * sizeof(*reply.offsets));
+    if (!reply.offsets) {
+        log_error("malloc failed while reading message history");
+        return 0;
+    }
+    msglog_page_back(g_msglog, frame->payload, beforeSeq, limit, collect_history, &reply);
+
+    // Too large for one frame: keep the newest records, the client pages
+    // back from the oldest one it got.
+    size_t start = 0;
+    size_t maxBody = PROTO_DEFAULT_MAX_PAYLOAD - PROTO_ID_SIZE;
+    for (size_t i = 0; i < reply.count && reply.length - reply.offsets[i] > maxBody; ++i) {
+        start = i + 1 < reply.count ? reply.offsets[i + 1] : reply.length;
+    }
+
+    struct MsgBuf* buf = reply.failed ? NULL : msgbuf_create(PROTO_OP_HISTORY, 0, (const char*)frame->payload,
+        PROTO_ID_SIZE, reply.data + start, reply.length - start);
+    free(reply.data);
+    free(reply.offsets);
+    if (!buf) {
+        log_error("malloc failed while composing message history");
+        return 0;
+    }
+    enum OutQueueResult result = outqueue_push(&conn->outQueue, buf);
+    if (result == OUTQ_QUEUED_FIRST || result == OUTQ_OVERFLOW) {
+        schedule_drain(conn);
+    }
+    msgbuf_release(buf);
+    return 0;
+}
+
+// Records the range and, if it acknowledged anything new, stages it for the
+// messages' senders; members only.
+static int handle_receipt(void* context, const struct ProtoFrame* frame)
+{
+    struct Connection* conn = (struct Connection*)context;
+    struct ReactorWorker* worker = conn->owner;
+    if (frame->length != PROTO_ID_SIZE + 1 + 2 * PROTO_SEQ_SIZE) {
+        return -1;
+    }
+    uint8_t kind = frame->payload[PROTO_ID_SIZE];
+    if (kind != RECEIPT_DELIVERED && kind != RECEIPT_READ) {
+        return -1;
+    }
+    if (!conn->identified) {
+        log_warn("%s sent a receipt before HELLO", conn->peerName);
+        return 0;
+    }
+
+    registry_read_begin(&g_registry, worker->routingReader);
+    bool member = routing_is_member(routing_members(routing_find(&g_routing, frame->payload)), conn);
+    registry_read_end(worker->routingReader);
+    if (!member) {
+        log_warn("%s sent a receipt for a conversation it has not joined", conn->peerName);
+        return 0;
+    }
+
+    // Only messages that exist can be acknowledged, including any staged
+    // earlier in this batch.
+    if (worker->historyCount > 0) {
+        append_history(worker);
+    }
+    uint64_t fromSeq = decode_be(frame->payload + PROTO_ID_SIZE + 1, PROTO_SEQ_SIZE);
+    uint64_t toSeq = decode_be(frame->payload + PROTO_ID_SIZE + 1 + PROTO_SEQ_SIZE, PROTO_SEQ_SIZE);
+    uint64_t lastSeq = msglog_last_seq(g_msglog, frame->payload);
+    if (toSeq > lastSeq) {
+        toSeq = lastSeq;
+    }
+    if (fromSeq == 0 || fromSeq > toSeq) {
+        return 0;
+    }
+    if (receipt_ack(g_receipts, frame->payload, conn->deviceId, (enum ReceiptKind)kind, fromSeq, toSeq)) {
+        stage_receipt(worker, frame->payload, conn->deviceId, kind, fromSeq, toSeq);
+    }
+    return 0;
+}
+
+// Outbound queue encoder: compresses a payload of at least compressMinBytes
+// on conn's stream, unless it would not shrink.
+static struct MsgBuf* compress_frame(void* context, struct MsgBuf* buf)
+{
+    struct Connection* conn = (struct Connection*)context;
+    size_t length = msgbuf_size(buf) - PROTO_HEADER_SIZE;
+    if (length < g_config.compressMinBytes || length > LZ_MAX_INPUT) {
+        return NULL;
+    }
+    uint8_t opcode = buf->head[4];
+    uint8_t flags = buf->head[5];
+    struct MsgBuf* packed = msgbuf_create(opcode, flags, NULL, 0, NULL, length);
+    if (!packed) {
+        return NULL;
+    }
+    uint64_t startNs = metrics_now_ns();
+    size_t packedLength = lz_compress(conn->encoder, buf->head + PROTO_HEADER_SIZE, buf->headLength - PROTO_HEADER_SIZE,
+        buf->body, buf->bodyLength, packed->body, length - 1);
+    metrics_add(METRIC_COMPRESS_NS, metrics_now_ns() - startNs);
+    if (packedLength == 0) {
+        metrics_add(METRIC_COMPRESS_SKIPPED, 1);
+        msgbuf_release(packed);
+        return NULL;
+    }
+    proto_encode_header(packed->head, opcode, flags, (uint32_t)packedLength);
+    packed->head[PROTO_ENCODING_OFFSET] = PROTO_ENCODING_LZ;
+    packed->bodyLength = (uint32_t)packedLength;
+    metrics_add(METRIC_COMPRESSED_FRAMES, 1);
+    metrics_add(METRIC_COMPRESS_SAVED_BYTES, length - packedLength);
+    return packed;
+}
+
+static bool decode_frame(void* context, struct ProtoFrame* frame)
+{
+    struct Connection* conn = (struct Connection*)context;
+    if (frame->encoding != PROTO_ENCODING_LZ || !conn->decoder) {
+        return false;
+    }
+    uint64_t startNs = metrics_now_ns();
+    size_t length;
+    const uint8_t* payload = lz_decompress(conn->decoder, frame->payload, frame->length, &length);
+    metrics_add(METRIC_COMPRESS_NS, metrics_now_ns() - startNs);
+    if (!payload) {
+        return false;
+    }
+    frame->payload = payload;
+    frame->length = (uint32_t)length;
+    frame->encoding = 0;
+    return true;
+}
+
+// Enables what the client supports and the server offers, and answers with
+// what is enabled. Compression, once on, stays on for the connection.
+static int handle_features(void* context, const struct ProtoFrame* frame)
+{
+    struct Connection* conn = (struct Connection*)context;
+    if (frame->length < 4) {
+        return -1;
+    }
+    uint32_t wanted = (uint32_t)decode_be(frame->payload, 4);
+    if ((wanted & PROTO_FEATURE_LZ) && g_config.compressMinBytes > 0 && !conn->encoder) {
+        conn->encoder = lz_encoder_create();
+        conn->decoder = lz_decoder_create();
+        if (conn->encoder && conn->decoder) {
+            outqueue_set_encoder(&conn->outQueue, compress_frame, conn);
+        } else {
+            log_error("malloc failed while enabling compression for %s", conn->peerName);
+            lz_encoder_destroy(conn->encoder);
+            lz_decoder_destroy(conn->decoder);
+            conn->encoder = NULL;
+            conn->decoder = NULL;
+        }
+    }
+
+    uint8_t enabled[4];
+    encode_be(enabled, conn->encoder ? PROTO_FEATURE_LZ : 0, sizeof(enabled));
+    struct MsgBuf* buf = msgbuf_create(PROTO_OP_FEATURES, 0, NULL, 0, enabled, sizeof(enabled));
+    if (buf) {
+        push_reply(conn, buf);
+        msgbuf_release(buf);
+    }
+    return 0;
+}
+
+static void reply_blob_put(struct Connection* conn, const uint8_t* id, uint64_t stored, bool refused)
+{
+    uint8_t reply[PROTO_ID_SIZE + PROTO_SEQ_SIZE];
+    memcpy(reply, id, PROTO_ID_SIZE);
+    encode_be(reply + PROTO_ID_SIZE, stored, PROTO_SEQ_SIZE);
+    struct MsgBuf* buf = msgbuf_create(PROTO_OP_BLOB_PUT, refused ? PROTO_BLOB_REFUSED : 0, NULL, 0, reply,
+        sizeof(reply));
+    if (buf) {
+        push_reply(conn, buf);
+        msgbuf_release(buf);
+    }
+}
+
+// Sends the replies of published blobs: the whole size, or a refusal if
+// publishing failed (the client asks again and finds the part complete).
+static void release_blob_replies(struct ReactorWorker* worker)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < worker->blobReplyCount; ++i) {
+        struct BlobReply* reply = &worker->blobReplies[i];
+        if (!atomic_load(&reply->publish->done)) {
+            worker->blobReplies[kept++] = *reply;
+            continue;
+        }
+        if (reply->conn) {
+            reply_blob_put(reply->conn, reply->publish->id, reply->publish->size, !reply->publish->ok);
+        }
+        blob_publish_release(reply->publish);
+    }
+    worker->blobReplyCount = kept;
+    atomic_store(&worker->blobWaiting, kept > 0);
+}
+
+// The blob is durable only once the publisher thread is done with it; the
+// reply waits for that, like a prekey claim's for its journal.
+static void hold_blob_reply(struct Connection* conn, struct BlobPublish* publish)
+{
+    struct ReactorWorker* worker = conn->owner;
+    if (worker->blobReplyCount == worker->blobReplyCapacity) {
+        size_t capacity = worker->blobReplyCapacity ? worker->blobReplyCapacity * 2 : 16;
+        struct BlobReply* replies = (struct BlobReply*)realloc(worker->blobReplies, capacity * sizeof(*replies));
+        if (!replies) {
+            // Publishing goes on; the client asks again later.
+            log_error("malloc failed while holding a blob reply");
+            reply_blob_put(conn, publish->id, publish->size, true);
+            blob_publish_release(publish);
+            return;
+        }
+        worker->blobReplies = replies;
+        worker->blobReplyCapacity = capacity;
+    }
+    struct BlobReply* reply = &worker->blobReplies[worker->blobReplyCount++];
+    reply->conn = conn;
+    reply->publish = publish;
+    atomic_store(&worker->blobWaiting, true);
+}
+
+// Writes one chunk of an attachment. Answers only an empty chunk (asking
+// where to resume), a refusal, a chunk not at the resume point and the
+// chunk that completes the blob, so an upload in order costs no replies.
+static int handle_blob_put(void* context, const struct ProtoFrame* frame)
+{
+    struct Connection* conn = (struct Connection*)context;
+    if (frame->length < REACTOR_BLOB_PUT_HEADER) {
+        return -1;
+    }
+    if (!conn->identified) {
+        log_warn("%s uploaded a blob before HELLO", conn->peerName);
+        return 0;
+    }
+    const uint8_t* id = frame->payload;
+    uint64_t size = decode_be(frame->payload + PROTO_ID_SIZE, PROTO_SEQ_SIZE);
+    uint64_t offset = decode_be(frame->payload + PROTO_ID_SIZE + PROTO_SEQ_SIZE, PROTO_SEQ_SIZE);
+    size_t length = frame->length - REACTOR_BLOB_PUT_HEADER;
+
+    struct BlobUpload* upload = &conn->blobUpload;
+    bool refused = false;
+    if (upload->fd < 0 || memcmp(upload->id, id, PROTO_ID_SIZE) != 0 || upload->size != size) {
+        blob_upload_end(g_blobs, upload);
+        refused = blob_upload_begin(g_blobs, upload, id, size) != 0;
+    }
+    if (!refused && length > 0 && offset == upload->stored) {
+        refused = blob_upload_write(g_blobs, upload, offset, frame->payload + REACTOR_BLOB_PUT_HEADER, length) != 0;
+        if (!refused && upload->stored < size) {
+            return 0;
+        }
+    }
+    if (upload->publish) {
+        hold_blob_reply(conn, upload->publish);
+        upload->publish = NULL;
+        return 0;
+    }
+    reply_blob_put(conn, id, upload->stored, refused);
+    return 0;
+}
+
+// Streams a complete attachment from offset, one download per connection.
+static int handle_blob_get(void* context, const struct ProtoFrame* frame)
+{
+    struct Connection* conn = (struct Connection*)context;
+    if (frame->length != PROTO_ID_SIZE + PROTO_SEQ_SIZE) {
+        return -1;
+    }
+    if (!conn->identified) {
+        log_warn("%s asked for a blob before HELLO", conn->peerName);
+        return 0;
+    }
+    uint64_t offset = decode_be(frame->payload + PROTO_ID_SIZE, PROTO_SEQ_SIZE);
+    if (conn->blobStream.fd < 0 && blob_stream_open(g_blobs, &conn->blobStream, frame->payload, offset) == 0) {
+        schedule_drain(conn);
+        return 0;
+    }
+
+    uint8_t reply[BLOB_DATA_PREFIX];
+    memcpy(reply, frame->payload, PROTO_ID_SIZE);
+    encode_be(reply + PROTO_ID_SIZE, 0, PROTO_SEQ_SIZE);
+    encode_be(reply + PROTO_ID_SIZE + PROTO_SEQ_SIZE, offset, PROTO_SEQ_SIZE);
+    struct MsgBuf* buf = msgbuf_create(PROTO_OP_BLOB_DATA, PROTO_BLOB_REFUSED, NULL, 0, reply, sizeof(reply));
+    if (buf) {
+        push_reply(conn, buf);
+        msgbuf_release(buf);
+    }
+    return 0;
+}
+
+static int handle_prekey_upload(void* context, const struct ProtoFrame* frame)
+{
+    struct Connection* conn = (struct Connection*)context;
+    size_t count = 0;
+    for (size_t offset = 0; offset < frame->length; ++count) {
+        if (frame->length - offset < REACTOR_PREKEY_UPLOAD_HEADER) {
+            return -1;
+        }
+        size_t length = (size_t)decode_be(frame->payload + offset + PROTO_ID_SIZE, 2);
+        offset += REACTOR_PREKEY_UPLOAD_HEADER;
+        if (length == 0 || length > PREKEY_MAX_KEY_SIZE || frame->length - offset < length) {
+            return -1;
+        }
+        offset += length;
+    }
+    if (!conn->identified) {
+        log_warn("%s uploaded prekeys before HELLO", conn->peerName);
+        return 0;
+    }
+
+    struct PrekeyUpload* keys = (struct PrekeyUpload*)malloc((count ? count : 1) * sizeof(*keys));
+    if (!keys) {
+        log_error("malloc failed while uploading prekeys");
+        return 0;
+    }
+    const uint8_t* cursor = frame->payload;
+    for (size_t i = 0; i < count; ++i) {
+        keys[i].keyId = cursor;
+        keys[i].length = (size_t)decode_be(cursor + PROTO_ID_SIZE, 2);
+        keys[i].publicKey = cursor + REACTOR_PREKEY_UPLOAD_HEADER;
+        cursor += REACTOR_PREKEY_UPLOAD_HEADER + keys[i].length;
+    }
+    size_t stored = prekey_upload(g_prekeys, conn->deviceId, keys, count);
+    free(keys);
+
+    uint8_t reply[8];
+    encode_be(reply, stored, 4);
+    encode_be(reply + 4, prekey_available(g_prekeys, conn->deviceId), 4);
+    struct MsgBuf* buf = msgbuf_create(PROTO_OP_PREKEY_UPLOAD, 0, NULL, 0, reply, sizeof(reply));
+    if (buf) {
+        push_reply(conn, buf);
+        msgbuf_release(buf);
+    }
+    return 0;
+}
+
+// The reply to a claim that got no key.
+static void push_empty_claim(struct Connection* conn, const uint8_t* deviceId)
+{
+    struct MsgBuf* buf = msgbuf_create(PROTO_OP_PREKEY_CLAIM, 0, (const char*)deviceId, PROTO_ID_SIZE, NULL, 0);
+    if (buf) {
+        push_reply(conn, buf);
+        msgbuf_release(buf);
+    }
+}
+
+// Sends the durable prefix of the worker's held claim replies. Claims the
+// journal gave up on get the empty reply instead; their keys are never sent.
+static void release_prekey_replies(struct ReactorWorker* worker)
+{
+    uint64_t durable = prekey_durable_generation(g_prekeys);
+    uint64_t failed = prekey_failed_generation(g_prekeys);
+    size_t released = 0;
+    while (released < worker->prekeyReplyCount) {
+        struct PrekeyReply* reply = &worker->prekeyReplies[released];
+        if (reply->generation > durable && reply->generation > failed) {
+            break;
+        }
+        ++released;
+        if (reply->conn && reply->generation <= durable) {
+            push_reply(reply->conn, reply->buf);
+        } else if (reply->conn) {
+            push_empty_claim(reply->conn, reply->deviceId);
+        }
+        msgbuf_release(reply->buf);
+    }
+    worker->prekeyReplyCount -= released;
+    memmove(worker->prekeyReplies, worker->prekeyReplies + released,
+        worker->prekeyReplyCount * sizeof(*worker->prekeyReplies));
+    atomic_store(&worker->prekeyWaiting, worker->prekeyReplyCount > 0);
+}
+
+// Claims are lock-free; the reply waits for the journal's next group commit
+// so a key handed out is never handed out again after a crash.
+static int handle_prekey_claim(void* context, const struct ProtoFrame* frame)
+{
+    struct Connection* conn = (struct Connection*)context;
+    struct ReactorWorker* worker = conn->owner;
+    if (frame->length != PROTO_ID_SIZE) {
+        return -1;
+    }
+
+    struct PrekeyClaim claim;
+    if (!prekey_claim(g_prekeys, frame->payload, &claim)) {
+        push_empty_claim(conn, frame->payload);
+        return 0;
+    }
+
+    uint8_t prefix[2 * PROTO_ID_SIZE];
+    memcpy(prefix, frame->payload, PROTO_ID_SIZE);
+    memcpy(prefix + PROTO_ID_SIZE, claim.keyId, PROTO_ID_SIZE);
+    struct MsgBuf* buf = msgbuf_create(PROTO_OP_PREKEY_CLAIM, 0, (const char*)prefix, sizeof(prefix),
+        claim.publicKey, claim.length);
+    if (!buf) {
+        log_error("malloc failed while composing prekey claim");
+        return 0;
+    }
+    if (worker->prekeyReplyCount == worker->prekeyReplyCapacity) {
+        size_t capacity = worker->prekeyReplyCapacity ? worker->prekeyReplyCapacity * 2 : 64;
+        struct PrekeyReply* replies = (struct PrekeyReply*)realloc(worker->prekeyReplies,
+            capacity * sizeof(*replies));
+        if (!replies) {
+            // The key is already taken, but must not go out before its
+            // tombstone is durable; it is simply not handed to anyone.
+            log_error("malloc failed while holding a prekey claim");
+            msgbuf_release(buf);
+            push_empty_claim(conn, frame->payload);
+            return 0;
+        }
+        worker->prekeyReplies = replies;
+        worker->prekeyReplyCapacity = capacity;
+    }
+    struct PrekeyReply* reply = &worker->prekeyReplies[worker->prekeyReplyCount++];
+    reply->conn = conn;
+    reply->buf = buf;
+    reply->generation = claim.generation;
+    memcpy(reply->deviceId, frame->payload, PROTO_ID_SIZE);
+    atomic_store(&worker->prekeyWaiting, true);
+    return 0;
+}
+
+static void queue_prekey_low(struct Connection* conn)
+{
+    uint8_t payload[4];
+    encode_be(payload, prekey_available(g_prekeys, conn->deviceId), sizeof(payload));
+    struct MsgBuf* buf = msgbuf_create(PROTO_OP_PREKEY_LOW, 0, NULL, 0, payload, sizeof(payload));
+    if (buf) {
+        outqueue_push(&conn->outQueue, buf);
+        msgbuf_release(buf);
+    }
+}
+
+static bool replay_record(void* context, uint64_t seq, const uint8_t* sender, const uint8_t* body, size_t length)
+{
+    struct Connection* conn = (struct Connection*)context;
+
+    uint8_t prefix[PROTO_ID_SIZE + PROTO_SEQ_SIZE];
+    memcpy(prefix, sender, PROTO_ID_SIZE);
+    for (size_t i = 0; i < PROTO_SEQ_SIZE; ++i) {
+        prefix[PROTO_ID_SIZE + i] = (uint8_t)(seq >> (8 * (PROTO_SEQ_SIZE - 1 - i)));
+    }
+    struct MsgBuf* buf = msgbuf_create(PROTO_OP_DEVICE_MSG, 0, (const char*)prefix, sizeof(prefix), body, length);
+    if (!buf) {
+        log_error("malloc failed while replaying device message");
+        return false;
+    }
+    outqueue_push(&conn->outQueue, buf);
+    msgbuf_release(buf);
+    return outqueue_has_headroom(&conn->outQueue);
+}
+
+static void arm_retry_timer(struct Connection* conn)
+{
+    if (g_config.retryBaseMs == 0 || timer_pending(&conn->retryTimer)) {
+        return;
+    }
+    uint64_t delayMs = (uint64_t)g_config.retryBaseMs << conn->retryAttempt;
+    if (g_config.retryMaxMs && delayMs > g_config.retryMaxMs) {
+        delayMs = g_config.retryMaxMs;
+    }
+    timerwheel_schedule(&conn->owner->wheel, &conn->retryTimer, conn->owner->nowMs + delayMs);
+}
+
+// Moves stored deliveries into the out queue while it has headroom; the rest
+// stay pending until a flush makes room. Unacked records are sent again after
+// a reconnect, so anything dropped here is not lost.
+static void replay_offline(struct Connection* conn)
+{
+    if (!conn->offlineAttached || !atomic_exchange(&conn->offlinePending, false)) {
+        return;
+    }
+    if (outqueue_has_headroom(&conn->outQueue)) {
+        uint64_t from = conn->replaySeq;
+        conn->replaySeq = offline_read(g_offline, conn->deviceId, from, replay_record, conn);
+        if (conn->replaySeq != from) {
+            arm_retry_timer(conn);
+        }
+    }
+    if (!outqueue_has_headroom(&conn->outQueue)) {
+        atomic_store(&conn->offlinePending, true);
+    }
+}
+
+static bool arm_recv(struct Connection* conn);
+static bool arm_writable(struct Connection* conn);
+static bool dispatch_buffered(struct Connection* conn);
+static bool read_connection(struct Connection* conn);
+
+// Raises the client's CREDIT grant to flowWindow frames past what it has
+// sent, once half of the last grant is used. Grants are running totals, so
+// a newer one makes up for any a full queue dropped.
+static void grant_credit(struct Connection* conn)
+{
+    int32_t remaining = (int32_t)(conn->creditLimit - conn->framesAdmitted);
+    if (g_config.flowWindow == 0 || remaining > (int32_t)(g_config.flowWindow / 2)) {
+        return;
+    }
+    conn->creditLimit = conn->framesAdmitted + g_config.flowWindow;
+    uint8_t payload[4];
+    encode_be(payload, conn->creditLimit, sizeof(payload));
+    struct MsgBuf* buf = msgbuf_create(PROTO_OP_CREDIT, 0, NULL, 0, payload, sizeof(payload));
+    if (buf) {
+        push_reply(conn, buf);
+        msgbuf_release(buf);
+    }
+}
+
+// Stops reading conn; waitMs > 0 resumes it then, 0 once its queue drains.
+static void pause_reading(struct Connection* conn, uint32_t waitMs)
+{
+    struct ReactorWorker* worker = conn->owner;
+    conn->readPaused = true;
+    if (waitMs > 0) {
+        timerwheel_schedule(&worker->wheel, &conn->resumeTimer, worker->nowMs + waitMs);
+    }
+    // A multishot recv would go on completing: cancel it. Resuming re-arms.
+    if (worker->useUring && conn->recvArmed) {
+        struct io_uring_sqe* sqe = uring_get_sqe(&worker->ring);
+        if (sqe) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (uint64_t)(uintptr_t)conn | REACTOR_OP_RECV;
+            sqe->user_data = REACTOR_OP_CANCEL;
+        }
+    }
+}
+
+// Asked before every frame. Holds it back, pausing reads, while the
+// client's own queue is over half full or its device or address is out of
+// tokens; otherwise counts it against the client's credit.
+static bool admit_frame(void* context, const struct ProtoFrame* frame)
+{
+    (void)frame;
+    struct Connection* conn = (struct Connection*)context;
+    if (conn->readPaused) {
+        return false;
+    }
+    if (!outqueue_has_headroom(&conn->outQueue)) {
+        metrics_add(METRIC_BACKPRESSURE_PAUSES, 1);
+        pause_reading(conn, 0);
+        return false;
+    }
+
+    uint64_t nowMs = conn->owner->nowMs;
+    uint32_t waitMs = 0;
+    if (g_config.deviceLimit.ratePerSecond > 0) {
+        waitMs = ratelimit_take(&g_deviceLimits, conn->limitKey, nowMs);
+    }
+    if (waitMs == 0 && g_config.addressLimit.ratePerSecond > 0) {
+        waitMs = ratelimit_take(&g_addressLimits, ratelimit_key_ipv4(conn->address.sin_addr.s_addr), nowMs);
+    }
+    if (waitMs > 0) {
+        metrics_add(METRIC_RATE_LIMITED, 1);
+        pause_reading(conn, waitMs);
+        return false;
+    }
+
+    ++conn->framesAdmitted;
+    grant_credit(conn);
+    return true;
+}
+
+// Dispatches what a paused connection held back and reads on. Returns false
+// if the connection must be closed.
+static bool resume_reading(struct Connection* conn)
+{
+    conn->readPaused = false;
+    timerwheel_cancel(&conn->owner->wheel, &conn->resumeTimer);
+    if (!dispatch_buffered(conn)) {
+        return false;
+    }
+    if (conn->readPaused) {
+        return true;
+    }
+    grant_credit(conn);
+    if (conn->owner->useUring) {
+        // A cancelled recv that has yet to complete re-arms itself then.
+        return conn->recvArmed || arm_recv(conn);
+    }
+    return read_connection(conn);
+}
+
+static void resume_timer_expired(struct TimerNode* timer)
+{
+    struct Connection* conn = (struct Connection*)timer->context;
+    if (!resume_reading(conn)) {
+        close_connection(conn);
+    }
+}
+
+// Resumes a connection paused for its own queue once that has room again.
+static bool resume_if_drained(struct Connection* conn)
+{
+    if (!conn->readPaused || timer_pending(&conn->resumeTimer) || !outqueue_has_headroom(&conn->outQueue)) {
+        return true;
+    }
+    return resume_reading(conn);
+}
+
+// io_uring counterpart of outqueue_flush: one SENDMSG with as much of the
+// queue as sendIov describes. Returns false if the connection must be closed.
+static bool submit_send(struct Connection* conn)
+{
+    int segments = outqueue_gather(&conn->outQueue, conn->sendIov, REACTOR_URING_SEND_IOV);
+    if (segments <= 0) {
+        return segments == 0;
+    }
+    struct io_uring_sqe* sqe = uring_get_sqe(&conn->owner->ring);
+    if (!sqe) {
+        log_error("io_uring submission failed while sending");
+        outqueue_complete(&conn->outQueue, 0);
+        return false;
+    }
+    memset(&conn->sendMsg, 0, sizeof(conn->sendMsg));
+    conn->sendMsg.msg_iov = conn->sendIov;
+    conn->sendMsg.msg_iovlen = (size_t)segments;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&conn->sendMsg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | REACTOR_OP_SEND;
+    conn->sendInFlight = true;
+    return true;
+}
+
+// Returns false if the connection must be closed.
+static bool drain_connection(struct Connection* conn)
+{
+    if (conn->prekeyAttached && atomic_exchange(&conn->prekeyLow, false)) {
+        queue_prekey_low(conn);
+    }
+    if (conn->owner->useUring) {
+        // The completion of a send in flight drains whatever follows it.
+        if (conn->sendInFlight || conn->writableArmed) {
+            return true;
+        }
+        replay_offline(conn);
+        // Queued frames go first, between BLOB_DATA frames, never inside one.
+        if (!conn->blobStream.inFrame && (!submit_send(conn) || conn->sendInFlight)) {
+            return conn->sendInFlight;
+        }
+        while (conn->blobStream.fd >= 0) {
+            enum BlobSendResult blob = blob_stream_send(&conn->blobStream, conn->fd);
+            if (blob == BLOB_SEND_ERROR) {
+                return false;
+            }
+            if (blob == BLOB_SEND_BLOCKED) {
+                return arm_writable(conn);
+            }
+            if (!submit_send(conn) || conn->sendInFlight) {
+                return conn->sendInFlight;
+            }
+        }
+        return true;
+    }
+    while (true) {
+        replay_offline(conn);
+        if (!conn->blobStream.inFrame) {
+            enum OutQueueFlushResult result = outqueue_flush(&conn->outQueue, conn->fd);
+            if (result == OUTQ_FLUSH_ERROR) {
+                return false;
+            }
+            if (result != OUTQ_FLUSH_DRAINED) {
+                return resume_if_drained(conn);
+            }
+            if (atomic_load(&conn->offlinePending)) {
+                continue;
+            }
+        }
+        // EPOLLOUT resumes a blocked stream.
+        enum BlobSendResult blob = blob_stream_send(&conn->blobStream, conn->fd);
+        if (blob == BLOB_SEND_ERROR) {
+            return false;
+        }
+        if (blob != BLOB_SEND_FRAME) {
+            return resume_if_drained(conn);
+        }
+    }
+}
+
+// Sets the idle timer for whichever comes first: the heartbeat (unless a
+// PING is already out) or the idle deadline. Reads only move lastActivityMs;
+// the timer notices on expiry and re-arms, so busy connections cost nothing.
+static void arm_idle_timer(struct Connection* conn)
+{
+    uint64_t dueMs = UINT64_MAX;
+    if (g_config.heartbeatMs && !conn->pinged) {
+        dueMs = conn->lastActivityMs + g_config.heartbeatMs;
+    }
+    if (g_config.idleTimeoutMs && conn->lastActivityMs + g_config.idleTimeoutMs < dueMs) {
+        dueMs = conn->lastActivityMs + g_config.idleTimeoutMs;
+    }
+    if (dueMs != UINT64_MAX) {
+        timerwheel_schedule(&conn->owner->wheel, &conn->idleTimer, dueMs);
+    }
+}
+
+static void idle_timer_expired(struct TimerNode* timer)
+{
+    struct Connection* conn = (struct Connection*)timer->context;
+    uint64_t silentMs = conn->owner->nowMs - conn->lastActivityMs;
+
+    if (g_config.idleTimeoutMs && silentMs >= g_config.idleTimeoutMs) {
+        log_info("Closing idle client %s", conn->peerName);
+        close_connection(conn);
+        return;
+    }
+    if (g_config.heartbeatMs && silentMs >= g_config.heartbeatMs && !conn->pinged) {
+        struct MsgBuf* ping = msgbuf_create(PROTO_OP_PING, 0, NULL, 0, NULL, 0);
+        if (ping) {
+            enum OutQueueResult result = outqueue_push(&conn->outQueue, ping);
+            if (result == OUTQ_QUEUED_FIRST || result == OUTQ_OVERFLOW) {
+                schedule_drain(conn);
+            }
+            msgbuf_release(ping);
+        }
+        conn->pinged = true;
+    }
+    arm_idle_timer(conn);
+}
+
+// Redelivers device messages that are still unacknowledged when the timer
+// fires, then backs off exponentially while the device makes no progress.
+static void retry_timer_expired(struct TimerNode* timer)
+{
+    struct Connection* conn = (struct Connection*)timer->context;
+    if (!conn->offlineAttached) {
+        return;
+    }
+
+    uint64_t first = offline_first_unacked(g_offline, conn->deviceId);
+    if (first >= conn->replaySeq) {
+        // Everything sent is acknowledged; the next replay re-arms.
+        conn->retryAttempt = 0;
+        return;
+    }
+    if (first > conn->retryFirstSeq) {
+        conn->retryAttempt = 0;
+    } else {
+        // Still queued means the client is not reading: resending would only
+        // pile up duplicates, so just wait longer.
+        if (outqueue_length(&conn->outQueue) == 0) {
+            conn->replaySeq = first;
+            atomic_store(&conn->offlinePending, true);
+            schedule_drain(conn);
+        }
+        if (conn->retryAttempt < REACTOR_MAX_RETRY_SHIFT) {
+            ++conn->retryAttempt;
+        }
+    }
+    conn->retryFirstSeq = first;
+    arm_retry_timer(conn);
+}
+
+static void deliver_inbox(struct ReactorWorker* worker)
+{
+    pthread_mutex_lock(&worker->inboxMutex);
+    struct MsgBuf** inbox = worker->inbox;
+    size_t count = worker->inboxCount;
+    worker->inbox = NULL;
+    worker->inboxCount = 0;
+    worker->inboxCapacity = 0;
+    pthread_mutex_unlock(&worker->inboxMutex);
+
+    for (size_t i = 0; i < count; ++i) {
+        uint8_t opcode = inbox[i]->head[4];
+        if (opcode == PROTO_OP_CONV_MSG || opcode == PROTO_OP_PRESENCE || opcode == PROTO_OP_RECEIPT) {
+            route_conversation(worker, inbox[i], NULL, false);
+        } else {
+            fan_out(worker, inbox[i], NULL);
+        }
+        msgbuf_release(inbox[i]);
+    }
+    free(inbox);
+}
+
+static void drain_scheduled(struct ReactorWorker* worker)
+{
+    if (g_sharded) {
+        deliver_inbox(worker);
+    }
+    if (worker->prekeyReplyCount > 0) {
+        release_prekey_replies(worker);
+    }
+    if (worker->blobReplyCount > 0) {
+        release_blob_replies(worker);
+    }
+
+    while (true) {
+        pthread_mutex_lock(&worker->drainMutex);
+        struct Connection* conn = worker->drainHead;
+        if (conn) {
+            worker->drainHead = conn->drainNext;
+            conn->drainQueued = false;
+            conn->drainNext = NULL;
+        }
+        pthread_mutex_unlock(&worker->drainMutex);
+
+        if (!conn) {
+            break;
+        }
+        // A broadcaster may schedule a connection after it closed; it waits
+        // here for reclamation. Live ones aren't closed here either: shutting
+        // down makes the next wait report the hangup, and the normal event
+        // path closes them.
+        if (conn->closed) {
+            continue;
+        }
+        if (!drain_connection(conn)) {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+}
+
+// Runs the drains scheduled during a loop iteration, so every frame queued
+// for a connection in it goes out in one send. With a cork window they wait
+// up to corkMs for more frames to join them.
+static void run_drains(struct ReactorWorker* worker)
+{
+    if (!worker->drainPending) {
+        return;
+    }
+    if (g_config.corkMs > 0) {
+        if (worker->drainDueMs == 0) {
+            worker->drainDueMs = worker->nowMs + g_config.corkMs;
+        }
+        if (worker->nowMs < worker->drainDueMs) {
+            return;
+        }
+        worker->drainDueMs = 0;
+    }
+    // Anything scheduled while draining is drained by the same pass.
+    drain_scheduled(worker);
+    worker->drainPending = false;
+}
+
+// Sets up a connection for an accepted socket and starts watching it.
+static void open_connection(struct ReactorWorker* worker, socket_t clientFd, const struct sockaddr_in* clientAddr)
+{
+    struct Connection* conn = (struct Connection*)slab_alloc(&g_connectionSlab);
+    if (!conn) {
+        log_error("malloc failed while accepting client");
+        closesocket(clientFd);
+        return;
+    }
+    conn->fd = clientFd;
+    conn->address = *clientAddr;
+    cache_peer_name(conn);
+    conn->owner = worker;
+    conn->lastActivityMs = worker->nowMs;
+    timer_init(&conn->idleTimer, idle_timer_expired, conn);
+    timer_init(&conn->retryTimer, retry_timer_expired, conn);
+    timer_init(&conn->resumeTimer, resume_timer_expired, conn);
+    blob_upload_init(&conn->blobUpload);
+    blob_stream_init(&conn->blobStream);
+    outqueue_init(&conn->outQueue, g_outQueueConfig);
+    proto_recv_init(&conn->recvBuffer, REACTOR_MAX_INBOUND_PAYLOAD);
+
+    if (!worker->useUring) {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, clientFd, &event) != 0) {
+            log_os_error("epoll_ctl");
+            closesocket(clientFd);
+            outqueue_destroy(&conn->outQueue);
+            slab_free(&g_connectionSlab, conn);
+            return;
+        }
+        int one = 1;
+        if (g_outQueueConfig->zeroCopyMinBytes > 0
+            && setsockopt(clientFd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+            conn->zeroCopy = true;
+            outqueue_enable_zerocopy(&conn->outQueue);
+        }
+    }
+
+    // Events can't be handled before this returns: they arrive on this thread.
+    conn->slot = registry_insert(worker->registry, conn);
+    if (conn->slot == REGISTRY_NO_SLOT) {
+        if (!worker->useUring) {
+            epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, clientFd, NULL);
+        }
+        closesocket(clientFd);
+        outqueue_destroy(&conn->outQueue);
+        slab_free(&g_connectionSlab, conn);
+        return;
+    }
+
+    arm_idle_timer(conn);
+    metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+    log_info("Client connected: %s", conn->peerName);
+
+    // Until HELLO names a device the connection has a bucket of its own.
+    uint8_t serial[PROTO_ID_SIZE] = { 0 };
+    encode_be(serial, atomic_fetch_add_explicit(&g_connectionSerial, 1, memory_order_relaxed), PROTO_SEQ_SIZE);
+    conn->limitKey = ratelimit_key_id(serial);
+    grant_credit(conn);
+    if (worker->useUring && !arm_recv(conn)) {
+        close_connection(conn);
+    }
+}
+
+static void accept_connections(struct ReactorWorker* worker)
+{
+    while (true) {
+        struct sockaddr_in clientAddr;
+        socklen_t clientAddrLen = sizeof(clientAddr);
+        metrics_add(METRIC_IO_SYSCALLS, 1);
+        socket_t clientFd = accept4(worker->listenFd, (struct sockaddr*)&clientAddr, &clientAddrLen,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientFd == INVALID_SOCKET) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_os_error("accept");
+            }
+            return;
+        }
+        open_connection(worker, clientFd, &clientAddr);
+    }
+}
+
+// Dispatches the complete frames in conn's buffer, up to any flow control
+// holds back. Returns false if the peer broke the protocol.
+static bool dispatch_buffered(struct Connection* conn)
+{
+    uint64_t framesBefore = conn->recvBuffer.frames;
+    int status = proto_recv_dispatch(&conn->recvBuffer, &g_dispatcher, conn);
+    metrics_add(METRIC_FRAMES_IN, conn->recvBuffer.frames - framesBefore);
+    if (status != PROTO_OK && status != PROTO_PAUSED) {
+        log_warn("Closing client after protocol error %d", status);
+        return false;
+    }
+    return true;
+}
+
+// Takes received bytes already placed at the end of conn's buffer and
+// dispatches the frames they complete. Returns false if the peer broke the
+// protocol.
+static bool consume_received(struct Connection* conn, size_t received)
+{
+    conn->lastActivityMs = conn->owner->nowMs;
+    conn->pinged = false;
+    if (conn->presenceOnline
+        && conn->lastActivityMs - conn->presenceTouchedMs >= g_config.presence.persistIntervalMs) {
+        presence_touch(g_presence, conn->deviceId);
+        conn->presenceTouchedMs = conn->lastActivityMs;
+    }
+    proto_recv_commit(&conn->recvBuffer, received);
+    metrics_add(METRIC_BYTES_IN, received);
+    return dispatch_buffered(conn);
+}
+
+// Drains the socket (required with EPOLLET), dispatching frames as they
+// complete, until flow control pauses it. Returns false if the peer is gone
+// or broke the protocol.
+static bool read_connection(struct Connection* conn)
+{
+    while (!conn->readPaused) {
+        size_t available;
+        uint8_t* space = proto_recv_reserve(&conn->recvBuffer, &available);
+        if (!space && conn->recvBuffer.limited) {
+            // The socket keeps the rest, and TCP pushes back on the client.
+            metrics_add(METRIC_RECV_MEMORY_PAUSES, 1);
+            pause_reading(conn, REACTOR_RECV_MEMORY_RETRY_MS);
+            return true;
+        }
+        if (!space) {
+            log_error("malloc failed while receiving");
+            return false;
+        }
+
+        metrics_add(METRIC_IO_SYSCALLS, 1);
+        ssize_t bytesReceived = recv(conn->fd, space, available, 0);
+        if (bytesReceived > 0) {
+            if (!consume_received(conn, (size_t)bytesReceived)) {
+                return false;
+            }
+        } else if (bytesReceived == 0) {
+            return false;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            proto_recv_release_idle(&conn->recvBuffer);
+            return true;
+        } else {
+            log_os_error("recv");
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs what a batch of events left behind: history appends, prekey
+// replies, timers and reclamation.
+static void finish_batch(struct ReactorWorker* worker)
+{
+    if (worker->historyCount > 0) {
+        append_history(worker);
+    }
+    if (worker->prekeyReplyCount > 0) {
+        release_prekey_replies(worker);
+    }
+    if (worker->blobReplyCount > 0) {
+        release_blob_replies(worker);
+    }
+
+    timerwheel_advance(&worker->wheel, worker->nowMs);
+    uint64_t lagMaxMs = atomic_load_explicit(&worker->wheel.stats.lagMaxMs, memory_order_relaxed);
+    if (lagMaxMs >= REACTOR_TIMER_LAG_WARN_MS && lagMaxMs > worker->lagWarnedMs) {
+        log_warn("worker %d: timers running up to %llu ms late", worker->index,
+            (unsigned long long)lagMaxMs);
+        worker->lagWarnedMs = lagMaxMs;
+    }
+
+    if (worker->reader->retired) {
+        registry_reclaim(worker->registry, worker->reader);
+    }
+    if (worker->routingReader != worker->reader && worker->routingReader->retired) {
+        registry_reclaim(&g_registry, worker->routingReader);
+    }
+}
+
+// How long the loop may wait: until the next timer or corked drain, or
+// briefly while retired connections wait to be freed. Not at all if timers
+// (a resumed connection) left history or prekey replies behind, or a blob
+// reply whose publisher wake-up may have come before it was held.
+static int wait_timeout(struct ReactorWorker* worker)
+{
+    if (worker->historyCount > 0 || worker->prekeyReplyCount > 0) {
+        return 0;
+    }
+    if (worker->blobReplyCount > 0 && atomic_load(&worker->blobReplies[0].publish->done)) {
+        return 0;
+    }
+    bool retired = worker->reader->retired || worker->routingReader->retired;
+    uint64_t nowMs = monotonic_ms();
+    int timeout = timerwheel_next_timeout(&worker->wheel, nowMs);
+    if (retired && (timeout < 0 || timeout > REACTOR_RECLAIM_INTERVAL_MS)) {
+        timeout = REACTOR_RECLAIM_INTERVAL_MS;
+    }
+    if (worker->drainPending) {
+        int corked = worker->drainDueMs > nowMs ? (int)(worker->drainDueMs - nowMs) : 0;
+        if (timeout < 0 || timeout > corked) {
+            timeout = corked;
+        }
+    }
+    return timeout;
+}
+
+// EPOLLERR on a zero-copy socket is usually just completions on its error
+// queue; returns false if the socket failed as well.
+static bool reap_zerocopy(struct Connection* conn)
+{
+    if (!outqueue_reap_zerocopy(&conn->outQueue, conn->fd)) {
+        return false;
+    }
+    int error = 0;
+    socklen_t length = sizeof(error);
+    return getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0;
+}
+
+static void epoll_loop(struct ReactorWorker* worker)
+{
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (true) {
+        int timeout = wait_timeout(worker);
+        metrics_add(METRIC_IO_SYSCALLS, 1);
+        int count = epoll_wait(worker->epollFd, events, REACTOR_MAX_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_os_error("epoll_wait");
+            break;
+        }
+        worker->nowMs = monotonic_ms();
+
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.ptr == &g_wakeToken) {
+                uint64_t counter;
+                do {
+                    metrics_add(METRIC_IO_SYSCALLS, 1);
+                } while (read(worker->wakeFd, &counter, sizeof(counter)) > 0);
+                worker->drainPending = true;
+                continue;
+            }
+            struct Connection* conn = (struct Connection*)events[i].data.ptr;
+            if (!conn) {
+                accept_connections(worker);
+                continue;
+            }
+
+            uint32_t flags = events[i].events;
+            bool alive = (flags & EPOLLHUP) == 0;
+            if (alive && (flags & EPOLLERR)) {
+                alive = conn->zeroCopy && reap_zerocopy(conn);
+            }
+            if (alive && (flags & (EPOLLIN | EPOLLRDHUP))) {
+                alive = read_connection(conn);
+            }
+            if (alive && (flags & EPOLLOUT)) {
+                alive = drain_connection(conn);
+            }
+            if (!alive) {
+                close_connection(conn);
+            }
+        }
+
+        finish_batch(worker);
+        run_drains(worker);
+    }
+}
+
+static bool arm_accept(struct ReactorWorker* worker)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(&worker->ring);
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = worker->listenFd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = REACTOR_OP_ACCEPT;
+    return true;
+}
+
+static bool arm_wake(struct ReactorWorker* worker)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(&worker->ring);
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = worker->wakeFd;
+    sqe->addr = (uint64_t)(uintptr_t)&worker->wakeValue;
+    sqe->len = sizeof(worker->wakeValue);
+    sqe->user_data = REACTOR_OP_WAKE;
+    return true;
+}
+
+static bool arm_recv(struct Connection* conn)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(&conn->owner->ring);
+    if (!sqe) {
+        log_error("io_uring submission failed while receiving");
+        return false;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | REACTOR_OP_RECV;
+    conn->recvArmed = true;
+    return true;
+}
+
+// Blob bodies go out with sendfile, which the ring can't do: wait for room
+// and send them from the completion.
+static bool arm_writable(struct Connection* conn)
+{
+    struct io_uring_sqe* sqe = uring_get_sqe(&conn->owner->ring);
+    if (!sqe) {
+        log_error("io_uring submission failed while streaming");
+        return false;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | REACTOR_OP_WRITABLE;
+    conn->writableArmed = true;
+    return true;
+}
+
+static void complete_accept(struct ReactorWorker* worker, const struct io_uring_cqe* cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !arm_accept(worker)) {
+        log_error("worker %d: io_uring submission failed; no longer accepting", worker->index);
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECONNABORTED && cqe->res != -EINTR && cqe->res != -EAGAIN) {
+            errno = -cqe->res;
+            log_os_error("accept");
+        }
+        return;
+    }
+
+    // Multishot accept has nowhere to put each peer's address.
+    struct sockaddr_in clientAddr;
+    socklen_t clientAddrLen = sizeof(clientAddr);
+    metrics_add(METRIC_IO_SYSCALLS, 1);
+    if (getpeername(cqe->res, (struct sockaddr*)&clientAddr, &clientAddrLen) != 0) {
+        memset(&clientAddr, 0, sizeof(clientAddr));
+    }
+    open_connection(worker, cqe->res, &clientAddr);
+}
+
+// Copies a provided buffer's bytes into conn's receive buffer and dispatches
+// them. They are already received, so they are kept even past the
+// receive-memory limit; reading pauses after them instead.
+static bool receive_from_ring(struct Connection* conn, const uint8_t* data, size_t length)
+{
+    while (length > 0) {
+        size_t available;
+        uint8_t* space = proto_recv_reserve_received(&conn->recvBuffer, &available);
+        if (!space) {
+            log_error("malloc failed while receiving");
+            return false;
+        }
+        if (conn->recvBuffer.limited && !conn->readPaused) {
+            metrics_add(METRIC_RECV_MEMORY_PAUSES, 1);
+            pause_reading(conn, REACTOR_RECV_MEMORY_RETRY_MS);
+        }
+        size_t chunk = length < available ? length : available;
+        memcpy(space, data, chunk);
+        if (!consume_received(conn, chunk)) {
+            return false;
+        }
+        data += chunk;
+        length -= chunk;
+    }
+    proto_recv_release_idle(&conn->recvBuffer);
+    return true;
+}
+
+static void complete_recv(struct ReactorWorker* worker, struct Connection* conn, const struct io_uring_cqe* cqe)
+{
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->recvArmed = false;
+    }
+    bool alive = !conn->closed;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bufferId = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if (alive && cqe->res > 0) {
+            alive = receive_from_ring(conn, uring_buffer(&worker->ring, bufferId), (size_t)cqe->res);
+        }
+        uring_recycle_buffer(&worker->ring, bufferId);
+    } else if (cqe->res == 0) {
+        alive = false;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EINTR && cqe->res != -ECANCELED) {
+        // ENOBUFS: every provided buffer was in use; re-arming below waits for returns.
+        errno = -cqe->res;
+        log_os_error("recv");
+        alive = false;
+    }
+
+    if (conn->closed) {
+        if (!conn->recvArmed && !conn->sendInFlight && !conn->writableArmed) {
+            release_connection(conn);
+        }
+    } else if (!alive || (!conn->recvArmed && !conn->readPaused && !arm_recv(conn))) {
+        close_connection(conn);
+    }
+}
+
+static void complete_send(struct Connection* conn, const struct io_uring_cqe* cqe)
+{
+    conn->sendInFlight = false;
+    outqueue_complete(&conn->outQueue, cqe->res > 0 ? (size_t)cqe->res : 0);
+
+    if (conn->closed) {
+        if (!conn->recvArmed && !conn->writableArmed) {
+            release_connection(conn);
+        }
+        return;
+    }
+    if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR) {
+        errno = -cqe->res;
+        log_os_error("queued send");
+        metrics_add(METRIC_SEND_ERRORS, 1);
+        close_connection(conn);
+        return;
+    }
+    if (!drain_connection(conn) || !resume_if_drained(conn)) {
+        close_connection(conn);
+    }
+}
+
+static void complete_writable(struct Connection* conn)
+{
+    conn->writableArmed = false;
+    if (conn->closed) {
+        if (!conn->recvArmed && !conn->sendInFlight) {
+            release_connection(conn);
+        }
+        return;
+    }
+    if (!drain_connection(conn) || !resume_if_drained(conn)) {
+        close_connection(conn);
+    }
+}
+
+static void complete_request(struct ReactorWorker* worker, const struct io_uring_cqe* cqe)
+{
+    struct Connection* conn = (struct Connection*)(uintptr_t)(cqe->user_data & ~(uint64_t)REACTOR_OP_MASK);
+    switch (cqe->user_data & REACTOR_OP_MASK) {
+    case REACTOR_OP_ACCEPT:
+        complete_accept(worker, cqe);
+        break;
+    case REACTOR_OP_WAKE:
+        if (!arm_wake(worker)) {
+            log_error("worker %d: io_uring submission failed; cross-thread wakeups lost", worker->index);
+        }
+        worker->drainPending = true;
+        break;
+    case REACTOR_OP_RECV:
+        complete_recv(worker, conn, cqe);
+        break;
+    case REACTOR_OP_SEND:
+        complete_send(conn, cqe);
+        break;
+    case REACTOR_OP_WRITABLE:
+        complete_writable(conn);
+        break;
+    default:
+        break;
+    }
+}
+
+static void uring_loop(struct ReactorWorker* worker)
+{
+    struct Uring* ring = &worker->ring;
+    if (!arm_accept(worker) || !arm_wake(worker)) {
+        log_error("worker %d: io_uring submission failed", worker->index);
+        return;
+    }
+
+    while (true) {
+        // Sends and re-arms queued since the last wait go in with this one.
+        uring_buffers_commit(ring);
+        int err = uring_enter(ring, uring_peek_cqe(ring) ? 0 : 1, wait_timeout(worker));
+        if (err != 0) {
+            errno = -err;
+            log_os_error("io_uring_enter");
+            break;
+        }
+        worker->nowMs = monotonic_ms();
+
+        struct io_uring_cqe* cqe;
+        while ((cqe = uring_peek_cqe(ring)) != NULL) {
+            struct io_uring_cqe completion = *cqe;
+            uring_cqe_seen(ring);
+            complete_request(worker, &completion);
+        }
+
+        finish_batch(worker);
+        run_drains(worker);
+    }
+}
+
+static void* reactor_thread(void* arg)
+{
+    struct ReactorWorker* worker = (struct ReactorWorker*)arg;
+    t_worker = worker;
+    if (worker->useUring) {
+        uring_loop(worker);
+    } else {
+        epoll_loop(worker);
+    }
+    return NULL;
+}
+
+// Accepted sockets inherit it, so this costs nothing per connection.
+static int set_nodelay(socket_t fd)
+{
+    int one = 1;
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) != 0) {
+        log_os_error("setsockopt TCP_NODELAY");
+        return -1;
+    }
+    return 0;
+}
+
+static int set_reuseport(socket_t fd)
+{
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+        log_os_error("setsockopt SO_REUSEPORT");
+        return -1;
+    }
+    return 0;
+}
+
+// Opens another listener on listenFd's address for a shard; the kernel
+// spreads incoming connections across every SO_REUSEPORT listener.
+static socket_t open_shard_listener(socket_t listenFd, int backlog)
+{
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    if (getsockname(listenFd, (struct sockaddr*)&address, &addressLength) != 0) {
+        log_os_error("getsockname");
+        return INVALID_SOCKET;
+    }
+
+    socket_t fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd == INVALID_SOCKET) {
+        log_os_error("socket");
+        return INVALID_SOCKET;
+    }
+    if (set_reuseport(fd) != 0
+        || (g_config.noDelay && set_nodelay(fd) != 0)
+        || bind(fd, (struct sockaddr*)&address, addressLength) != 0
+        || listen(fd, backlog) != 0) {
+        log_os_error("shard listener");
+        closesocket(fd);
+        return INVALID_SOCKET;
+    }
+    return fd;
+}
+
+static void pin_worker(struct ReactorWorker* worker)
+{
+    long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpuCount <= 0) {
+        return;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET((int)(worker->index % cpuCount), &cpus);
+    int err = pthread_setaffinity_np(worker->threadId, sizeof(cpus), &cpus);
+    if (err != 0) {
+        log_error("pthread_setaffinity_np failed for worker %d: %d", worker->index, err);
+    }
+}
+
+static int init_worker(struct ReactorWorker* worker, int index, int threadCount, socket_t listenFd,
+    const struct ReactorConfig* config)
+{
+    worker->index = index;
+    worker->listenFd = listenFd;
+    worker->ownsListener = false;
+    worker->drainHead = NULL;
+    worker->nowMs = monotonic_ms();
+    timerwheel_init(&worker->wheel, TIMERWHEEL_DEFAULT_TICK_MS, worker->nowMs);
+    timer_init(&worker->presenceTimer, presence_timer_expired, worker);
+    timer_init(&worker->receiptTimer, receipt_timer_expired, worker);
+    pthread_mutex_init(&worker->drainMutex, NULL);
+    pthread_mutex_init(&worker->inboxMutex, NULL);
+
+    worker->registry = &g_registry;
+    if (g_sharded) {
+        registry_init(&worker->shardRegistry, free_connection);
+        worker->registry = &worker->shardRegistry;
+
+        // Shard 0 keeps the listener main() bound; the rest open their own.
+        if (index > 0) {
+            worker->listenFd = open_shard_listener(listenFd, config->backlog);
+            if (worker->listenFd == INVALID_SOCKET) {
+                return -1;
+            }
+            worker->ownsListener = true;
+        }
+    }
+
+    worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (worker->epollFd < 0) {
+        log_os_error("epoll_create1");
+        goto fail_listener;
+    }
+
+    worker->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->wakeFd < 0) {
+        log_os_error("eventfd");
+        goto fail_epoll;
+    }
+
+    worker->useUring = false;
+    if (config->backend == REACTOR_BACKEND_URING) {
+        if (uring_init(&worker->ring, URING_DEFAULT_ENTRIES, URING_DEFAULT_BUFFERS, PROTO_RECV_CHUNK) == 0) {
+            worker->useUring = true;
+        } else {
+            log_os_error("io_uring setup");
+            log_warn("worker %d: falling back to epoll", index);
+        }
+    }
+
+    // A ring watches the wake eventfd and the listener itself; an epoll set
+    // that nobody waits on must not take the listener's exclusive wakeups.
+    if (!worker->useUring) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &g_wakeToken;
+        if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->wakeFd, &event) != 0) {
+            log_os_error("epoll_ctl wake");
+            goto fail_wake;
+        }
+
+        // Shared listener: level-triggered + EPOLLEXCLUSIVE, so one worker wakes
+        // per pending connection and keeps the connection on its own loop. A
+        // shard's listener is only in its own epoll set.
+        event.events = g_sharded ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = NULL;
+        if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->listenFd, &event) != 0) {
+            log_os_error("epoll_ctl listen");
+            goto fail_wake;
+        }
+    }
+
+    worker->reader = registry_reader_register(worker->registry);
+    if (!worker->reader) {
+        goto fail_wake;
+    }
+    worker->routingReader = worker->reader;
+    if (g_sharded) {
+        worker->routingReader = registry_reader_register(&g_registry);
+        worker->shardTargets = (bool*)calloc((size_t)threadCount, sizeof(*worker->shardTargets));
+        if (!worker->routingReader || !worker->shardTargets) {
+            registry_reader_unregister(&g_registry, worker->routingReader);
+            registry_reader_unregister(worker->registry, worker->reader);
+            free(worker->shardTargets);
+            goto fail_wake;
+        }
+    }
+    return 0;
+
+fail_wake:
+    if (worker->useUring) {
+        uring_destroy(&worker->ring);
+    }
+    close(worker->wakeFd);
+fail_epoll:
+    close(worker->epollFd);
+fail_listener:
+    if (worker->ownsListener) {
+        closesocket(worker->listenFd);
+    }
+    return -1;
+}
+
+static void destroy_worker(struct ReactorWorker* worker)
+{
+    if (worker->historyCount > 0) {
+        append_history(worker);
+    }
+    free(worker->history);
+    free(worker->historyEntries);
+    for (size_t i = 0; i < worker->prekeyReplyCount; ++i) {
+        msgbuf_release(worker->prekeyReplies[i].buf);
+    }
+    free(worker->prekeyReplies);
+    for (size_t i = 0; i < worker->blobReplyCount; ++i) {
+        blob_publish_release(worker->blobReplies[i].publish);
+    }
+    free(worker->blobReplies);
+    free(worker->presenceChanges);
+    free(worker->receiptChanges);
+    registry_reader_unregister(worker->registry, worker->reader);
+    if (worker->routingReader != worker->reader) {
+        registry_reader_unregister(&g_registry, worker->routingReader);
+    }
+    free(worker->shardTargets);
+    if (worker->useUring) {
+        uring_destroy(&worker->ring);
+    }
+    close(worker->wakeFd);
+    close(worker->epollFd);
+    if (worker->ownsListener) {
+        closesocket(worker->listenFd);
+    }
+    pthread_mutex_destroy(&worker->drainMutex);
+    pthread_mutex_destroy(&worker->inboxMutex);
+}
+
+int reactor_prepare_listener(socket_t listenFd, const struct ReactorConfig* config)
+{
+    if (config->noDelay && set_nodelay(listenFd) != 0) {
+        return -1;
+    }
+    return config->sharded ? set_reuseport(listenFd) : 0;
+}
+
+int reactor_run(socket_t listenFd, const struct ReactorConfig* config)
+{
+    struct ReactorConfig defaults;
+    if (!config) {
+        reactor_default_config(&defaults);
+        config = &defaults;
+    }
+
+    int threadCount = config->threadCount;
+    if (threadCount <= 0) {
+        long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount = config->sharded && cpuCount > 0 ? (int)cpuCount : REACTOR_DEFAULT_THREADS;
+    }
+
+    g_config = *config;
+    g_outQueueConfig = &g_config.outQueue;
+    // Room for at least two of the largest frames, or one would never fit.
+    proto_set_recv_limit(config->recvMemoryBytes > 0 && config->recvMemoryBytes < 4 * PROTO_DEFAULT_MAX_PAYLOAD
+        ? 4 * PROTO_DEFAULT_MAX_PAYLOAD : config->recvMemoryBytes);
+    g_sharded = config->sharded;
+    slab_init(&g_connectionSlab, sizeof(struct Connection));
+
+    registry_init(&g_registry, free_connection);
+    if (routing_init(&g_routing, &g_registry, 0, config->allowBroadcast) != ROUTING_OK) {
+        return -1;
+    }
+    proto_dispatcher_init(&g_dispatcher);
+    proto_register(&g_dispatcher, PROTO_OP_CHAT, handle_chat);
+    proto_register(&g_dispatcher, PROTO_OP_HELLO, handle_hello);
+    proto_register(&g_dispatcher, PROTO_OP_JOIN, handle_join);
+    proto_register(&g_dispatcher, PROTO_OP_LEAVE, handle_leave);
+    proto_register(&g_dispatcher, PROTO_OP_CONV_MSG, handle_conv_msg);
+    proto_register(&g_dispatcher, PROTO_OP_PONG, handle_pong);
+    proto_register(&g_dispatcher, PROTO_OP_FEATURES, handle_features);
+    g_dispatcher.admit = admit_frame;
+    g_dispatcher.decode = decode_frame;
+    if ((config->deviceLimit.ratePerSecond > 0 && ratelimit_init(&g_deviceLimits, &config->deviceLimit) != 0)
+        || (config->addressLimit.ratePerSecond > 0 && ratelimit_init(&g_addressLimits, &config->addressLimit) != 0)) {
+        log_error("malloc failed while setting up rate limits");
+        ratelimit_destroy(&g_deviceLimits);
+        return -1;
+    }
+    if (config->offline.directory) {
+        g_offline = offline_open(&config->offline);
+        if (!g_offline) {
+            log_error("could not open offline store in %s", config->offline.directory);
+            return -1;
+        }
+        proto_register(&g_dispatcher, PROTO_OP_DEVICE_MSG, handle_device_msg);
+        proto_register(&g_dispatcher, PROTO_OP_ACK, handle_ack);
+    }
+    if (config->history.directory) {
+        g_msglog = msglog_open(&config->history);
+        if (!g_msglog) {
+            log_error("could not open message history in %s", config->history.directory);
+            offline_close(g_offline);
+            g_offline = NULL;
+            return -1;
+        }
+        proto_register(&g_dispatcher, PROTO_OP_HISTORY, handle_history);
+    }
+    if (config->prekeys.directory) {
+        g_prekeys = prekey_open(&config->prekeys, prekeys_durable, NULL);
+        if (!g_prekeys) {
+            log_error("could not open prekey pools in %s", config->prekeys.directory);
+            msglog_close(g_msglog);
+            g_msglog = NULL;
+            offline_close(g_offline);
+            g_offline = NULL;
+            return -1;
+        }
+        proto_register(&g_dispatcher, PROTO_OP_PREKEY_UPLOAD, handle_prekey_upload);
+        proto_register(&g_dispatcher, PROTO_OP_PREKEY_CLAIM, handle_prekey_claim);
+    }
+    if (config->presence.directory) {
+        g_presence = presence_open(&config->presence);
+        if (!g_presence) {
+            log_error("could not open presence store in %s", config->presence.directory);
+            prekey_close(g_prekeys);
+            g_prekeys = NULL;
+            msglog_close(g_msglog);
+            g_msglog = NULL;
+            offline_close(g_offline);
+            g_offline = NULL;
+            return -1;
+        }
+    }
+    // Receipts are by history seq: nothing to acknowledge without it.
+    if (config->receipts.directory && g_msglog) {
+        g_receipts = receipts_open(&config->receipts);
+        if (!g_receipts) {
+            log_error("could not open receipt store in %s", config->receipts.directory);
+            presence_close(g_presence);
+            g_presence = NULL;
+            prekey_close(g_prekeys);
+            g_prekeys = NULL;
+            msglog_close(g_msglog);
+            g_msglog = NULL;
+            offline_close(g_offline);
+            g_offline = NULL;
+            return -1;
+        }
+        proto_register(&g_dispatcher, PROTO_OP_RECEIPT, handle_receipt);
+    }
+    if (config->blobs.directory) {
+        g_blobs = blob_open(&config->blobs, blobs_published, NULL);
+        if (!g_blobs) {
+            log_error("could not open blob store in %s", config->blobs.directory);
+            receipts_close(g_receipts);
+            g_receipts = NULL;
+            presence_close(g_presence);
+            g_presence = NULL;
+            prekey_close(g_prekeys);
+            g_prekeys = NULL;
+            msglog_close(g_msglog);
+            g_msglog = NULL;
+            offline_close(g_offline);
+            g_offline = NULL;
+            return -1;
+        }
+        proto_register(&g_dispatcher, PROTO_OP_BLOB_PUT, handle_blob_put);
+        proto_register(&g_dispatcher, PROTO_OP_BLOB_GET, handle_blob_get);
+    }
+
+    raise_fd_limit();
+    if (set_socket_nonblocking(listenFd) != 0) {
+        return -1;
+    }
+
+    struct ReactorWorker* workers = (struct ReactorWorker*)calloc((size_t)threadCount, sizeof(*workers));
+    if (!workers) {
+        log_error("malloc failed while starting reactor");
+        return -1;
+    }
+    g_workers = workers;
+    atomic_init(&g_workerCount, 0);
+
+    int started = 0;
+    int result = 0;
+    for (int i = 0; i < threadCount; ++i) {
+        struct ReactorWorker* worker = &workers[i];
+        if (init_worker(worker, i, threadCount, listenFd, config) != 0) {
+            result = -1;
+            break;
+        }
+
+        int threadErr = pthread_create(&worker->threadId, NULL, reactor_thread, worker);
+        if (threadErr != 0) {
+            log_error("pthread_create failed: %d", threadErr);
+            destroy_worker(worker);
+            result = threadErr;
+            break;
+        }
+        if (config->pinCpus) {
+            pin_worker(worker);
+        }
+        ++started;
+        atomic_store(&g_workerCount, started);
+    }
+
+    if (started > 0) {
+        int uringCount = 0;
+        for (int i = 0; i < started; ++i) {
+            uringCount += workers[i].useUring ? 1 : 0;
+        }
+        log_info("Reactor running with %d %s, %d on io_uring", started,
+            g_sharded ? "SO_REUSEPORT shard(s)" : "thread(s)", uringCount);
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(workers[i].threadId, NULL);
+    }
+    // Their journal and publisher threads wake workers until they are gone.
+    prekey_close(g_prekeys);
+    g_prekeys = NULL;
+    blob_close(g_blobs);
+    g_blobs = NULL;
+    presence_close(g_presence);
+    g_presence = NULL;
+    receipts_close(g_receipts);
+    g_receipts = NULL;
+    for (int i = 0; i < started; ++i) {
+        destroy_worker(&workers[i]);
+    }
+
+    free(workers);
+    msglog_close(g_msglog);
+    g_msglog = NULL;
+    offline_close(g_offline);
+    g_offline = NULL;
+    ratelimit_destroy(&g_deviceLimits);
+    ratelimit_destroy(&g_addressLimits);
+    return started > 0 ? 0 : result;
+}
+
+void reactor_timer_stats(struct ReactorTimerStats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    int workerCount = atomic_load(&g_workerCount);
+    for (int i = 0; i < workerCount; ++i) {
+        const struct TimerWheelStats* wheel = &g_workers[i].wheel.stats;
+        stats->fired += atomic_load_explicit(&wheel->fired, memory_order_relaxed);
+        stats->lagTotalMs += atomic_load_explicit(&wheel->lagTotalMs, memory_order_relaxed);
+        uint64_t lagMaxMs = atomic_load_explicit(&wheel->lagMaxMs, memory_order_relaxed);
+        if (lagMaxMs > stats->lagMaxMs) {
+            stats->lagMaxMs = lagMaxMs;
+        }
+    }
+}
+
+#endif // __linux__
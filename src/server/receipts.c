@@ -0,0 +1,326 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "receipts.h"
+#include "logger.h"
+#include "storeutil.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define RECEIPTS_BUCKETS 65536
+#define RECEIPTS_TABLE_STRIPES 64
+// Compact once the journal holds this many records per known entry...
+#define RECEIPTS_COMPACT_FACTOR 4
+// ...and is at least this large.
+#define RECEIPTS_COMPACT_MIN_BYTES (1024 * 1024)
+
+// Journal record, host byte order; the newest record of an entry wins. A bad
+// checksum marks a torn tail.
+struct ReceiptRecord {
+    uint32_t checksum;      // over the rest of the record
+    uint32_t reserved;
+    uint8_t conversationId[PROTO_ID_SIZE];
+    uint8_t deviceId[PROTO_ID_SIZE];
+    struct ReceiptState state;
+};
+
+// Guarded by its table stripe, like the bucket chain it is on.
+struct ReceiptEntry {
+    uint8_t conversationId[PROTO_ID_SIZE];
+    uint8_t deviceId[PROTO_ID_SIZE];
+    struct ReceiptState state;
+    bool dirty;                         // on its stripe's dirty list
+    struct ReceiptEntry* dirtyNext;
+    struct ReceiptEntry* next;          // bucket chain
+};
+
+struct ReceiptStore {
+    struct ReceiptsConfig config;
+    struct StoreJournal journal;    // and the flusher's scratch records
+    atomic_size_t entryCount;      // decides when to compact
+
+    pthread_mutex_t tableMutex[RECEIPTS_TABLE_STRIPES];
+    struct ReceiptEntry* dirtyHead[RECEIPTS_TABLE_STRIPES];
+    struct ReceiptEntry** buckets;
+
+    struct StoreFlusher flusher;
+};
+
+static size_t hash_entry(const uint8_t* conversationId, const uint8_t* deviceId)
+{
+    uint64_t words[4];
+    memcpy(words, conversationId, PROTO_ID_SIZE);
+    memcpy(words + 2, deviceId, PROTO_ID_SIZE);
+    uint64_t mixed = words[0] ^ (words[1] * 0x9e3779b97f4a7c15ULL) ^ (words[2] * 0xc2b2ae3d27d4eb4fULL) ^ words[3];
+    return (size_t)(mixed ^ (mixed >> 29)) & (RECEIPTS_BUCKETS - 1);
+}
+
+// Returns the entry with its stripe locked (*stripe set), or NULL with
+// nothing locked if it is unknown and create is false or allocation failed.
+static struct ReceiptEntry* lock_entry(struct ReceiptStore* store, const uint8_t* conversationId,
+    const uint8_t* deviceId, bool create, pthread_mutex_t** stripe)
+{
+    size_t bucket = hash_entry(conversationId, deviceId);
+    *stripe = &store->tableMutex[bucket % RECEIPTS_TABLE_STRIPES];
+
+    pthread_mutex_lock(*stripe);
+    struct ReceiptEntry* entry = store->buckets[bucket];
+    while (entry && (memcmp(entry->deviceId, deviceId, PROTO_ID_SIZE) != 0
+        || memcmp(entry->conversationId, conversationId, PROTO_ID_SIZE) != 0)) {
+        entry = entry->next;
+    }
+    if (!entry && create) {
+        entry = (struct ReceiptEntry*)calloc(1, sizeof(*entry));
+        if (!entry) {
+            log_error("malloc failed while tracking receipts");
+        } else {
+            memcpy(entry->conversationId, conversationId, PROTO_ID_SIZE);
+            memcpy(entry->deviceId, deviceId, PROTO_ID_SIZE);
+            entry->next = store->buckets[bucket];
+            store->buckets[bucket] = entry;
+            atomic_fetch_add(&store->entryCount, 1);
+        }
+    }
+    if (!entry) {
+        pthread_mutex_unlock(*stripe);
+    }
+    return entry;
+}
+
+static void mark_dirty(struct ReceiptStore* store, struct ReceiptEntry* entry)
+{
+    if (!entry->dirty) {
+        size_t stripe = hash_entry(entry->conversationId, entry->deviceId) % RECEIPTS_TABLE_STRIPES;
+        entry->dirty = true;
+        entry->dirtyNext = store->dirtyHead[stripe];
+        store->dirtyHead[stripe] = entry;
+    }
+}
+
+// Marks fromSeq..toSeq. A range that starts at or below the watermark's
+// successor moves the watermark to its end and absorbs whatever the window
+// already held beyond it; one past a gap only sets window bits.
+static bool mark_range(struct ReceiptMark* mark, uint64_t fromSeq, uint64_t toSeq)
+{
+    if (toSeq <= mark->watermark) {
+        return false;
+    }
+    if (fromSeq <= mark->watermark + 1) {
+        uint64_t shift = toSeq - mark->watermark;
+        mark->window = shift < RECEIPTS_WINDOW ? mark->window >> shift : 0;
+        mark->watermark = toSeq;
+        while (mark->window & 1) {
+            ++mark->watermark;
+            mark->window >>= 1;
+        }
+        return true;
+    }
+
+    uint64_t first = fromSeq - mark->watermark - 1;
+    if (first >= RECEIPTS_WINDOW) {
+        return false;
+    }
+    uint64_t last = toSeq - mark->watermark - 1;
+    if (last >= RECEIPTS_WINDOW) {
+        last = RECEIPTS_WINDOW - 1;
+    }
+    uint64_t bits = (~(uint64_t)0 >> (RECEIPTS_WINDOW - 1 - last)) & (~(uint64_t)0 << first);
+    bool changed = (bits & ~mark->window) != 0;
+    mark->window |= bits;
+    return changed;
+}
+
+bool receipt_ack(struct ReceiptStore* store, const uint8_t* conversationId, const uint8_t* deviceId,
+    enum ReceiptKind kind, uint64_t fromSeq, uint64_t toSeq)
+{
+    if (fromSeq == 0 || fromSeq > toSeq) {
+        return false;
+    }
+    pthread_mutex_t* stripe;
+    struct ReceiptEntry* entry = lock_entry(store, conversationId, deviceId, true, &stripe);
+    if (!entry) {
+        return false;
+    }
+    bool delivered = mark_range(&entry->state.delivered, fromSeq, toSeq);
+    bool changed = kind == RECEIPT_READ ? mark_range(&entry->state.read, fromSeq, toSeq) : delivered;
+    if (delivered || changed) {
+        mark_dirty(store, entry);
+    }
+    pthread_mutex_unlock(stripe);
+    return changed;
+}
+
+static void encode_record(struct ReceiptRecord* record, const struct ReceiptEntry* entry)
+{
+    memset(record, 0, sizeof(*record));
+    memcpy(record->conversationId, entry->conversationId, PROTO_ID_SIZE);
+    memcpy(record->deviceId, entry->deviceId, PROTO_ID_SIZE);
+    record->state = entry->state;
+}
+
+// Copies one record per entry (all of them, or only the dirty ones) into
+// the journal's scratch array. Returns the record count. Taking a dirty
+// entry clears its mark; one that finds no room stays marked.
+static size_t collect_records(struct ReceiptStore* store, bool all)
+{
+    size_t count = 0;
+    for (size_t stripe = 0; stripe < RECEIPTS_TABLE_STRIPES; ++stripe) {
+        pthread_mutex_lock(&store->tableMutex[stripe]);
+        struct ReceiptEntry* entry;
+        while (!all && (entry = store->dirtyHead[stripe]) != NULL) {
+            struct ReceiptRecord* record = store_journal_slot(&store->journal, count);
+            if (!record) {
+                break;
+            }
+            encode_record(record, entry);
+            ++count;
+            store->dirtyHead[stripe] = entry->dirtyNext;
+            entry->dirty = false;
+            entry->dirtyNext = NULL;
+        }
+
+        for (size_t bucket = stripe; all && bucket < RECEIPTS_BUCKETS; bucket += RECEIPTS_TABLE_STRIPES) {
+            for (entry = store->buckets[bucket]; entry; entry = entry->next) {
+                struct ReceiptRecord* record = store_journal_slot(&store->journal, count);
+                if (record) {
+                    encode_record(record, entry);
+                    ++count;
+                }
+            }
+        }
+        pthread_mutex_unlock(&store->tableMutex[stripe]);
+    }
+    return count;
+}
+
+// The first count scratch records were not written: marks their entries
+// dirty again, so the next pass writes whatever their state is by then.
+static void requeue_records(struct ReceiptStore* store, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        const struct ReceiptRecord* record = (const struct ReceiptRecord*)store_journal_slot(&store->journal, i);
+        pthread_mutex_t* stripe;
+        struct ReceiptEntry* entry = lock_entry(store, record->conversationId, record->deviceId, false, &stripe);
+        if (entry) {
+            mark_dirty(store, entry);
+            pthread_mutex_unlock(stripe);
+        }
+    }
+}
+
+// Replaces the journal with one record per entry. Leaves the dirty marks
+// alone: if it fails, nothing is lost.
+static bool compact_journal(struct ReceiptStore* store)
+{
+    return store_journal_replace(&store->journal, collect_records(store, true));
+}
+
+static void flush_dirty(void* context)
+{
+    struct ReceiptStore* store = (struct ReceiptStore*)context;
+    if (store_journal_oversized(&store->journal, atomic_load(&store->entryCount), RECEIPTS_COMPACT_FACTOR,
+            RECEIPTS_COMPACT_MIN_BYTES)) {
+        compact_journal(store);
+    }
+    size_t count = collect_records(store, false);
+    if (!store_journal_append(&store->journal, count)) {
+        requeue_records(store, count);
+    }
+}
+
+// Applies one journal record; the newest record of each entry wins.
+static bool load_record(void* context, const void* data)
+{
+    struct ReceiptStore* store = (struct ReceiptStore*)context;
+    const struct ReceiptRecord* record = (const struct ReceiptRecord*)data;
+    pthread_mutex_t* stripe;
+    struct ReceiptEntry* entry = lock_entry(store, record->conversationId, record->deviceId, true, &stripe);
+    if (!entry) {
+        return false;
+    }
+    entry->state = record->state;
+    pthread_mutex_unlock(stripe);
+    return true;
+}
+
+static void free_store(struct ReceiptStore* store)
+{
+    for (size_t i = 0; store->buckets && i < RECEIPTS_BUCKETS; ++i) {
+        struct ReceiptEntry* entry = store->buckets[i];
+        while (entry) {
+            struct ReceiptEntry* next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    for (size_t i = 0; i < RECEIPTS_TABLE_STRIPES; ++i) {
+        pthread_mutex_destroy(&store->tableMutex[i]);
+    }
+    store_journal_free(&store->journal);
+    free(store->buckets);
+    free(store);
+}
+
+struct ReceiptStore* receipts_open(const struct ReceiptsConfig* config)
+{
+    if (mkdir(config->directory, 0700) != 0 && errno != EEXIST) {
+        perror("mkdir receipts");
+        return NULL;
+    }
+
+    struct ReceiptStore* store = (struct ReceiptStore*)calloc(1, sizeof(*store));
+    if (!store) {
+        return NULL;
+    }
+    store->config = *config;
+    if (store->config.persistIntervalMs == 0) {
+        store->config.persistIntervalMs = RECEIPTS_DEFAULT_PERSIST_INTERVAL_MS;
+    }
+    for (size_t i = 0; i < RECEIPTS_TABLE_STRIPES; ++i) {
+        pthread_mutex_init(&store->tableMutex[i], NULL);
+    }
+
+    store->buckets = (struct ReceiptEntry**)calloc(RECEIPTS_BUCKETS, sizeof(*store->buckets));
+    if (!store_journal_init(&store->journal, config->directory, sizeof(struct ReceiptRecord), "receipt journal")
+        || !store->buckets) {
+        free_store(store);
+        return NULL;
+    }
+    // Compacting also creates the journal.
+    if (!store_journal_load(&store->journal, load_record, store) || !compact_journal(store)) {
+        free_store(store);
+        return NULL;
+    }
+
+    if (!store_flusher_start(&store->flusher, STORE_FLUSH_PERIODIC, store->config.persistIntervalMs, flush_dirty,
+            store)) {
+        free_store(store);
+        return NULL;
+    }
+    size_t entryCount = atomic_load(&store->entryCount);
+    if (entryCount > 0) {
+        log_info("Loaded receipts of %zu conversation member(s)", entryCount);
+    }
+    return store;
+}
+
+void receipts_close(struct ReceiptStore* store)
+{
+    if (!store) {
+        return;
+    }
+    // The flusher makes one last pass on its way out.
+    store_flusher_stop(&store->flusher);
+    free_store(store);
+}
+
+#endif // __linux__
@@ -0,0 +1,266 @@
+#include "registry.h"
+#include "metrics.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REGISTRY_INITIAL_CAPACITY 64
+
+// Writer mutex, timed for the metrics: the hold time always, the wait only
+// when trylock finds it taken.
+static void lock_registry(struct Registry* registry)
+{
+    if (pthread_mutex_trylock(&registry->mutex) != 0) {
+        uint64_t waitStartNs = metrics_now_ns();
+        pthread_mutex_lock(&registry->mutex);
+        registry->lockedAtNs = metrics_now_ns();
+        metrics_add(METRIC_REGISTRY_LOCK_CONTENDED, 1);
+        metrics_add(METRIC_REGISTRY_LOCK_WAIT_NS, registry->lockedAtNs - waitStartNs);
+    } else {
+        registry->lockedAtNs = metrics_now_ns();
+    }
+    metrics_add(METRIC_REGISTRY_LOCKS, 1);
+}
+
+static void unlock_registry(struct Registry* registry)
+{
+    uint64_t heldNs = metrics_now_ns() - registry->lockedAtNs;
+    pthread_mutex_unlock(&registry->mutex);
+    metrics_add(METRIC_REGISTRY_LOCK_HOLD_NS, heldNs);
+}
+
+void registry_init(struct Registry* registry, registry_free_fn freeItem)
+{
+    memset(registry, 0, sizeof(*registry));
+    pthread_mutex_init(&registry->mutex, NULL);
+    atomic_init(&registry->slots, NULL);
+    atomic_init(&registry->epoch, 1);
+    registry->freeItem = freeItem;
+}
+
+struct RegistryReader* registry_reader_register(struct Registry* registry)
+{
+    lock_registry(registry);
+
+    struct RegistryReader* reader = registry->readers;
+    while (reader && reader->inUse) {
+        reader = reader->next;
+    }
+    if (!reader) {
+        reader = (struct RegistryReader*)calloc(1, sizeof(*reader));
+        if (!reader) {
+            unlock_registry(registry);
+            log_error("malloc failed while registering reader");
+            return NULL;
+        }
+        atomic_init(&reader->epoch, 0);
+        reader->next = registry->readers;
+        registry->readers = reader;
+    }
+    reader->inUse = true;
+
+    unlock_registry(registry);
+    return reader;
+}
+
+void registry_reader_unregister(struct Registry* registry, struct RegistryReader* reader)
+{
+    if (!reader) {
+        return;
+    }
+
+    lock_registry(registry);
+    atomic_store(&reader->epoch, 0);
+    // Whatever it could not free yet becomes anyone's to reclaim.
+    while (reader->retired) {
+        struct RegistryRetired* retired = reader->retired;
+        reader->retired = retired->next;
+        retired->next = registry->orphans;
+        registry->orphans = retired;
+    }
+    reader->retiredCount = 0;
+    reader->inUse = false;
+    unlock_registry(registry);
+}
+
+// Retires on reader's list when given, else on the orphan list; caller holds the mutex.
+static void retire_locked(struct Registry* registry, struct RegistryReader* reader, void* item, registry_free_fn freeItem)
+{
+    struct RegistryRetired* retired = (struct RegistryRetired*)malloc(sizeof(*retired));
+    if (!retired) {
+        // Leaking beats freeing something a reader may still hold.
+        log_error("malloc failed while retiring registry item");
+        return;
+    }
+    retired->item = item;
+    retired->freeItem = freeItem;
+    retired->epoch = atomic_fetch_add(&registry->epoch, 1);
+    if (reader) {
+        retired->next = reader->retired;
+        reader->retired = retired;
+        ++reader->retiredCount;
+    } else {
+        retired->next = registry->orphans;
+        registry->orphans = retired;
+    }
+}
+
+static bool grow_locked(struct Registry* registry, struct RegistryReader* reader)
+{
+    struct RegistrySlots* old = atomic_load_explicit(&registry->slots, memory_order_relaxed);
+    size_t capacity = old ? old->capacity * 2 : REGISTRY_INITIAL_CAPACITY;
+    if (capacity > REGISTRY_NO_SLOT) {
+        return false;
+    }
+
+    struct RegistrySlots* slots = (struct RegistrySlots*)malloc(sizeof(*slots) + capacity * sizeof(slots->items[0]));
+    if (!slots) {
+        log_error("malloc failed while growing registry");
+        return false;
+    }
+    slots->capacity = capacity;
+    size_t used = old ? atomic_load_explicit(&old->used, memory_order_relaxed) : 0;
+    atomic_init(&slots->used, used);
+    for (size_t i = 0; i < capacity; ++i) {
+        atomic_init(&slots->items[i], i < used ? atomic_load_explicit(&old->items[i], memory_order_relaxed) : NULL);
+    }
+
+    atomic_store_explicit(&registry->slots, slots, memory_order_release);
+    if (old) {
+        retire_locked(registry, reader, old, free);
+    }
+    return true;
+}
+
+uint32_t registry_insert(struct Registry* registry, void* item)
+{
+    lock_registry(registry);
+
+    uint32_t slot = REGISTRY_NO_SLOT;
+    struct RegistrySlots* slots = atomic_load_explicit(&registry->slots, memory_order_relaxed);
+    if (registry->freeCount > 0) {
+        slot = registry->freeSlots[--registry->freeCount];
+    } else {
+        size_t used = slots ? atomic_load_explicit(&slots->used, memory_order_relaxed) : 0;
+        if (!slots || used == slots->capacity) {
+            if (!grow_locked(registry, NULL)) {
+                unlock_registry(registry);
+                return REGISTRY_NO_SLOT;
+            }
+            slots = atomic_load_explicit(&registry->slots, memory_order_relaxed);
+        }
+        slot = (uint32_t)used;
+        atomic_store_explicit(&slots->used, used + 1, memory_order_release);
+    }
+
+    atomic_store_explicit(&slots->items[slot], item, memory_order_release);
+    ++registry->count;
+
+    unlock_registry(registry);
+    return slot;
+}
+
+void registry_remove(struct Registry* registry, struct RegistryReader* reader, uint32_t slot)
+{
+    lock_registry(registry);
+
+    struct RegistrySlots* slots = atomic_load_explicit(&registry->slots, memory_order_relaxed);
+    void* item = slots && slot < slots->capacity ? atomic_load_explicit(&slots->items[slot], memory_order_relaxed) : NULL;
+    if (!item) {
+        unlock_registry(registry);
+        return;
+    }
+
+    if (registry->freeCount == registry->freeCapacity) {
+        size_t capacity = registry->freeCapacity ? registry->freeCapacity * 2 : REGISTRY_INITIAL_CAPACITY;
+        uint32_t* freeSlots = (uint32_t*)realloc(registry->freeSlots, capacity * sizeof(*freeSlots));
+        if (!freeSlots) {
+            // The slot stays taken by this item; better than losing track of it.
+            log_error("malloc failed while freeing registry slot");
+            unlock_registry(registry);
+            return;
+        }
+        registry->freeSlots = freeSlots;
+        registry->freeCapacity = capacity;
+    }
+
+    atomic_store(&slots->items[slot], NULL);
+    registry->freeSlots[registry->freeCount++] = slot;
+    --registry->count;
+    retire_locked(registry, reader, item, registry->freeItem);
+
+    unlock_registry(registry);
+}
+
+void registry_retire(struct Registry* registry, struct RegistryReader* reader, void* item, registry_free_fn freeItem)
+{
+    lock_registry(registry);
+    retire_locked(registry, reader, item, freeItem);
+    unlock_registry(registry);
+}
+
+// Oldest epoch any reader is still reading in; caller holds the mutex.
+static uint64_t min_active_epoch_locked(struct Registry* registry)
+{
+    uint64_t minimum = UINT64_MAX;
+    for (struct RegistryReader* reader = registry->readers; reader; reader = reader->next) {
+        uint64_t epoch = atomic_load(&reader->epoch);
+        if (epoch != 0 && epoch < minimum) {
+            minimum = epoch;
+        }
+    }
+    return minimum;
+}
+
+// Unlinks the entries of list that are safe to free into *ready.
+static void collect_expired(struct RegistryRetired** list, uint64_t minimum, struct RegistryRetired** ready, size_t* removed)
+{
+    struct RegistryRetired** current = list;
+    while (*current) {
+        struct RegistryRetired* retired = *current;
+        if (retired->epoch < minimum) {
+            *current = retired->next;
+            retired->next = *ready;
+            *ready = retired;
+            ++*removed;
+        } else {
+            current = &retired->next;
+        }
+    }
+}
+
+void registry_reclaim(struct Registry* registry, struct RegistryReader* reader)
+{
+    struct RegistryRetired* ready = NULL;
+    size_t freed = 0;
+    size_t orphansFreed = 0;
+
+    lock_registry(registry);
+    uint64_t minimum = min_active_epoch_locked(registry);
+    if (reader) {
+        collect_expired(&reader->retired, minimum, &ready, &freed);
+        reader->retiredCount -= freed;
+    }
+    collect_expired(&registry->orphans, minimum, &ready, &orphansFreed);
+    unlock_registry(registry);
+
+    // Free outside the lock: callbacks may be slow or take other locks.
+    while (ready) {
+        struct RegistryRetired* retired = ready;
+        ready = retired->next;
+        if (retired->freeItem) {
+            retired->freeItem(retired->item);
+        }
+        free(retired);
+    }
+}
+
+size_t registry_count(struct Registry* registry)
+{
+    lock_registry(registry);
+    size_t count = registry->count;
+    unlock_registry(registry);
+    return count;
+}
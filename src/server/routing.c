@@ -0,0 +1,362 @@
+#include "routing.h"
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUTING_NO_SLOT SIZE_MAX
+
+static size_t hash_id(const uint8_t* id)
+{
+    // Ids are random UUIDs; folding both halves is enough to spread them.
+    uint64_t low;
+    uint64_t high;
+    memcpy(&low, id, sizeof(low));
+    memcpy(&high, id + sizeof(low), sizeof(high));
+    uint64_t mixed = (low ^ (high * 0x9e3779b97f4a7c15ULL));
+    mixed ^= mixed >> 29;
+    return (size_t)mixed;
+}
+
+static size_t hash_endpoint(const void* endpoint)
+{
+    uint64_t mixed = (uint64_t)(uintptr_t)endpoint * 0x9e3779b97f4a7c15ULL;
+    return (size_t)(mixed ^ (mixed >> 32));
+}
+
+int routing_init(struct RoutingTable* table, struct Registry* epochs, size_t bucketCount, bool allowBroadcast)
+{
+    size_t buckets = 1;
+    size_t wanted = bucketCount ? bucketCount : ROUTING_DEFAULT_BUCKETS;
+    while (buckets < wanted) {
+        buckets <<= 1;
+    }
+
+    memset(table, 0, sizeof(*table));
+    table->conversations = (_Atomic(struct RoutingConversation*)*)calloc(buckets, sizeof(*table->conversations));
+    if (!table->conversations) {
+        log_error("malloc failed while creating routing table");
+        return ROUTING_ERR_NO_MEMORY;
+    }
+    for (size_t i = 0; i < buckets; ++i) {
+        atomic_init(&table->conversations[i], NULL);
+    }
+    for (size_t i = 0; i < ROUTING_LOCK_STRIPES; ++i) {
+        pthread_mutex_init(&table->locks[i], NULL);
+    }
+    table->epochs = epochs;
+    table->allowBroadcast = allowBroadcast;
+    table->bucketMask = buckets - 1;
+    return ROUTING_OK;
+}
+
+// Bucket walk for writers; caller holds the bucket's stripe.
+static struct RoutingConversation* find_conversation_locked(struct RoutingTable* table, size_t bucket,
+    const uint8_t* id, _Atomic(struct RoutingConversation*)** link)
+{
+    _Atomic(struct RoutingConversation*)* current = &table->conversations[bucket];
+    struct RoutingConversation* conversation;
+    while ((conversation = atomic_load_explicit(current, memory_order_relaxed)) != NULL) {
+        if (memcmp(conversation->id, id, PROTO_ID_SIZE) == 0) {
+            break;
+        }
+        current = &conversation->next;
+    }
+    if (link) {
+        *link = current;
+    }
+    return conversation;
+}
+
+static bool is_zero_id(const uint8_t* id)
+{
+    for (size_t i = 0; i < PROTO_ID_SIZE; ++i) {
+        if (id[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t find_slot(const struct RoutingMembers* members, const void* endpoint)
+{
+    for (size_t i = hash_endpoint(endpoint) & members->indexMask;; i = (i + 1) & members->indexMask) {
+        uint32_t entry = atomic_load_explicit(&members->byEndpoint[i], memory_order_acquire);
+        if (entry == 0) {
+            return ROUTING_NO_SLOT;
+        }
+        if (routing_member_endpoint(&members->members[entry - 1]) == endpoint) {
+            return entry - 1;
+        }
+    }
+}
+
+// The live slot of deviceId; writers only.
+static size_t find_device(const struct RoutingMembers* members, const uint8_t* deviceId)
+{
+    for (size_t i = hash_id(deviceId) & members->indexMask;; i = (i + 1) & members->indexMask) {
+        uint32_t entry = members->byDevice[i];
+        if (entry == 0) {
+            return ROUTING_NO_SLOT;
+        }
+        const struct RoutingMember* member = &members->members[entry - 1];
+        if (memcmp(member->deviceId, deviceId, PROTO_ID_SIZE) == 0 && routing_member_endpoint(member)) {
+            return entry - 1;
+        }
+    }
+}
+
+static struct RoutingMembers* create_members(size_t capacity)
+{
+    size_t indexSize = 2 * capacity;
+    struct RoutingMembers* members = (struct RoutingMembers*)malloc(sizeof(*members)
+        + capacity * sizeof(members->members[0]) + indexSize * (sizeof(*members->byEndpoint)
+        + sizeof(*members->byDevice)));
+    if (!members) {
+        return NULL;
+    }
+    atomic_init(&members->count, 0);
+    members->capacity = capacity;
+    members->live = 0;
+    members->indexMask = indexSize - 1;
+    members->byEndpoint = (_Atomic(uint32_t)*)(members->members + capacity);
+    members->byDevice = (uint32_t*)(members->byEndpoint + indexSize);
+    for (size_t i = 0; i < indexSize; ++i) {
+        atomic_init(&members->byEndpoint[i], 0);
+        members->byDevice[i] = 0;
+    }
+    return members;
+}
+
+// Writes the next slot and indexes it; only then does count cover it.
+// Caller made sure there is room.
+static void append_member(struct RoutingMembers* members, void* endpoint, uint32_t shard, const uint8_t* userId,
+    const uint8_t* deviceId)
+{
+    size_t slot = atomic_load_explicit(&members->count, memory_order_relaxed);
+    struct RoutingMember* member = &members->members[slot];
+    atomic_store_explicit(&member->endpoint, endpoint, memory_order_relaxed);
+    member->shard = shard;
+    if (userId) {
+        memcpy(member->userId, userId, PROTO_ID_SIZE);
+    } else {
+        memset(member->userId, 0, PROTO_ID_SIZE);
+    }
+    if (deviceId) {
+        memcpy(member->deviceId, deviceId, PROTO_ID_SIZE);
+    } else {
+        memset(member->deviceId, 0, PROTO_ID_SIZE);
+    }
+
+    size_t i = hash_endpoint(endpoint) & members->indexMask;
+    while (atomic_load_explicit(&members->byEndpoint[i], memory_order_relaxed) != 0) {
+        i = (i + 1) & members->indexMask;
+    }
+    atomic_store_explicit(&members->byEndpoint[i], (uint32_t)slot + 1, memory_order_release);
+    if (!is_zero_id(member->deviceId)) {
+        i = hash_id(member->deviceId) & members->indexMask;
+        while (members->byDevice[i] != 0) {
+            i = (i + 1) & members->indexMask;
+        }
+        members->byDevice[i] = (uint32_t)slot + 1;
+    }
+
+    ++members->live;
+    atomic_store_explicit(&members->count, slot + 1, memory_order_release);
+}
+
+// A copy of the live members of old (NULL for none) with room for extra
+// more, or NULL if out of memory.
+static struct RoutingMembers* rebuild_members(const struct RoutingMembers* old, size_t extra)
+{
+    size_t live = old ? old->live : 0;
+    size_t capacity = ROUTING_MIN_CAPACITY;
+    while (capacity < 2 * (live + extra)) {
+        capacity <<= 1;
+    }
+    struct RoutingMembers* members = create_members(capacity);
+    if (!members) {
+        return NULL;
+    }
+    size_t count = old ? atomic_load_explicit(&old->count, memory_order_relaxed) : 0;
+    for (size_t i = 0; i < count; ++i) {
+        const struct RoutingMember* member = &old->members[i];
+        void* endpoint = routing_member_endpoint(member);
+        if (endpoint) {
+            append_member(members, endpoint, member->shard, member->userId, member->deviceId);
+        }
+    }
+    return members;
+}
+
+// Publishes members and retires the array it replaces.
+static void publish_members(struct RoutingTable* table, struct RegistryReader* reader,
+    struct RoutingConversation* conversation, struct RoutingMembers* members)
+{
+    struct RoutingMembers* old = atomic_load_explicit(&conversation->members, memory_order_relaxed);
+    atomic_store_explicit(&conversation->members, members, memory_order_release);
+    if (old) {
+        registry_retire(table->epochs, reader, old, free);
+    }
+}
+
+// Whether a Direct conversation takes another device of userId, besides
+// members other than slot skip. Members without a userId count as users of
+// their own.
+static bool direct_admits(const struct RoutingMembers* members, size_t skip, const uint8_t* userId)
+{
+    size_t users = 0;
+    size_t count = routing_member_slots(members);
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t* memberUser = members->members[i].userId;
+        if (i == skip || !routing_member_endpoint(&members->members[i])) {
+            continue;
+        }
+        if (is_zero_id(memberUser)) {
+            ++users;
+            continue;
+        }
+        if (userId && memcmp(memberUser, userId, PROTO_ID_SIZE) == 0) {
+            return true;
+        }
+        bool seen = false;
+        for (size_t j = 0; j < i && !seen; ++j) {
+            seen = j != skip && routing_member_endpoint(&members->members[j])
+                && memcmp(members->members[j].userId, memberUser, PROTO_ID_SIZE) == 0;
+        }
+        users += seen ? 0 : 1;
+    }
+    return users < ROUTING_DIRECT_USERS;
+}
+
+static void clear_slot(struct RoutingMembers* members, size_t slot)
+{
+    atomic_store_explicit(&members->members[slot].endpoint, NULL, memory_order_release);
+    --members->live;
+}
+
+int routing_join(struct RoutingTable* table, struct RegistryReader* reader, const uint8_t* conversationId,
+    uint8_t type, void* endpoint, uint32_t shard, const uint8_t* userId, const uint8_t* deviceId)
+{
+    size_t bucket = hash_id(conversationId) & table->bucketMask;
+    pthread_mutex_t* lock = &table->locks[bucket % ROUTING_LOCK_STRIPES];
+    pthread_mutex_lock(lock);
+
+    _Atomic(struct RoutingConversation*)* link;
+    struct RoutingConversation* conversation = find_conversation_locked(table, bucket, conversationId, &link);
+    if (conversation && conversation->type != type) {
+        pthread_mutex_unlock(lock);
+        return ROUTING_ERR_TYPE;
+    }
+    if (!conversation && type == PROTO_CONV_BROADCAST && !table->allowBroadcast) {
+        pthread_mutex_unlock(lock);
+        return ROUTING_ERR_DENIED;
+    }
+
+    struct RoutingMembers* members = conversation
+        ? atomic_load_explicit(&conversation->members, memory_order_relaxed) : NULL;
+    if (routing_is_member(members, endpoint)) {
+        pthread_mutex_unlock(lock);
+        return ROUTING_OK;
+    }
+    // The entry of the device's previous connection, if it is still listed.
+    size_t stale = members && deviceId && !is_zero_id(deviceId) ? find_device(members, deviceId) : ROUTING_NO_SLOT;
+    if (type == PROTO_CONV_DIRECT && !direct_admits(members, stale, userId)) {
+        pthread_mutex_unlock(lock);
+        return ROUTING_ERR_FULL;
+    }
+    void* staleEndpoint = stale != ROUTING_NO_SLOT ? routing_member_endpoint(&members->members[stale]) : NULL;
+
+    if (members && atomic_load_explicit(&members->count, memory_order_relaxed) < members->capacity) {
+        append_member(members, endpoint, shard, userId, deviceId);
+        if (staleEndpoint) {
+            clear_slot(members, stale);
+        }
+        pthread_mutex_unlock(lock);
+        return ROUTING_OK;
+    }
+
+    struct RoutingMembers* grown = rebuild_members(members, 1);
+    if (!grown) {
+        pthread_mutex_unlock(lock);
+        return ROUTING_ERR_NO_MEMORY;
+    }
+    append_member(grown, endpoint, shard, userId, deviceId);
+    if (staleEndpoint) {
+        clear_slot(grown, find_slot(grown, staleEndpoint));
+    }
+
+    if (conversation) {
+        publish_members(table, reader, conversation, grown);
+    } else {
+        conversation = (struct RoutingConversation*)malloc(sizeof(*conversation));
+        if (!conversation) {
+            pthread_mutex_unlock(lock);
+            free(grown);
+            return ROUTING_ERR_NO_MEMORY;
+        }
+        memcpy(conversation->id, conversationId, PROTO_ID_SIZE);
+        conversation->type = type;
+        atomic_init(&conversation->members, grown);
+        atomic_init(&conversation->next, NULL);
+        // Appended at the chain tail, fully built before it becomes reachable.
+        atomic_store_explicit(link, conversation, memory_order_release);
+    }
+
+    pthread_mutex_unlock(lock);
+    return ROUTING_OK;
+}
+
+bool routing_leave(struct RoutingTable* table, struct RegistryReader* reader, const uint8_t* conversationId,
+    void* endpoint)
+{
+    size_t bucket = hash_id(conversationId) & table->bucketMask;
+    pthread_mutex_t* lock = &table->locks[bucket % ROUTING_LOCK_STRIPES];
+    pthread_mutex_lock(lock);
+
+    _Atomic(struct RoutingConversation*)* link;
+    struct RoutingConversation* conversation = find_conversation_locked(table, bucket, conversationId, &link);
+    struct RoutingMembers* members = conversation
+        ? atomic_load_explicit(&conversation->members, memory_order_relaxed) : NULL;
+    size_t slot = members ? find_slot(members, endpoint) : ROUTING_NO_SLOT;
+    if (slot == ROUTING_NO_SLOT) {
+        pthread_mutex_unlock(lock);
+        return false;
+    }
+    clear_slot(members, slot);
+
+    if (members->live == 0) {
+        // Last participant gone: unlink the conversation. Readers already on
+        // it still see a valid node and its old members until they finish.
+        atomic_store_explicit(link, atomic_load_explicit(&conversation->next, memory_order_relaxed),
+            memory_order_release);
+        registry_retire(table->epochs, reader, members, free);
+        registry_retire(table->epochs, reader, conversation, free);
+    } else if (members->capacity > ROUTING_MIN_CAPACITY
+        && members->live * 4 < atomic_load_explicit(&members->count, memory_order_relaxed)) {
+        // Mostly cleared slots: readers would walk past them on every message.
+        struct RoutingMembers* shrunk = rebuild_members(members, 0);
+        if (shrunk) {
+            publish_members(table, reader, conversation, shrunk);
+        }
+    }
+
+    pthread_mutex_unlock(lock);
+    return true;
+}
+
+struct RoutingConversation* routing_find(struct RoutingTable* table, const uint8_t* conversationId)
+{
+    struct RoutingConversation* conversation = atomic_load_explicit(
+        &table->conversations[hash_id(conversationId) & table->bucketMask], memory_order_acquire);
+    while (conversation && memcmp(conversation->id, conversationId, PROTO_ID_SIZE) != 0) {
+        conversation = atomic_load_explicit(&conversation->next, memory_order_acquire);
+    }
+    return conversation;
+}
+
+bool routing_is_member(const struct RoutingMembers* members, const void* endpoint)
+{
+    return members && endpoint && find_slot(members, endpoint) != ROUTING_NO_SLOT;
+}
@@ -1,17 +1,45 @@
 #include "socketutil.h"
+#include "reactor.h"
+#include "dispatcher.h"
+#include "msgbuf.h"
+#include "registry.h"
+#include "routing.h"
+#include "metrics.h"
+#include "logger.h"
+#include "pool.h"
 
 struct AcceptedSocket {
     socket_t acceptedSocketFd;
     struct sockaddr_in clientAddress;
+    char peerName[INET_ADDRSTRLEN + 8];     // "ip:port", formatted once at accept
+    char prefix[MSGBUF_MAX_PREFIX];         // "[ip:port] " prepended to relayed messages
+    size_t prefixLength;
+    uint32_t slot;      // registry slot id
+    struct RegistryReader* reader;  // this client's thread, for broadcasting
+
+    // Any client thread may send to this socket, one frame at a time. The
+    // registry holds one reference and every sender one more while it sends.
+    pthread_mutex_t sendMutex;
+    atomic_uint refs;
+
+    // Identity and memberships from HELLO/JOIN; this client's thread only.
+    bool identified;
+    uint8_t userId[PROTO_ID_SIZE];
+    uint8_t deviceId[PROTO_ID_SIZE];
+    uint8_t (*joined)[PROTO_ID_SIZE];
+    size_t joinedCount;
+    size_t joinedCapacity;
+
+    // Recipients of the frame this client's thread is sending, retained.
+    struct AcceptedSocket** recipients;
+    size_t recipientCapacity;
 };
 
-struct ClientNode {
-    struct AcceptedSocket* client;
-    struct ClientNode* next;
-};
-
-static pthread_mutex_t g_clientsMutex = PTHREAD_MUTEX_INITIALIZER;
-static struct ClientNode* g_clientsHead = NULL;
+// Client threads read it lock-free to find recipients; sockets are closed and
+// freed once no sender can still reach them or still holds them.
+static struct Registry g_clients;
+static struct RoutingTable g_routing;
+static struct Slab g_clientSlab;
 
 static struct AcceptedSocket* acceptIncomingConnection(socket_t serverSocketFD)
 {
@@ -19,123 +47,328 @@ static struct AcceptedSocket* acceptIncomingConnection(socket_t serverSocketFD)
     socklen_t clientAddrLen = sizeof(clientAddr);
     socket_t acceptResult = accept(serverSocketFD, (struct sockaddr*)&clientAddr, &clientAddrLen);
     if (acceptResult == INVALID_SOCKET) {
-        print_last_error("accept");
+        log_os_error("accept");
         return NULL;
     }
 
-    struct AcceptedSocket* acceptedSocket = (struct AcceptedSocket*)malloc(sizeof(*acceptedSocket));
+    struct AcceptedSocket* acceptedSocket = (struct AcceptedSocket*)slab_alloc(&g_clientSlab);
     if (!acceptedSocket) {
-        fprintf(stderr, "malloc failed while accepting client\n");
+        log_error("malloc failed while accepting client");
         closesocket(acceptResult);
         return NULL;
     }
 
     acceptedSocket->acceptedSocketFd = acceptResult;
     acceptedSocket->clientAddress = clientAddr;
+    pthread_mutex_init(&acceptedSocket->sendMutex, NULL);
+    atomic_init(&acceptedSocket->refs, 1);
+    acceptedSocket->recipients = NULL;
+    acceptedSocket->recipientCapacity = 0;
+
+    char ipStr[INET_ADDRSTRLEN];
+    if (!inet_ntop(AF_INET, &clientAddr.sin_addr, ipStr, sizeof(ipStr))) {
+        strncpy(ipStr, "unknown", sizeof(ipStr));
+        ipStr[sizeof(ipStr) - 1] = '\0';
+    }
+    snprintf(acceptedSocket->peerName, sizeof(acceptedSocket->peerName), "%s:%d", ipStr, ntohs(clientAddr.sin_port));
+    int prefixLength = snprintf(acceptedSocket->prefix, sizeof(acceptedSocket->prefix), "[%s] ",
+        acceptedSocket->peerName);
+    acceptedSocket->prefixLength = prefixLength > 0 ? (size_t)prefixLength : 0;
     return acceptedSocket;
 }
 
-static void close_client_socket(struct AcceptedSocket* clientSocket)
+// Drops a reference; the last one closes and frees the socket.
+static void close_client_socket(void* item)
 {
-    if (!clientSocket) {
+    struct AcceptedSocket* clientSocket = (struct AcceptedSocket*)item;
+    if (!clientSocket || atomic_fetch_sub_explicit(&clientSocket->refs, 1, memory_order_acq_rel) != 1) {
         return;
     }
 
     if (clientSocket->acceptedSocketFd != INVALID_SOCKET) {
         closesocket(clientSocket->acceptedSocketFd);
     }
-    free(clientSocket);
+    pthread_mutex_destroy(&clientSocket->sendMutex);
+    free(clientSocket->joined);
+    free(clientSocket->recipients);
+    slab_free(&g_clientSlab, clientSocket);
 }
 
 static bool add_client(struct AcceptedSocket* client)
 {
-    struct ClientNode* node = (struct ClientNode*)malloc(sizeof(*node));
-    if (!node) {
-        fprintf(stderr, "malloc failed while tracking client\n");
+    client->slot = registry_insert(&g_clients, client);
+    if (client->slot == REGISTRY_NO_SLOT) {
+        log_error("malloc failed while tracking client");
         return false;
     }
 
-    node->client = client;
+    metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+    log_info("Client connected: %s", client->peerName);
+    return true;
+}
 
-    pthread_mutex_lock(&g_clientsMutex);
-    node->next = g_clientsHead;
-    g_clientsHead = node;
-    pthread_mutex_unlock(&g_clientsMutex);
+// Unlinks client and stops its traffic; the socket itself is closed and
+// freed later, by registry reclamation or the last sender still holding it.
+static void remove_client(struct AcceptedSocket* client, struct RegistryReader* reader)
+{
+    // Leave conversations first: the member arrays that still list client
+    // are then retired no later than client itself.
+    for (size_t i = 0; i < client->joinedCount; ++i) {
+        routing_leave(&g_routing, reader, client->joined[i], client);
+    }
+    client->joinedCount = 0;
 
-    char ipStr[INET_ADDRSTRLEN] = "unknown";
-    if (!inet_ntop(AF_INET, &client->clientAddress.sin_addr, ipStr, sizeof(ipStr))) {
-        strncpy(ipStr, "unknown", sizeof(ipStr));
-        ipStr[sizeof(ipStr) - 1] = '\0';
+    shutdown(client->acceptedSocketFd, SD_BOTH);
+    registry_remove(&g_clients, reader, client->slot);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+}
+
+static int send_msgbuf_once(socket_t sockfd, const struct MsgBuf* buf)
+{
+    size_t total = msgbuf_size(buf);
+    size_t offset = 0;
+    while (offset < buf->headLength) {
+        int sent = send_two(sockfd, buf->head + offset, buf->headLength - offset, buf->body, buf->bodyLength);
+        if (sent == SOCKET_ERROR) {
+#ifndef _WIN32
+            if (errno == EINTR) {
+                continue;
+            }
+#endif
+            return SOCKET_ERROR;
+        }
+        offset += (size_t)sent;
+    }
+    if (offset < total) {
+        return send_all(sockfd, buf->body + (offset - buf->headLength), total - offset);
+    }
+    return 0;
+}
+
+// Blocking send of a whole frame, header and payload in one gather call where possible.
+static int send_msgbuf(socket_t sockfd, const struct MsgBuf* buf)
+{
+    int result = send_msgbuf_once(sockfd, buf);
+    if (result == SOCKET_ERROR) {
+        metrics_add(METRIC_SEND_ERRORS, 1);
+    } else {
+        metrics_add(METRIC_FRAMES_OUT, 1);
+        metrics_add(METRIC_BYTES_OUT, msgbuf_size(buf));
+    }
+    return result;
+}
+
+// --threaded mode sends directly, without the reactor's OutQueue. It is the
+// fallback for platforms without epoll: one blocking thread per client and
+// no event loop to drain a queue when a socket turns writable, so a queue
+// would need a second thread per client to empty it. A slow recipient
+// therefore holds up the thread of whoever sends to it (never the registry:
+// see send_to_recipients), and the --queue-* limits do not apply.
+
+// Room for count recipients in sender's snapshot; call inside the read section.
+static bool reserve_recipients(struct AcceptedSocket* sender, size_t count)
+{
+    if (count <= sender->recipientCapacity) {
+        return true;
+    }
+    size_t capacity = sender->recipientCapacity ? sender->recipientCapacity : 16;
+    while (capacity < count) {
+        capacity *= 2;
     }
-    printf("Client connected: %s:%d\n", ipStr, ntohs(client->clientAddress.sin_port));
+    struct AcceptedSocket** recipients = (struct AcceptedSocket**)realloc(sender->recipients,
+        capacity * sizeof(*recipients));
+    if (!recipients) {
+        log_error("malloc failed while collecting recipients");
+        return false;
+    }
+    sender->recipients = recipients;
+    sender->recipientCapacity = capacity;
     return true;
 }
 
-static void remove_client(struct AcceptedSocket* client)
+// Inside the read section, so client cannot have been freed yet.
+static size_t add_recipient(struct AcceptedSocket* sender, size_t count, struct AcceptedSocket* client)
 {
-    pthread_mutex_lock(&g_clientsMutex);
+    if (!client || client == sender || client->acceptedSocketFd == INVALID_SOCKET) {
+        return count;
+    }
+    atomic_fetch_add_explicit(&client->refs, 1, memory_order_relaxed);
+    sender->recipients[count] = client;
+    return count + 1;
+}
 
-    struct ClientNode** current = &g_clientsHead;
-    while (*current) {
-        if ((*current)->client == client) {
-            struct ClientNode* toRemove = *current;
-            *current = toRemove->next;
-            free(toRemove);
-            break;
+// Sends buf to the recipients collected, after the read section: a slow
+// peer holds up this thread, not reclamation for every other. Each frame
+// goes out whole under the recipient's send mutex, so frames from several
+// senders never interleave on its stream.
+static void send_to_recipients(struct AcceptedSocket* sender, size_t count, const struct MsgBuf* buf,
+    const char* what)
+{
+    for (size_t i = 0; i < count; ++i) {
+        struct AcceptedSocket* client = sender->recipients[i];
+        pthread_mutex_lock(&client->sendMutex);
+        int result = send_msgbuf(client->acceptedSocketFd, buf);
+        pthread_mutex_unlock(&client->sendMutex);
+        if (result == SOCKET_ERROR) {
+            log_os_error(what);
         }
-        current = &(*current)->next;
+        close_client_socket(client);
     }
-
-    pthread_mutex_unlock(&g_clientsMutex);
+    metrics_record_fanout(count);
 }
 
-static void broadcast_message(struct AcceptedSocket* sender, const char* data, size_t length)
+static void broadcast_message(struct AcceptedSocket* sender, struct RegistryReader* reader, const uint8_t* data,
+    size_t length)
 {
     if (!sender || !data || length == 0) {
         return;
     }
 
-    char senderIp[INET_ADDRSTRLEN] = "unknown";
-    if (!inet_ntop(AF_INET, &sender->clientAddress.sin_addr, senderIp, sizeof(senderIp))) {
-        strncpy(senderIp, "unknown", sizeof(senderIp));
-        senderIp[sizeof(senderIp) - 1] = '\0';
+    struct MsgBuf* buf = msgbuf_create(PROTO_OP_CHAT, 0, sender->prefix, sender->prefixLength, data, length);
+    if (!buf) {
+        log_error("malloc failed while composing broadcast");
+        return;
     }
-    int senderPort = ntohs(sender->clientAddress.sin_port);
 
-    char composedMessage[BUFFER_SIZE + 64];
-    int written = snprintf(composedMessage, sizeof(composedMessage), "[%s:%d] %.*s",
-        senderIp, senderPort, (int)length, data);
-    if (written < 0) {
-        return;
+    size_t recipients = 0;
+    struct RegistrySlots* slots = registry_read_begin(&g_clients, reader);
+    size_t used = registry_slots_used(slots);
+    if (reserve_recipients(sender, used)) {
+        for (size_t i = 0; i < used; ++i) {
+            recipients = add_recipient(sender, recipients, (struct AcceptedSocket*)registry_slot_item(slots, i));
+        }
     }
+    registry_read_end(reader);
+    send_to_recipients(sender, recipients, buf, "broadcast send");
+
+    msgbuf_release(buf);
+}
+
+static int handle_chat(void* context, const struct ProtoFrame* frame)
+{
+    struct AcceptedSocket* clientSocket = (struct AcceptedSocket*)context;
 
-    size_t messageLength = (size_t)written;
-    if (messageLength >= sizeof(composedMessage)) {
-        messageLength = sizeof(composedMessage) - 1;
-        composedMessage[messageLength] = '\0';
+    log_sampled("Received from %s -> %.*s", clientSocket->peerName, (int)frame->length, (const char*)frame->payload);
+
+    broadcast_message(clientSocket, clientSocket->reader, frame->payload, frame->length);
+    return 0;
+}
+
+static int handle_hello(void* context, const struct ProtoFrame* frame)
+{
+    struct AcceptedSocket* clientSocket = (struct AcceptedSocket*)context;
+    if (frame->length != 2 * PROTO_ID_SIZE) {
+        return -1;
     }
 
-    pthread_mutex_lock(&g_clientsMutex);
+    memcpy(clientSocket->userId, frame->payload, PROTO_ID_SIZE);
+    memcpy(clientSocket->deviceId, frame->payload + PROTO_ID_SIZE, PROTO_ID_SIZE);
+    clientSocket->identified = true;
+    return 0;
+}
+
+static int handle_join(void* context, const struct ProtoFrame* frame)
+{
+    struct AcceptedSocket* clientSocket = (struct AcceptedSocket*)context;
+    if (frame->length != PROTO_ID_SIZE + 1 || frame->payload[PROTO_ID_SIZE] > PROTO_CONV_BROADCAST) {
+        return -1;
+    }
 
-    struct ClientNode* node = g_clientsHead;
-    while (node) {
-        if (node->client && node->client != sender && node->client->acceptedSocketFd != INVALID_SOCKET) {
-            size_t totalSent = 0;
-            while (totalSent < messageLength) {
-                int sent = send(node->client->acceptedSocketFd,
-                    composedMessage + totalSent,
-                    (int)(messageLength - totalSent), 0);
-                if (sent == SOCKET_ERROR) {
-                    print_last_error("broadcast send");
-                    break;
-                }
-                totalSent += (size_t)sent;
-            }
+    for (size_t i = 0; i < clientSocket->joinedCount; ++i) {
+        if (memcmp(clientSocket->joined[i], frame->payload, PROTO_ID_SIZE) == 0) {
+            return 0;
         }
-        node = node->next;
+    }
+    if (clientSocket->joinedCount == clientSocket->joinedCapacity) {
+        size_t capacity = clientSocket->joinedCapacity ? clientSocket->joinedCapacity * 2 : 4;
+        uint8_t (*joined)[PROTO_ID_SIZE] = (uint8_t (*)[PROTO_ID_SIZE])realloc(clientSocket->joined,
+            capacity * sizeof(*joined));
+        if (!joined) {
+            log_error("malloc failed while joining conversation");
+            return 0;
+        }
+        clientSocket->joined = joined;
+        clientSocket->joinedCapacity = capacity;
     }
 
-    pthread_mutex_unlock(&g_clientsMutex);
+    int status = routing_join(&g_routing, clientSocket->reader, frame->payload, frame->payload[PROTO_ID_SIZE],
+        clientSocket, 0, clientSocket->identified ? clientSocket->userId : NULL,
+        clientSocket->identified ? clientSocket->deviceId : NULL);
+    if (status != ROUTING_OK) {
+        log_warn("%s could not join conversation: %d", clientSocket->peerName, status);
+        return 0;
+    }
+    memcpy(clientSocket->joined[clientSocket->joinedCount++], frame->payload, PROTO_ID_SIZE);
+    return 0;
+}
+
+static int handle_leave(void* context, const struct ProtoFrame* frame)
+{
+    struct AcceptedSocket* clientSocket = (struct AcceptedSocket*)context;
+    if (frame->length != PROTO_ID_SIZE) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < clientSocket->joinedCount; ++i) {
+        if (memcmp(clientSocket->joined[i], frame->payload, PROTO_ID_SIZE) == 0) {
+            routing_leave(&g_routing, clientSocket->reader, frame->payload, clientSocket);
+            memcpy(clientSocket->joined[i], clientSocket->joined[--clientSocket->joinedCount], PROTO_ID_SIZE);
+            break;
+        }
+    }
+    return 0;
+}
+
+static int handle_conv_msg(void* context, const struct ProtoFrame* frame)
+{
+    struct AcceptedSocket* clientSocket = (struct AcceptedSocket*)context;
+    struct RegistryReader* reader = clientSocket->reader;
+    if (frame->length < PROTO_ID_SIZE) {
+        return -1;
+    }
+    if (frame->length == PROTO_ID_SIZE) {
+        return 0;
+    }
+
+    struct RegistrySlots* slots = registry_read_begin(&g_clients, reader);
+    struct RoutingConversation* conversation = routing_find(&g_routing, frame->payload);
+    const struct RoutingMembers* members = routing_members(conversation);
+    if (!routing_is_member(members, clientSocket)) {
+        registry_read_end(reader);
+        log_warn("%s sent to a conversation it has not joined", clientSocket->peerName);
+        return 0;
+    }
+    log_sampled("Conversation message from %s, %u byte(s)", clientSocket->peerName,
+        (unsigned)(frame->length - PROTO_ID_SIZE));
+
+    // Recipients see conversationId + sender deviceId + seq ahead of the
+    // body; there is no history in this mode, so seq is always 0.
+    uint8_t prefix[2 * PROTO_ID_SIZE + PROTO_SEQ_SIZE];
+    memcpy(prefix, frame->payload, PROTO_ID_SIZE);
+    memcpy(prefix + PROTO_ID_SIZE, clientSocket->deviceId, PROTO_ID_SIZE);
+    memset(prefix + 2 * PROTO_ID_SIZE, 0, PROTO_SEQ_SIZE);
+    struct MsgBuf* buf = msgbuf_create(PROTO_OP_CONV_MSG, conversation->type, (const char*)prefix, sizeof(prefix),
+        frame->payload + PROTO_ID_SIZE, frame->length - PROTO_ID_SIZE);
+    if (!buf) {
+        registry_read_end(reader);
+        log_error("malloc failed while composing conversation message");
+        return 0;
+    }
+
+    bool everyone = conversation->type == PROTO_CONV_BROADCAST;
+    size_t count = everyone ? registry_slots_used(slots) : routing_member_slots(members);
+    size_t recipients = 0;
+    if (reserve_recipients(clientSocket, count)) {
+        for (size_t i = 0; i < count; ++i) {
+            recipients = add_recipient(clientSocket, recipients, (struct AcceptedSocket*)(everyone
+                ? registry_slot_item(slots, i) : routing_member_endpoint(&members->members[i])));
+        }
+    }
+    registry_read_end(reader);
+    send_to_recipients(clientSocket, recipients, buf, "conversation send");
+
+    msgbuf_release(buf);
+    return 0;
 }
 
 static void* recv_data(void* arg)
@@ -145,41 +378,83 @@ static void* recv_data(void* arg)
         return NULL;
     }
 
-    char clientIp[INET_ADDRSTRLEN] = "unknown";
-    if (!inet_ntop(AF_INET, &clientSocket->clientAddress.sin_addr, clientIp, sizeof(clientIp))) {
-        strncpy(clientIp, "unknown", sizeof(clientIp));
-        clientIp[sizeof(clientIp) - 1] = '\0';
+    clientSocket->reader = registry_reader_register(&g_clients);
+    if (!clientSocket->reader) {
+        remove_client(clientSocket, NULL);
+        registry_reclaim(&g_clients, NULL);
+        return NULL;
     }
-    int clientPort = ntohs(clientSocket->clientAddress.sin_port);
 
-    char buffer[BUFFER_SIZE];
+    struct ProtoDispatcher dispatcher;
+    proto_dispatcher_init(&dispatcher);
+    proto_register(&dispatcher, PROTO_OP_CHAT, handle_chat);
+    proto_register(&dispatcher, PROTO_OP_HELLO, handle_hello);
+    proto_register(&dispatcher, PROTO_OP_JOIN, handle_join);
+    proto_register(&dispatcher, PROTO_OP_LEAVE, handle_leave);
+    proto_register(&dispatcher, PROTO_OP_CONV_MSG, handle_conv_msg);
+
+    // Leaves room for the "[ip:port] " prefix added when relaying.
+    struct ProtoRecvBuffer recvBuffer;
+    proto_recv_init(&recvBuffer, PROTO_DEFAULT_MAX_PAYLOAD - MSGBUF_MAX_PREFIX);
+
     while (true) {
-        int bytesReceived = recv(clientSocket->acceptedSocketFd, buffer, sizeof(buffer) - 1, 0);
+        size_t available;
+        uint8_t* space = proto_recv_reserve(&recvBuffer, &available);
+        if (!space) {
+            log_error("malloc failed while receiving");
+            break;
+        }
+
+        int bytesReceived = recv(clientSocket->acceptedSocketFd, (char*)space, (int)available, 0);
         if (bytesReceived > 0) {
-            buffer[bytesReceived] = '\0';
-            printf("Received from %s:%d -> %s\n", clientIp, clientPort, buffer);
-            broadcast_message(clientSocket, buffer, (size_t)bytesReceived);
+            proto_recv_commit(&recvBuffer, (size_t)bytesReceived);
+            uint64_t framesBefore = recvBuffer.frames;
+            int status = proto_recv_dispatch(&recvBuffer, &dispatcher, clientSocket);
+            metrics_add(METRIC_BYTES_IN, (uint64_t)bytesReceived);
+            metrics_add(METRIC_FRAMES_IN, recvBuffer.frames - framesBefore);
+            if (status != PROTO_OK) {
+                log_warn("Closing %s after protocol error %d", clientSocket->peerName, status);
+                break;
+            }
         } else if (bytesReceived == 0) {
-            printf("Client disconnected: %s:%d\n", clientIp, clientPort);
+            log_info("Client disconnected: %s", clientSocket->peerName);
+            break;
+        } else if (SOCKET_TIMED_OUT(WSAGetLastError())) {
+            log_info("Closing idle client %s", clientSocket->peerName);
             break;
         } else {
-            print_last_error("recv");
+            log_os_error("recv");
             break;
         }
     }
 
-    remove_client(clientSocket);
-    close_client_socket(clientSocket);
+    proto_recv_destroy(&recvBuffer);
+    struct RegistryReader* reader = clientSocket->reader;
+    remove_client(clientSocket, reader);
+    registry_reader_unregister(&g_clients, reader);
+    registry_reclaim(&g_clients, NULL);
     return NULL;
 }
 
-int startGettingIncomingConnections(socket_t serverSocketFD)
+// idleTimeoutMs: how long a client thread waits in recv before dropping a silent client; 0 forever.
+// allowBroadcast: whether JOIN may create Broadcast conversations.
+int startGettingIncomingConnections(socket_t serverSocketFD, unsigned idleTimeoutMs, bool allowBroadcast)
 {
+    registry_init(&g_clients, close_client_socket);
+    if (routing_init(&g_routing, &g_clients, 0, allowBroadcast) != ROUTING_OK) {
+        return -1;
+    }
+
     while (true) {
         struct AcceptedSocket* clientSocket = acceptIncomingConnection(serverSocketFD);
+        // Picks up sockets whose threads exited while a broadcast still held them.
+        registry_reclaim(&g_clients, NULL);
         if (!clientSocket) {
             continue;
         }
+        if (idleTimeoutMs) {
+            set_socket_recv_timeout(clientSocket->acceptedSocketFd, idleTimeoutMs);
+        }
 
         if (!add_client(clientSocket)) {
             close_client_socket(clientSocket);
@@ -189,9 +464,9 @@ int startGettingIncomingConnections(socket_t serverSocketFD)
         pthread_t threadId;
         int threadErr = pthread_create(&threadId, NULL, recv_data, clientSocket);
         if (threadErr != 0) {
-            fprintf(stderr, "pthread_create failed: %d\n", threadErr);
-            remove_client(clientSocket);
-            close_client_socket(clientSocket);
+            log_error("pthread_create failed: %d", threadErr);
+            remove_client(clientSocket, NULL);
+            registry_reclaim(&g_clients, NULL);
             return threadErr;
         }
         pthread_detach(threadId);
@@ -200,39 +475,246 @@ int startGettingIncomingConnections(socket_t serverSocketFD)
     return 0;
 }
 
-int main(void)
+#ifdef __linux__
+// Timer wheel health of the reactor, appended to the metrics.
+static size_t render_reactor_metrics(char* out, size_t capacity)
 {
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2,2), &wsaData) != 0) {
-        printf("WSAStartup failed.\n");
+    struct ReactorTimerStats stats;
+    reactor_timer_stats(&stats);
+    int written = snprintf(out, capacity,
+        "# HELP chat_timers_fired_total Reactor timers that fired.\n"
+        "# TYPE chat_timers_fired_total counter\n"
+        "chat_timers_fired_total %llu\n"
+        "# HELP chat_timer_lag_seconds_total Time timers fired after they were due.\n"
+        "# TYPE chat_timer_lag_seconds_total counter\n"
+        "chat_timer_lag_seconds_total %.3f\n"
+        "# HELP chat_timer_lag_max_seconds Latest any timer has fired.\n"
+        "# TYPE chat_timer_lag_max_seconds gauge\n"
+        "chat_timer_lag_max_seconds %.3f\n",
+        (unsigned long long)stats.fired, (double)stats.lagTotalMs / 1000.0, (double)stats.lagMaxMs / 1000.0);
+    if (written < 0) {
+        return 0;
+    }
+    return (size_t)written < capacity ? (size_t)written : capacity - 1;
+}
+#endif
+
+static void print_usage(const char* program)
+{
+    fprintf(stderr, "Usage: %s [--threaded] [--io epoll|uring] [--threads N] [--shards] [--pin-cpus] [--backlog N]\n"
+        "          [--nagle] [--cork-ms MS] [--zerocopy N] [--allow-broadcast]\n"
+        "          [--flow-window N] [--device-rate N] [--device-burst N] [--ip-rate N] [--ip-burst N] [--compress-min N]\n"
+        "          [--recv-mem-mb N] [--queue-frames N] [--queue-bytes N] [--queue-policy drop-oldest|drop-newest|disconnect]\n"
+        "          [--spool DIR] [--history DIR] [--prekeys DIR] [--presence DIR] [--presence-ms MS]\n"
+        "          [--receipts DIR] [--blobs DIR] [--blob-max-mb N] [--blob-quota-mb N] [--blob-part-ttl S]\n"
+        "          [--commit-ms N] [--idle-timeout MS] [--heartbeat MS] [--retry-ms MS]\n"
+        "          [--admin-port N] [--log-level error|warn|info|debug] [--log-sample N] [--log-rate N]\n", program);
+    fprintf(stderr, "  --threaded      one thread per client (default where epoll is unavailable)\n");
+    fprintf(stderr, "  --io uring      reactor network I/O through io_uring instead of epoll (Linux 6.0+)\n");
+    fprintf(stderr, "  --threads N     reactor thread count (default %d, or one per CPU with --shards)\n", REACTOR_DEFAULT_THREADS);
+    fprintf(stderr, "  --shards        one SO_REUSEPORT listener and connection table per reactor thread\n");
+    fprintf(stderr, "  --pin-cpus      pin each reactor thread to its own CPU\n");
+    fprintf(stderr, "  --backlog N     listen backlog (default %d)\n", REACTOR_DEFAULT_BACKLOG);
+    fprintf(stderr, "  --nagle         leave Nagle's algorithm on client sockets (default TCP_NODELAY)\n");
+    fprintf(stderr, "  --cork-ms MS    hold queued frames this long so more share one send (default 0)\n");
+    fprintf(stderr, "  --zerocopy N    send payloads of at least N bytes with MSG_ZEROCOPY (default 0, off; epoll only)\n");
+    fprintf(stderr, "  --allow-broadcast  let clients create Broadcast conversations, which reach every connection\n");
+    fprintf(stderr, "  --flow-window N frames granted to a client per CREDIT (default %d, 0 none; reactor only)\n", REACTOR_DEFAULT_FLOW_WINDOW);
+    fprintf(stderr, "  --device-rate N frames per second a device may send before its reads pause (default %d, 0 no limit)\n", REACTOR_DEFAULT_DEVICE_RATE);
+    fprintf(stderr, "  --device-burst  frames a device may send at once above its rate (default %d)\n", REACTOR_DEFAULT_DEVICE_BURST);
+    fprintf(stderr, "  --ip-rate N     frames per second per client address (default 0, no limit)\n");
+    fprintf(stderr, "  --ip-burst N    frames an address may send at once above its rate (default twice the rate)\n");
+    fprintf(stderr, "  --compress-min N compress payloads of at least N bytes for clients that ask (default %d, 0 never)\n", REACTOR_DEFAULT_COMPRESS_MIN_BYTES);
+    fprintf(stderr, "  --recv-mem-mb N receive buffer memory of all clients, in MiB; reads pause past it (default %d, 0 no limit)\n",
+        REACTOR_DEFAULT_RECV_MEMORY_BYTES >> 20);
+    fprintf(stderr, "  --queue-frames  per-client outbound frame limit (default %d; reactor only)\n", OUTQ_DEFAULT_MAX_FRAMES);
+    fprintf(stderr, "  --queue-bytes   per-client outbound byte high-water mark (default %d; reactor only)\n", OUTQ_DEFAULT_HIGH_WATER_BYTES);
+    fprintf(stderr, "  --queue-policy  what to do with a client that falls behind (default drop-oldest; reactor only)\n");
+    fprintf(stderr, "  --spool DIR     directory of the offline delivery store (default %s; reactor only)\n", OFFLINE_DEFAULT_DIRECTORY);
+    fprintf(stderr, "  --history DIR   directory of the conversation message history (default %s; reactor only)\n", MSGLOG_DEFAULT_DIRECTORY);
+    fprintf(stderr, "  --prekeys DIR   directory of the one-time prekey journal (default %s; reactor only)\n", PREKEY_DEFAULT_DIRECTORY);
+    fprintf(stderr, "  --presence DIR  directory of the device presence journal (default %s; reactor only)\n", PRESENCE_DEFAULT_DIRECTORY);
+    fprintf(stderr, "  --presence-ms   write each device's presence at most this often (default %d)\n", PRESENCE_DEFAULT_PERSIST_INTERVAL_MS);
+    fprintf(stderr, "  --receipts DIR  directory of the Delivered/Read receipt journal (default %s; reactor only)\n", RECEIPTS_DEFAULT_DIRECTORY);
+    fprintf(stderr, "  --blobs DIR     directory of uploaded attachments (default %s; reactor only)\n", BLOB_DEFAULT_DIRECTORY);
+    fprintf(stderr, "  --blob-max-mb N largest attachment accepted, in MiB (default %llu)\n", BLOB_DEFAULT_MAX_BYTES >> 20);
+    fprintf(stderr, "  --blob-quota-mb N  all attachments and partial uploads together, in MiB (default %llu, 0 no limit)\n", BLOB_DEFAULT_QUOTA_BYTES >> 20);
+    fprintf(stderr, "  --blob-part-ttl S  delete partial uploads unwritten for S seconds (default %d, 0 never)\n", BLOB_DEFAULT_PART_EXPIRY_S);
+    fprintf(stderr, "  --commit-ms N   group-commit interval of the offline store, history and prekeys (default %d)\n", OFFLINE_DEFAULT_COMMIT_INTERVAL_MS);
+    fprintf(stderr, "  --idle-timeout  drop clients silent this many ms (default %d, 0 never)\n", REACTOR_DEFAULT_IDLE_TIMEOUT_MS);
+    fprintf(stderr, "  --heartbeat     PING clients silent this many ms (default %d, 0 never; reactor only)\n", REACTOR_DEFAULT_HEARTBEAT_MS);
+    fprintf(stderr, "  --retry-ms      first redelivery of unacked device messages, doubling (default %d, 0 never)\n", REACTOR_DEFAULT_RETRY_BASE_MS);
+    fprintf(stderr, "  --admin-port N  serve metrics (Prometheus text, or \"stats\" over nc) on %s:N (default off)\n", METRICS_DEFAULT_ADMIN_ADDRESS);
+    fprintf(stderr, "  --log-level     error, warn, info or debug; debug adds per-message lines (default info)\n");
+    fprintf(stderr, "  --log-sample N  log one in N messages per thread at debug level (default %d)\n", LOGGER_DEFAULT_SAMPLE_EVERY);
+    fprintf(stderr, "  --log-rate N    log at most N messages per thread and second at debug level (default %d, 0 no limit)\n", LOGGER_DEFAULT_SAMPLED_PER_SECOND);
+}
+
+int main(int argc, char** argv)
+{
+    bool threaded = true;
+    int adminPort = 0;
+    struct LoggerConfig loggerConfig;
+    logger_default_config(&loggerConfig);
+    struct ReactorConfig reactorConfig;
+    reactor_default_config(&reactorConfig);
+#ifdef __linux__
+    threaded = false;
+#endif
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--threaded") == 0) {
+            threaded = true;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            reactorConfig.threadCount = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--shards") == 0) {
+            reactorConfig.sharded = true;
+        } else if (strcmp(argv[i], "--pin-cpus") == 0) {
+            reactorConfig.pinCpus = true;
+        } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+            reactorConfig.backlog = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--nagle") == 0) {
+            reactorConfig.noDelay = false;
+        } else if (strcmp(argv[i], "--cork-ms") == 0 && i + 1 < argc) {
+            reactorConfig.corkMs = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--zerocopy") == 0 && i + 1 < argc) {
+            reactorConfig.outQueue.zeroCopyMinBytes = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--allow-broadcast") == 0) {
+            reactorConfig.allowBroadcast = true;
+        } else if (strcmp(argv[i], "--flow-window") == 0 && i + 1 < argc) {
+            reactorConfig.flowWindow = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--device-rate") == 0 && i + 1 < argc) {
+            reactorConfig.deviceLimit.ratePerSecond = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--device-burst") == 0 && i + 1 < argc) {
+            reactorConfig.deviceLimit.burst = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--ip-rate") == 0 && i + 1 < argc) {
+            reactorConfig.addressLimit.ratePerSecond = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--ip-burst") == 0 && i + 1 < argc) {
+            reactorConfig.addressLimit.burst = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--compress-min") == 0 && i + 1 < argc) {
+            reactorConfig.compressMinBytes = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--recv-mem-mb") == 0 && i + 1 < argc) {
+            reactorConfig.recvMemoryBytes = (size_t)strtoull(argv[++i], NULL, 10) << 20;
+        } else if (strcmp(argv[i], "--queue-frames") == 0 && i + 1 < argc) {
+            reactorConfig.outQueue.maxFrames = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--queue-bytes") == 0 && i + 1 < argc) {
+            reactorConfig.outQueue.highWaterBytes = (size_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc
+            && reactor_parse_backend(argv[i + 1], &reactorConfig.backend)) {
+            ++i;
+        } else if (strcmp(argv[i], "--queue-policy") == 0 && i + 1 < argc
+            && outqueue_parse_policy(argv[i + 1], &reactorConfig.outQueue.policy)) {
+            ++i;
+        } else if (strcmp(argv[i], "--spool") == 0 && i + 1 < argc) {
+            reactorConfig.offline.directory = argv[++i];
+        } else if (strcmp(argv[i], "--history") == 0 && i + 1 < argc) {
+            reactorConfig.history.directory = argv[++i];
+        } else if (strcmp(argv[i], "--prekeys") == 0 && i + 1 < argc) {
+            reactorConfig.prekeys.directory = argv[++i];
+        } else if (strcmp(argv[i], "--presence") == 0 && i + 1 < argc) {
+            reactorConfig.presence.directory = argv[++i];
+        } else if (strcmp(argv[i], "--presence-ms") == 0 && i + 1 < argc) {
+            reactorConfig.presence.persistIntervalMs = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--receipts") == 0 && i + 1 < argc) {
+            reactorConfig.receipts.directory = argv[++i];
+        } else if (strcmp(argv[i], "--blobs") == 0 && i + 1 < argc) {
+            reactorConfig.blobs.directory = argv[++i];
+        } else if (strcmp(argv[i], "--blob-max-mb") == 0 && i + 1 < argc) {
+            reactorConfig.blobs.maxBytes = (uint64_t)strtoull(argv[++i], NULL, 10) << 20;
+        } else if (strcmp(argv[i], "--blob-quota-mb") == 0 && i + 1 < argc) {
+            reactorConfig.blobs.quotaBytes = (uint64_t)strtoull(argv[++i], NULL, 10) << 20;
+        } else if (strcmp(argv[i], "--blob-part-ttl") == 0 && i + 1 < argc) {
+            reactorConfig.blobs.partExpirySeconds = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--commit-ms") == 0 && i + 1 < argc) {
+            reactorConfig.offline.commitIntervalMs = (unsigned)strtoul(argv[++i], NULL, 10);
+            reactorConfig.history.commitIntervalMs = reactorConfig.offline.commitIntervalMs;
+            reactorConfig.prekeys.commitIntervalMs = reactorConfig.offline.commitIntervalMs;
+        } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+            reactorConfig.idleTimeoutMs = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--heartbeat") == 0 && i + 1 < argc) {
+            reactorConfig.heartbeatMs = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--retry-ms") == 0 && i + 1 < argc) {
+            reactorConfig.retryBaseMs = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--admin-port") == 0 && i + 1 < argc) {
+            adminPort = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc
+            && logger_parse_level(argv[i + 1], &loggerConfig.level)) {
+            ++i;
+        } else if (strcmp(argv[i], "--log-sample") == 0 && i + 1 < argc) {
+            loggerConfig.sampleEvery = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--log-rate") == 0 && i + 1 < argc) {
+            loggerConfig.sampledPerSecond = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Flushed on every exit path, including clean_and_exit.
+    if (logger_start(&loggerConfig) == 0) {
+        atexit(logger_stop);
+    }
+
+    if (socket_startup() != 0) {
         return EXIT_FAILURE;
     }
 
+    // Frames, receive buffers and client records come from the pools.
+    proto_set_allocator(pool_alloc, pool_free);
+    slab_init(&g_clientSlab, sizeof(struct AcceptedSocket));
+
     socket_t serverSocketFD = create_socket();
     if (serverSocketFD == INVALID_SOCKET) {
-        WSACleanup();
+        socket_cleanup();
         return EXIT_FAILURE;
     }
 
     struct sockaddr_in* serverAddr = createIPv4Address("", 2000);
     if (!serverAddr) {
         closesocket(serverSocketFD);
-        WSACleanup();
+        socket_cleanup();
         return EXIT_FAILURE;
     }
 
+#ifdef __linux__
+    if (!threaded && reactor_prepare_listener(serverSocketFD, &reactorConfig) != 0) {
+        clean_and_exit(NULL, serverAddr, serverSocketFD, EXIT_FAILURE);
+    }
+#endif
+
     int bindResult = bind(serverSocketFD, (struct sockaddr*)serverAddr, sizeof(struct sockaddr_in));
     if (bindResult == SOCKET_ERROR) {
         clean_and_exit(NULL, serverAddr, serverSocketFD, EXIT_FAILURE);
     }
 
-    printf("Server listening on port %d\n", 2000);
-    int listenResult = listen(serverSocketFD, 10);
+    log_info("Server listening on port %d", 2000);
+    int listenResult = listen(serverSocketFD, reactorConfig.backlog);
     if (listenResult == SOCKET_ERROR) {
         clean_and_exit(NULL, serverAddr, serverSocketFD, EXIT_FAILURE);
     }
 
-    int acceptResult = startGettingIncomingConnections(serverSocketFD);
+    if (adminPort > 0) {
+        metrics_extra_fn extra = NULL;
+#ifdef __linux__
+        if (!threaded) {
+            extra = render_reactor_metrics;
+        }
+#endif
+        if (metrics_start_admin(METRICS_DEFAULT_ADMIN_ADDRESS, adminPort, extra) != 0) {
+            clean_and_exit(NULL, serverAddr, serverSocketFD, EXIT_FAILURE);
+        }
+    }
+
+    int acceptResult;
+#ifdef __linux__
+    if (!threaded) {
+        acceptResult = reactor_run(serverSocketFD, &reactorConfig);
+    } else
+#endif
+    {
+        acceptResult = startGettingIncomingConnections(serverSocketFD, reactorConfig.idleTimeoutMs,
+            reactorConfig.allowBroadcast);
+    }
     if (acceptResult != 0) {
         clean_and_exit(NULL, serverAddr, serverSocketFD, EXIT_FAILURE);
     }
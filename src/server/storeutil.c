@@ -0,0 +1,346 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "storeutil.h"
+#include "logger.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STORE_JOURNAL_COMPACT_SUFFIX ".tmp"
+#define STORE_JOURNAL_LOAD_BATCH 256    // records per read while loading
+
+uint64_t store_wall_clock_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+uint32_t store_fnv1a(uint32_t hash, const void* data, size_t length)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+uint64_t store_hash_id(const uint8_t* id)
+{
+    uint64_t low;
+    uint64_t high;
+    memcpy(&low, id, sizeof(low));
+    memcpy(&high, id + sizeof(low), sizeof(high));
+    uint64_t mixed = low ^ (high * 0x9e3779b97f4a7c15ULL);
+    return mixed ^ (mixed >> 29);
+}
+
+char* store_join_path(const char* directory, const char* name)
+{
+    size_t length = strlen(directory) + 1 + strlen(name) + 1;
+    char* path = (char*)malloc(length);
+    if (path) {
+        snprintf(path, length, "%s/%s", directory, name);
+    }
+    return path;
+}
+
+bool store_write_all(int fd, const void* data, size_t length)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        bytes += written;
+        length -= (size_t)written;
+    }
+    return true;
+}
+
+bool store_sync_directory(const char* path)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// Waits until intervalMs from now or until stopping; caller holds the mutex.
+static void wait_interval(struct StoreFlusher* flusher)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += flusher->intervalMs / 1000;
+    deadline.tv_nsec += (long)(flusher->intervalMs % 1000) * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    while (!flusher->stopping && pthread_cond_timedwait(&flusher->cond, &flusher->mutex, &deadline) != ETIMEDOUT) {
+    }
+}
+
+static void* flusher_thread(void* arg)
+{
+    struct StoreFlusher* flusher = (struct StoreFlusher*)arg;
+
+    pthread_mutex_lock(&flusher->mutex);
+    while (!flusher->stopping) {
+        if (flusher->mode == STORE_FLUSH_COMMIT_GROUP && !flusher->pending) {
+            pthread_cond_wait(&flusher->cond, &flusher->mutex);
+            continue;
+        }
+        // Let the commit group fill for one interval, then sync it in one
+        // pass; in periodic mode, whatever changed meanwhile is written once.
+        wait_interval(flusher);
+        flusher->pending = false;
+
+        pthread_mutex_unlock(&flusher->mutex);
+        flusher->flush(flusher->context);
+        pthread_mutex_lock(&flusher->mutex);
+    }
+    pthread_mutex_unlock(&flusher->mutex);
+
+    flusher->flush(flusher->context);
+    return NULL;
+}
+
+bool store_flusher_start(struct StoreFlusher* flusher, enum StoreFlushMode mode, unsigned intervalMs,
+    store_flush_fn flush, void* context)
+{
+    flusher->pending = false;
+    flusher->stopping = false;
+    flusher->mode = mode;
+    flusher->intervalMs = intervalMs;
+    flusher->flush = flush;
+    flusher->context = context;
+    pthread_mutex_init(&flusher->mutex, NULL);
+    pthread_cond_init(&flusher->cond, NULL);
+
+    int err = pthread_create(&flusher->thread, NULL, flusher_thread, flusher);
+    if (err != 0) {
+        log_error("pthread_create failed for store flusher: %d", err);
+        pthread_mutex_destroy(&flusher->mutex);
+        pthread_cond_destroy(&flusher->cond);
+        return false;
+    }
+    return true;
+}
+
+void store_flusher_wake(struct StoreFlusher* flusher)
+{
+    pthread_mutex_lock(&flusher->mutex);
+    if (!flusher->pending) {
+        flusher->pending = true;
+        pthread_cond_signal(&flusher->cond);
+    }
+    pthread_mutex_unlock(&flusher->mutex);
+}
+
+void store_flusher_stop(struct StoreFlusher* flusher)
+{
+    pthread_mutex_lock(&flusher->mutex);
+    flusher->stopping = true;
+    pthread_cond_signal(&flusher->cond);
+    pthread_mutex_unlock(&flusher->mutex);
+    pthread_join(flusher->thread, NULL);
+
+    pthread_mutex_destroy(&flusher->mutex);
+    pthread_cond_destroy(&flusher->cond);
+}
+
+static uint32_t record_checksum(const struct StoreJournal* journal, const uint8_t* record)
+{
+    return store_fnv1a(STORE_FNV_BASIS, record + sizeof(uint32_t), journal->recordSize - sizeof(uint32_t));
+}
+
+bool store_journal_init(struct StoreJournal* journal, const char* directory, size_t recordSize, const char* label)
+{
+    memset(journal, 0, sizeof(*journal));
+    journal->label = label;
+    journal->recordSize = recordSize;
+    journal->fd = -1;
+    journal->directory = strdup(directory);
+    journal->path = store_join_path(directory, "journal");
+    journal->compactPath = store_join_path(directory, "journal" STORE_JOURNAL_COMPACT_SUFFIX);
+    if (!journal->directory || !journal->path || !journal->compactPath) {
+        store_journal_free(journal);
+        return false;
+    }
+    return true;
+}
+
+void store_journal_free(struct StoreJournal* journal)
+{
+    if (journal->fd >= 0) {
+        close(journal->fd);
+        journal->fd = -1;
+    }
+    free(journal->directory);
+    free(journal->path);
+    free(journal->compactPath);
+    free(journal->scratch);
+    journal->directory = NULL;
+    journal->path = NULL;
+    journal->compactPath = NULL;
+    journal->scratch = NULL;
+    journal->scratchCapacity = 0;
+}
+
+void* store_journal_slot(struct StoreJournal* journal, size_t index)
+{
+    if (index >= journal->scratchCapacity) {
+        size_t capacity = journal->scratchCapacity ? journal->scratchCapacity : 1024;
+        while (capacity <= index) {
+            capacity *= 2;
+        }
+        uint8_t* scratch = (uint8_t*)realloc(journal->scratch, capacity * journal->recordSize);
+        if (!scratch) {
+            return NULL;
+        }
+        journal->scratch = scratch;
+        journal->scratchCapacity = capacity;
+    }
+    return journal->scratch + index * journal->recordSize;
+}
+
+bool store_journal_load(struct StoreJournal* journal, store_record_fn fn, void* context)
+{
+    int fd = open(journal->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            perror(journal->label);
+        }
+        return errno == ENOENT;
+    }
+    if (!store_journal_slot(journal, STORE_JOURNAL_LOAD_BATCH - 1)) {
+        close(fd);
+        return false;
+    }
+
+    size_t valid = 0;
+    size_t buffered = 0;    // bytes of a partial record carried over
+    bool torn = false;
+    bool ok = true;
+    while (!torn && ok) {
+        ssize_t got = read(fd, journal->scratch + buffered, STORE_JOURNAL_LOAD_BATCH * journal->recordSize - buffered);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            perror(journal->label);
+            ok = false;
+            break;
+        }
+        if (got == 0) {
+            torn = buffered > 0;
+            break;
+        }
+        buffered += (size_t)got;
+        size_t count = buffered / journal->recordSize;
+        for (size_t i = 0; i < count; ++i) {
+            const uint8_t* record = journal->scratch + i * journal->recordSize;
+            uint32_t checksum;
+            memcpy(&checksum, record, sizeof(checksum));
+            if (checksum != record_checksum(journal, record)) {
+                torn = true;
+                break;
+            }
+            if (!fn(context, record)) {
+                ok = false;
+                break;
+            }
+            ++valid;
+        }
+        size_t consumed = count * journal->recordSize;
+        memmove(journal->scratch, journal->scratch + consumed, buffered - consumed);
+        buffered -= consumed;
+    }
+    close(fd);
+    if (torn) {
+        log_warn("%s: ignoring a torn tail after %zu record(s)", journal->label, valid);
+    }
+    return ok;
+}
+
+bool store_journal_append(struct StoreJournal* journal, size_t count)
+{
+    if (count == 0) {
+        return true;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        uint8_t* record = journal->scratch + i * journal->recordSize;
+        uint32_t checksum = record_checksum(journal, record);
+        memcpy(record, &checksum, sizeof(checksum));
+    }
+    if (journal->fd < 0) {
+        journal->fd = open(journal->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    }
+    size_t bytes = count * journal->recordSize;
+    if (journal->fd < 0 || !store_write_all(journal->fd, journal->scratch, bytes) || fdatasync(journal->fd) != 0) {
+        perror(journal->label);
+        // Cut off whatever part did land: records after a torn one are never loaded.
+        if (journal->fd >= 0 && ftruncate(journal->fd, (off_t)journal->bytes) != 0) {
+            close(journal->fd);
+            journal->fd = -1;
+        }
+        return false;
+    }
+    journal->bytes += bytes;
+    return true;
+}
+
+bool store_journal_replace(struct StoreJournal* journal, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        uint8_t* record = journal->scratch + i * journal->recordSize;
+        uint32_t checksum = record_checksum(journal, record);
+        memcpy(record, &checksum, sizeof(checksum));
+    }
+    size_t bytes = count * journal->recordSize;
+    int fd = open(journal->compactPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0 || !store_write_all(fd, journal->scratch, bytes) || fdatasync(fd) != 0
+        || rename(journal->compactPath, journal->path) != 0) {
+        log_error("%s: compaction failed: %s", journal->label, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    close(fd);
+    store_sync_directory(journal->directory);
+
+    // The old descriptor now refers to the replaced file; append reopens if this fails.
+    if (journal->fd >= 0) {
+        close(journal->fd);
+    }
+    journal->fd = open(journal->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    journal->bytes = bytes;
+    if (journal->fd < 0) {
+        perror(journal->label);
+        return false;
+    }
+    return true;
+}
+
+bool store_journal_oversized(const struct StoreJournal* journal, size_t live, size_t factor, size_t minBytes)
+{
+    return journal->bytes > live * journal->recordSize * factor && journal->bytes > minBytes;
+}
+
+#endif // __linux__
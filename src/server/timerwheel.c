@@ -0,0 +1,180 @@
+#include "timerwheel.h"
+
+#include <limits.h>
+
+#define TIMERWHEEL_MASK (TIMERWHEEL_SLOTS - 1)
+#define TIMERWHEEL_SPAN ((uint64_t)1 << (TIMERWHEEL_BITS * TIMERWHEEL_LEVELS))
+
+static void list_init(struct TimerNode* head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+static void list_append(struct TimerNode* head, struct TimerNode* node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void list_unlink(struct TimerNode* node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = NULL;
+    node->next = NULL;
+}
+
+// Moves every node of from onto the empty list to.
+static void list_take(struct TimerNode* to, struct TimerNode* from)
+{
+    if (from->next == from) {
+        list_init(to);
+        return;
+    }
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    list_init(from);
+}
+
+// Links timer into the slot covering its expiry: level 0 holds the next
+// TIMERWHEEL_SLOTS ticks one per slot, each level above a span that much wider.
+static void place(struct TimerWheel* wheel, struct TimerNode* timer)
+{
+    uint64_t tick = timer->expiresTick > wheel->nowTick ? timer->expiresTick : wheel->nowTick + 1;
+    uint64_t delta = tick - wheel->nowTick;
+    if (delta >= TIMERWHEEL_SPAN) {
+        // Beyond the top level: park in the furthest slot and re-place on arrival.
+        tick = wheel->nowTick + TIMERWHEEL_SPAN - 1;
+        delta = TIMERWHEEL_SPAN - 1;
+    }
+
+    int level = 0;
+    while (level < TIMERWHEEL_LEVELS - 1 && delta >= ((uint64_t)1 << (TIMERWHEEL_BITS * (level + 1)))) {
+        ++level;
+    }
+    size_t slot = (size_t)(tick >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK;
+    list_append(&wheel->slots[level][slot], timer);
+}
+
+void timerwheel_init(struct TimerWheel* wheel, uint64_t tickMs, uint64_t nowMs)
+{
+    wheel->tickMs = tickMs ? tickMs : TIMERWHEEL_DEFAULT_TICK_MS;
+    wheel->nowTick = nowMs / wheel->tickMs;
+    wheel->count = 0;
+    for (int level = 0; level < TIMERWHEEL_LEVELS; ++level) {
+        for (int slot = 0; slot < TIMERWHEEL_SLOTS; ++slot) {
+            list_init(&wheel->slots[level][slot]);
+        }
+    }
+    atomic_init(&wheel->stats.fired, 0);
+    atomic_init(&wheel->stats.lagTotalMs, 0);
+    atomic_init(&wheel->stats.lagMaxMs, 0);
+}
+
+void timerwheel_schedule(struct TimerWheel* wheel, struct TimerNode* timer, uint64_t expiresMs)
+{
+    if (timer_pending(timer)) {
+        list_unlink(timer);
+    } else {
+        ++wheel->count;
+    }
+    timer->expiresMs = expiresMs;
+    timer->expiresTick = (expiresMs + wheel->tickMs - 1) / wheel->tickMs;
+    place(wheel, timer);
+}
+
+void timerwheel_cancel(struct TimerWheel* wheel, struct TimerNode* timer)
+{
+    if (timer_pending(timer)) {
+        list_unlink(timer);
+        --wheel->count;
+    }
+}
+
+static void cascade(struct TimerWheel* wheel, int level)
+{
+    size_t slot = (size_t)(wheel->nowTick >> (TIMERWHEEL_BITS * level)) & TIMERWHEEL_MASK;
+    struct TimerNode pending;
+    list_take(&pending, &wheel->slots[level][slot]);
+    while (pending.next != &pending) {
+        struct TimerNode* timer = pending.next;
+        list_unlink(timer);
+        place(wheel, timer);
+    }
+}
+
+static void record_lag(struct TimerWheel* wheel, uint64_t lagMs)
+{
+    // Single writer, so plain load/store pairs are enough.
+    atomic_store_explicit(&wheel->stats.fired,
+        atomic_load_explicit(&wheel->stats.fired, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&wheel->stats.lagTotalMs,
+        atomic_load_explicit(&wheel->stats.lagTotalMs, memory_order_relaxed) + lagMs, memory_order_relaxed);
+    if (lagMs > atomic_load_explicit(&wheel->stats.lagMaxMs, memory_order_relaxed)) {
+        atomic_store_explicit(&wheel->stats.lagMaxMs, lagMs, memory_order_relaxed);
+    }
+}
+
+void timerwheel_advance(struct TimerWheel* wheel, uint64_t nowMs)
+{
+    uint64_t target = nowMs / wheel->tickMs;
+
+    while (wheel->nowTick < target) {
+        if (wheel->count == 0) {
+            wheel->nowTick = target;
+            break;
+        }
+        ++wheel->nowTick;
+
+        // Crossing a boundary of level n refills the levels below it.
+        for (int level = 1; level < TIMERWHEEL_LEVELS; ++level) {
+            if ((wheel->nowTick & (((uint64_t)1 << (TIMERWHEEL_BITS * level)) - 1)) != 0) {
+                break;
+            }
+            cascade(wheel, level);
+        }
+
+        // Detach the slot first: callbacks may cancel timers still waiting in it.
+        struct TimerNode due;
+        list_take(&due, &wheel->slots[0][wheel->nowTick & TIMERWHEEL_MASK]);
+        while (due.next != &due) {
+            struct TimerNode* timer = due.next;
+            list_unlink(timer);
+            if (timer->expiresTick > wheel->nowTick) {
+                place(wheel, timer);
+                continue;
+            }
+            --wheel->count;
+            record_lag(wheel, nowMs > timer->expiresMs ? nowMs - timer->expiresMs : 0);
+            timer->callback(timer);
+        }
+    }
+}
+
+int timerwheel_next_timeout(const struct TimerWheel* wheel, uint64_t nowMs)
+{
+    if (wheel->count == 0) {
+        return -1;
+    }
+
+    // The nearest non-empty level 0 slot, else the next cascade.
+    uint64_t ticks = TIMERWHEEL_SLOTS - (wheel->nowTick & TIMERWHEEL_MASK);
+    for (uint64_t i = 1; i < ticks; ++i) {
+        const struct TimerNode* head = &wheel->slots[0][(wheel->nowTick + i) & TIMERWHEEL_MASK];
+        if (head->next != head) {
+            ticks = i;
+            break;
+        }
+    }
+
+    uint64_t dueMs = (wheel->nowTick + ticks) * wheel->tickMs;
+    if (dueMs <= nowMs) {
+        return 0;
+    }
+    return dueMs - nowMs > INT_MAX ? INT_MAX : (int)(dueMs - nowMs);
+}
@@ -0,0 +1,295 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "uring.h"
+#include "metrics.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define URING_REQUIRED_FEATURES (IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)
+#define URING_PROBE_USER_DATA UINT64_MAX     // the test recv; the reactor never uses it
+#define URING_PROBE_TIMEOUT_MS 1000
+
+static const uint8_t g_requiredOps[] = {
+    IORING_OP_ACCEPT, IORING_OP_ASYNC_CANCEL, IORING_OP_POLL_ADD, IORING_OP_READ, IORING_OP_RECV, IORING_OP_SENDMSG
+};
+
+static int uring_register(int fd, unsigned opcode, void* arg, unsigned count)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+static int setup_buffers(struct Uring* ring, unsigned bufferCount, unsigned bufferSize)
+{
+    size_t ringBytes = (size_t)bufferCount * sizeof(struct io_uring_buf);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    void* memory = NULL;
+    if (posix_memalign(&memory, pageSize > 0 ? (size_t)pageSize : 4096, ringBytes) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(memory, 0, ringBytes);
+    ring->bufRing = (struct io_uring_buf_ring*)memory;
+    ring->buffers = (uint8_t*)malloc((size_t)bufferCount * bufferSize);
+    if (!ring->buffers) {
+        free(ring->bufRing);
+        ring->bufRing = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    ring->bufferCount = bufferCount;
+    ring->bufferSize = bufferSize;
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->bufRing;
+    reg.ring_entries = bufferCount;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        free(ring->buffers);
+        free(ring->bufRing);
+        ring->buffers = NULL;
+        ring->bufRing = NULL;
+        return -1;
+    }
+
+    for (unsigned i = 0; i < bufferCount; ++i) {
+        uring_recycle_buffer(ring, (uint16_t)i);
+    }
+    uring_buffers_commit(ring);
+    return 0;
+}
+
+static int probe_ops(struct Uring* ring)
+{
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, size);
+    if (!probe) {
+        errno = ENOMEM;
+        return -1;
+    }
+    int result = uring_register(ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST);
+    for (size_t i = 0; result == 0 && i < sizeof(g_requiredOps); ++i) {
+        uint8_t op = g_requiredOps[i];
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            errno = ENOSYS;
+            result = -1;
+        }
+    }
+    free(probe);
+    return result;
+}
+
+// Waits for the test recv's next completion; false if none came.
+static bool wait_probe_cqe(struct Uring* ring, struct io_uring_cqe* out)
+{
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        struct io_uring_cqe* cqe = uring_peek_cqe(ring);
+        if (!cqe) {
+            uring_enter(ring, 1, URING_PROBE_TIMEOUT_MS);
+            cqe = uring_peek_cqe(ring);
+        }
+        if (cqe) {
+            *out = *cqe;
+            uring_cqe_seen(ring);
+            if (out->user_data == URING_PROBE_USER_DATA) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Multishot recv (6.0) is not an opcode of its own, so the probe cannot
+// show it: one recv on a socket pair must answer with more to come. Older
+// kernels reject the flag or complete it as a single shot.
+static int probe_multishot_recv(struct Uring* ring)
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+        return -1;
+    }
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = pair[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_PROBE_USER_DATA;
+
+    bool supported = false;
+    struct io_uring_cqe cqe;
+    if (write(pair[1], "", 1) == 1 && wait_probe_cqe(ring, &cqe)) {
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            uring_recycle_buffer(ring, (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+            uring_buffers_commit(ring);
+        }
+        supported = cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE);
+        // End of stream finishes a recv that is still armed.
+        if (cqe.flags & IORING_CQE_F_MORE) {
+            close(pair[1]);
+            pair[1] = -1;
+            if (!wait_probe_cqe(ring, &cqe)) {
+                supported = false;
+            }
+        }
+    }
+    if (pair[1] >= 0) {
+        close(pair[1]);
+    }
+    close(pair[0]);
+    if (!supported) {
+        errno = ENOSYS;
+        return -1;
+    }
+    return 0;
+}
+
+int uring_init(struct Uring* ring, unsigned entries, unsigned bufferCount, unsigned bufferSize)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 2;
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+        return -1;
+    }
+    ring->fd = fd;
+    if ((params.features & URING_REQUIRED_FEATURES) != URING_REQUIRED_FEATURES) {
+        close(fd);
+        ring->fd = -1;
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // One mapping holds both rings (IORING_FEAT_SINGLE_MMAP).
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ringSize = sqSize > cqSize ? sqSize : cqSize;
+    ring->ringMemory = mmap(NULL, ring->ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+        IORING_OFF_SQ_RING);
+    if (ring->ringMemory == MAP_FAILED) {
+        ring->ringMemory = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+
+    uint8_t* base = (uint8_t*)ring->ringMemory;
+    ring->sqHead = (_Atomic unsigned*)(base + params.sq_off.head);
+    ring->sqTailShared = (_Atomic unsigned*)(base + params.sq_off.tail);
+    ring->sqMask = *(unsigned*)(base + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->sqTail = atomic_load_explicit(ring->sqTailShared, memory_order_relaxed);
+    // Slot i always submits sqes[i].
+    unsigned* array = (unsigned*)(base + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; ++i) {
+        array[i] = i;
+    }
+    ring->cqHead = (_Atomic unsigned*)(base + params.cq_off.head);
+    ring->cqTail = (_Atomic unsigned*)(base + params.cq_off.tail);
+    ring->cqMask = *(unsigned*)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+
+    if (setup_buffers(ring, bufferCount, bufferSize) != 0 || probe_ops(ring) != 0
+        || probe_multishot_recv(ring) != 0) {
+        int err = errno;
+        uring_destroy(ring);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void uring_destroy(struct Uring* ring)
+{
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->ringMemory) {
+        munmap(ring->ringMemory, ring->ringSize);
+    }
+    free(ring->buffers);
+    free(ring->bufRing);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+struct io_uring_sqe* uring_get_sqe(struct Uring* ring)
+{
+    if (ring->sqTail - atomic_load_explicit(ring->sqHead, memory_order_acquire) >= ring->sqEntries) {
+        if (uring_enter(ring, 0, 0) != 0
+            || ring->sqTail - atomic_load_explicit(ring->sqHead, memory_order_acquire) >= ring->sqEntries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqTail & ring->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++ring->sqTail;
+    return sqe;
+}
+
+int uring_enter(struct Uring* ring, unsigned waitFor, int timeoutMs)
+{
+    atomic_store_explicit(ring->sqTailShared, ring->sqTail, memory_order_release);
+    unsigned pending = ring->sqTail - atomic_load_explicit(ring->sqHead, memory_order_acquire);
+
+    struct __kernel_timespec timeout;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeoutMs >= 0) {
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&timeout;
+    }
+    // GETEVENTS even without waiting: it flushes completions the kernel
+    // held back while the CQ was full.
+    unsigned flags = IORING_ENTER_EXT_ARG | IORING_ENTER_GETEVENTS;
+    metrics_add(METRIC_IO_SYSCALLS, 1);
+    long result = syscall(__NR_io_uring_enter, ring->fd, pending, waitFor, flags, &arg, sizeof(arg));
+    // EBUSY/EAGAIN: completions must be reaped before more can be submitted.
+    if (result >= 0 || errno == ETIME || errno == EINTR || errno == EBUSY || errno == EAGAIN) {
+        return 0;
+    }
+    return -errno;
+}
+
+void uring_recycle_buffer(struct Uring* ring, uint16_t bufferId)
+{
+    struct io_uring_buf* buf = &ring->bufRing->bufs[ring->bufTail & (ring->bufferCount - 1)];
+    buf->addr = (uint64_t)(uintptr_t)uring_buffer(ring, bufferId);
+    buf->len = ring->bufferSize;
+    buf->bid = bufferId;
+    ++ring->bufTail;
+}
+
+void uring_buffers_commit(struct Uring* ring)
+{
+    atomic_store_explicit((_Atomic uint16_t*)&ring->bufRing->tail, ring->bufTail, memory_order_release);
+}
+
+#endif // __linux__
@@ -0,0 +1,89 @@
+#include "histogram.h"
+
+#include <string.h>
+
+#define HISTOGRAM_SUB_COUNT ((uint64_t)1 << HISTOGRAM_SUB_BITS)
+
+static unsigned highest_bit(uint64_t value)
+{
+    unsigned bit = 0;
+    while (value >>= 1) {
+        ++bit;
+    }
+    return bit;
+}
+
+// Values below HISTOGRAM_SUB_COUNT are exact; above, the bucket is the
+// power of two and the sub-bucket the next HISTOGRAM_SUB_BITS bits.
+static size_t bucket_of(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_COUNT) {
+        return (size_t)value;
+    }
+    unsigned shift = highest_bit(value) - HISTOGRAM_SUB_BITS;
+    uint64_t sub = (value >> shift) - HISTOGRAM_SUB_COUNT;
+    return (size_t)((shift + 1) * HISTOGRAM_SUB_COUNT + sub);
+}
+
+static uint64_t highest_in_bucket(size_t index)
+{
+    if (index < HISTOGRAM_SUB_COUNT) {
+        return index;
+    }
+    unsigned shift = (unsigned)(index / HISTOGRAM_SUB_COUNT) - 1;
+    uint64_t sub = index % HISTOGRAM_SUB_COUNT;
+    uint64_t width = (uint64_t)1 << shift;
+    return ((HISTOGRAM_SUB_COUNT + sub) << shift) + (width - 1);
+}
+
+void histogram_init(struct Histogram* histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->min = UINT64_MAX;
+}
+
+void histogram_record(struct Histogram* histogram, uint64_t value)
+{
+    ++histogram->counts[bucket_of(value)];
+    ++histogram->total;
+    if (value < histogram->min) {
+        histogram->min = value;
+    }
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+void histogram_merge(struct Histogram* into, const struct Histogram* from)
+{
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->min < into->min) {
+        into->min = from->min;
+    }
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+uint64_t histogram_percentile(const struct Histogram* histogram, double percentile)
+{
+    if (histogram->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)histogram->total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t value = highest_in_bucket(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
@@ -0,0 +1,257 @@
+#include "lz.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+// History kept ahead of each block; positions fit a uint16.
+#define LZ_BUFFER_SIZE (LZ_WINDOW + LZ_MAX_INPUT)
+// Misses before the search starts skipping: every further 2^LZ_SKIP_TRIGGER
+// misses lengthen the stride by a byte, so random input is crossed quickly.
+#define LZ_SKIP_TRIGGER 6
+
+struct LzEncoder {
+    size_t fill;                // bytes of history in buffer
+    uint16_t table[1 << LZ_HASH_BITS];     // last position of each 4-byte hash
+    uint8_t buffer[LZ_BUFFER_SIZE];
+};
+
+struct LzDecoder {
+    size_t fill;
+    uint8_t buffer[LZ_BUFFER_SIZE];
+};
+
+static uint32_t load32(const uint8_t* in)
+{
+    uint32_t value;
+    memcpy(&value, in, sizeof(value));
+    return value;
+}
+
+static uint32_t hash4(const uint8_t* in)
+{
+    return (load32(in) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+struct LzEncoder* lz_encoder_create(void)
+{
+    return (struct LzEncoder*)calloc(1, sizeof(struct LzEncoder));
+}
+
+void lz_encoder_destroy(struct LzEncoder* encoder)
+{
+    free(encoder);
+}
+
+struct LzDecoder* lz_decoder_create(void)
+{
+    return (struct LzDecoder*)calloc(1, sizeof(struct LzDecoder));
+}
+
+void lz_decoder_destroy(struct LzDecoder* decoder)
+{
+    free(decoder);
+}
+
+// Keeps the last LZ_WINDOW bytes of history, at the front. Matches never
+// reach further back, so encoder and decoder may slide at different times.
+static size_t slide(uint8_t* buffer, size_t fill)
+{
+    size_t shift = fill - LZ_WINDOW;
+    memmove(buffer, buffer + shift, LZ_WINDOW);
+    return shift;
+}
+
+// Writes a length's extra bytes after its nibble of 15.
+static bool put_length(uint8_t** op, const uint8_t* end, size_t length)
+{
+    for (; length >= 255; length -= 255) {
+        if (*op == end) {
+            return false;
+        }
+        *(*op)++ = 255;
+    }
+    if (*op == end) {
+        return false;
+    }
+    *(*op)++ = (uint8_t)length;
+    return true;
+}
+
+// Emits literals and, with matchLength non-zero, the match after them.
+static bool put_sequence(uint8_t** op, const uint8_t* end, const uint8_t* literals, size_t literalLength,
+    size_t distance, size_t matchLength)
+{
+    if (*op == end) {
+        return false;
+    }
+    size_t matchCode = matchLength ? matchLength - LZ_MIN_MATCH : 0;
+    uint8_t* token = (*op)++;
+    *token = (uint8_t)((literalLength < 15 ? literalLength : 15) << 4 | (matchCode < 15 ? matchCode : 15));
+    if (literalLength >= 15 && !put_length(op, end, literalLength - 15)) {
+        return false;
+    }
+    if ((size_t)(end - *op) < literalLength) {
+        return false;
+    }
+    memcpy(*op, literals, literalLength);
+    *op += literalLength;
+    if (matchLength == 0) {
+        return true;
+    }
+    if (end - *op < 2) {
+        return false;
+    }
+    *(*op)++ = (uint8_t)distance;
+    *(*op)++ = (uint8_t)(distance >> 8);
+    return matchCode < 15 || put_length(op, end, matchCode - 15);
+}
+
+size_t lz_compress(struct LzEncoder* encoder, const uint8_t* prefix, size_t prefixLength, const uint8_t* data,
+    size_t length, uint8_t* out, size_t capacity)
+{
+    size_t total = prefixLength + length;
+    if (total > LZ_MAX_INPUT || capacity <= LZ_BLOCK_HEADER) {
+        return 0;
+    }
+    if (encoder->fill + total > LZ_BUFFER_SIZE) {
+        size_t shift = slide(encoder->buffer, encoder->fill);
+        for (size_t i = 0; i < (1 << LZ_HASH_BITS); ++i) {
+            encoder->table[i] = encoder->table[i] >= shift ? (uint16_t)(encoder->table[i] - shift) : 0;
+        }
+        encoder->fill = LZ_WINDOW;
+    }
+
+    uint8_t* base = encoder->buffer;
+    size_t start = encoder->fill;
+    size_t end = start + total;
+    if (prefixLength > 0) {
+        memcpy(base + start, prefix, prefixLength);
+    }
+    if (length > 0) {
+        memcpy(base + start + prefixLength, data, length);
+    }
+
+    uint8_t* op = out;
+    const uint8_t* opEnd = out + capacity;
+    *op++ = (uint8_t)(total >> 8);
+    *op++ = (uint8_t)total;
+
+    // Table entries may be stale (slid, or from a block given up on); a
+    // candidate counts only if it is behind ip, in the window, and matches.
+    size_t anchor = start;
+    size_t ip = start;
+    size_t misses = (size_t)1 << LZ_SKIP_TRIGGER;
+    while (ip + LZ_MIN_MATCH <= end) {
+        uint32_t hash = hash4(base + ip);
+        size_t candidate = encoder->table[hash];
+        encoder->table[hash] = (uint16_t)ip;
+        if (candidate >= ip || ip - candidate > LZ_WINDOW || load32(base + candidate) != load32(base + ip)) {
+            ip += misses++ >> LZ_SKIP_TRIGGER;
+            continue;
+        }
+
+        size_t matchLength = LZ_MIN_MATCH;
+        while (ip + matchLength < end && base[candidate + matchLength] == base[ip + matchLength]) {
+            ++matchLength;
+        }
+        while (ip > anchor && candidate > 0 && base[candidate - 1] == base[ip - 1]) {
+            --ip;
+            --candidate;
+            ++matchLength;
+        }
+        if (!put_sequence(&op, opEnd, base + anchor, ip - anchor, ip - candidate, matchLength)) {
+            return 0;
+        }
+        ip += matchLength;
+        anchor = ip;
+        misses = (size_t)1 << LZ_SKIP_TRIGGER;
+        if (ip + 2 <= end) {
+            encoder->table[hash4(base + ip - 2)] = (uint16_t)(ip - 2);
+        }
+    }
+    if (!put_sequence(&op, opEnd, base + anchor, end - anchor, 0, 0)) {
+        return 0;
+    }
+    encoder->fill = end;
+    return (size_t)(op - out);
+}
+
+// Reads a length's extra bytes; false if the block ends first.
+static bool get_length(const uint8_t** ip, const uint8_t* end, size_t* length)
+{
+    uint8_t byte;
+    do {
+        if (*ip == end || *length > LZ_MAX_INPUT) {
+            return false;
+        }
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+const uint8_t* lz_decompress(struct LzDecoder* decoder, const uint8_t* block, size_t blockLength, size_t* length)
+{
+    if (blockLength < LZ_BLOCK_HEADER) {
+        return NULL;
+    }
+    size_t total = (size_t)block[0] << 8 | block[1];
+    if (total > LZ_MAX_INPUT) {
+        return NULL;
+    }
+    if (decoder->fill + total > LZ_BUFFER_SIZE) {
+        slide(decoder->buffer, decoder->fill);
+        decoder->fill = LZ_WINDOW;
+    }
+
+    uint8_t* base = decoder->buffer;
+    size_t start = decoder->fill;
+    size_t end = start + total;
+    size_t op = start;
+    const uint8_t* ip = block + LZ_BLOCK_HEADER;
+    const uint8_t* ipEnd = block + blockLength;
+    while (ip < ipEnd) {
+        uint8_t token = *ip++;
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !get_length(&ip, ipEnd, &literalLength)) {
+            return NULL;
+        }
+        if (literalLength > (size_t)(ipEnd - ip) || literalLength > end - op) {
+            return NULL;
+        }
+        memcpy(base + op, ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+        if (ip == ipEnd) {
+            break;
+        }
+
+        if (ipEnd - ip < 2) {
+            return NULL;
+        }
+        size_t distance = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !get_length(&ip, ipEnd, &matchLength)) {
+            return NULL;
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (distance == 0 || distance > LZ_WINDOW || distance > op || matchLength > end - op) {
+            return NULL;
+        }
+        // Byte by byte: a match may overlap the bytes it produces.
+        const uint8_t* from = base + op - distance;
+        for (size_t i = 0; i < matchLength; ++i) {
+            base[op + i] = from[i];
+        }
+        op += matchLength;
+    }
+    if (op != end) {
+        return NULL;
+    }
+    decoder->fill = end;
+    *length = total;
+    return base + start;
+}
@@ -0,0 +1,488 @@
+#include "sha256.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_LANES 8
+// Batches averaging at most this many bytes go through the AVX2 lanes even
+// when SHA-NI is available: for short messages eight lanes beat one SHA-NI
+// stream, for long ones SHA-NI wins.
+#define SHA256_LANES_MAX_AVERAGE 192
+
+typedef void (*compress_fn)(uint32_t* state, const uint8_t* data, size_t blocks);
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t INITIAL_STATE[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static uint32_t load_be32(const uint8_t* in)
+{
+    return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | in[3];
+}
+
+static void store_be32(uint8_t* out, uint32_t value)
+{
+    out[0] = (uint8_t)(value >> 24);
+    out[1] = (uint8_t)(value >> 16);
+    out[2] = (uint8_t)(value >> 8);
+    out[3] = (uint8_t)value;
+}
+
+static uint32_t rotr(uint32_t value, int bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static void compress_scalar(uint32_t* state, const uint8_t* data, size_t blocks)
+{
+    for (; blocks > 0; --blocks, data += SHA256_BLOCK_SIZE) {
+        uint32_t w[64];
+        for (int t = 0; t < 16; ++t) {
+            w[t] = load_be32(data + 4 * t);
+        }
+        for (int t = 16; t < 64; ++t) {
+            uint32_t s0 = rotr(w[t - 15], 7) ^ rotr(w[t - 15], 18) ^ (w[t - 15] >> 3);
+            uint32_t s1 = rotr(w[t - 2], 17) ^ rotr(w[t - 2], 19) ^ (w[t - 2] >> 10);
+            w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int t = 0; t < 64; ++t) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[t] + w[t];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+// The final one or two blocks: the bytes after the last full block, the
+// 0x80 terminator, zeros and the message length in bits. Returns the count.
+static size_t pad_tail(const uint8_t* rest, size_t restLength, uint64_t totalLength, uint8_t* tail)
+{
+    size_t blocks = restLength + 9 <= SHA256_BLOCK_SIZE ? 1 : 2;
+    memset(tail, 0, blocks * SHA256_BLOCK_SIZE);
+    if (restLength > 0) {
+        memcpy(tail, rest, restLength);
+    }
+    tail[restLength] = 0x80;
+    uint64_t bits = totalLength * 8;
+    uint8_t* end = tail + blocks * SHA256_BLOCK_SIZE;
+    for (int i = 1; i <= 8; ++i) {
+        end[-i] = (uint8_t)(bits >> (8 * (i - 1)));
+    }
+    return blocks;
+}
+
+static void hash_with(compress_fn compress, const void* data, size_t length, uint8_t* digest)
+{
+    uint32_t state[8];
+    memcpy(state, INITIAL_STATE, sizeof(state));
+    size_t fullBlocks = length / SHA256_BLOCK_SIZE;
+    if (fullBlocks > 0) {
+        compress(state, (const uint8_t*)data, fullBlocks);
+    }
+    uint8_t tail[2 * SHA256_BLOCK_SIZE];
+    size_t done = fullBlocks * SHA256_BLOCK_SIZE;
+    size_t tailBlocks = pad_tail((const uint8_t*)data + done, length - done, length, tail);
+    compress(state, tail, tailBlocks);
+    for (int i = 0; i < 8; ++i) {
+        store_be32(digest + 4 * i, state[i]);
+    }
+}
+
+#ifdef SHA256_X86
+
+// Intel SHA extensions keep the state as ABEF/CDGH pairs and do two rounds
+// per sha256rnds2; sha256msg1/msg2 compute the message schedule.
+__attribute__((target("sha,sse4.1")))
+static void compress_shani(uint32_t* state, const uint8_t* data, size_t blocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+    for (; blocks > 0; --blocks, data += SHA256_BLOCK_SIZE) {
+        __m128i abefSaved = abef;
+        __m128i cdghSaved = cdgh;
+        __m128i w[4];
+        for (int i = 0; i < 4; ++i) {
+            w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16 * i)), byteSwap);
+        }
+        // Group r is rounds 4r..4r+3; once used, its slot takes group r+4.
+        for (int r = 0; r < 16; ++r) {
+            __m128i wk = _mm_add_epi32(w[r & 3], _mm_loadu_si128((const __m128i*)&K[4 * r]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(wk, 0x0E));
+            if (r < 12) {
+                __m128i sum = _mm_add_epi32(_mm_sha256msg1_epu32(w[r & 3], w[(r + 1) & 3]),
+                    _mm_alignr_epi8(w[(r + 3) & 3], w[(r + 2) & 3], 4));
+                w[r & 3] = _mm_sha256msg2_epu32(sum, w[(r + 3) & 3]);
+            }
+        }
+        abef = _mm_add_epi32(abef, abefSaved);
+        cdgh = _mm_add_epi32(cdgh, cdghSaved);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+
+#define ROTR8(x, n) _mm256_or_si256(_mm256_srli_epi32((x), (n)), _mm256_slli_epi32((x), 32 - (n)))
+
+// One block for each of eight independent hashes. state is word-major:
+// state[8 * word + lane].
+__attribute__((target("avx2")))
+static void compress_avx2_x8(uint32_t* state, const uint8_t* const* blocks)
+{
+    const __m256i byteSwap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+        3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i w[16];
+
+    // Lane i's block as rows, transposed so w[t] holds word t of every lane.
+    for (int half = 0; half < 2; ++half) {
+        __m256i r[8];
+        for (int i = 0; i < SHA256_LANES; ++i) {
+            r[i] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(blocks[i] + 32 * half)), byteSwap);
+        }
+        __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+        __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+        __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+        __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+        __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+        __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+        __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+        __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+        __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+        __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+        __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+        __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+        __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+        __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+        __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+        __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+        __m256i* out = w + 8 * half;
+        out[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+        out[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+        out[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+        out[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+        out[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+        out[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+        out[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+        out[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+    }
+
+    __m256i v[8];
+    for (int i = 0; i < 8; ++i) {
+        v[i] = _mm256_loadu_si256((const __m256i*)(state + 8 * i));
+    }
+    __m256i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+
+    for (int t = 0; t < 64; ++t) {
+        __m256i wt;
+        if (t < 16) {
+            wt = w[t];
+        } else {
+            __m256i w15 = w[(t - 15) & 15];
+            __m256i w2 = w[(t - 2) & 15];
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(w15, 7), ROTR8(w15, 18)), _mm256_srli_epi32(w15, 3));
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(w2, 17), ROTR8(w2, 19)), _mm256_srli_epi32(w2, 10));
+            wt = _mm256_add_epi32(_mm256_add_epi32(w[t & 15], s0), _mm256_add_epi32(w[(t - 7) & 15], s1));
+            w[t & 15] = wt;
+        }
+        __m256i bigS1 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(e, 6), ROTR8(e, 11)), ROTR8(e, 25));
+        __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, bigS1),
+            _mm256_add_epi32(_mm256_add_epi32(ch, _mm256_set1_epi32((int)K[t])), wt));
+        __m256i bigS0 = _mm256_xor_si256(_mm256_xor_si256(ROTR8(a, 2), ROTR8(a, 13)), ROTR8(a, 22));
+        __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+        __m256i t2 = _mm256_add_epi32(bigS0, maj);
+        h = g;
+        g = f;
+        f = e;
+        e = _mm256_add_epi32(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = _mm256_add_epi32(t1, t2);
+    }
+
+    v[0] = _mm256_add_epi32(v[0], a);
+    v[1] = _mm256_add_epi32(v[1], b);
+    v[2] = _mm256_add_epi32(v[2], c);
+    v[3] = _mm256_add_epi32(v[3], d);
+    v[4] = _mm256_add_epi32(v[4], e);
+    v[5] = _mm256_add_epi32(v[5], f);
+    v[6] = _mm256_add_epi32(v[6], g);
+    v[7] = _mm256_add_epi32(v[7], h);
+    for (int i = 0; i < 8; ++i) {
+        _mm256_storeu_si256((__m256i*)(state + 8 * i), v[i]);
+    }
+}
+
+// A job in flight on one lane: its full blocks straight from the buffer,
+// then its padded tail.
+struct Sha256Lane {
+    struct Sha256Job* job;
+    const uint8_t* data;
+    size_t blocks;
+    uint8_t tail[2 * SHA256_BLOCK_SIZE];
+    size_t tailBlocks;
+    size_t next;
+};
+
+static void lane_start(struct Sha256Lane* lane, uint32_t* state, int index, struct Sha256Job* job)
+{
+    lane->job = job;
+    lane->data = (const uint8_t*)job->data;
+    lane->blocks = job->length / SHA256_BLOCK_SIZE;
+    size_t done = lane->blocks * SHA256_BLOCK_SIZE;
+    lane->tailBlocks = pad_tail(lane->data + done, job->length - done, job->length, lane->tail);
+    lane->next = 0;
+    for (int i = 0; i < 8; ++i) {
+        state[8 * i + index] = INITIAL_STATE[i];
+    }
+}
+
+static const uint8_t* lane_block(const struct Sha256Lane* lane)
+{
+    if (lane->next < lane->blocks) {
+        return lane->data + lane->next * SHA256_BLOCK_SIZE;
+    }
+    return lane->tail + (lane->next - lane->blocks) * SHA256_BLOCK_SIZE;
+}
+
+static void lane_finish(const struct Sha256Lane* lane, const uint32_t* state, int index)
+{
+    for (int i = 0; i < 8; ++i) {
+        store_be32(lane->job->digest + 4 * i, state[8 * i + index]);
+    }
+}
+
+static void batch_avx2(struct Sha256Job* jobs, size_t count)
+{
+    static const uint8_t idleBlock[SHA256_BLOCK_SIZE];
+    struct Sha256Lane lanes[SHA256_LANES];
+    uint32_t state[8 * SHA256_LANES];
+    const uint8_t* blocks[SHA256_LANES];
+    size_t nextJob = 0;
+    int active = 0;
+
+    for (int i = 0; i < SHA256_LANES; ++i) {
+        lanes[i].job = NULL;
+        if (nextJob < count) {
+            lane_start(&lanes[i], state, i, &jobs[nextJob++]);
+            ++active;
+        }
+    }
+
+    // Below two busy lanes the vector unit is mostly idle: finish scalar.
+    while (active >= 2 || (active == 1 && nextJob < count)) {
+        for (int i = 0; i < SHA256_LANES; ++i) {
+            blocks[i] = lanes[i].job ? lane_block(&lanes[i]) : idleBlock;
+        }
+        compress_avx2_x8(state, blocks);
+
+        for (int i = 0; i < SHA256_LANES; ++i) {
+            struct Sha256Lane* lane = &lanes[i];
+            if (!lane->job || ++lane->next < lane->blocks + lane->tailBlocks) {
+                continue;
+            }
+            lane_finish(lane, state, i);
+            lane->job = NULL;
+            --active;
+            if (nextJob < count) {
+                lane_start(lane, state, i, &jobs[nextJob++]);
+                ++active;
+            }
+        }
+    }
+
+    for (int i = 0; i < SHA256_LANES; ++i) {
+        struct Sha256Lane* lane = &lanes[i];
+        if (!lane->job) {
+            continue;
+        }
+        uint32_t single[8];
+        for (int w = 0; w < 8; ++w) {
+            single[w] = state[8 * w + i];
+        }
+        if (lane->next < lane->blocks) {
+            compress_scalar(single, lane_block(lane), lane->blocks - lane->next);
+            lane->next = lane->blocks;
+        }
+        compress_scalar(single, lane_block(lane), lane->blocks + lane->tailBlocks - lane->next);
+        for (int w = 0; w < 8; ++w) {
+            state[8 * w + i] = single[w];
+        }
+        lane_finish(lane, state, i);
+    }
+}
+
+static bool cpu_has(enum Sha256Impl impl)
+{
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    bool sse41 = (ecx & bit_SSE4_1) != 0;
+    bool osAvx = (ecx & bit_OSXSAVE) && (ecx & bit_AVX);
+    if (osAvx) {
+        // The OS must save the YMM registers, not only the CPU support them.
+        unsigned low, high;
+        __asm__("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+        osAvx = (low & 6) == 6;
+    }
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    if (impl == SHA256_IMPL_SHANI) {
+        return sse41 && (ebx & bit_SHA) != 0;
+    }
+    return osAvx && (ebx & bit_AVX2) != 0;
+}
+
+#endif // SHA256_X86
+
+static atomic_int g_impl = -1;  // detected on first use
+static atomic_bool g_lanes;     // sha256_batch may use the AVX2 lanes
+
+bool sha256_impl_supported(enum Sha256Impl impl)
+{
+    if (impl == SHA256_IMPL_SCALAR) {
+        return true;
+    }
+#ifdef SHA256_X86
+    return cpu_has(impl);
+#else
+    return false;
+#endif
+}
+
+enum Sha256Impl sha256_impl(void)
+{
+    int impl = atomic_load_explicit(&g_impl, memory_order_relaxed);
+    if (impl < 0) {
+        // Racing first calls all detect the same answer.
+        bool lanes = sha256_impl_supported(SHA256_IMPL_AVX2);
+        impl = sha256_impl_supported(SHA256_IMPL_SHANI) ? SHA256_IMPL_SHANI
+            : lanes ? SHA256_IMPL_AVX2 : SHA256_IMPL_SCALAR;
+        atomic_store_explicit(&g_lanes, lanes, memory_order_relaxed);
+        atomic_store_explicit(&g_impl, impl, memory_order_relaxed);
+    }
+    return (enum Sha256Impl)impl;
+}
+
+bool sha256_use_impl(enum Sha256Impl impl)
+{
+    if (!sha256_impl_supported(impl)) {
+        return false;
+    }
+    atomic_store_explicit(&g_lanes, impl != SHA256_IMPL_SCALAR && sha256_impl_supported(SHA256_IMPL_AVX2),
+        memory_order_relaxed);
+    atomic_store_explicit(&g_impl, (int)impl, memory_order_relaxed);
+    return true;
+}
+
+const char* sha256_impl_name(enum Sha256Impl impl)
+{
+    switch (impl) {
+    case SHA256_IMPL_SHANI:
+        return "sha-ni";
+    case SHA256_IMPL_AVX2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+// The single-buffer compressor: AVX2 only pays off across lanes.
+static compress_fn single_compress(enum Sha256Impl impl)
+{
+#ifdef SHA256_X86
+    if (impl == SHA256_IMPL_SHANI) {
+        return compress_shani;
+    }
+#else
+    (void)impl;
+#endif
+    return compress_scalar;
+}
+
+void sha256(const void* data, size_t length, uint8_t* digest)
+{
+    hash_with(single_compress(sha256_impl()), data, length, digest);
+}
+
+void sha256_batch(struct Sha256Job* jobs, size_t count)
+{
+    enum Sha256Impl impl = sha256_impl();
+#ifdef SHA256_X86
+    if (impl == SHA256_IMPL_AVX2 && count > 1) {
+        batch_avx2(jobs, count);
+        return;
+    }
+    if (count > 1 && atomic_load_explicit(&g_lanes, memory_order_relaxed)) {
+        size_t total = 0;
+        for (size_t i = 0; i < count; ++i) {
+            total += jobs[i].length;
+        }
+        if (total / count <= SHA256_LANES_MAX_AVERAGE) {
+            batch_avx2(jobs, count);
+            return;
+        }
+    }
+#endif
+    compress_fn compress = single_compress(impl);
+    for (size_t i = 0; i < count; ++i) {
+        hash_with(compress, jobs[i].data, jobs[i].length, jobs[i].digest);
+    }
+}
+
+void sha256_hex(const uint8_t* digest, char* out)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < SHA256_DIGEST_SIZE; ++i) {
+        out[2 * i] = digits[digest[i] >> 4];
+        out[2 * i + 1] = digits[digest[i] & 0x0f];
+    }
+    out[2 * SHA256_DIGEST_SIZE] = '\0';
+}
@@ -1,14 +1,46 @@
 #include "socketutil.h"
 
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+int socket_startup(void)
+{
+#ifdef _WIN32
+    WSADATA wsaData;
+    int result = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (result != 0) {
+        fprintf(stderr, "WSAStartup failed: %d\n", result);
+        return result;
+    }
+#else
+    // A peer closing mid-send must surface as EPIPE, not kill the process.
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    return 0;
+}
+
+void socket_cleanup(void)
+{
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
 void print_last_error(const char *label)
 {
+#ifdef _WIN32
     fprintf(stderr, "%s failed with error: %d\n", label, WSAGetLastError());
+#else
+    int err = errno;
+    fprintf(stderr, "%s failed with error: %d (%s)\n", label, err, strerror(err));
+#endif
 }
 
 void print_socket_info(socket_t sockfd)
 {
     struct sockaddr_in addr;
-    int addrlen = sizeof(addr);
+    socklen_t addrlen = sizeof(addr);
     
     if (getsockname(sockfd, (struct sockaddr*)&addr, &addrlen) == 0) {
         char ip_str[INET_ADDRSTRLEN];
@@ -37,6 +69,90 @@ socket_t create_socket(void)
     }
     return sock;
 }
+
+int set_socket_nonblocking(socket_t sockfd)
+{
+#ifdef _WIN32
+    u_long mode = 1;
+    if (ioctlsocket(sockfd, FIONBIO, &mode) == SOCKET_ERROR) {
+        print_last_error("ioctlsocket");
+        return -1;
+    }
+#else
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        print_last_error("fcntl");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+int set_socket_recv_timeout(socket_t sockfd, unsigned timeoutMs)
+{
+#ifdef _WIN32
+    DWORD timeout = timeoutMs;
+#else
+    struct timeval timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_usec = (timeoutMs % 1000) * 1000;
+#endif
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout)) == SOCKET_ERROR) {
+        print_last_error("setsockopt SO_RCVTIMEO");
+        return -1;
+    }
+    return 0;
+}
+
+int send_all(socket_t sockfd, const void* data, size_t length)
+{
+    const char* bytes = (const char*)data;
+    size_t totalSent = 0;
+    while (totalSent < length) {
+        int sent = send(sockfd, bytes + totalSent, (int)(length - totalSent), MSG_NOSIGNAL);
+        if (sent == SOCKET_ERROR) {
+#ifndef _WIN32
+            if (errno == EINTR) {
+                continue;
+            }
+#endif
+            return SOCKET_ERROR;
+        }
+        totalSent += (size_t)sent;
+    }
+    return 0;
+}
+
+int send_two(socket_t sockfd, const void* first, size_t firstLength, const void* second, size_t secondLength)
+{
+#ifdef _WIN32
+    WSABUF buffers[2];
+    buffers[0].buf = (char*)first;
+    buffers[0].len = (ULONG)firstLength;
+    buffers[1].buf = (char*)second;
+    buffers[1].len = (ULONG)secondLength;
+    DWORD sent = 0;
+    if (WSASend(sockfd, buffers, secondLength > 0 ? 2 : 1, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+        return SOCKET_ERROR;
+    }
+    return (int)sent;
+#else
+    struct iovec segments[2];
+    segments[0].iov_base = (void*)first;
+    segments[0].iov_len = firstLength;
+    segments[1].iov_base = (void*)second;
+    segments[1].iov_len = secondLength;
+
+    // sendmsg rather than writev so MSG_NOSIGNAL applies.
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = segments;
+    message.msg_iovlen = secondLength > 0 ? 2 : 1;
+    ssize_t sent = sendmsg(sockfd, &message, MSG_NOSIGNAL);
+    return sent < 0 ? SOCKET_ERROR : (int)sent;
+#endif
+}
+
 int createIPv4Adress_getaddrinfo(const char *hostname, const char *port, struct addrinfo **result)
 {
     struct addrinfo hints;
@@ -50,7 +166,7 @@ int createIPv4Adress_getaddrinfo(const char *hostname, const char *port, struct
     if (getaddrinfo_result != 0)
     {
         fprintf(stderr, "getaddrinfo failed: %d\n", getaddrinfo_result);
-        WSACleanup();
+        socket_cleanup();
         return EXIT_FAILURE;
     }
     *result = addrinfo_result;
@@ -87,6 +203,6 @@ void clean_and_exit(struct addrinfo* addrinfo_result, struct sockaddr_in* sockad
     {
         closesocket(sockfd);
     }
-    WSACleanup();
+    socket_cleanup();
     exit(exit_code);
 }